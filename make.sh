@@ -183,7 +183,7 @@ fi
 
 # tests
 if [[ "${TESTS}" == "1" ]]; then
-  true # currently this project has no tests
+  cd build && ctest --output-on-failure && cd .. || exiterr "tests failed, exiting."
 fi
 
 # doc
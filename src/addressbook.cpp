@@ -18,6 +18,7 @@
 #include "log.h"
 #include "loghelp.h"
 #include "maphelp.h"
+#include "reencrypt.h"
 #include "sqlitehelp.h"
 #include "util.h"
 
@@ -79,20 +80,11 @@ void AddressBook::Cleanup()
   }
 }
 
-bool AddressBook::ChangePass(const bool p_CacheEncrypt,
-                             const std::string& p_OldPass, const std::string& p_NewPass)
+void AddressBook::ChangePass(const bool p_CacheEncrypt, ReEncrypt& p_ReEncrypt)
 {
-  if (!p_CacheEncrypt) return true;
+  if (!p_CacheEncrypt) return;
 
-  Util::RmDir(GetAddressBookTempDbDir());
-  Util::MkDir(GetAddressBookTempDbDir());
-  if (!CacheUtil::DecryptCacheDir(p_OldPass, GetAddressBookCacheDbDir(), GetAddressBookTempDbDir())) return false;
-
-  Util::RmDir(GetAddressBookCacheDbDir());
-  Util::MkDir(GetAddressBookCacheDbDir());
-  if (!CacheUtil::EncryptCacheDir(p_NewPass, GetAddressBookTempDbDir(), GetAddressBookCacheDbDir())) return false;
-
-  return true;
+  p_ReEncrypt.AddDir(GetAddressBookCacheDbDir());
 }
 
 void AddressBook::Add(const std::string& p_MsgId, const std::set<std::string>& p_Addresses)
@@ -235,7 +227,7 @@ std::vector<std::string> AddressBook::GetFrom(const std::string& p_Filter)
 
 void AddressBook::InitCacheDir()
 {
-  static const int version = 8; // note: keep synchronized with ImapIndex (for now)
+  static const int version = 10; // note: keep synchronized with ImapIndex (for now)
   const std::string cacheDir = GetAddressBookCacheDir();
   CacheUtil::CommonInitCacheDir(cacheDir, version, m_AddressBookEncrypt);
   Util::MkDir(GetAddressBookCacheDbDir());
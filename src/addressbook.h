@@ -20,14 +20,15 @@ namespace sqlite
   class database;
 }
 
+class ReEncrypt;
+
 class AddressBook
 {
 public:
   static void Init(const bool p_AddressBookEncrypt, const std::string& p_Pass);
   static void Cleanup();
 
-  static bool ChangePass(const bool p_CacheEncrypt,
-                         const std::string& p_OldPass, const std::string& p_NewPass);
+  static void ChangePass(const bool p_CacheEncrypt, ReEncrypt& p_ReEncrypt);
 
   static void Add(const std::string& p_MsgId, const std::set<std::string>& p_Addresses);
   static void AddFrom(const std::string& p_Address);
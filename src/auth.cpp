@@ -16,6 +16,7 @@
 #include "config.h"
 #include "log.h"
 #include "loghelp.h"
+#include "reencrypt.h"
 #include "util.h"
 
 std::mutex Auth::m_Mutex;
@@ -73,18 +74,11 @@ void Auth::Cleanup()
   Util::RmDir(GetAuthTempDir());
 }
 
-bool Auth::ChangePass(const bool p_CacheEncrypt,
-                      const std::string& p_OldPass, const std::string& p_NewPass)
+void Auth::ChangePass(const bool p_CacheEncrypt, ReEncrypt& p_ReEncrypt)
 {
-  if (!p_CacheEncrypt) return true;
+  if (!p_CacheEncrypt) return;
 
-  m_AuthEncrypt = p_CacheEncrypt;
-  m_Pass = p_OldPass;
-  LoadCache();
-  m_Pass = p_NewPass;
-  SaveCache();
-
-  return true;
+  p_ReEncrypt.AddDir(GetAuthCacheDir());
 }
 
 bool Auth::GenerateToken(const std::string& p_Auth)
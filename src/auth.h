@@ -11,6 +11,8 @@
 #include <mutex>
 #include <string>
 
+class ReEncrypt;
+
 class Auth
 {
 public:
@@ -18,8 +20,7 @@ public:
                    const std::string& p_Pass, const bool p_IsSetup);
   static void Cleanup();
 
-  static bool ChangePass(const bool p_CacheEncrypt,
-                         const std::string& p_OldPass, const std::string& p_NewPass);
+  static void ChangePass(const bool p_CacheEncrypt, ReEncrypt& p_ReEncrypt);
 
   static bool GenerateToken(const std::string& p_Auth);
   static std::string GetName();
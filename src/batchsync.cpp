@@ -0,0 +1,226 @@
+// batchsync.cpp
+//
+// Copyright (c) 2024 Kristofer Berggren
+// All rights reserved.
+//
+// falanet is distributed under the MIT license, see LICENSE for details.
+
+#include "batchsync.h"
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <set>
+#include <thread>
+
+#include "loghelp.h"
+#include "util.h"
+
+static const size_t s_MaxHeadersBatch = 100;
+static const size_t s_MaxFlagsBatch = 1000;
+static const size_t s_MaxBodysBatch = 10;
+
+BatchSync::BatchSync(Imap& p_Imap, const unsigned p_Parallelism)
+  : m_Imap(p_Imap)
+  , m_Parallelism(std::max(1u, p_Parallelism))
+{
+  LOG_DEBUG_FUNC(STR(p_Parallelism));
+}
+
+BatchSync::~BatchSync()
+{
+  LOG_DEBUG_FUNC(STR());
+}
+
+bool BatchSync::Run()
+{
+  m_StartTime = std::chrono::steady_clock::now();
+
+  std::set<std::string> folders;
+  if (!m_Imap.GetFolders(false /* p_Cached */, folders))
+  {
+    std::cerr << "error: get folders failed\n";
+    return false;
+  }
+
+  m_Folders.assign(folders.begin(), folders.end());
+  m_FolderCount = m_Folders.size();
+
+  // each additional worker uses its own server connection, sharing cache and index
+  const size_t workerCount = std::max<size_t>(1, std::min<size_t>(m_Parallelism, m_FolderCount));
+  std::vector<std::unique_ptr<Imap>> sessions;
+  for (size_t i = 1; i < workerCount; ++i)
+  {
+    std::unique_ptr<Imap> session = m_Imap.CreateSession();
+    if (!session->Login())
+    {
+      LOG_WARNING("session login failed, using %zu connections", sessions.size() + 1);
+      break;
+    }
+
+    sessions.push_back(std::move(session));
+  }
+
+  LOG_INFO("sync %zu folders using %zu connections", m_FolderCount, sessions.size() + 1);
+
+  std::vector<std::thread> threads;
+  for (auto& session : sessions)
+  {
+    threads.emplace_back(&BatchSync::Worker, this, session.get());
+  }
+
+  Worker(&m_Imap);
+
+  for (auto& thread : threads)
+  {
+    thread.join();
+  }
+
+  uint64_t plainBytes = 0;
+  uint64_t wireBytes = 0;
+  m_Imap.GetTrafficStats(plainBytes, wireBytes);
+  for (auto& session : sessions)
+  {
+    uint64_t sessionPlainBytes = 0;
+    uint64_t sessionWireBytes = 0;
+    session->GetTrafficStats(sessionPlainBytes, sessionWireBytes);
+    plainBytes += sessionPlainBytes;
+    wireBytes += sessionWireBytes;
+    session->Logout();
+  }
+
+  sessions.clear();
+  ReportProgress(true /* p_Done */);
+
+  if ((plainBytes > 0) && (wireBytes < plainBytes))
+  {
+    std::cout << "Compressed " << Util::GetPrefixedSize(plainBytes) << " to "
+              << Util::GetPrefixedSize(wireBytes) << " on the wire ("
+              << (int)((wireBytes * 100) / plainBytes) << "%)\n";
+    LOG_INFO("sync compress %llu plain bytes %llu wire bytes",
+             (unsigned long long)plainBytes, (unsigned long long)wireBytes);
+  }
+
+  std::cout << "Indexing" << std::flush;
+  const std::chrono::steady_clock::time_point indexStartTime = std::chrono::steady_clock::now();
+  m_Imap.IndexWaitDone();
+  const std::chrono::duration<double> indexElapsed = std::chrono::steady_clock::now() - indexStartTime;
+  std::cout << " completed in " << (int)indexElapsed.count() << " secs\n";
+  LOG_INFO("sync index wait %.1f secs", indexElapsed.count());
+
+  return (m_FoldersFailed == 0);
+}
+
+void BatchSync::Worker(Imap* p_Imap)
+{
+  std::string folder;
+  while (NextFolder(folder))
+  {
+    if (!SyncFolder(*p_Imap, folder))
+    {
+      LOG_WARNING("sync folder \"%s\" failed", folder.c_str());
+      ++m_FoldersFailed;
+    }
+
+    ++m_FoldersDone;
+    ReportProgress(false /* p_Done */);
+  }
+}
+
+bool BatchSync::NextFolder(std::string& p_Folder)
+{
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  if (m_Folders.empty()) return false;
+
+  p_Folder = m_Folders.front();
+  m_Folders.pop_front();
+  return true;
+}
+
+bool BatchSync::SyncFolder(Imap& p_Imap, const std::string& p_Folder)
+{
+  LOG_DEBUG_FUNC(STR(p_Folder));
+
+  UidSet uids;
+  if (!p_Imap.GetUids(p_Folder, false /* p_Cached */, uids)) return false;
+
+  for (const auto& batch : SplitUids(p_Imap.GetHeadersNotCached(p_Folder, uids), s_MaxHeadersBatch))
+  {
+    std::map<uint32_t, Header> headers;
+    if (!p_Imap.GetHeaders(p_Folder, batch, false /* p_Cached */, false /* p_Prefetch */, headers)) return false;
+
+    m_Headers += headers.size();
+    ReportProgress(false /* p_Done */);
+  }
+
+  for (const auto& batch : SplitUids(uids, s_MaxFlagsBatch))
+  {
+    std::map<uint32_t, uint32_t> flags;
+    if (!p_Imap.GetFlags(p_Folder, batch, false /* p_Cached */, flags)) return false;
+  }
+
+  for (const auto& batch : SplitUids(p_Imap.GetBodysNotCached(p_Folder, uids), s_MaxBodysBatch))
+  {
+    std::map<uint32_t, Body> bodys;
+    if (!p_Imap.GetBodys(p_Folder, batch, false /* p_Cached */, false /* p_Prefetch */, bodys)) return false;
+
+    for (const auto& body : bodys)
+    {
+      m_Bytes += body.second.GetDataSize();
+    }
+
+    m_Bodys += bodys.size();
+    ReportProgress(false /* p_Done */);
+  }
+
+  return true;
+}
+
+std::vector<UidSet> BatchSync::SplitUids(const UidSet& p_Uids, const size_t p_MaxCount)
+{
+  std::vector<UidSet> batches;
+  UidSet batch;
+  for (const auto& uid : p_Uids)
+  {
+    batch.insert(uid);
+    if (batch.size() >= p_MaxCount)
+    {
+      batches.push_back(batch);
+      batch.clear();
+    }
+  }
+
+  if (!batch.empty())
+  {
+    batches.push_back(batch);
+  }
+
+  return batches;
+}
+
+void BatchSync::ReportProgress(bool p_Done)
+{
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - m_StartTime;
+  const double secs = std::max(elapsed.count(), 0.001);
+  const double msgRate = (double)(m_Headers + m_Bodys) / secs;
+  const double kbRate = ((double)m_Bytes / 1024.0) / secs;
+
+  std::cout << "\rSynced " << m_FoldersDone << "/" << m_FolderCount << " folders, "
+            << m_Headers << " headers, " << m_Bodys << " bodies";
+  if (m_FoldersFailed > 0)
+  {
+    std::cout << ", " << m_FoldersFailed << " folders failed";
+  }
+
+  std::cout << " (" << (int)msgRate << " msgs/sec, " << (int)kbRate << " KB/sec)";
+  if (p_Done)
+  {
+    std::cout << " in " << (int)secs << " secs\n";
+    LOG_INFO("sync %zu folders %zu headers %zu bodys %llu bytes %.1f msgs/sec %.1f KB/sec",
+             (size_t)m_FoldersDone, (size_t)m_Headers, (size_t)m_Bodys, (unsigned long long)m_Bytes,
+             msgRate, kbRate);
+  }
+
+  std::cout << std::flush;
+}
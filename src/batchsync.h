@@ -0,0 +1,49 @@
+// batchsync.h
+//
+// Copyright (c) 2024 Kristofer Berggren
+// All rights reserved.
+//
+// falanet is distributed under the MIT license, see LICENSE for details.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "imap.h"
+
+class BatchSync
+{
+public:
+  BatchSync(Imap& p_Imap, const unsigned p_Parallelism);
+  virtual ~BatchSync();
+
+  bool Run();
+
+private:
+  void Worker(Imap* p_Imap);
+  bool NextFolder(std::string& p_Folder);
+  bool SyncFolder(Imap& p_Imap, const std::string& p_Folder);
+
+  static std::vector<UidSet> SplitUids(const UidSet& p_Uids, const size_t p_MaxCount);
+  void ReportProgress(bool p_Done);
+
+private:
+  Imap& m_Imap;
+  unsigned m_Parallelism = 1;
+
+  std::mutex m_Mutex;
+  std::deque<std::string> m_Folders;
+  size_t m_FolderCount = 0;
+
+  std::atomic<size_t> m_FoldersDone{ 0 };
+  std::atomic<size_t> m_FoldersFailed{ 0 };
+  std::atomic<size_t> m_Headers{ 0 };
+  std::atomic<size_t> m_Bodys{ 0 };
+  std::atomic<uint64_t> m_Bytes{ 0 };
+  std::chrono::steady_clock::time_point m_StartTime;
+};
@@ -0,0 +1,189 @@
+// blobstore.cpp
+//
+// Copyright (c) 2024 Kristofer Berggren
+// All rights reserved.
+//
+// falanet is distributed under the MIT license, see LICENSE for details.
+
+#include "blobstore.h"
+
+#include <cstdio>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "crypto.h"
+#include "loghelp.h"
+#include "reencrypt.h"
+#include "util.h"
+
+Blob::Blob(std::string p_Str)
+  : m_Str(std::move(p_Str))
+{
+}
+
+Blob::Blob(void* p_Map, size_t p_MapSize, size_t p_Offset)
+  : m_Map(p_Map)
+  , m_MapSize(p_MapSize)
+  , m_Offset(p_Offset)
+{
+}
+
+Blob::~Blob()
+{
+  if (m_Map != nullptr)
+  {
+    munmap(m_Map, m_MapSize);
+  }
+}
+
+const char* Blob::GetData() const
+{
+  return (m_Map != nullptr) ? ((const char*)m_Map + m_Offset) : m_Str.data();
+}
+
+size_t Blob::GetSize() const
+{
+  return (m_Map != nullptr) ? (m_MapSize - m_Offset) : m_Str.size();
+}
+
+std::string Blob::ToString() const
+{
+  return std::string(GetData(), GetSize());
+}
+
+BlobStore::BlobStore(const std::string& p_Dir, const bool p_Encrypt, const std::string& p_Pass)
+  : m_Dir(p_Dir)
+  , m_Encrypt(p_Encrypt)
+  , m_Pass(p_Pass)
+{
+  Util::MkDir(m_Dir);
+}
+
+std::string BlobStore::GetHash(const std::string& p_Data) const
+{
+  // blobs named under a previous pass remain valid, as rows reference blobs by name
+  return m_Encrypt ? Crypto::HMACSHA256(p_Data, m_Pass) : Crypto::SHA256(p_Data);
+}
+
+void BlobStore::ChangePass(const std::string& p_Dir, ReEncrypt& p_ReEncrypt)
+{
+  const std::vector<std::string>& subDirs = Util::ListDir(p_Dir);
+  for (const auto& subDir : subDirs)
+  {
+    p_ReEncrypt.AddDir(p_Dir + subDir + "/");
+  }
+}
+
+bool BlobStore::Put(const std::string& p_Hash, const std::string& p_Data, size_t& p_StoredSize)
+{
+  // encrypted size is salt header plus packed data padded to the next full aes block
+  const std::string packed = Compress::Pack(p_Data);
+  const size_t fileSize = m_Encrypt ? (16 + (((packed.size() / 16) + 1) * 16)) : packed.size();
+  const std::string path = GetPath(p_Hash);
+  struct stat sb;
+  if ((stat(path.c_str(), &sb) == 0) && (sb.st_size > 0) && ((size_t)sb.st_size == fileSize))
+  {
+    p_StoredSize = sb.st_size;
+    return true;
+  }
+
+  // write to temporary file first, as a blob file present under its hash is assumed complete,
+  // and sync it before rename so a crash cannot leave a truncated blob under its name
+  const std::string tmpPath = path + ".tmp";
+  Util::MkDir(Util::DirName(path));
+  const std::string encData = m_Encrypt ? Crypto::AESEncrypt(packed, m_Pass) : std::string();
+  const std::string& fileData = m_Encrypt ? encData : packed;
+  bool rv = (fileData.size() == fileSize);
+  int fd = rv ? open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600) : -1;
+  if (fd != -1)
+  {
+    rv = (write(fd, fileData.data(), fileData.size()) == (ssize_t)fileData.size()) && (fsync(fd) == 0);
+    close(fd);
+  }
+  else
+  {
+    rv = false;
+  }
+
+  if (!rv || (rename(tmpPath.c_str(), path.c_str()) != 0))
+  {
+    LOG_WARNING("failed to store blob %s", p_Hash.c_str());
+    Util::DeleteFile(tmpPath);
+    return false;
+  }
+
+  p_StoredSize = fileData.size();
+  return true;
+}
+
+std::shared_ptr<Blob> BlobStore::Get(const std::string& p_Hash)
+{
+  // failure to decrypt or unpack is treated as missing, so the blob is fetched and stored again
+  const std::string path = GetPath(p_Hash);
+  std::string data;
+  if (m_Encrypt)
+  {
+    // encrypted blobs cannot be mapped, decrypt to memory
+    if (!Util::Exists(path)) return std::shared_ptr<Blob>();
+
+    const std::string packed = Crypto::AESDecrypt(Util::ReadFile(path), m_Pass);
+    if (!Compress::Unpack(packed.data(), packed.size(), data)) return std::shared_ptr<Blob>();
+
+    return std::make_shared<Blob>(std::move(data));
+  }
+
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) return std::shared_ptr<Blob>();
+
+  // an empty blob file is a left-over from an interrupted write, treat it as missing
+  std::shared_ptr<Blob> blob;
+  struct stat sb;
+  if ((fstat(fd, &sb) == 0) && (sb.st_size > 0))
+  {
+    void* map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+    {
+      LOG_WARNING("failed to map blob %s", p_Hash.c_str());
+    }
+    else if (*(const char*)map == (char)Compress::FormatRaw)
+    {
+      blob = std::make_shared<Blob>(map, sb.st_size, 1);
+    }
+    else
+    {
+      if (Compress::Unpack((const char*)map, sb.st_size, data))
+      {
+        blob = std::make_shared<Blob>(std::move(data));
+      }
+
+      munmap(map, sb.st_size);
+    }
+  }
+
+  close(fd);
+  return blob;
+}
+
+bool BlobStore::Exists(const std::string& p_Hash)
+{
+  struct stat sb;
+  return (stat(GetPath(p_Hash).c_str(), &sb) == 0) && (sb.st_size > 0);
+}
+
+void BlobStore::Remove(const std::string& p_Hash)
+{
+  // existing mappings remain valid after unlink
+  Util::DeleteFile(GetPath(p_Hash));
+}
+
+std::string BlobStore::GetPath(const std::string& p_Hash)
+{
+  // fan out on hash prefix to keep directory sizes manageable
+  return m_Dir + p_Hash.substr(0, 2) + "/" + p_Hash;
+}
@@ -0,0 +1,62 @@
+// blobstore.h
+//
+// Copyright (c) 2024 Kristofer Berggren
+// All rights reserved.
+//
+// falanet is distributed under the MIT license, see LICENSE for details.
+
+#pragma once
+
+#include <memory>
+#include <string>
+
+class ReEncrypt;
+
+// immutable raw message data, memory-mapped from a blob file or held in memory
+class Blob
+{
+public:
+  explicit Blob(std::string p_Str);
+  Blob(void* p_Map, size_t p_MapSize, size_t p_Offset);
+  ~Blob();
+
+  Blob(const Blob&) = delete;
+  Blob& operator=(const Blob&) = delete;
+
+  const char* GetData() const;
+  size_t GetSize() const;
+  std::string ToString() const;
+
+private:
+  std::string m_Str;
+  void* m_Map = nullptr;
+  size_t m_MapSize = 0;
+  size_t m_Offset = 0;
+};
+
+// content-addressed store of blob files named by sha256 of their content, or by
+// hmac keyed by cache pass when encrypted so names do not reveal content. files
+// are written once and never modified, so readers can map them without locking.
+// blobs are packed, those kept raw as deflate does not pay off (ex. attachments)
+// are mapped directly past the format tag, others are inflated into memory on read.
+class BlobStore
+{
+public:
+  BlobStore(const std::string& p_Dir, const bool p_Encrypt, const std::string& p_Pass);
+
+  std::string GetHash(const std::string& p_Data) const;
+  static void ChangePass(const std::string& p_Dir, ReEncrypt& p_ReEncrypt);
+
+  bool Put(const std::string& p_Hash, const std::string& p_Data, size_t& p_StoredSize);
+  std::shared_ptr<Blob> Get(const std::string& p_Hash);
+  bool Exists(const std::string& p_Hash);
+  void Remove(const std::string& p_Hash);
+
+private:
+  std::string GetPath(const std::string& p_Hash);
+
+private:
+  std::string m_Dir;
+  bool m_Encrypt = false;
+  std::string m_Pass;
+};
@@ -9,6 +9,7 @@
 
 #include <libetpan/mailmime.h>
 
+#include "blobstore.h"
 #include "encoding.h"
 #include "header.h"
 #include "log.h"
@@ -43,14 +44,51 @@ void Body::FromHeader(const std::string& p_Data)
 
 void Body::SetData(const std::string& p_Data)
 {
-  m_Data = p_Data;
-  RemoveInvalidHeaders();
+  std::string data = p_Data;
+  RemoveInvalidHeaders(data);
+  m_Blob = std::make_shared<Blob>(std::move(data));
   ParseIfNeeded();
 }
 
 std::string Body::GetData() const
 {
-  return m_Data;
+  return m_Blob ? m_Blob->ToString() : std::string();
+}
+
+size_t Body::GetDataSize() const
+{
+  return m_Blob ? m_Blob->GetSize() : 0;
+}
+
+// raw message header up to, but excluding, the empty line ending it
+std::string Body::GetHeaderData() const
+{
+  if (!m_Blob) return std::string();
+
+  const char* data = m_Blob->GetData();
+  const size_t size = m_Blob->GetSize();
+  for (size_t i = 0; (i + 1) < size; ++i)
+  {
+    if ((data[i] == '\n') &&
+        ((data[i + 1] == '\n') || ((data[i + 1] == '\r') && ((i + 2) < size) && (data[i + 2] == '\n'))))
+    {
+      return std::string(data, i + 1);
+    }
+  }
+
+  return std::string(data, size);
+}
+
+void Body::SetBlob(const std::shared_ptr<Blob>& p_Blob)
+{
+  m_Blob = p_Blob;
+  m_PartDatas.clear();
+  m_PartDatasParsed = false;
+}
+
+std::shared_ptr<Blob> Body::GetBlob() const
+{
+  return m_Blob;
 }
 
 std::string Body::GetTextPlain() const
@@ -96,15 +134,37 @@ std::map<ssize_t, PartInfo> Body::GetPartInfos() const
 
 std::map<ssize_t, std::string> Body::GetPartDatas()
 {
-  if (!m_PartDatasParsed)
+  std::map<ssize_t, std::string> partDatas;
+  for (const auto& partInfo : m_PartInfos)
+  {
+    partDatas[partInfo.first] = GetPartData(partInfo.first);
+  }
+
+  return partDatas;
+}
+
+std::string Body::GetPartData(ssize_t p_Index)
+{
+  std::string partData;
+  std::map<ssize_t, PartInfo>::const_iterator infoIt = m_PartInfos.find(p_Index);
+  if (infoIt == m_PartInfos.end()) return partData;
+
+  // decode only the part's slice of the raw message when its location is known
+  if (DecodePartData(infoIt->second, partData)) return partData;
+
+  if (!m_PartDatasParsed && m_Blob)
   {
     bool forceParse = true;
-    m_NumParts = 0;
-    m_PartInfos.clear();
-    m_PartDatas.clear();
     ParseIfNeeded(forceParse);
   }
-  return m_PartDatas;
+
+  std::map<ssize_t, std::string>::const_iterator dataIt = m_PartDatas.find(p_Index);
+  if (dataIt != m_PartDatas.end())
+  {
+    partData = dataIt->second;
+  }
+
+  return partData;
 }
 
 bool Body::HasAttachments() const
@@ -136,9 +196,11 @@ void Body::Parse()
 {
   // @note: this function should not be called directly, only via ParseIfNeeded()
   LOG_DURATION();
+  m_ParseData = m_Blob ? m_Blob->GetData() : "";
+  m_ParseSize = m_Blob ? m_Blob->GetSize() : 0;
   struct mailmime* mime = NULL;
   size_t current_index = 0;
-  mailmime_parse(m_Data.c_str(), m_Data.size(), &current_index, &mime);
+  mailmime_parse(m_ParseData, m_ParseSize, &current_index, &mime);
 
   // clear all parsed members, in the event that it's a reparse due to version update
   m_NumParts = 0;
@@ -167,6 +229,21 @@ void Body::Parse()
     ParseHtmlIfNeeded();
   }
 
+  // part data which can be decoded from its slice of the raw message is not kept in memory
+  for (auto it = m_PartDatas.begin(); it != m_PartDatas.end(); /* incremented in loop */)
+  {
+    if (m_PartInfos[it->first].m_Encoding != -1)
+    {
+      it = m_PartDatas.erase(it);
+    }
+    else
+    {
+      ++it;
+    }
+  }
+
+  m_ParseData = nullptr;
+  m_ParseSize = 0;
   m_ParseVersion = GetCurrentParseVersion();
   m_PartDatasParsed = true;
 }
@@ -421,6 +498,16 @@ void Body::ParseMimeData(mailmime* p_Mime, std::string p_MimeType)
           partInfo.m_IsAttachment = isAttachment;
           partInfo.m_Size = partData.size();
 
+          const char* partStart = data->dt_data.dt_text.dt_data;
+          const size_t partLength = data->dt_data.dt_text.dt_length;
+          if ((m_ParseData != nullptr) && (partStart >= m_ParseData) &&
+              ((partStart + partLength) <= (m_ParseData + m_ParseSize)))
+          {
+            partInfo.m_Offset = partStart - m_ParseData;
+            partInfo.m_Length = partLength;
+            partInfo.m_Encoding = data->dt_encoding;
+          }
+
           if ((m_TextPlainIndex == -1) && (p_MimeType == "text/plain"))
           {
             ParseMimeContentType(p_Mime->mm_content_type, partInfo.m_IsFormatFlowed);
@@ -498,14 +585,36 @@ void Body::ParseMimeContentType(struct mailmime_content* p_MimeContentType, bool
   }
 }
 
-void Body::RemoveInvalidHeaders()
+bool Body::DecodePartData(const PartInfo& p_PartInfo, std::string& p_PartData) const
+{
+  if ((p_PartInfo.m_Encoding == -1) || !m_Blob) return false;
+
+  if ((p_PartInfo.m_Offset + p_PartInfo.m_Length) > m_Blob->GetSize()) return false;
+
+  size_t index = 0;
+  char* parsedStr = NULL;
+  size_t parsedLen = 0;
+  int rv = mailmime_part_parse(m_Blob->GetData() + p_PartInfo.m_Offset, p_PartInfo.m_Length, &index,
+                               p_PartInfo.m_Encoding, &parsedStr, &parsedLen);
+  if (rv != MAILIMF_NO_ERROR) return false;
+
+  if (parsedStr != NULL)
+  {
+    p_PartData = std::string(parsedStr, parsedLen);
+    mmap_string_unref(parsedStr);
+  }
+
+  return true;
+}
+
+void Body::RemoveInvalidHeaders(std::string& p_Data)
 {
-  if (m_Data.find("From ", 0) == 0)
+  if (p_Data.find("From ", 0) == 0)
   {
-    size_t firstLinefeed = m_Data.find("\n");
+    size_t firstLinefeed = p_Data.find("\n");
     if (firstLinefeed != std::string::npos)
     {
-      m_Data.erase(0, firstLinefeed + 1);
+      p_Data.erase(0, firstLinefeed + 1);
     }
   }
 }
@@ -514,7 +623,7 @@ size_t Body::GetCurrentParseVersion()
 {
   static std::hash<std::string> hashStr;
   static size_t htmlToTextCmdHash = hashStr(Util::GetHtmlToTextConvertCmd());
-  static size_t parseVersionOffset = 1; // bump version offset when parsing changes
+  static size_t parseVersionOffset = 2; // bump version offset when parsing changes
   static size_t parseVersion = parseVersionOffset + htmlToTextCmdHash;
   return parseVersion;
 }
@@ -8,6 +8,7 @@
 #pragma once
 
 #include <map>
+#include <memory>
 #include <string>
 
 #include <libetpan/mailmime_types.h>
@@ -22,6 +23,11 @@ struct PartInfo
   bool m_IsAttachment = false;
   bool m_IsFormatFlowed = false;
 
+  // location of encoded part data in raw message, encoding -1 if not available
+  size_t m_Offset = 0;
+  size_t m_Length = 0;
+  int m_Encoding = -1;
+
   template<class Archive>
   void serialize(Archive& p_Archive)
   {
@@ -31,10 +37,15 @@ struct PartInfo
               m_Charset,
               m_Size,
               m_IsAttachment,
-              m_IsFormatFlowed);
+              m_IsFormatFlowed,
+              m_Offset,
+              m_Length,
+              m_Encoding);
   }
 };
 
+class Blob;
+
 class Body
 {
 public:
@@ -42,11 +53,16 @@ public:
   void FromHeader(const std::string& p_Data);
   void SetData(const std::string& p_Data);
   std::string GetData() const;
+  size_t GetDataSize() const;
+  std::string GetHeaderData() const;
+  void SetBlob(const std::shared_ptr<Blob>& p_Blob);
+  std::shared_ptr<Blob> GetBlob() const;
   std::string GetTextPlain() const;
   std::string GetTextHtml() const;
   std::string GetHtml() const;
   std::map<ssize_t, PartInfo> GetPartInfos() const;
   std::map<ssize_t, std::string> GetPartDatas();
+  std::string GetPartData(ssize_t p_Index);
   bool HasAttachments() const;
   bool IsFormatFlowed() const;
 
@@ -66,11 +82,11 @@ public:
     return true;
   }
 
+  // raw message data is not serialized, it is stored separately as a blob
   template<class Archive>
   void serialize(Archive& p_Archive)
   {
-    p_Archive(m_Data,
-              m_ParseVersion,
+    p_Archive(m_ParseVersion,
               m_PartInfos,
               m_NumParts,
               m_TextPlainIndex,
@@ -91,12 +107,13 @@ private:
   void ParseMimeFields(mailmime* p_Mime, std::string& p_Filename, std::string& p_ContentId,
                        std::string& p_Charset, bool& p_IsAttachment);
   void ParseMimeContentType(struct mailmime_content* p_MimeContentType, bool& p_IsFormatFlowed);
-  void RemoveInvalidHeaders();
+  bool DecodePartData(const PartInfo& p_PartInfo, std::string& p_PartData) const;
+  static void RemoveInvalidHeaders(std::string& p_Data);
 
   size_t GetCurrentParseVersion();
 
 private:
-  std::string m_Data;
+  std::shared_ptr<Blob> m_Blob;
 
   size_t m_ParseVersion = 0;
   std::map<ssize_t, PartInfo> m_PartInfos;
@@ -110,6 +127,8 @@ private:
 
   std::map<ssize_t, std::string> m_PartDatas;
   bool m_PartDatasParsed = false;
+  const char* m_ParseData = nullptr;
+  size_t m_ParseSize = 0;
 };
 
 std::ostream& operator<<(std::ostream& p_Stream, const Body& p_Body);
@@ -0,0 +1,353 @@
+// bulkimport.cpp
+//
+// Copyright (c) 2024 Kristofer Berggren
+// All rights reserved.
+//
+// falanet is distributed under the MIT license, see LICENSE for details.
+
+#include "bulkimport.h"
+
+#include <algorithm>
+#include <iostream>
+
+#include <sys/stat.h>
+
+#include "config.h"
+#include "header.h"
+#include "loghelp.h"
+#include "util.h"
+
+static const size_t s_MaxBatchCount = 50;
+static const size_t s_MaxBatchBytes = 16 * 1024 * 1024;
+
+BulkImport::BulkImport(Imap& p_Imap, const std::string& p_Path, const std::string& p_Folder)
+  : m_Imap(p_Imap)
+  , m_Path(p_Path)
+  , m_Folder(p_Folder)
+{
+  LOG_DEBUG_FUNC(STR(p_Path, p_Folder));
+}
+
+BulkImport::~BulkImport()
+{
+  LOG_DEBUG_FUNC(STR());
+}
+
+bool BulkImport::Run()
+{
+  if (!Open())
+  {
+    std::cerr << "error: unable to open " << m_Path << "\n";
+    return false;
+  }
+
+  LoadCheckpoint();
+  if (m_Checkpoint > 0)
+  {
+    std::cout << "Resuming import after " << m_Checkpoint << " messages\n";
+  }
+
+  m_StartTime = std::chrono::steady_clock::now();
+
+  bool rv = true;
+  size_t batchBytes = 0;
+  std::vector<Imap::AppendMessage> batch;
+  std::vector<size_t> batchPositions;
+  Imap::AppendMessage msg;
+  while (NextMessage(msg))
+  {
+    if (m_Consumed <= m_Checkpoint) continue;
+
+    batchBytes += msg.m_Msg.size();
+    batch.push_back(msg);
+    batchPositions.push_back(m_Consumed);
+    if ((batch.size() >= s_MaxBatchCount) || (batchBytes >= s_MaxBatchBytes))
+    {
+      rv = UploadBatch(batch, batchPositions);
+      batchBytes = 0;
+      if (!rv) break;
+    }
+  }
+
+  if (rv && !batch.empty())
+  {
+    rv = UploadBatch(batch, batchPositions);
+  }
+
+  ReportProgress(true /* p_Done */);
+
+  if (rv)
+  {
+    ClearCheckpoint();
+  }
+
+  return rv;
+}
+
+bool BulkImport::Open()
+{
+  m_IsMaildir = Util::IsDir(m_Path);
+  if (m_IsMaildir)
+  {
+    // process cur before new, in filename order to keep checkpoints stable
+    for (const auto& subdir : { "cur", "new" })
+    {
+      const std::string dir = m_Path + "/" + subdir;
+      if (!Util::IsDir(dir)) continue;
+
+      std::vector<std::string> files = Util::ListDir(dir);
+      std::sort(files.begin(), files.end());
+      for (const auto& file : files)
+      {
+        m_MaildirFiles.push_back(dir + "/" + file);
+      }
+    }
+
+    return true;
+  }
+
+  m_MboxStream.open(m_Path, std::ios::binary);
+  return m_MboxStream.is_open();
+}
+
+bool BulkImport::NextMessage(Imap::AppendMessage& p_Msg)
+{
+  p_Msg = Imap::AppendMessage();
+  const bool rv = m_IsMaildir ? NextMaildirMessage(p_Msg) : NextMboxMessage(p_Msg);
+  if (rv)
+  {
+    ++m_Consumed;
+    if (m_Consumed > m_Checkpoint)
+    {
+      p_Msg.m_Time = GetMessageTime(p_Msg.m_Msg);
+    }
+  }
+
+  return rv;
+}
+
+bool BulkImport::NextMaildirMessage(Imap::AppendMessage& p_Msg)
+{
+  while (m_MaildirIndex < m_MaildirFiles.size())
+  {
+    const std::string& path = m_MaildirFiles.at(m_MaildirIndex++);
+    if (m_Consumed < m_Checkpoint)
+    {
+      // skip reading content of already imported messages, empty files are not messages
+      struct stat sb;
+      if ((stat(path.c_str(), &sb) != 0) || (sb.st_size == 0)) continue;
+
+      return true;
+    }
+
+    p_Msg.m_Msg = Util::ReadFile(path);
+    if (p_Msg.m_Msg.empty()) continue;
+
+    // maildir info suffix, ex: 1700000000.M1P2.host:2,RS
+    const size_t infoPos = path.rfind(":2,");
+    p_Msg.m_Seen = (infoPos != std::string::npos) && (path.find('S', infoPos + 3) != std::string::npos);
+    return true;
+  }
+
+  return false;
+}
+
+bool BulkImport::NextMboxMessage(Imap::AppendMessage& p_Msg)
+{
+  std::string line;
+  bool inMessage = false;
+  bool inHeaders = true;
+  bool prevEmpty = true;
+  bool hasStatus = false;
+  bool statusRead = false;
+
+  if (!m_MboxPendingLine.empty())
+  {
+    inMessage = true;
+    prevEmpty = false;
+    m_MboxPendingLine.clear();
+  }
+
+  while (std::getline(m_MboxStream, line))
+  {
+    const bool isSeparator = prevEmpty && (line.rfind("From ", 0) == 0);
+    if (isSeparator)
+    {
+      if (inMessage)
+      {
+        m_MboxPendingLine = line;
+        break;
+      }
+
+      inMessage = true;
+      prevEmpty = false;
+      continue;
+    }
+
+    if (!inMessage) continue;
+
+    prevEmpty = line.empty() || (line == "\r");
+    if (inHeaders)
+    {
+      if (prevEmpty)
+      {
+        inHeaders = false;
+      }
+      else if (line.rfind("Status:", 0) == 0)
+      {
+        hasStatus = true;
+        statusRead = (line.find('R', 7) != std::string::npos);
+      }
+    }
+
+    // mboxrd unescaping of >From lines
+    const size_t quotes = line.find_first_not_of('>');
+    if ((quotes != std::string::npos) && (quotes > 0) && (line.compare(quotes, 5, "From ") == 0))
+    {
+      line.erase(0, 1);
+    }
+
+    p_Msg.m_Msg += line + "\n";
+  }
+
+  if (!inMessage) return false;
+
+  // strip blank line separating message from next message or end of mbox
+  std::string& data = p_Msg.m_Msg;
+  if ((data.size() >= 4) && (data.compare(data.size() - 4, 4, "\r\n\r\n") == 0))
+  {
+    data.resize(data.size() - 2);
+  }
+  else if ((data.size() >= 2) && (data.compare(data.size() - 2, 2, "\n\n") == 0))
+  {
+    data.resize(data.size() - 1);
+  }
+
+  p_Msg.m_Seen = !hasStatus || statusRead;
+  return true;
+}
+
+bool BulkImport::UploadBatch(std::vector<Imap::AppendMessage>& p_Batch, std::vector<size_t>& p_Positions)
+{
+  LOG_DEBUG_FUNC(STR(p_Batch.size()));
+
+  // messages rejected by server are counted as failed, on connection error they are left for resume
+  const bool rv = m_Imap.UploadMessages(m_Folder, p_Batch);
+  size_t checkpoint = m_Checkpoint;
+  for (size_t i = 0; i < p_Batch.size(); ++i)
+  {
+    const Imap::AppendMessage& msg = p_Batch.at(i);
+    if (msg.m_Appended)
+    {
+      ++m_Imported;
+      m_Bytes += msg.m_Msg.size();
+      checkpoint = p_Positions.at(i);
+    }
+    else if (rv)
+    {
+      ++m_Failed;
+    }
+  }
+
+  p_Batch.clear();
+  p_Positions.clear();
+
+  // checkpoint up to the last appended message only
+  if (checkpoint != m_Checkpoint)
+  {
+    m_Checkpoint = checkpoint;
+    SaveCheckpoint();
+  }
+
+  if (!rv)
+  {
+    std::cerr << "\nerror: upload failed, rerun to resume import\n";
+    return false;
+  }
+
+  ReportProgress(false /* p_Done */);
+
+  return true;
+}
+
+void BulkImport::LoadCheckpoint()
+{
+  const std::map<std::string, std::string> defaultConfig =
+  {
+    { "path", "" },
+    { "folder", "" },
+    { "count", "0" },
+  };
+  Config config(GetCheckpointPath(), defaultConfig);
+  if ((config.Get("path") == m_Path) && (config.Get("folder") == m_Folder))
+  {
+    try
+    {
+      m_Checkpoint = std::stoull(config.Get("count"));
+    }
+    catch (...)
+    {
+      m_Checkpoint = 0;
+    }
+  }
+}
+
+void BulkImport::SaveCheckpoint()
+{
+  Config config;
+  config.Set("path", m_Path);
+  config.Set("folder", m_Folder);
+  config.Set("count", std::to_string(m_Checkpoint));
+  config.Save(GetCheckpointPath());
+}
+
+void BulkImport::ClearCheckpoint()
+{
+  Util::DeleteFile(GetCheckpointPath());
+}
+
+std::string BulkImport::GetCheckpointPath()
+{
+  return Util::GetApplicationDir() + std::string("import.conf");
+}
+
+time_t BulkImport::GetMessageTime(const std::string& p_Msg)
+{
+  size_t hdrEnd = p_Msg.find("\r\n\r\n");
+  if (hdrEnd != std::string::npos)
+  {
+    hdrEnd += 4;
+  }
+  else
+  {
+    hdrEnd = p_Msg.find("\n\n");
+    hdrEnd = (hdrEnd != std::string::npos) ? (hdrEnd + 2) : p_Msg.size();
+  }
+
+  Header header;
+  header.SetHeaderData(p_Msg.substr(0, hdrEnd), "", 0);
+  return header.GetTimeStamp();
+}
+
+void BulkImport::ReportProgress(bool p_Done)
+{
+  const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - m_StartTime;
+  const double secs = std::max(elapsed.count(), 0.001);
+  const double msgRate = (double)m_Imported / secs;
+  const double kbRate = ((double)m_Bytes / 1024.0) / secs;
+
+  std::cout << "\rImported " << m_Imported << " messages";
+  if (m_Failed > 0)
+  {
+    std::cout << ", " << m_Failed << " failed";
+  }
+
+  std::cout << " (" << (int)msgRate << " msgs/sec, " << (int)kbRate << " KB/sec)";
+  if (p_Done)
+  {
+    std::cout << " in " << (int)secs << " secs\n";
+    LOG_INFO("import %zu msgs %zu failed %.1f msgs/sec", m_Imported, m_Failed, msgRate);
+  }
+
+  std::cout << std::flush;
+}
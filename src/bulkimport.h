@@ -0,0 +1,57 @@
+// bulkimport.h
+//
+// Copyright (c) 2024 Kristofer Berggren
+// All rights reserved.
+//
+// falanet is distributed under the MIT license, see LICENSE for details.
+
+#pragma once
+
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "imap.h"
+
+class BulkImport
+{
+public:
+  BulkImport(Imap& p_Imap, const std::string& p_Path, const std::string& p_Folder);
+  virtual ~BulkImport();
+
+  bool Run();
+
+private:
+  bool Open();
+  bool NextMessage(Imap::AppendMessage& p_Msg);
+  bool NextMaildirMessage(Imap::AppendMessage& p_Msg);
+  bool NextMboxMessage(Imap::AppendMessage& p_Msg);
+  bool UploadBatch(std::vector<Imap::AppendMessage>& p_Batch, std::vector<size_t>& p_Positions);
+
+  void LoadCheckpoint();
+  void SaveCheckpoint();
+  void ClearCheckpoint();
+  static std::string GetCheckpointPath();
+
+  static time_t GetMessageTime(const std::string& p_Msg);
+  void ReportProgress(bool p_Done);
+
+private:
+  Imap& m_Imap;
+  std::string m_Path;
+  std::string m_Folder;
+
+  bool m_IsMaildir = false;
+  std::vector<std::string> m_MaildirFiles;
+  size_t m_MaildirIndex = 0;
+  std::ifstream m_MboxStream;
+  std::string m_MboxPendingLine;
+
+  size_t m_Consumed = 0;
+  size_t m_Checkpoint = 0;
+  size_t m_Imported = 0;
+  size_t m_Failed = 0;
+  size_t m_Bytes = 0;
+  std::chrono::steady_clock::time_point m_StartTime;
+};
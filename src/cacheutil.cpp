@@ -7,10 +7,67 @@
 
 #include "cacheutil.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <set>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "crypto.h"
 #include "loghelp.h"
+#include "serialization.h"
 #include "util.h"
 
+static const uint64_t s_SegmentSize = 1024 * 1024;
+static const std::string s_ManifestName = "manifest";
+
+static bool GetFileState(const std::string& p_Path, uint64_t& p_Size, int64_t& p_ModTime)
+{
+  struct stat sb;
+  if (stat(p_Path.c_str(), &sb) != 0) return false;
+
+  p_Size = sb.st_size;
+  p_ModTime = ((int64_t)sb.st_mtim.tv_sec * 1000000000LL) + sb.st_mtim.tv_nsec;
+  return true;
+}
+
+static std::string GetSegmentName(const std::string& p_File, const std::string& p_Digest)
+{
+  return p_File + "." + p_Digest;
+}
+
+static bool WriteFileSync(const std::string& p_Path, const std::string& p_Str)
+{
+  const std::string tmpPath = p_Path + ".tmp";
+  int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1) return false;
+
+  bool rv = (write(fd, p_Str.data(), p_Str.size()) == (ssize_t)p_Str.size()) && (fsync(fd) == 0);
+  close(fd);
+  rv = rv && (rename(tmpPath.c_str(), p_Path.c_str()) == 0);
+  if (!rv)
+  {
+    Util::DeleteFile(tmpPath);
+  }
+
+  return rv;
+}
+
+static void SyncDir(const std::string& p_Dir)
+{
+  int fd = open(p_Dir.c_str(), O_RDONLY);
+  if (fd == -1) return;
+
+  fsync(fd);
+  close(fd);
+}
+
 void CacheUtil::InitCacheDir()
 {
   static const int version = 5;
@@ -89,6 +146,219 @@ bool CacheUtil::EncryptCacheDir(const std::string& p_Pass, const std::string& p_
   return true;
 }
 
+bool CacheUtil::DecryptSegmentDir(const std::string& p_Pass, const std::string& p_SrcDir,
+                                  const std::string& p_DstDir,
+                                  std::map<std::string, SegmentManifest>& p_Manifests)
+{
+  p_Manifests.clear();
+  const std::string manifestPath = p_SrcDir + "/" + s_ManifestName;
+  if (!Util::Exists(manifestPath))
+  {
+    // empty for a new index, otherwise segments of an earlier layout to be rebuilt
+    return Util::ListDir(p_SrcDir).empty();
+  }
+
+  const std::string& data = Crypto::AESDecrypt(Util::ReadFile(manifestPath), p_Pass);
+  if (data.empty()) return false;
+
+  std::map<std::string, SegmentManifest> manifests =
+    Serialization::FromString<std::map<std::string, SegmentManifest>>(data);
+
+  // segment digests are taken from the manifest, so segments only need to be decrypted,
+  // which is done in parallel directly into place in the preallocated plaintext files
+  std::map<std::string, int> fds;
+  std::vector<std::pair<std::string, size_t>> tasks;
+  bool ok = true;
+  for (auto& manifest : manifests)
+  {
+    const std::string dstPath = p_DstDir + "/" + manifest.first;
+    int fd = open(dstPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if ((fd == -1) || (ftruncate(fd, manifest.second.m_Size) != 0))
+    {
+      LOG_WARNING("failed to create %s", dstPath.c_str());
+      if (fd != -1)
+      {
+        close(fd);
+      }
+
+      ok = false;
+      break;
+    }
+
+    fds[manifest.first] = fd;
+    for (size_t i = 0; i < manifest.second.m_Digests.size(); ++i)
+    {
+      tasks.push_back(std::make_pair(manifest.first, i));
+    }
+  }
+
+  std::atomic<size_t> nextTask(0);
+  std::atomic<bool> failed(!ok);
+  auto worker = [&]()
+  {
+    for (size_t t = nextTask++; (t < tasks.size()) && !failed; t = nextTask++)
+    {
+      const std::string& file = tasks.at(t).first;
+      const size_t i = tasks.at(t).second;
+      const SegmentManifest& manifest = manifests.at(file);
+      const std::string segmentPath = p_SrcDir + "/" + GetSegmentName(file, manifest.m_Digests.at(i));
+      const std::string& segment = Crypto::AESDecrypt(Util::ReadFile(segmentPath), p_Pass);
+      const uint64_t segmentLen = std::min(s_SegmentSize, manifest.m_Size - (i * s_SegmentSize));
+      if ((segment.size() != segmentLen) ||
+          (pwrite(fds.at(file), segment.data(), segmentLen, i * s_SegmentSize) != (ssize_t)segmentLen))
+      {
+        LOG_WARNING("failed to decrypt %s segment %zu", file.c_str(), i);
+        failed = true;
+      }
+    }
+  };
+
+  const unsigned threadCount =
+    std::max(1u, std::min<unsigned>(std::thread::hardware_concurrency(), tasks.size()));
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < threadCount; ++i)
+  {
+    threads.push_back(std::thread(worker));
+  }
+
+  worker();
+  for (auto& thread : threads)
+  {
+    thread.join();
+  }
+
+  for (auto& fd : fds)
+  {
+    close(fd.second);
+    if (failed)
+    {
+      Util::DeleteFile(p_DstDir + "/" + fd.first);
+    }
+  }
+
+  if (failed) return false;
+
+  std::set<std::string> segmentNames;
+  for (auto& manifest : manifests)
+  {
+    uint64_t plainSize = 0;
+    GetFileState(p_DstDir + "/" + manifest.first, plainSize, manifest.second.m_ModTime);
+    for (const auto& digest : manifest.second.m_Digests)
+    {
+      segmentNames.insert(GetSegmentName(manifest.first, digest));
+    }
+  }
+
+  // segments and tmp files left by an interrupted sync
+  for (const auto& file : Util::ListDir(p_SrcDir))
+  {
+    if ((file != s_ManifestName) && !segmentNames.count(file))
+    {
+      Util::DeleteFile(p_SrcDir + "/" + file);
+    }
+  }
+
+  p_Manifests = manifests;
+  return true;
+}
+
+bool CacheUtil::SyncSegmentDir(const std::string& p_Pass, const std::string& p_SrcDir,
+                               const std::string& p_DstDir,
+                               std::map<std::string, SegmentManifest>& p_Manifests)
+{
+  // files modified this recently may be modified again within the same mtime tick,
+  // so their mtime is not trusted and their segments are re-hashed on next sync
+  const int64_t racyModTime = ((int64_t)time(NULL) - 2) * 1000000000LL;
+
+  // segments are named by keyed digest and never overwritten, the manifest listing them is
+  // replaced last, so an interrupted sync leaves the previous snapshot complete on disk
+  size_t segmentsWritten = 0;
+  std::map<std::string, SegmentManifest> manifests;
+  const std::vector<std::string>& files = Util::ListDir(p_SrcDir);
+  for (auto& file : files)
+  {
+    const std::string srcPath = p_SrcDir + "/" + file;
+    uint64_t size = 0;
+    int64_t modTime = 0;
+    if (!GetFileState(srcPath, size, modTime)) continue;
+
+    auto it = p_Manifests.find(file);
+    if ((it != p_Manifests.end()) && (it->second.m_Size == size) && (it->second.m_ModTime == modTime) &&
+        (modTime != 0))
+    {
+      manifests[file] = it->second;
+      continue;
+    }
+
+    SegmentManifest& manifest = manifests[file];
+    manifest.m_Size = size;
+    manifest.m_ModTime = (modTime < racyModTime) ? modTime : 0;
+
+    std::ifstream inStream(srcPath, std::ios::binary);
+    std::string segment(s_SegmentSize, '\0');
+    for (size_t i = 0; (i * s_SegmentSize) < size; ++i)
+    {
+      const uint64_t segmentLen = std::min(s_SegmentSize, size - (i * s_SegmentSize));
+      segment.resize(segmentLen);
+      if (!inStream.read(&segment[0], segmentLen))
+      {
+        LOG_WARNING("failed to read %s", srcPath.c_str());
+        return false;
+      }
+
+      const std::string digest = Crypto::HMACSHA256(segment, p_Pass);
+      manifest.m_Digests.push_back(digest);
+      const std::string segmentPath = p_DstDir + "/" + GetSegmentName(file, digest);
+      if (Util::Exists(segmentPath)) continue;
+
+      const std::string& ciphertext = Crypto::AESEncrypt(segment, p_Pass);
+      if (ciphertext.empty() || !WriteFileSync(segmentPath, ciphertext))
+      {
+        LOG_WARNING("failed to write %s", segmentPath.c_str());
+        return false;
+      }
+
+      ++segmentsWritten;
+    }
+  }
+
+  SyncDir(p_DstDir);
+  const std::string& manifestData = Crypto::AESEncrypt(Serialization::ToString(manifests), p_Pass);
+  if (manifestData.empty() || !WriteFileSync(p_DstDir + "/" + s_ManifestName, manifestData))
+  {
+    LOG_WARNING("failed to write segment manifest");
+    return false;
+  }
+
+  SyncDir(p_DstDir);
+
+  // segments only referenced by the previous snapshot
+  std::set<std::string> segmentNames;
+  for (const auto& manifest : manifests)
+  {
+    for (const auto& digest : manifest.second.m_Digests)
+    {
+      segmentNames.insert(GetSegmentName(manifest.first, digest));
+    }
+  }
+
+  for (const auto& manifest : p_Manifests)
+  {
+    for (const auto& digest : manifest.second.m_Digests)
+    {
+      const std::string segmentName = GetSegmentName(manifest.first, digest);
+      if (!segmentNames.count(segmentName))
+      {
+        Util::DeleteFile(p_DstDir + "/" + segmentName);
+      }
+    }
+  }
+
+  p_Manifests = manifests;
+  LOG_DEBUG("synced %zu segments", segmentsWritten);
+  return true;
+}
+
 void CacheUtil::ReadVersionFromFile(const std::string& p_Path, int& p_Version)
 {
   std::string str = Util::FromHex(Util::ReadFile(p_Path));
@@ -7,17 +7,38 @@
 
 #pragma once
 
+#include <cstdint>
+#include <map>
 #include <string>
+#include <vector>
 
 class CacheUtil
 {
 public:
+  struct SegmentManifest
+  {
+    uint64_t m_Size = 0;
+    std::vector<std::string> m_Digests; // hmac-sha256 of plaintext segments, also segment file names
+    int64_t m_ModTime = 0; // not persisted, plaintext mtime at last sync
+
+    template<class Archive>
+    void serialize(Archive& p_Archive)
+    {
+      p_Archive(m_Size,
+                m_Digests);
+    }
+  };
+
   static void InitCacheDir();
   static std::string GetCacheDir();
 
   static bool CommonInitCacheDir(const std::string& p_Dir, int p_Version, bool p_Encrypted);
   static bool DecryptCacheDir(const std::string& p_Pass, const std::string& p_SrcDir, const std::string& p_DstDir);
   static bool EncryptCacheDir(const std::string& p_Pass, const std::string& p_SrcDir, const std::string& p_DstDir);
+  static bool DecryptSegmentDir(const std::string& p_Pass, const std::string& p_SrcDir, const std::string& p_DstDir,
+                                std::map<std::string, SegmentManifest>& p_Manifests);
+  static bool SyncSegmentDir(const std::string& p_Pass, const std::string& p_SrcDir, const std::string& p_DstDir,
+                             std::map<std::string, SegmentManifest>& p_Manifests);
   static void ReadVersionFromFile(const std::string& p_Path, int& p_Version);
   static void WriteVersionToFile(const std::string& p_Path, const int p_Version);
 };
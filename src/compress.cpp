@@ -0,0 +1,129 @@
+// compress.cpp
+//
+// Copyright (c) 2024 Kristofer Berggren
+// All rights reserved.
+//
+// falanet is distributed under the MIT license, see LICENSE for details.
+
+#include "compress.h"
+
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+#include <zlib.h>
+
+#include "loghelp.h"
+
+// fast level, as sync throughput matters more than the last percent of ratio
+static const int s_Level = 3;
+static const size_t s_SizeLen = 4;
+
+std::string Compress::GetVersion()
+{
+  return std::string(zlibVersion());
+}
+
+std::string Compress::Pack(const std::string& p_Data, const std::string& p_Dict)
+{
+  std::string packed;
+  if (p_Data.size() <= std::numeric_limits<uint32_t>::max())
+  {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, s_Level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK)
+    {
+      if (p_Dict.empty() ||
+          (deflateSetDictionary(&stream, (const Bytef*)p_Dict.data(), p_Dict.size()) == Z_OK))
+      {
+        // tag, uncompressed size (little endian) and raw deflate stream
+        const uint32_t size = p_Data.size();
+        packed.resize(1 + s_SizeLen + deflateBound(&stream, p_Data.size()));
+        packed[0] = (char)FormatDeflate;
+        for (size_t i = 0; i < s_SizeLen; ++i)
+        {
+          packed[1 + i] = (char)((size >> (8 * i)) & 0xff);
+        }
+
+        stream.next_in = (Bytef*)const_cast<char*>(p_Data.data());
+        stream.avail_in = p_Data.size();
+        stream.next_out = (Bytef*)&packed[1 + s_SizeLen];
+        stream.avail_out = packed.size() - 1 - s_SizeLen;
+        if (deflate(&stream, Z_FINISH) == Z_STREAM_END)
+        {
+          packed.resize(1 + s_SizeLen + stream.total_out);
+        }
+        else
+        {
+          packed.clear();
+        }
+      }
+
+      deflateEnd(&stream);
+    }
+  }
+
+  // keep data raw unless deflate saves at least an eighth
+  if (packed.empty() || (packed.size() > (p_Data.size() - (p_Data.size() / 8))))
+  {
+    packed.clear();
+    packed.reserve(1 + p_Data.size());
+    packed.push_back((char)FormatRaw);
+    packed.append(p_Data);
+  }
+
+  return packed;
+}
+
+bool Compress::Unpack(const char* p_Data, size_t p_Size, std::string& p_Out, const std::string& p_Dict)
+{
+  p_Out.clear();
+  if (p_Size < 1) return false;
+
+  if (p_Data[0] == (char)FormatRaw)
+  {
+    p_Out.assign(p_Data + 1, p_Size - 1);
+    return true;
+  }
+
+  if ((p_Data[0] != (char)FormatDeflate) || (p_Size < (1 + s_SizeLen))) return false;
+
+  uint32_t size = 0;
+  for (size_t i = 0; i < s_SizeLen; ++i)
+  {
+    size |= ((uint32_t)(unsigned char)p_Data[1 + i]) << (8 * i);
+  }
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) return false;
+
+  bool rv = p_Dict.empty() ||
+    (inflateSetDictionary(&stream, (const Bytef*)p_Dict.data(), p_Dict.size()) == Z_OK);
+  if (rv)
+  {
+    p_Out.resize(size);
+    stream.next_in = (Bytef*)const_cast<char*>(p_Data + 1 + s_SizeLen);
+    stream.avail_in = p_Size - 1 - s_SizeLen;
+    stream.next_out = (Bytef*)&p_Out[0];
+    stream.avail_out = size;
+    rv = (inflate(&stream, Z_FINISH) == Z_STREAM_END) && (stream.total_out == size);
+  }
+
+  inflateEnd(&stream);
+
+  if (!rv)
+  {
+    LOG_WARNING("failed to inflate %zu bytes", p_Size);
+    p_Out.clear();
+  }
+
+  return rv;
+}
+
+std::string Compress::Unpack(const std::string& p_Data, const std::string& p_Dict)
+{
+  std::string data;
+  Unpack(p_Data.data(), p_Data.size(), data, p_Dict);
+  return data;
+}
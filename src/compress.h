@@ -0,0 +1,29 @@
+// compress.h
+//
+// Copyright (c) 2024 Kristofer Berggren
+// All rights reserved.
+//
+// falanet is distributed under the MIT license, see LICENSE for details.
+
+#pragma once
+
+#include <string>
+
+// packs data as a format tag followed by the payload, which is deflated unless
+// compression does not pay off, in which case it is stored raw after the tag
+class Compress
+{
+public:
+  enum Format
+  {
+    FormatRaw = 'R',
+    FormatDeflate = 'Z',
+  };
+
+  static std::string GetVersion();
+
+  static std::string Pack(const std::string& p_Data, const std::string& p_Dict = std::string());
+  static bool Unpack(const char* p_Data, size_t p_Size, std::string& p_Out,
+                     const std::string& p_Dict = std::string());
+  static std::string Unpack(const std::string& p_Data, const std::string& p_Dict = std::string());
+};
@@ -0,0 +1,121 @@
+// countingstream.cpp
+//
+// Copyright (c) 2024 Kristofer Berggren
+// All rights reserved.
+//
+// falanet is distributed under the MIT license, see LICENSE for details.
+
+#include "countingstream.h"
+
+#include <cstdlib>
+
+struct CountingStreamData
+{
+  mailstream_low* m_Low = nullptr;
+  std::atomic<uint64_t>* m_Bytes = nullptr;
+};
+
+static ssize_t CountingStreamRead(mailstream_low* p_Low, void* p_Buf, size_t p_Count)
+{
+  CountingStreamData* stream = (CountingStreamData*)p_Low->data;
+  ssize_t rv = mailstream_low_read(stream->m_Low, p_Buf, p_Count);
+  if (rv > 0)
+  {
+    *stream->m_Bytes += rv;
+  }
+
+  return rv;
+}
+
+static ssize_t CountingStreamWrite(mailstream_low* p_Low, const void* p_Buf, size_t p_Count)
+{
+  CountingStreamData* stream = (CountingStreamData*)p_Low->data;
+  ssize_t rv = mailstream_low_write(stream->m_Low, p_Buf, p_Count);
+  if (rv > 0)
+  {
+    *stream->m_Bytes += rv;
+  }
+
+  return rv;
+}
+
+static int CountingStreamClose(mailstream_low* p_Low)
+{
+  return mailstream_low_close(((CountingStreamData*)p_Low->data)->m_Low);
+}
+
+static int CountingStreamGetFd(mailstream_low* p_Low)
+{
+  return mailstream_low_get_fd(((CountingStreamData*)p_Low->data)->m_Low);
+}
+
+static void CountingStreamFree(mailstream_low* p_Low)
+{
+  CountingStreamData* stream = (CountingStreamData*)p_Low->data;
+  mailstream_low_free(stream->m_Low);
+  delete stream;
+  free(p_Low);
+}
+
+static void CountingStreamCancel(mailstream_low* p_Low)
+{
+  mailstream_low_cancel(((CountingStreamData*)p_Low->data)->m_Low);
+}
+
+static struct mailstream_cancel* CountingStreamGetCancel(mailstream_low* p_Low)
+{
+  return mailstream_low_get_cancel(((CountingStreamData*)p_Low->data)->m_Low);
+}
+
+static carray* CountingStreamGetCertificateChain(mailstream_low* p_Low)
+{
+  return mailstream_low_get_certificate_chain(((CountingStreamData*)p_Low->data)->m_Low);
+}
+
+static int CountingStreamSetupIdle(mailstream_low* p_Low)
+{
+  return mailstream_low_setup_idle(((CountingStreamData*)p_Low->data)->m_Low);
+}
+
+static int CountingStreamUnsetupIdle(mailstream_low* p_Low)
+{
+  return mailstream_low_unsetup_idle(((CountingStreamData*)p_Low->data)->m_Low);
+}
+
+static int CountingStreamInterruptIdle(mailstream_low* p_Low)
+{
+  return mailstream_low_interrupt_idle(((CountingStreamData*)p_Low->data)->m_Low);
+}
+
+static mailstream_low_driver s_CountingStreamDriver =
+{
+  CountingStreamRead,
+  CountingStreamWrite,
+  CountingStreamClose,
+  CountingStreamGetFd,
+  CountingStreamFree,
+  CountingStreamCancel,
+  CountingStreamGetCancel,
+  CountingStreamGetCertificateChain,
+  CountingStreamSetupIdle,
+  CountingStreamUnsetupIdle,
+  CountingStreamInterruptIdle,
+};
+
+bool CountingStream::Push(mailstream* p_Stream, std::atomic<uint64_t>* p_Bytes)
+{
+  mailstream_low* low = mailstream_get_low(p_Stream);
+  CountingStreamData* stream = new CountingStreamData();
+  stream->m_Low = low;
+  stream->m_Bytes = p_Bytes;
+  mailstream_low* countingLow = mailstream_low_new(stream, &s_CountingStreamDriver);
+  if (countingLow == NULL)
+  {
+    delete stream;
+    return false;
+  }
+
+  mailstream_low_set_timeout(countingLow, mailstream_low_get_timeout(low));
+  mailstream_set_low(p_Stream, countingLow);
+  return true;
+}
@@ -0,0 +1,21 @@
+// countingstream.h
+//
+// Copyright (c) 2024 Kristofer Berggren
+// All rights reserved.
+//
+// falanet is distributed under the MIT license, see LICENSE for details.
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "libetpan_help.h"
+#include <libetpan/mailstream.h>
+
+// pass-through mailstream layer counting bytes read and written by the layer below it
+class CountingStream
+{
+public:
+  static bool Push(mailstream* p_Stream, std::atomic<uint64_t>* p_Bytes);
+};
@@ -9,6 +9,7 @@
 
 #include <cstring>
 #include <fstream>
+#include <sstream>
 
 #include <openssl/conf.h>
 #include <openssl/crypto.h>
@@ -164,6 +165,52 @@ std::string Crypto::SHA256(const std::string& p_Str)
   return hexDigest;
 }
 
+static std::string HMACSHA256Stream(std::istream& p_Stream, const std::string& p_Key)
+{
+  std::string hexDigest;
+  EVP_PKEY* pkey = EVP_PKEY_new_mac_key(EVP_PKEY_HMAC, NULL, (const unsigned char*)p_Key.data(), p_Key.size());
+  EVP_MD_CTX* mdctx = EVP_MD_CTX_new();
+  if ((pkey != NULL) && (mdctx != NULL) && (EVP_DigestSignInit(mdctx, NULL, EVP_sha256(), NULL, pkey) == 1))
+  {
+    bool rv = true;
+    std::vector<char> buf(64 * 1024);
+    while (rv && p_Stream)
+    {
+      p_Stream.read(buf.data(), buf.size());
+      const std::streamsize readLen = p_Stream.gcount();
+      if (readLen > 0)
+      {
+        rv = (EVP_DigestSignUpdate(mdctx, buf.data(), readLen) == 1);
+      }
+    }
+
+    unsigned char digest[EVP_MAX_MD_SIZE] = { 0 };
+    size_t digestLen = sizeof(digest);
+    if (rv && p_Stream.eof() && (EVP_DigestSignFinal(mdctx, digest, &digestLen) == 1))
+    {
+      hexDigest = Util::ToHex(std::string((char*)digest, digestLen));
+    }
+  }
+
+  EVP_MD_CTX_free(mdctx);
+  EVP_PKEY_free(pkey);
+  return hexDigest;
+}
+
+std::string Crypto::HMACSHA256(const std::string& p_Str, const std::string& p_Key)
+{
+  std::istringstream stream(p_Str);
+  return HMACSHA256Stream(stream, p_Key);
+}
+
+std::string Crypto::HMACSHA256File(const std::string& p_Path, const std::string& p_Key)
+{
+  std::ifstream stream(p_Path, std::ios::binary);
+  if (!stream) return std::string();
+
+  return HMACSHA256Stream(stream, p_Key);
+}
+
 bool Crypto::AESEncryptFile(const std::string& p_InPath, const std::string& p_OutPath, const std::string& p_Pass)
 {
   unsigned char salt[8] = { 0 };
@@ -326,3 +373,124 @@ bool Crypto::AESDecryptFile(const std::string& p_InPath, const std::string& p_Ou
 
   return true;
 }
+
+bool Crypto::AESReEncryptFile(const std::string& p_InPath, const std::string& p_OutPath,
+                              const std::string& p_OldPass, const std::string& p_NewPass)
+{
+  // decrypt and encrypt chunk by chunk, so plaintext never reaches the disk
+  std::ifstream inStream(p_InPath, std::ios::binary);
+  if (!inStream) return false;
+
+  char header[16] = { 0 };
+  if (!inStream.read(header, sizeof(header)) || (strncmp(header, "Salted__", 8) != 0)) return false;
+
+  unsigned char inSalt[8] = { 0 };
+  memcpy(inSalt, header + 8, sizeof(inSalt));
+  unsigned char inKey[32] = { 0 };
+  unsigned char inIv[32] = { 0 };
+  EVP_BytesToKey(EVP_aes_256_cbc(), EVP_sha1(), inSalt, (unsigned char*)const_cast<char*>(p_OldPass.c_str()),
+                 p_OldPass.size(), 1, inKey, inIv);
+
+  unsigned char outSalt[8] = { 0 };
+  RAND_bytes(outSalt, sizeof(outSalt));
+  unsigned char outKey[32] = { 0 };
+  unsigned char outIv[32] = { 0 };
+  EVP_BytesToKey(EVP_aes_256_cbc(), EVP_sha1(), outSalt, (unsigned char*)const_cast<char*>(p_NewPass.c_str()),
+                 p_NewPass.size(), 1, outKey, outIv);
+
+  EVP_CIPHER_CTX* decCtx = EVP_CIPHER_CTX_new();
+  EVP_CIPHER_CTX* encCtx = EVP_CIPHER_CTX_new();
+  bool rv = (decCtx != NULL) && (encCtx != NULL) &&
+    (EVP_DecryptInit_ex(decCtx, EVP_aes_256_cbc(), NULL, inKey, inIv) == 1) &&
+    (EVP_EncryptInit_ex(encCtx, EVP_aes_256_cbc(), NULL, outKey, outIv) == 1);
+
+  std::ofstream outStream;
+  if (rv)
+  {
+    outStream.open(p_OutPath, std::ios::binary);
+    outStream.write("Salted__", 8);
+    outStream.write((char*)outSalt, sizeof(outSalt));
+    rv = (bool)outStream;
+  }
+
+  const std::streamsize bufLen = 64 * 1024;
+  std::vector<char> inBuf(bufLen);
+  std::vector<char> plainBuf(bufLen + EVP_MAX_BLOCK_LENGTH);
+  std::vector<char> outBuf(bufLen + (2 * EVP_MAX_BLOCK_LENGTH));
+  bool inDone = false;
+  while (rv && !inDone)
+  {
+    int plainLen = 0;
+    inStream.read(inBuf.data(), bufLen);
+    const std::streamsize readLen = inStream.gcount();
+    if (readLen > 0)
+    {
+      rv = (EVP_DecryptUpdate(decCtx, (unsigned char*)plainBuf.data(), &plainLen,
+                              (unsigned char*)inBuf.data(), readLen) == 1);
+    }
+    else
+    {
+      // wrong pass is detected here through invalid padding
+      inDone = true;
+      rv = (EVP_DecryptFinal_ex(decCtx, (unsigned char*)plainBuf.data(), &plainLen) == 1);
+    }
+
+    int outLen = 0;
+    if (rv && (plainLen > 0))
+    {
+      rv = (EVP_EncryptUpdate(encCtx, (unsigned char*)outBuf.data(), &outLen,
+                              (unsigned char*)plainBuf.data(), plainLen) == 1);
+      outStream.write(outBuf.data(), outLen);
+    }
+  }
+
+  if (rv)
+  {
+    int outLen = 0;
+    rv = (EVP_EncryptFinal_ex(encCtx, (unsigned char*)outBuf.data(), &outLen) == 1);
+    outStream.write(outBuf.data(), outLen);
+    outStream.close();
+    rv = rv && (bool)outStream;
+  }
+
+  OPENSSL_cleanse(plainBuf.data(), plainBuf.size());
+  EVP_CIPHER_CTX_free(decCtx);
+  EVP_CIPHER_CTX_free(encCtx);
+
+  return rv;
+}
+
+std::string Crypto::AESDecryptFileHead(const std::string& p_Path, const std::string& p_Pass)
+{
+  // decrypts the first block only, without padding check, to identify file content by a known header
+  std::ifstream inStream(p_Path, std::ios::binary);
+  if (!inStream) return std::string();
+
+  char header[32] = { 0 };
+  if (!inStream.read(header, sizeof(header)) || (strncmp(header, "Salted__", 8) != 0)) return std::string();
+
+  unsigned char salt[8] = { 0 };
+  memcpy(salt, header + 8, sizeof(salt));
+  unsigned char key[32] = { 0 };
+  unsigned char iv[32] = { 0 };
+  EVP_BytesToKey(EVP_aes_256_cbc(), EVP_sha1(), salt, (unsigned char*)const_cast<char*>(p_Pass.c_str()),
+                 p_Pass.size(), 1, key, iv);
+
+  std::string head;
+  EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+  if ((ctx != NULL) && (EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv) == 1))
+  {
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+    unsigned char plain[16 + EVP_MAX_BLOCK_LENGTH] = { 0 };
+    int plainLen = 0;
+    if (EVP_DecryptUpdate(ctx, plain, &plainLen, (unsigned char*)header + 16, 16) == 1)
+    {
+      head = std::string((char*)plain, plainLen);
+    }
+
+    OPENSSL_cleanse(plain, sizeof(plain));
+  }
+
+  EVP_CIPHER_CTX_free(ctx);
+  return head;
+}
@@ -20,7 +20,12 @@ public:
   static std::string AESDecrypt(const std::string& p_Ciphertext, const std::string& p_Pass);
 
   static std::string SHA256(const std::string& p_Str);
+  static std::string HMACSHA256(const std::string& p_Str, const std::string& p_Key);
+  static std::string HMACSHA256File(const std::string& p_Path, const std::string& p_Key);
 
   static bool AESEncryptFile(const std::string& p_InPath, const std::string& p_OutPath, const std::string& p_Pass);
   static bool AESDecryptFile(const std::string& p_InPath, const std::string& p_OutPath, const std::string& p_Pass);
+  static bool AESReEncryptFile(const std::string& p_InPath, const std::string& p_OutPath,
+                               const std::string& p_OldPass, const std::string& p_NewPass);
+  static std::string AESDecryptFileHead(const std::string& p_Path, const std::string& p_Pass);
 };
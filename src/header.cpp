@@ -42,6 +42,22 @@ std::string Header::GetData() const
   return m_Data;
 }
 
+void Header::SetSummaryData(const time_t p_TimeStamp, const std::string& p_ShortFrom, const std::string& p_ShortTo,
+                            const std::string& p_Subject, const bool p_HasAttachments)
+{
+  // partial header for result lists, no raw data to parse
+  m_ParseVersion = GetCurrentParseVersion();
+  if (p_TimeStamp != 0)
+  {
+    SetTimeStamp(p_TimeStamp);
+  }
+
+  m_ShortFrom = p_ShortFrom;
+  m_ShortTo = p_ShortTo;
+  m_Subject = p_Subject;
+  m_HasAttachments = p_HasAttachments;
+}
+
 std::string Header::GetDate() const
 {
   return m_Date;
@@ -112,6 +128,24 @@ std::string Header::GetMessageId() const
   return m_MessageId;
 }
 
+// key identifying identical copies of a message in different folders, empty if not available
+std::string Header::GetDedupKey() const
+{
+  if (m_MessageId.empty()) return std::string();
+
+  // exclude local server time header, which differs between copies
+  size_t startpos = 0;
+  if (m_Data.compare(0, labelServerTime.size(), labelServerTime) == 0)
+  {
+    startpos = m_Data.find("\n");
+    if (startpos == std::string::npos) return std::string();
+
+    ++startpos;
+  }
+
+  return Crypto::SHA256(m_Data.substr(startpos));
+}
+
 std::set<std::string> Header::GetAddresses() const
 {
   return m_Addresses;
@@ -152,6 +186,27 @@ std::string Header::GetRawHeaderText(bool p_LocalHeaders)
   return raw;
 }
 
+// full header text from message header data, when available, as cached headers may only hold compact fields
+std::string Header::GetFullHeaderText(bool p_LocalHeaders, const std::string& p_MsgHdrData)
+{
+  if (p_MsgHdrData.empty()) return GetRawHeaderText(p_LocalHeaders);
+
+  std::string raw;
+  if (p_LocalHeaders && (m_Data.compare(0, labelServerTime.size(), labelServerTime) == 0))
+  {
+    raw = m_Data.substr(0, m_Data.find("\n") + 1);
+  }
+
+  raw += p_MsgHdrData;
+  raw.erase(std::remove(raw.begin(), raw.end(), L'\r'), raw.end());
+  if (raw.back() != '\n')
+  {
+    raw += "\n";
+  }
+
+  return raw;
+}
+
 std::string Header::GetCurrentDate()
 {
   time_t nowtime = time(NULL);
@@ -161,6 +216,60 @@ std::string Header::GetCurrentDate()
   return std::string(nowdatestr);
 }
 
+// fields needed for message lists, replies and dedup, fetched instead of the full header.
+// mime fields are needed for the appended bodystructure to parse as the message parts.
+const std::vector<std::string>& Header::GetCompactFields()
+{
+  static const std::vector<std::string> fields =
+  {
+    "Date", "From", "To", "Cc", "Bcc", "Reply-To", "Subject", "Message-ID",
+    "MIME-Version", "Content-Type",
+  };
+  return fields;
+}
+
+// filter raw header data to compact fields, in the same form as an imap HEADER.FIELDS fetch
+std::string Header::GetCompactHeaderData(const std::string& p_HdrData)
+{
+  static const std::set<std::string> fields = []()
+  {
+    std::set<std::string> lowerFields;
+    for (const auto& field : GetCompactFields())
+    {
+      lowerFields.insert(Util::ToLower(field));
+    }
+
+    return lowerFields;
+  }();
+
+  std::string data;
+  bool keep = false;
+  size_t pos = 0;
+  while (pos < p_HdrData.size())
+  {
+    size_t endpos = p_HdrData.find('\n', pos);
+    endpos = (endpos != std::string::npos) ? (endpos + 1) : p_HdrData.size();
+    const std::string line = p_HdrData.substr(pos, endpos - pos);
+    pos = endpos;
+
+    if ((line == "\r\n") || (line == "\n")) break;
+
+    if ((line[0] != ' ') && (line[0] != '\t'))
+    {
+      const size_t colonpos = line.find(':');
+      keep = (colonpos != std::string::npos) && (fields.count(Util::ToLower(line.substr(0, colonpos))) > 0);
+    }
+
+    if (keep)
+    {
+      data += line;
+    }
+  }
+
+  data += "\r\n";
+  return data;
+}
+
 void Header::Parse()
 {
   // @note: this function should not be called directly, only via ParseIfNeeded()
@@ -289,23 +398,28 @@ void Header::Parse()
 
   if (timeStamp != 0)
   {
-    struct tm* timeinfo = localtime(&timeStamp);
+    SetTimeStamp(timeStamp);
+  }
 
-    char senttimestr[64];
-    strftime(senttimestr, sizeof(senttimestr), "%H:%M", timeinfo);
-    std::string senttime(senttimestr);
+  m_ParseVersion = GetCurrentParseVersion();
+}
 
-    char sentdatestr[64];
-    strftime(sentdatestr, sizeof(sentdatestr), "%Y-%m-%d", timeinfo);
-    std::string sentdate(sentdatestr);
+void Header::SetTimeStamp(const time_t p_TimeStamp)
+{
+  struct tm* timeinfo = localtime(&p_TimeStamp);
 
-    m_TimeStamp = timeStamp;
-    m_Date = sentdate;
-    m_DateTime = sentdate + std::string(" ") + senttime;
-    m_Time = senttime;
-  }
+  char senttimestr[64];
+  strftime(senttimestr, sizeof(senttimestr), "%H:%M", timeinfo);
+  std::string senttime(senttimestr);
 
-  m_ParseVersion = GetCurrentParseVersion();
+  char sentdatestr[64];
+  strftime(sentdatestr, sizeof(sentdatestr), "%Y-%m-%d", timeinfo);
+  std::string sentdate(sentdatestr);
+
+  m_TimeStamp = p_TimeStamp;
+  m_Date = sentdate;
+  m_DateTime = sentdate + std::string(" ") + senttime;
+  m_Time = senttime;
 }
 
 std::vector<std::string> Header::MailboxListToStrings(mailimf_mailbox_list* p_MailboxList,
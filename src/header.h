@@ -19,6 +19,8 @@ public:
   void SetHeaderData(const std::string& p_HdrData, const std::string& p_StrData,
                      const time_t p_ServerTime);
   std::string GetData() const;
+  void SetSummaryData(const time_t p_TimeStamp, const std::string& p_ShortFrom, const std::string& p_ShortTo,
+                      const std::string& p_Subject, const bool p_HasAttachments);
 
   std::string GetDate() const;
   std::string GetDateTime() const;
@@ -35,9 +37,11 @@ public:
   std::string GetSubject() const;
   std::string GetUniqueId() const;
   std::string GetMessageId() const;
+  std::string GetDedupKey() const;
   std::set<std::string> GetAddresses() const;
   bool GetHasAttachments() const;
   std::string GetRawHeaderText(bool p_LocalHeaders);
+  std::string GetFullHeaderText(bool p_LocalHeaders, const std::string& p_MsgHdrData);
   inline bool ParseIfNeeded()
   {
     if (m_ParseVersion == GetCurrentParseVersion()) return false;
@@ -70,9 +74,12 @@ public:
   }
 
   static std::string GetCurrentDate();
+  static const std::vector<std::string>& GetCompactFields();
+  static std::string GetCompactHeaderData(const std::string& p_HdrData);
 
 private:
   void Parse();
+  void SetTimeStamp(const time_t p_TimeStamp);
   std::vector<std::string> MailboxListToStrings(struct mailimf_mailbox_list* p_MailboxList,
                                                 const bool p_Short = false);
   std::vector<std::string> AddressListToStrings(struct mailimf_address_list* p_AddrList,
@@ -7,11 +7,19 @@
 
 #include "imap.h"
 
+#include <algorithm>
+#include <limits>
+
+#include <sys/stat.h>
+
 #include "libetpan_help.h"
 #include <libetpan/imapdriver_tools.h>
 #include <libetpan/mailimap.h>
+#include <libetpan/mailimap_sender.h>
+#include <libetpan/uidplus.h>
 
 #include "auth.h"
+#include "countingstream.h"
 #include "crypto.h"
 #include "encoding.h"
 #include "flag.h"
@@ -23,6 +31,25 @@
 #include "sethelp.h"
 #include "util.h"
 
+bool Imap::s_CompressEnabled = true;
+bool Imap::s_CompactHeaders = true;
+
+static void AddUidRanges(struct mailimap_set* p_Set, const UidSet& p_Uids)
+{
+  // uid sets are stored as ranges, which map directly to imap sequence-set ranges
+  for (const auto& range : p_Uids.GetRanges())
+  {
+    if (range.first == range.second)
+    {
+      mailimap_set_add_single(p_Set, range.first);
+    }
+    else
+    {
+      mailimap_set_add_interval(p_Set, range.first, range.second);
+    }
+  }
+}
+
 Imap::Imap(const std::string& p_User, const std::string& p_Pass, const std::string& p_Host,
            const uint16_t p_Port, const int64_t p_Timeout,
            const bool p_CacheEncrypt, const bool p_CacheIndexEncrypt,
@@ -54,6 +81,30 @@ Imap::Imap(const std::string& p_User, const std::string& p_Pass, const std::stri
   m_ImapIndex.reset(new ImapIndex(m_CacheIndexEncrypt, m_Pass, m_ImapCache, p_StatusHandler));
 }
 
+Imap::Imap(const std::string& p_User, const std::string& p_Pass, const std::string& p_Host,
+           const uint16_t p_Port, const int64_t p_Timeout,
+           const bool p_CacheEncrypt, const bool p_CacheIndexEncrypt,
+           const std::set<std::string>& p_FoldersExclude,
+           const bool p_SniEnabled,
+           std::shared_ptr<ImapCache> p_ImapCache, std::shared_ptr<ImapIndex> p_ImapIndex)
+  : m_User(p_User)
+  , m_Pass(p_Pass)
+  , m_Host(p_Host)
+  , m_Port(p_Port)
+  , m_Timeout(p_Timeout)
+  , m_CacheEncrypt(p_CacheEncrypt)
+  , m_CacheIndexEncrypt(p_CacheIndexEncrypt)
+  , m_FoldersExclude(p_FoldersExclude)
+  , m_SniEnabled(p_SniEnabled)
+  , m_ImapCache(p_ImapCache)
+  , m_ImapIndex(p_ImapIndex)
+  , m_IsPrimary(false)
+{
+  LOG_DEBUG_FUNC(STR("***", "***" /*p_Pass*/, p_Host, p_Port, p_CacheEncrypt));
+
+  InitImap();
+}
+
 Imap::~Imap()
 {
   LOG_DEBUG_FUNC(STR());
@@ -71,6 +122,14 @@ Imap::~Imap()
   }
 }
 
+std::unique_ptr<Imap> Imap::CreateSession() const
+{
+  // separate server connection sharing cache and search index with this instance
+  return std::unique_ptr<Imap>(new Imap(m_User, m_Pass, m_Host, m_Port, m_Timeout, m_CacheEncrypt,
+                                        m_CacheIndexEncrypt, m_FoldersExclude, m_SniEnabled,
+                                        m_ImapCache, m_ImapIndex));
+}
+
 void Imap::InitImap()
 {
   m_Imap = LOG_IF_NULL(mailimap_new(0, NULL));
@@ -112,6 +171,8 @@ bool Imap::Login()
   {
     std::lock_guard<std::mutex> imapLock(m_ImapMutex);
     m_SelectedFolder.clear();
+    m_NotifySet = false;
+    m_ReconnectNeeded = false;
 
     int rv = 0;
     if (isSSL)
@@ -164,6 +225,11 @@ bool Imap::Login()
 
       InitImap();
     }
+
+    if (connected && s_CompressEnabled)
+    {
+      EnableCompress();
+    }
   }
 
   {
@@ -194,6 +260,7 @@ bool Imap::Logout()
       rv = LOG_IF_IMAP_LOGOUT_ERR(mailimap_logout(m_Imap));
     }
     m_SelectedFolder.clear();
+    LogTrafficStats();
 
     m_Connected = false;
   }
@@ -271,7 +338,7 @@ bool Imap::GetFolders(const bool p_Cached, std::set<std::string>& p_Folders)
   return false;
 }
 
-bool Imap::GetUids(const std::string& p_Folder, const bool p_Cached, std::set<uint32_t>& p_Uids)
+bool Imap::GetUids(const std::string& p_Folder, const bool p_Cached, UidSet& p_Uids)
 {
   LOG_DEBUG_FUNC(STR(p_Folder, p_Cached, p_Uids));
 
@@ -331,7 +398,7 @@ bool Imap::GetUids(const std::string& p_Folder, const bool p_Cached, std::set<ui
   return (rv == MAILIMAP_NO_ERROR);
 }
 
-bool Imap::GetHeaders(const std::string& p_Folder, const std::set<uint32_t>& p_Uids,
+bool Imap::GetHeaders(const std::string& p_Folder, const UidSet& p_Uids,
                       const bool p_Cached, const bool p_Prefetch,
                       std::map<uint32_t, Header>& p_Headers)
 {
@@ -344,12 +411,9 @@ bool Imap::GetHeaders(const std::string& p_Folder, const std::set<uint32_t>& p_U
 
   if (!p_Cached)
   {
-    std::set<uint32_t> uidsNotCached = p_Uids - MapKey(p_Headers);
-    for (auto& uid : uidsNotCached)
-    {
-      mailimap_set_add_single(set, uid);
-      needFetch = true;
-    }
+    UidSet uidsNotCached = p_Uids - MapKey(p_Headers);
+    AddUidRanges(set, uidsNotCached);
+    needFetch = !uidsNotCached.empty();
   }
 
   if (p_Prefetch)
@@ -379,7 +443,23 @@ bool Imap::GetHeaders(const std::string& p_Folder, const std::set<uint32_t>& p_U
     }
 
     struct mailimap_fetch_type* fetch_type = mailimap_fetch_type_new_fetch_att_list_empty();
-    mailimap_fetch_type_new_fetch_att_list_add(fetch_type, mailimap_fetch_att_new_rfc822_header());
+    if (s_CompactHeaders)
+    {
+      // only fields needed for lists, the full header is available from the body when viewed
+      clist* field_list = clist_new();
+      for (const auto& field : Header::GetCompactFields())
+      {
+        clist_append(field_list, strdup(field.c_str()));
+      }
+
+      struct mailimap_section* section = mailimap_section_new_header_fields(mailimap_header_list_new(field_list));
+      mailimap_fetch_type_new_fetch_att_list_add(fetch_type, mailimap_fetch_att_new_body_peek_section(section));
+    }
+    else
+    {
+      mailimap_fetch_type_new_fetch_att_list_add(fetch_type, mailimap_fetch_att_new_rfc822_header());
+    }
+
     mailimap_fetch_type_new_fetch_att_list_add(fetch_type, mailimap_fetch_att_new_uid());
     mailimap_fetch_type_new_fetch_att_list_add(fetch_type, mailimap_fetch_att_new_internaldate());
     mailimap_fetch_type_new_fetch_att_list_add(fetch_type, mailimap_fetch_att_new_bodystructure());
@@ -409,6 +489,15 @@ bool Imap::GetHeaders(const std::string& p_Folder, const std::set<uint32_t>& p_U
               hdrData = std::string(item->att_data.att_static->att_data.att_rfc822_header.att_content,
                                     item->att_data.att_static->att_data.att_rfc822_header.att_length);
             }
+            else if (item->att_data.att_static->att_type == MAILIMAP_MSG_ATT_BODY_SECTION)
+            {
+              struct mailimap_msg_att_body_section* body_section =
+                item->att_data.att_static->att_data.att_body_section;
+              if (body_section->sec_body_part != NULL)
+              {
+                hdrData = std::string(body_section->sec_body_part, body_section->sec_length);
+              }
+            }
             else if (item->att_data.att_static->att_type == MAILIMAP_MSG_ATT_UID)
             {
               uid = item->att_data.att_static->att_data.att_uid;
@@ -476,7 +565,49 @@ bool Imap::GetHeaders(const std::string& p_Folder, const std::set<uint32_t>& p_U
   return (rv == MAILIMAP_NO_ERROR);
 }
 
-bool Imap::GetFlags(const std::string& p_Folder, const std::set<uint32_t>& p_Uids,
+static void GetMsgAttUidFlags(struct mailimap_msg_att* p_MsgAtt, uint32_t& p_Uid, uint32_t& p_Flag,
+                              bool& p_HasFlags)
+{
+  for (clistiter* ait = clist_begin(p_MsgAtt->att_list); ait != NULL; ait = clist_next(ait))
+  {
+    struct mailimap_msg_att_item* item = (struct mailimap_msg_att_item*)clist_content(ait);
+
+    if (item->att_type == MAILIMAP_MSG_ATT_ITEM_DYNAMIC)
+    {
+      p_HasFlags = true;
+      if (item->att_data.att_dyn->att_list != NULL)
+      {
+        for (clistiter* dit = clist_begin(item->att_data.att_dyn->att_list); dit != NULL;
+             dit = clist_next(dit))
+        {
+          struct mailimap_flag_fetch* flag_fetch =
+            (struct mailimap_flag_fetch*)clist_content(dit);
+          if (flag_fetch && flag_fetch->fl_flag)
+          {
+            switch (flag_fetch->fl_flag->fl_type)
+            {
+              case MAILIMAP_FLAG_SEEN:
+                p_Flag |= Flag::Seen;
+                break;
+
+              default:
+                break;
+            }
+          }
+        }
+      }
+    }
+    else if (item->att_type == MAILIMAP_MSG_ATT_ITEM_STATIC)
+    {
+      if (item->att_data.att_static->att_type == MAILIMAP_MSG_ATT_UID)
+      {
+        p_Uid = item->att_data.att_static->att_data.att_uid;
+      }
+    }
+  }
+}
+
+bool Imap::GetFlags(const std::string& p_Folder, const UidSet& p_Uids,
                     const bool p_Cached, std::map<uint32_t, uint32_t>& p_Flags)
 {
   LOG_DEBUG_FUNC(STR(p_Folder, p_Uids, p_Cached, p_Flags));
@@ -493,10 +624,7 @@ bool Imap::GetFlags(const std::string& p_Folder, const std::set<uint32_t>& p_Uid
   }
 
   struct mailimap_set* set = mailimap_set_new_empty();
-  for (auto& uid : p_Uids)
-  {
-    mailimap_set_add_single(set, uid);
-  }
+  AddUidRanges(set, p_Uids);
 
   std::lock_guard<std::mutex> imapLock(m_ImapMutex);
 
@@ -521,42 +649,8 @@ bool Imap::GetFlags(const std::string& p_Folder, const std::set<uint32_t>& p_Uid
 
       uint32_t uid = 0;
       uint32_t flag = 0;
-      for (clistiter* ait = clist_begin(msg_att->att_list); ait != NULL; ait = clist_next(ait))
-      {
-        struct mailimap_msg_att_item* item = (struct mailimap_msg_att_item*)clist_content(ait);
-
-        if (item->att_type == MAILIMAP_MSG_ATT_ITEM_DYNAMIC)
-        {
-          if (item->att_data.att_dyn->att_list != NULL)
-          {
-            for (clistiter* dit = clist_begin(item->att_data.att_dyn->att_list); dit != NULL;
-                 dit = clist_next(dit))
-            {
-              struct mailimap_flag_fetch* flag_fetch =
-                (struct mailimap_flag_fetch*)clist_content(dit);
-              if (flag_fetch && flag_fetch->fl_flag)
-              {
-                switch (flag_fetch->fl_flag->fl_type)
-                {
-                  case MAILIMAP_FLAG_SEEN:
-                    flag |= Flag::Seen;
-                    break;
-
-                  default:
-                    break;
-                }
-              }
-            }
-          }
-        }
-        else if (item->att_type == MAILIMAP_MSG_ATT_ITEM_STATIC)
-        {
-          if (item->att_data.att_static->att_type == MAILIMAP_MSG_ATT_UID)
-          {
-            uid = item->att_data.att_static->att_data.att_uid;
-          }
-        }
-      }
+      bool hasFlags = false;
+      GetMsgAttUidFlags(msg_att, uid, flag, hasFlags);
 
       if (uid == 0)
       {
@@ -578,9 +672,9 @@ bool Imap::GetFlags(const std::string& p_Folder, const std::set<uint32_t>& p_Uid
   return (rv == MAILIMAP_NO_ERROR);
 }
 
-bool Imap::GetBodys(const std::string& p_Folder, const std::set<uint32_t>& p_Uids,
+bool Imap::GetBodys(const std::string& p_Folder, const UidSet& p_Uids,
                     const bool p_Cached, const bool p_Prefetch,
-                    std::map<uint32_t, Body>& p_Bodys)
+                    std::map<uint32_t, Body>& p_Bodys, uint64_t* p_FetchedBytes)
 {
   LOG_DEBUG_FUNC(STR(p_Folder, p_Uids, p_Cached, p_Prefetch, p_Bodys));
 
@@ -591,12 +685,22 @@ bool Imap::GetBodys(const std::string& p_Folder, const std::set<uint32_t>& p_Uid
 
   if (!p_Cached)
   {
-    std::set<uint32_t> uidsNotCached = p_Uids - MapKey(p_Bodys);
-    for (auto& uid : uidsNotCached)
+    UidSet uidsNotCached = p_Uids - MapKey(p_Bodys);
+    if (!uidsNotCached.empty())
     {
-      mailimap_set_add_single(set, uid);
-      needFetch = true;
+      // reuse copies of the same messages already cached in other folders instead of downloading
+      const std::map<uint32_t, Body>& dupBodys = m_ImapCache->GetDuplicateBodys(p_Folder, uidsNotCached);
+      if (!dupBodys.empty())
+      {
+        m_ImapCache->SetBodys(p_Folder, dupBodys);
+        m_ImapIndex->SetBodys(p_Folder, MapKey(dupBodys));
+        p_Bodys.insert(dupBodys.begin(), dupBodys.end());
+        uidsNotCached = uidsNotCached - MapKey(dupBodys);
+      }
     }
+
+    AddUidRanges(set, uidsNotCached);
+    needFetch = !uidsNotCached.empty();
   }
 
   if (p_Prefetch)
@@ -670,7 +774,7 @@ bool Imap::GetBodys(const std::string& p_Folder, const std::set<uint32_t>& p_Uid
           continue;
         }
 
-        if (body.GetData().empty())
+        if (body.GetDataSize() == 0)
         {
           LOG_WARNING("skip body = \"\"");
           continue;
@@ -681,6 +785,11 @@ bool Imap::GetBodys(const std::string& p_Folder, const std::set<uint32_t>& p_Uid
           p_Bodys[uid] = body;
         }
 
+        if (p_FetchedBytes != NULL)
+        {
+          *p_FetchedBytes += body.GetDataSize();
+        }
+
         cacheBodys[uid] = body;
       }
 
@@ -698,7 +807,21 @@ bool Imap::GetBodys(const std::string& p_Folder, const std::set<uint32_t>& p_Uid
   return (rv == MAILIMAP_NO_ERROR);
 }
 
-bool Imap::SetFlagSeen(const std::string& p_Folder, const std::set<uint32_t>& p_Uids,
+UidSet Imap::GetHeadersNotCached(const std::string& p_Folder, const UidSet& p_Uids)
+{
+  LOG_DEBUG_FUNC(STR(p_Folder, p_Uids));
+
+  return p_Uids - MapKey(m_ImapCache->GetHeaders(p_Folder, p_Uids, true /* p_Prefetch */));
+}
+
+UidSet Imap::GetBodysNotCached(const std::string& p_Folder, const UidSet& p_Uids)
+{
+  LOG_DEBUG_FUNC(STR(p_Folder, p_Uids));
+
+  return p_Uids - MapKey(m_ImapCache->GetBodys(p_Folder, p_Uids, true /* p_Prefetch */));
+}
+
+bool Imap::SetFlagSeen(const std::string& p_Folder, const UidSet& p_Uids,
                        bool p_Value)
 {
   LOG_DEBUG_FUNC(STR(p_Folder, p_Uids, p_Value));
@@ -714,10 +837,7 @@ bool Imap::SetFlagSeen(const std::string& p_Folder, const std::set<uint32_t>& p_
   mailimap_flag_list_add(flaglist, mailimap_flag_new_seen());
 
   struct mailimap_set* set = mailimap_set_new_empty();
-  for (auto& uid : p_Uids)
-  {
-    mailimap_set_add_single(set, uid);
-  }
+  AddUidRanges(set, p_Uids);
 
   struct mailimap_store_att_flags* storeflags = p_Value
     ? mailimap_store_att_flags_new_add_flags(flaglist) : mailimap_store_att_flags_new_remove_flags(flaglist);
@@ -739,7 +859,7 @@ bool Imap::SetFlagSeen(const std::string& p_Folder, const std::set<uint32_t>& p_
   return (rv == MAILIMAP_NO_ERROR);
 }
 
-bool Imap::SetFlagDeleted(const std::string& p_Folder, const std::set<uint32_t>& p_Uids,
+bool Imap::SetFlagDeleted(const std::string& p_Folder, const UidSet& p_Uids,
                           bool p_Value)
 {
   LOG_DEBUG_FUNC(STR(p_Folder, p_Uids, p_Value));
@@ -755,10 +875,7 @@ bool Imap::SetFlagDeleted(const std::string& p_Folder, const std::set<uint32_t>&
   mailimap_flag_list_add(flaglist, mailimap_flag_new_deleted());
 
   struct mailimap_set* set = mailimap_set_new_empty();
-  for (auto& uid : p_Uids)
-  {
-    mailimap_set_add_single(set, uid);
-  }
+  AddUidRanges(set, p_Uids);
 
   struct mailimap_store_att_flags* storeflags = p_Value
     ? mailimap_store_att_flags_new_add_flags(flaglist) : mailimap_store_att_flags_new_remove_flags(flaglist);
@@ -775,7 +892,7 @@ bool Imap::SetFlagDeleted(const std::string& p_Folder, const std::set<uint32_t>&
   return (rv == MAILIMAP_NO_ERROR);
 }
 
-bool Imap::MoveMessages(const std::string& p_Folder, const std::set<uint32_t>& p_Uids,
+bool Imap::MoveMessages(const std::string& p_Folder, const UidSet& p_Uids,
                         const std::string& p_DestFolder)
 {
   LOG_DEBUG_FUNC(STR(p_Folder, p_Uids, p_DestFolder));
@@ -788,10 +905,7 @@ bool Imap::MoveMessages(const std::string& p_Folder, const std::set<uint32_t>& p
   }
 
   struct mailimap_set* set = mailimap_set_new_empty();
-  for (auto& uid : p_Uids)
-  {
-    mailimap_set_add_single(set, uid);
-  }
+  AddUidRanges(set, p_Uids);
 
   const std::string encDestFolder = EncodeFolderName(p_DestFolder);
   int rv = LOG_IF_IMAP_ERR(mailimap_uid_move(m_Imap, set, encDestFolder.c_str()));
@@ -807,7 +921,7 @@ bool Imap::MoveMessages(const std::string& p_Folder, const std::set<uint32_t>& p
   return (rv == MAILIMAP_NO_ERROR);
 }
 
-bool Imap::DeleteMessages(const std::string& p_Folder, const std::set<uint32_t>& p_Uids)
+bool Imap::DeleteMessages(const std::string& p_Folder, const UidSet& p_Uids)
 {
   LOG_DEBUG_FUNC(STR(p_Folder, p_Uids));
 
@@ -826,12 +940,126 @@ bool Imap::DeleteMessages(const std::string& p_Folder, const std::set<uint32_t>&
   return rv;
 }
 
+bool Imap::PerformBatch(const std::string& p_Folder, const std::vector<BatchAction>& p_BatchActions,
+                        std::vector<bool>& p_Results)
+{
+  LOG_DEBUG_FUNC(STR(p_Folder, p_BatchActions.size()));
+
+  p_Results.assign(p_BatchActions.size(), false);
+  if (p_BatchActions.empty()) return true;
+
+  std::lock_guard<std::mutex> imapLock(m_ImapMutex);
+
+  if (!SelectFolder(p_Folder))
+  {
+    return false;
+  }
+
+  // send all commands without awaiting responses, keeping track of which action each belongs to
+  const int firstTag = m_Imap->imap_tag + 1;
+  std::vector<size_t> cmdActions;
+  std::set<size_t> expungeActions;
+  int rv = MAILIMAP_NO_ERROR;
+  for (size_t i = 0; (i < p_BatchActions.size()) && (rv == MAILIMAP_NO_ERROR); ++i)
+  {
+    const BatchAction& action = p_BatchActions.at(i);
+    struct mailimap_set* set = mailimap_set_new_empty();
+    AddUidRanges(set, action.m_Uids);
+
+    if (!action.m_MoveDestination.empty())
+    {
+      const std::string encDestFolder = EncodeFolderName(action.m_MoveDestination);
+      rv = mailimap_send_current_tag(m_Imap);
+      if (rv == MAILIMAP_NO_ERROR) rv = mailimap_uid_move_send(m_Imap->imap_stream, set, encDestFolder.c_str());
+      if (rv == MAILIMAP_NO_ERROR) rv = mailimap_crlf_send(m_Imap->imap_stream);
+      cmdActions.push_back(i);
+    }
+
+    if ((rv == MAILIMAP_NO_ERROR) && (action.m_SetSeen || action.m_SetUnseen || action.m_DeleteMessages))
+    {
+      struct mailimap_flag_list* flaglist = mailimap_flag_list_new_empty();
+      mailimap_flag_list_add(flaglist, action.m_DeleteMessages ? mailimap_flag_new_deleted()
+                                                               : mailimap_flag_new_seen());
+      struct mailimap_store_att_flags* storeflags = (action.m_SetSeen || action.m_DeleteMessages)
+        ? mailimap_store_att_flags_new_add_flags(flaglist) : mailimap_store_att_flags_new_remove_flags(flaglist);
+
+      rv = mailimap_send_current_tag(m_Imap);
+      if (rv == MAILIMAP_NO_ERROR) rv = mailimap_uid_store_send(m_Imap->imap_stream, set, 0, 0, storeflags);
+      if (rv == MAILIMAP_NO_ERROR) rv = mailimap_crlf_send(m_Imap->imap_stream);
+      cmdActions.push_back(i);
+
+      mailimap_store_att_flags_free(storeflags);
+
+      if (action.m_DeleteMessages)
+      {
+        expungeActions.insert(i);
+      }
+    }
+
+    mailimap_set_free(set);
+  }
+
+  if ((rv == MAILIMAP_NO_ERROR) && !expungeActions.empty())
+  {
+    // one expunge serves all delete actions in the batch
+    rv = mailimap_send_current_tag(m_Imap);
+    if (rv == MAILIMAP_NO_ERROR) rv = mailimap_expunge_send(m_Imap->imap_stream);
+    if (rv == MAILIMAP_NO_ERROR) rv = mailimap_crlf_send(m_Imap->imap_stream);
+    cmdActions.push_back(p_BatchActions.size());
+  }
+
+  if ((rv == MAILIMAP_NO_ERROR) && (mailstream_flush(m_Imap->imap_stream) == -1))
+  {
+    rv = MAILIMAP_ERROR_STREAM;
+  }
+
+  if (rv != MAILIMAP_NO_ERROR)
+  {
+    LOG_IF_IMAP_ERR(rv);
+    m_Imap->imap_tag = firstTag + (int)cmdActions.size() - 1;
+    return false;
+  }
+
+  std::vector<bool> actionOk(p_BatchActions.size() + 1, true);
+  rv = ReadPipelinedResponses(firstTag, (int)cmdActions.size(), [&](size_t p_Index, bool p_Ok)
+  {
+    actionOk[cmdActions.at(p_Index)] = actionOk[cmdActions.at(p_Index)] && p_Ok;
+  });
+
+  if (rv != MAILIMAP_NO_ERROR)
+  {
+    return false;
+  }
+
+  const bool expungeOk = actionOk.back();
+  for (size_t i = 0; i < p_BatchActions.size(); ++i)
+  {
+    const BatchAction& action = p_BatchActions.at(i);
+    p_Results[i] = actionOk.at(i) && (!expungeActions.count(i) || expungeOk);
+    if (!p_Results[i]) continue;
+
+    if (!action.m_MoveDestination.empty() || action.m_DeleteMessages)
+    {
+      m_ImapCache->DeleteMessages(p_Folder, action.m_Uids);
+      m_ImapIndex->DeleteMessages(p_Folder, action.m_Uids);
+    }
+    else if (action.m_SetSeen || action.m_SetUnseen)
+    {
+      m_ImapCache->SetFlagSeen(p_Folder, action.m_Uids, action.m_SetSeen);
+    }
+  }
+
+  return (std::find(p_Results.begin(), p_Results.end(), false) == p_Results.end());
+}
+
 bool Imap::CheckConnection()
 {
   LOG_DEBUG_FUNC(STR());
 
   std::lock_guard<std::mutex> imapLock(m_ImapMutex);
 
+  if (m_ReconnectNeeded) return false;
+
   bool rv = true;
   rv &= (LOG_IF_IMAP_ERR(mailimap_noop(m_Imap)) == MAILIMAP_NO_ERROR);
   return rv;
@@ -854,24 +1082,46 @@ int Imap::IdleStart(const std::string& p_Folder)
     return -1;
   }
 
+  // sequence number to uid mapping, for applying untagged responses received while idle
+  const UidSet uids = m_ImapCache->GetUids(p_Folder);
+  m_IdleSeqUids.assign(uids.begin(), uids.end());
+  m_IdleSeqValid = (m_Imap->imap_selection_info->sel_has_exists == 1) &&
+    (m_Imap->imap_selection_info->sel_exists == m_IdleSeqUids.size());
+
   int rv = LOG_IF_IMAP_ERR(mailimap_idle(m_Imap));
   if (rv == MAILIMAP_NO_ERROR)
   {
     int fd = mailimap_idle_get_fd(m_Imap);
-    m_ImapIndex->NotifyIdle(true);
+    if (m_IsPrimary)
+    {
+      m_ImapIndex->NotifyIdle(true);
+    }
+
     return fd;
   }
 
   return -1;
 }
 
-bool Imap::IdleDone()
+bool Imap::IdleDone(IdleChanges* p_Changes)
 {
   LOG_DEBUG_FUNC(STR());
 
   std::lock_guard<std::mutex> imapLock(m_ImapMutex);
   int rv = LOG_IF_IMAP_ERR(mailimap_idle_done(m_Imap));
-  m_ImapIndex->NotifyIdle(false);
+  if (m_IsPrimary)
+  {
+    m_ImapIndex->NotifyIdle(false);
+  }
+
+  if ((rv == MAILIMAP_NO_ERROR) && (p_Changes != NULL))
+  {
+    p_Changes->m_Resolved = m_IdleSeqValid && ApplyIdleChanges(*p_Changes);
+    LOG_DEBUG("idle changes %s new %d expunged %d flags %d",
+              p_Changes->m_Resolved ? "resolved" : "unresolved", (int)p_Changes->m_NewUids.size(),
+              (int)p_Changes->m_ExpungedUids.size(), (int)p_Changes->m_Flags.size());
+  }
+
   return (rv == MAILIMAP_NO_ERROR);
 }
 
@@ -906,86 +1156,645 @@ bool Imap::UploadMessage(const std::string& p_Folder, const std::string& p_Msg,
   return rv;
 }
 
-void Imap::Search(const std::string& p_QueryStr, const unsigned p_Offset, const unsigned p_Max,
-                  std::vector<Header>& p_Headers, std::vector<std::pair<std::string, uint32_t>>& p_FolderUids,
-                  bool& p_HasMore)
+bool Imap::UploadMessageFile(const std::string& p_Folder, const std::string& p_Path, bool p_IsDraft)
 {
-  return m_ImapIndex->Search(p_QueryStr, p_Offset, p_Max, p_Headers, p_FolderUids, p_HasMore);
-}
+  LOG_DEBUG_FUNC(STR(p_Folder, p_Path, p_IsDraft));
 
-void Imap::SetAborting(bool p_Aborting)
-{
-  m_Aborting = p_Aborting;
-}
+  // streams the message literal from file, which must have crlf line endings
+  FILE* file = fopen(p_Path.c_str(), "rb");
+  if (file == NULL)
+  {
+    LOG_WARNING("failed to open %s", p_Path.c_str());
+    return false;
+  }
 
-void Imap::IndexNotifyIdle(bool p_IsIdle)
-{
-  m_ImapIndex->NotifyIdle(p_IsIdle);
-}
+  struct stat st;
+  const size_t size = (fstat(fileno(file), &st) == 0) ? (size_t)st.st_size : 0;
 
-bool Imap::SetBodysCache(const std::string& p_Folder, const std::map<uint32_t, Body>& p_Bodys)
-{
-  m_ImapCache->SetBodys(p_Folder, p_Bodys);
-  m_ImapIndex->SetBodys(p_Folder, MapKey(p_Bodys));
-  return true;
-}
+  struct mailimap_flag_list* flaglist = mailimap_flag_list_new_empty();
+  mailimap_flag_list_add(flaglist, mailimap_flag_new_seen());
 
-Imap::FolderInfo Imap::GetFolderInfo(const std::string& p_Folder)
-{
-  FolderInfo folderInfo;
+  if (p_IsDraft)
+  {
+    mailimap_flag_list_add(flaglist, mailimap_flag_new_draft());
+  }
 
-  if (!SelectFolder(p_Folder))
+  time_t nowtime = time(NULL);
+  struct tm* lt = localtime(&nowtime);
+
+  struct mailimap_date_time* datetime =
+    mailimap_date_time_new(lt->tm_mday, (lt->tm_mon + 1), (lt->tm_year + 1900),
+                           lt->tm_hour, lt->tm_min, lt->tm_sec, 0 /* dt_zone */);
+
+  std::lock_guard<std::mutex> imapLock(m_ImapMutex);
+
+  const std::string encFolder = EncodeFolderName(p_Folder);
+  int rv = mailimap_send_current_tag(m_Imap);
+  if (rv == MAILIMAP_NO_ERROR)
   {
-    return folderInfo;
+    rv = mailimap_append_send(m_Imap->imap_stream, encFolder.c_str(), flaglist, datetime, size);
   }
 
-  struct mailimap_status_att_list* status_att_list =
-    mailimap_status_att_list_new_empty();
-  mailimap_status_att_list_add(status_att_list, MAILIMAP_STATUS_ATT_UNSEEN);
-  mailimap_status_att_list_add(status_att_list, MAILIMAP_STATUS_ATT_MESSAGES);
-  mailimap_status_att_list_add(status_att_list, MAILIMAP_STATUS_ATT_UIDNEXT);
+  mailimap_date_time_free(datetime);
+  mailimap_flag_list_free(flaglist);
 
-  struct mailimap_mailbox_data_status* status = nullptr;
+  if ((rv == MAILIMAP_NO_ERROR) && (mailstream_flush(m_Imap->imap_stream) == -1))
+  {
+    rv = MAILIMAP_ERROR_STREAM;
+  }
 
-  int rv = LOG_IF_IMAP_ERR(mailimap_status(m_Imap, p_Folder.c_str(),
-                                           status_att_list, &status));
-  if ((rv == MAILIMAP_NO_ERROR) && (status != nullptr))
+  // await continuation request before sending literal
+  if (rv == MAILIMAP_NO_ERROR)
   {
-    for (clistiter* it = clist_begin(status->st_info_list); it != nullptr;
-         it = clist_next(it))
+    char* line = mailimap_read_line(m_Imap);
+    if (line == NULL)
     {
-      struct mailimap_status_info* status_info =
-        (struct mailimap_status_info*)clist_content(it);
-
-      switch (status_info->st_att)
+      rv = MAILIMAP_ERROR_STREAM;
+    }
+    else if (line[0] != '+')
+    {
+      struct mailimap_response* response = NULL;
+      if (mailimap_parse_response(m_Imap, &response) == MAILIMAP_NO_ERROR)
       {
-        case MAILIMAP_STATUS_ATT_MESSAGES:
-          folderInfo.m_Count = status_info->st_value;
-          break;
-
-        case MAILIMAP_STATUS_ATT_UIDNEXT:
-          folderInfo.m_NextUid = status_info->st_value;
-          break;
+        mailimap_response_free(response);
+      }
 
-        case MAILIMAP_STATUS_ATT_UNSEEN:
-          folderInfo.m_Unseen = status_info->st_value;
-          break;
+      rv = MAILIMAP_ERROR_APPEND;
+    }
+  }
 
-        default:
-          break;
+  if (rv == MAILIMAP_NO_ERROR)
+  {
+    std::vector<char> buf(1024 * 1024);
+    size_t len = 0;
+    while ((rv == MAILIMAP_NO_ERROR) && ((len = fread(buf.data(), 1, buf.size(), file)) > 0))
+    {
+      if (mailstream_write(m_Imap->imap_stream, buf.data(), len) == -1)
+      {
+        rv = MAILIMAP_ERROR_STREAM;
       }
     }
   }
 
-  if (status != nullptr)
+  fclose(file);
+
+  if (rv == MAILIMAP_NO_ERROR)
   {
-    mailimap_mailbox_data_status_free(status);
+    rv = mailimap_crlf_send(m_Imap->imap_stream);
   }
 
-  mailimap_status_att_list_free(status_att_list);
-
-  return folderInfo;
-}
+  if ((rv == MAILIMAP_NO_ERROR) && (mailstream_flush(m_Imap->imap_stream) == -1))
+  {
+    rv = MAILIMAP_ERROR_STREAM;
+  }
+
+  if ((rv == MAILIMAP_NO_ERROR) && (mailimap_read_line(m_Imap) == NULL))
+  {
+    rv = MAILIMAP_ERROR_STREAM;
+  }
+
+  if (rv == MAILIMAP_NO_ERROR)
+  {
+    struct mailimap_response* response = NULL;
+    rv = mailimap_parse_response(m_Imap, &response);
+    if (rv == MAILIMAP_NO_ERROR)
+    {
+      const int state = response->rsp_resp_done->rsp_data.rsp_tagged->rsp_cond_state->rsp_type;
+      mailimap_response_free(response);
+      rv = (state == MAILIMAP_RESP_COND_STATE_OK) ? MAILIMAP_NO_ERROR : MAILIMAP_ERROR_APPEND;
+    }
+  }
+
+  return (LOG_IF_IMAP_ERR(rv) == MAILIMAP_NO_ERROR);
+}
+
+bool Imap::UploadMessages(const std::string& p_Folder, std::vector<AppendMessage>& p_Msgs)
+{
+  LOG_DEBUG_FUNC(STR(p_Folder, p_Msgs.size()));
+
+  if (p_Msgs.empty()) return true;
+
+  std::lock_guard<std::mutex> imapLock(m_ImapMutex);
+
+  // select folder to ensure cached uid validity is checked before populating cache
+  if (!SelectFolder(p_Folder))
+  {
+    return false;
+  }
+
+  uint32_t uidValidity = 0;
+  bool rv = false;
+  if (HasCapability("LITERAL+"))
+  {
+    // non-synchronizing literals allow sending all messages without awaiting continuation
+    const bool multiAppend = HasCapability("MULTIAPPEND");
+    rv = AppendPipelined(p_Folder, p_Msgs, multiAppend, uidValidity);
+  }
+  else
+  {
+    rv = AppendSequential(p_Folder, p_Msgs, uidValidity);
+  }
+
+  if ((uidValidity != 0) && (uidValidity == GetUidValidity()))
+  {
+    CacheAppendedMessages(p_Folder, p_Msgs);
+  }
+  else
+  {
+    LOG_DEBUG("skip cache update uidvalidity %u", uidValidity);
+  }
+
+  return rv;
+}
+
+void Imap::Search(const std::string& p_QueryStr, const unsigned p_Offset, const unsigned p_Max,
+                  std::vector<Header>& p_Headers, std::vector<std::pair<std::string, uint32_t>>& p_FolderUids,
+                  std::map<std::pair<std::string, uint32_t>, std::set<std::string>>& p_DuplicateFolders,
+                  bool& p_HasMore)
+{
+  return m_ImapIndex->Search(p_QueryStr, p_Offset, p_Max, p_Headers, p_FolderUids, p_DuplicateFolders,
+                             p_HasMore);
+}
+
+static bool GetServerSearchTerms(const std::string& p_QueryStr,
+                                 std::vector<std::pair<std::string, std::string>>& p_Terms)
+{
+  // map the local query syntax onto server search keys, ex: subject:"status report" bob
+  std::vector<std::string> tokens;
+  std::string token;
+  bool inQuote = false;
+  for (const char ch : p_QueryStr)
+  {
+    if (ch == '"')
+    {
+      inQuote = !inQuote;
+    }
+    else if ((ch == ' ') && !inQuote)
+    {
+      if (!token.empty()) tokens.push_back(token);
+      token.clear();
+    }
+    else
+    {
+      token += ch;
+    }
+  }
+
+  if (!token.empty()) tokens.push_back(token);
+
+  for (auto& term : tokens)
+  {
+    // boolean operators and exclusions cannot be expressed as a plain server AND search
+    if ((term == "OR") || (term == "NOT") || (term == "XOR") || (term.at(0) == '-')) return false;
+
+    if (term == "AND") continue;
+
+    if (term.at(0) == '+')
+    {
+      term.erase(0, 1);
+      if (term.empty()) continue;
+    }
+
+    std::string field = "text";
+    const size_t colonPos = term.find(':');
+    if (colonPos != std::string::npos)
+    {
+      const std::string prefix = term.substr(0, colonPos);
+      if ((prefix == "body") || (prefix == "subject") || (prefix == "from") || (prefix == "to") ||
+          (prefix == "folder"))
+      {
+        field = prefix;
+        term = term.substr(colonPos + 1);
+      }
+    }
+
+    term.erase(std::remove(term.begin(), term.end(), '*'), term.end());
+    if (term.empty()) continue;
+
+    p_Terms.push_back(std::make_pair(field, term));
+  }
+
+  return !p_Terms.empty();
+}
+
+static struct mailimap_search_key* GetServerSearchKey(const std::vector<std::pair<std::string, std::string>>& p_Terms)
+{
+  struct mailimap_search_key* key = mailimap_search_key_new_multiple_empty();
+  for (const auto& term : p_Terms)
+  {
+    char* value = strdup(term.second.c_str());
+    struct mailimap_search_key* termKey = NULL;
+    if (term.first == "subject")
+    {
+      termKey = mailimap_search_key_new_subject(value);
+    }
+    else if (term.first == "from")
+    {
+      termKey = mailimap_search_key_new_from(value);
+    }
+    else if (term.first == "to")
+    {
+      termKey = mailimap_search_key_new_to(value);
+    }
+    else if (term.first == "body")
+    {
+      termKey = mailimap_search_key_new_body(value);
+    }
+    else if (term.first == "text")
+    {
+      termKey = mailimap_search_key_new_text(value);
+    }
+    else
+    {
+      free(value);
+      continue;
+    }
+
+    mailimap_search_key_multiple_add(key, termKey);
+  }
+
+  if (clist_isempty(key->sk_data.sk_multiple))
+  {
+    // folder-only query
+    mailimap_search_key_multiple_add(key, mailimap_search_key_new_all());
+  }
+
+  return key;
+}
+
+bool Imap::ServerSearch(const std::string& p_QueryStr,
+                        const std::function<bool(const std::vector<Header>&,
+                                                 const std::vector<std::pair<std::string, uint32_t>>&)>&
+                        p_FolderHitsHandler)
+{
+  LOG_DEBUG_FUNC(STR(p_QueryStr));
+
+  std::vector<std::pair<std::string, std::string>> terms;
+  if (!GetServerSearchTerms(p_QueryStr, terms))
+  {
+    LOG_DEBUG("server search not applicable");
+    return true;
+  }
+
+  std::vector<std::string> folderTerms;
+  for (const auto& term : terms)
+  {
+    if (term.first == "folder")
+    {
+      folderTerms.push_back(Util::ToLower(term.second));
+    }
+  }
+
+  // folder-only queries match every message of the folder, so their hits are capped
+  static const size_t s_PageSize = 100;
+  static const size_t s_FolderOnlyMaxHits = 1000;
+  const bool isFolderOnly = (folderTerms.size() == terms.size());
+  size_t remainingHits = isFolderOnly ? s_FolderOnlyMaxHits : std::numeric_limits<size_t>::max();
+
+  typedef std::pair<std::pair<std::string, uint32_t>, Header> SearchHit;
+  const std::set<std::string> folders = m_ImapCache->GetFolders();
+  for (const auto& folder : folders)
+  {
+    if (remainingHits == 0) break;
+
+    if (m_FoldersExclude.count(folder) > 0) continue;
+
+    const std::string lowerFolder = Util::ToLower(folder);
+    const bool folderMatch =
+      std::all_of(folderTerms.begin(), folderTerms.end(), [&](const std::string& p_FolderTerm)
+    {
+      return lowerFolder.find(p_FolderTerm) != std::string::npos;
+    });
+    if (!folderMatch) continue;
+
+    // search the whole folder, as its uid list may not be cached, and drop locally indexed hits
+    UidSet serverUids;
+    {
+      std::lock_guard<std::mutex> imapLock(m_ImapMutex);
+
+      if (!SelectFolder(folder))
+      {
+        return false;
+      }
+
+      struct mailimap_search_key* key = GetServerSearchKey(terms);
+      clist* search_result = NULL;
+      int rv = LOG_IF_IMAP_ERR(mailimap_uid_search(m_Imap, "UTF-8", key, &search_result));
+      if (rv == MAILIMAP_NO_ERROR)
+      {
+        for (clistiter* it = clist_begin(search_result); it != NULL; it = clist_next(it))
+        {
+          serverUids.insert(*((uint32_t*)clist_content(it)));
+        }
+
+        mailimap_search_result_free(search_result);
+      }
+
+      mailimap_search_key_free(key);
+
+      if (rv != MAILIMAP_NO_ERROR)
+      {
+        return false;
+      }
+    }
+
+    const UidSet foundUids = m_ImapIndex->GetUnindexedUids(folder, serverUids);
+    LOG_DEBUG("server search %s found %d unindexed %d", folder.c_str(), (int)serverUids.size(),
+              (int)foundUids.size());
+
+    // fetch headers in pages, newest uids first, so first results are posted early
+    bool isSuperseded = false;
+    for (auto uidIt = foundUids.rbegin(); (uidIt != foundUids.rend()) && (remainingHits > 0); )
+    {
+      UidSet pageUids;
+      for ( ; (uidIt != foundUids.rend()) && (pageUids.size() < s_PageSize) && (remainingHits > 0);
+            ++uidIt, --remainingHits)
+      {
+        pageUids.insert(*uidIt);
+      }
+
+      std::map<uint32_t, Header> headers;
+      if (!GetHeaders(folder, pageUids, false /* p_Cached */, false /* p_Prefetch */, headers))
+      {
+        return false;
+      }
+
+      std::vector<SearchHit> hits;
+      for (const auto& uidHeader : headers)
+      {
+        hits.push_back(std::make_pair(std::make_pair(folder, uidHeader.first), uidHeader.second));
+      }
+
+      // order by date descending, same as local index results
+      std::stable_sort(hits.begin(), hits.end(), [](const SearchHit& p_Lhs, const SearchHit& p_Rhs)
+      {
+        return p_Lhs.second.GetTimeStamp() > p_Rhs.second.GetTimeStamp();
+      });
+
+      std::vector<Header> hitHeaders;
+      std::vector<std::pair<std::string, uint32_t>> hitFolderUids;
+      for (const auto& hit : hits)
+      {
+        hitFolderUids.push_back(hit.first);
+        hitHeaders.push_back(hit.second);
+      }
+
+      // handler returns false when the search is superseded
+      if (!p_FolderHitsHandler(hitHeaders, hitFolderUids))
+      {
+        isSuperseded = true;
+        break;
+      }
+    }
+
+    if (isSuperseded) break;
+  }
+
+  return true;
+}
+
+void Imap::SetAborting(bool p_Aborting)
+{
+  m_Aborting = p_Aborting;
+}
+
+void Imap::IndexNotifyIdle(bool p_IsIdle)
+{
+  m_ImapIndex->NotifyIdle(p_IsIdle);
+}
+
+void Imap::IndexNotifyUserActivity()
+{
+  m_ImapIndex->NotifyUserActivity();
+}
+
+void Imap::IndexWaitDone()
+{
+  m_ImapIndex->WaitDone();
+}
+
+bool Imap::SetBodysCache(const std::string& p_Folder, const std::map<uint32_t, Body>& p_Bodys)
+{
+  m_ImapCache->SetBodys(p_Folder, p_Bodys);
+  m_ImapIndex->SetBodys(p_Folder, MapKey(p_Bodys));
+  return true;
+}
+
+void Imap::GetTrafficStats(uint64_t& p_PlainBytes, uint64_t& p_WireBytes)
+{
+  // without compression, the counted bytes (if any) are plain
+  p_PlainBytes = m_PlainBytes;
+  p_WireBytes = m_WireBytes;
+  if (p_PlainBytes == 0)
+  {
+    p_PlainBytes = p_WireBytes;
+  }
+}
+
+void Imap::SetCompressEnabled(bool p_CompressEnabled)
+{
+  s_CompressEnabled = p_CompressEnabled;
+}
+
+void Imap::SetCompactHeaders(bool p_CompactHeaders)
+{
+  s_CompactHeaders = p_CompactHeaders;
+}
+
+static Imap::FolderInfo GetStatusFolderInfo(struct mailimap_mailbox_data_status* p_Status)
+{
+  Imap::FolderInfo folderInfo;
+  for (clistiter* it = clist_begin(p_Status->st_info_list); it != nullptr;
+       it = clist_next(it))
+  {
+    struct mailimap_status_info* status_info =
+      (struct mailimap_status_info*)clist_content(it);
+
+    switch (status_info->st_att)
+    {
+      case MAILIMAP_STATUS_ATT_MESSAGES:
+        folderInfo.m_Count = status_info->st_value;
+        break;
+
+      case MAILIMAP_STATUS_ATT_UIDNEXT:
+        folderInfo.m_NextUid = status_info->st_value;
+        break;
+
+      case MAILIMAP_STATUS_ATT_UNSEEN:
+        folderInfo.m_Unseen = status_info->st_value;
+        break;
+
+      default:
+        break;
+    }
+  }
+
+  return folderInfo;
+}
+
+static struct mailimap_status_att_list* GetFolderInfoAttList()
+{
+  struct mailimap_status_att_list* status_att_list =
+    mailimap_status_att_list_new_empty();
+  mailimap_status_att_list_add(status_att_list, MAILIMAP_STATUS_ATT_UNSEEN);
+  mailimap_status_att_list_add(status_att_list, MAILIMAP_STATUS_ATT_MESSAGES);
+  mailimap_status_att_list_add(status_att_list, MAILIMAP_STATUS_ATT_UIDNEXT);
+  return status_att_list;
+}
+
+Imap::FolderInfo Imap::GetFolderInfo(const std::string& p_Folder)
+{
+  FolderInfo folderInfo;
+
+  if (!SelectFolder(p_Folder))
+  {
+    return folderInfo;
+  }
+
+  struct mailimap_status_att_list* status_att_list = GetFolderInfoAttList();
+  struct mailimap_mailbox_data_status* status = nullptr;
+
+  int rv = LOG_IF_IMAP_ERR(mailimap_status(m_Imap, p_Folder.c_str(),
+                                           status_att_list, &status));
+  if ((rv == MAILIMAP_NO_ERROR) && (status != nullptr))
+  {
+    folderInfo = GetStatusFolderInfo(status);
+  }
+
+  if (status != nullptr)
+  {
+    mailimap_mailbox_data_status_free(status);
+  }
+
+  mailimap_status_att_list_free(status_att_list);
+
+  return folderInfo;
+}
+
+bool Imap::GetFolderInfos(const std::set<std::string>& p_Folders,
+                          std::map<std::string, FolderInfo>& p_FolderInfos)
+{
+  LOG_DEBUG_FUNC(STR(p_Folders));
+
+  if (p_Folders.empty()) return true;
+
+  std::lock_guard<std::mutex> imapLock(m_ImapMutex);
+
+  // pipeline one STATUS per folder, as libetpan only retains the last STATUS of a response
+  const int firstTag = m_Imap->imap_tag + 1;
+  struct mailimap_status_att_list* status_att_list = GetFolderInfoAttList();
+  int rv = MAILIMAP_NO_ERROR;
+  for (const auto& folder : p_Folders)
+  {
+    rv = mailimap_send_current_tag(m_Imap);
+    if (rv != MAILIMAP_NO_ERROR) break;
+
+    rv = mailimap_status_send(m_Imap->imap_stream, EncodeFolderName(folder).c_str(), status_att_list);
+    if (rv != MAILIMAP_NO_ERROR) break;
+
+    rv = mailimap_crlf_send(m_Imap->imap_stream);
+    if (rv != MAILIMAP_NO_ERROR) break;
+  }
+
+  mailimap_status_att_list_free(status_att_list);
+
+  if ((rv == MAILIMAP_NO_ERROR) && (mailstream_flush(m_Imap->imap_stream) == -1))
+  {
+    rv = MAILIMAP_ERROR_STREAM;
+  }
+
+  if (rv != MAILIMAP_NO_ERROR)
+  {
+    LOG_IF_IMAP_ERR(rv);
+    return false;
+  }
+
+  rv = ReadPipelinedResponses(firstTag, (int)p_Folders.size(), [&](size_t p_Index, bool p_Ok)
+  {
+    struct mailimap_mailbox_data_status* status = m_Imap->imap_response_info->rsp_status;
+    m_Imap->imap_response_info->rsp_status = nullptr;
+    if (status == nullptr) return;
+
+    if (p_Ok && (status->st_mailbox != nullptr))
+    {
+      p_FolderInfos[DecodeFolderName(status->st_mailbox)] = GetStatusFolderInfo(status);
+    }
+    else
+    {
+      LOG_WARNING("status %d rejected", (int)p_Index);
+    }
+
+    mailimap_mailbox_data_status_free(status);
+  });
+
+  return (rv == MAILIMAP_NO_ERROR);
+}
+
+bool Imap::NotifySet(const std::set<std::string>& p_Folders)
+{
+  LOG_DEBUG_FUNC(STR(p_Folders));
+
+  std::lock_guard<std::mutex> imapLock(m_ImapMutex);
+  if (m_NotifySet && (m_NotifyFolders == p_Folders)) return true;
+
+  m_NotifySet = false;
+  if (p_Folders.empty() || !HasCapability("NOTIFY")) return false;
+
+  // rfc 5465 status notifications for non-selected folders, the selected folder has to be
+  // included explicitly for the server to keep sending its untagged expunge, exists and fetch
+  const int firstTag = m_Imap->imap_tag + 1;
+  int rv = mailimap_send_current_tag(m_Imap);
+  if (rv == MAILIMAP_NO_ERROR)
+  {
+    rv = mailimap_token_send(m_Imap->imap_stream,
+                             "NOTIFY SET (selected (MessageNew (uid flags) MessageExpunge FlagChange)) "
+                             "(mailboxes (");
+  }
+
+  for (auto it = p_Folders.begin(); (it != p_Folders.end()) && (rv == MAILIMAP_NO_ERROR); ++it)
+  {
+    if (it != p_Folders.begin())
+    {
+      rv = mailimap_space_send(m_Imap->imap_stream);
+      if (rv != MAILIMAP_NO_ERROR) break;
+    }
+
+    rv = mailimap_mailbox_send(m_Imap->imap_stream, EncodeFolderName(*it).c_str());
+  }
+
+  if (rv == MAILIMAP_NO_ERROR)
+  {
+    rv = mailimap_token_send(m_Imap->imap_stream, ") (MessageNew MessageExpunge FlagChange))");
+  }
+
+  if (rv == MAILIMAP_NO_ERROR)
+  {
+    rv = mailimap_crlf_send(m_Imap->imap_stream);
+  }
+
+  if ((rv == MAILIMAP_NO_ERROR) && (mailstream_flush(m_Imap->imap_stream) == -1))
+  {
+    rv = MAILIMAP_ERROR_STREAM;
+  }
+
+  if (rv != MAILIMAP_NO_ERROR)
+  {
+    LOG_IF_IMAP_ERR(rv);
+    return false;
+  }
+
+  bool ok = false;
+  rv = ReadPipelinedResponses(firstTag, 1, [&](size_t, bool p_Ok)
+  {
+    ok = p_Ok;
+  });
+
+  m_NotifySet = (rv == MAILIMAP_NO_ERROR) && ok;
+  m_NotifyFolders = p_Folders;
+  LOG_DEBUG("notify %s", m_NotifySet ? "set" : "rejected");
+
+  return m_NotifySet;
+}
 
 bool Imap::SelectFolder(const std::string& p_Folder, bool p_Force)
 {
@@ -1024,6 +1833,108 @@ bool Imap::SelectFolder(const std::string& p_Folder, bool p_Force)
   }
 }
 
+bool Imap::ApplyIdleChanges(IdleChanges& p_Changes)
+{
+  struct mailimap_response_info* info = m_Imap->imap_response_info;
+  struct mailimap_selection_info* selInfo = m_Imap->imap_selection_info;
+  if ((info == NULL) || (selInfo == NULL) || (selInfo->sel_has_exists != 1)) return false;
+
+  // untagged responses of the idle command are kept until the next command is sent
+  const bool hasExpunged = (info->rsp_expunged != NULL) && !clist_isempty(info->rsp_expunged);
+  if (info->rsp_fetch_list != NULL)
+  {
+    for (clistiter* it = clist_begin(info->rsp_fetch_list); it != NULL; it = clist_next(it))
+    {
+      struct mailimap_msg_att* msg_att = (struct mailimap_msg_att*)clist_content(it);
+
+      uint32_t uid = 0;
+      uint32_t flag = 0;
+      bool hasFlags = false;
+      GetMsgAttUidFlags(msg_att, uid, flag, hasFlags);
+      if (!hasFlags) continue;
+
+      if (uid == 0)
+      {
+        // relative order of fetch and expunge is not retained, so sequence numbers are ambiguous
+        if (hasExpunged) return false;
+
+        // flags of new messages are fetched below
+        if ((msg_att->att_number < 1) || (msg_att->att_number > m_IdleSeqUids.size())) continue;
+
+        uid = m_IdleSeqUids.at(msg_att->att_number - 1);
+      }
+
+      p_Changes.m_Flags[uid] = flag;
+    }
+  }
+
+  if (hasExpunged)
+  {
+    for (clistiter* it = clist_begin(info->rsp_expunged); it != NULL; it = clist_next(it))
+    {
+      const uint32_t seq = *(uint32_t*)clist_content(it);
+      if ((seq < 1) || (seq > m_IdleSeqUids.size())) return false;
+
+      p_Changes.m_ExpungedUids.insert(m_IdleSeqUids.at(seq - 1));
+      m_IdleSeqUids.erase(m_IdleSeqUids.begin() + (seq - 1));
+    }
+  }
+
+  if (selInfo->sel_exists < m_IdleSeqUids.size()) return false;
+
+  if (selInfo->sel_exists > m_IdleSeqUids.size())
+  {
+    // fetch uid and flags of the new messages only
+    const uint32_t lastUid = m_IdleSeqUids.empty() ? 0 : m_IdleSeqUids.back();
+    struct mailimap_set* set = mailimap_set_new_interval(m_IdleSeqUids.size() + 1, 0);
+    struct mailimap_fetch_type* fetch_type = mailimap_fetch_type_new_fetch_att_list_empty();
+    mailimap_fetch_type_new_fetch_att_list_add(fetch_type, mailimap_fetch_att_new_uid());
+    mailimap_fetch_type_new_fetch_att_list_add(fetch_type, mailimap_fetch_att_new_flags());
+    clist* fetch_result = NULL;
+
+    int rv = LOG_IF_IMAP_ERR(mailimap_fetch(m_Imap, set, fetch_type, &fetch_result));
+    if (rv == MAILIMAP_NO_ERROR)
+    {
+      for (clistiter* it = clist_begin(fetch_result); it != NULL; it = clist_next(it))
+      {
+        struct mailimap_msg_att* msg_att = (struct mailimap_msg_att*)clist_content(it);
+
+        uint32_t uid = 0;
+        uint32_t flag = 0;
+        bool hasFlags = false;
+        GetMsgAttUidFlags(msg_att, uid, flag, hasFlags);
+        if (uid <= lastUid) continue;
+
+        m_IdleSeqUids.push_back(uid);
+        p_Changes.m_NewUids.insert(uid);
+        p_Changes.m_Flags[uid] = flag;
+      }
+
+      mailimap_fetch_list_free(fetch_result);
+    }
+
+    mailimap_fetch_type_free(fetch_type);
+    mailimap_set_free(set);
+
+    if (rv != MAILIMAP_NO_ERROR) return false;
+  }
+
+  p_Changes.m_Uids = UidSet(m_IdleSeqUids.begin(), m_IdleSeqUids.end());
+  m_SelectedFolderIsEmpty = m_IdleSeqUids.empty();
+  if (!p_Changes.m_NewUids.empty() || !p_Changes.m_ExpungedUids.empty())
+  {
+    m_ImapCache->SetUids(m_SelectedFolder, p_Changes.m_Uids);
+    m_ImapIndex->SetUids(m_SelectedFolder, p_Changes.m_Uids);
+  }
+
+  if (!p_Changes.m_Flags.empty())
+  {
+    m_ImapCache->SetFlags(m_SelectedFolder, p_Changes.m_Flags);
+  }
+
+  return true;
+}
+
 bool Imap::SelectedFolderIsEmpty()
 {
   return m_SelectedFolderIsEmpty;
@@ -1034,6 +1945,349 @@ uint32_t Imap::GetUidValidity()
   return m_Imap->imap_selection_info->sel_uidvalidity;
 }
 
+bool Imap::HasCapability(const std::string& p_Name)
+{
+  if ((m_Imap->imap_connection_info == NULL) || (m_Imap->imap_connection_info->imap_capability == NULL))
+  {
+    struct mailimap_capability_data* capdata = NULL;
+    if (LOG_IF_IMAP_ERR(mailimap_capability(m_Imap, &capdata)) == MAILIMAP_NO_ERROR)
+    {
+      mailimap_capability_data_free(capdata);
+    }
+  }
+
+  return (mailimap_has_extension(m_Imap, p_Name.c_str()) == 1);
+}
+
+void Imap::EnableCompress()
+{
+  m_Compressed = false;
+  if (!HasCapability("COMPRESS=DEFLATE"))
+  {
+    LOG_DEBUG("compress not supported by server");
+    return;
+  }
+
+  // count bytes on the wire below the deflate layer, and plain bytes above it
+  m_PlainBytes = 0;
+  m_WireBytes = 0;
+  CountingStream::Push(m_Imap->imap_stream, &m_WireBytes);
+  int rv = LOG_IF_IMAP_ERR(mailimap_compress(m_Imap));
+  if (rv != MAILIMAP_NO_ERROR) return;
+
+  CountingStream::Push(m_Imap->imap_stream, &m_PlainBytes);
+  m_Compressed = true;
+  m_CompressStartTime = std::chrono::steady_clock::now();
+  LOG_DEBUG("compress enabled");
+}
+
+void Imap::LogTrafficStats()
+{
+  if (!m_Compressed) return;
+
+  const uint64_t plainBytes = m_PlainBytes;
+  const uint64_t wireBytes = m_WireBytes;
+  const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - m_CompressStartTime;
+  const double secs = std::max(elapsed.count(), 0.001);
+  LOG_INFO("compress %llu plain bytes %llu wire bytes ratio %.1f%% %.1f KB/sec in %.1f secs",
+           (unsigned long long)plainBytes, (unsigned long long)wireBytes,
+           (plainBytes > 0) ? (100.0 * (double)wireBytes / (double)plainBytes) : 100.0,
+           ((double)plainBytes / 1024.0) / secs, secs);
+}
+
+static std::string AppendDateTime(time_t p_Time)
+{
+  static const char* months[] =
+  {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+  };
+
+  struct tm gmt;
+  gmtime_r(&p_Time, &gmt);
+  char datestr[64];
+  snprintf(datestr, sizeof(datestr), "\"%02d-%s-%04d %02d:%02d:%02d +0000\"",
+           gmt.tm_mday, months[gmt.tm_mon % 12], gmt.tm_year + 1900, gmt.tm_hour, gmt.tm_min, gmt.tm_sec);
+  return std::string(datestr);
+}
+
+static int AppendMessageSend(mailstream* p_Stream, const Imap::AppendMessage& p_Msg)
+{
+  // sends: [SP flag-list] [SP date-time] SP literal+ CRLF data
+  std::string args;
+  if (p_Msg.m_Seen)
+  {
+    args += " (\\Seen)";
+  }
+
+  if (p_Msg.m_Time != 0)
+  {
+    args += " " + AppendDateTime(p_Msg.m_Time);
+  }
+
+  const size_t size = mailstream_get_data_crlf_size(p_Msg.m_Msg.c_str(), p_Msg.m_Msg.size());
+  args += " {" + std::to_string(size) + "+}\r\n";
+
+  int rv = mailimap_token_send(p_Stream, args.c_str());
+  if (rv != MAILIMAP_NO_ERROR) return rv;
+
+  return mailimap_literal_data_send(p_Stream, p_Msg.m_Msg.c_str(), p_Msg.m_Msg.size(), 0, NULL);
+}
+
+static void GetAppendUids(struct mailimap* p_Imap, uint32_t& p_UidValidity, std::vector<uint32_t>& p_Uids)
+{
+  if (p_Imap->imap_response_info == NULL) return;
+
+  for (clistiter* it = clist_begin(p_Imap->imap_response_info->rsp_extension_list); it != NULL;
+       it = clist_next(it))
+  {
+    struct mailimap_extension_data* ext_data = (struct mailimap_extension_data*)clist_content(it);
+    if ((ext_data->ext_extension != &mailimap_extension_uidplus) ||
+        (ext_data->ext_type != MAILIMAP_UIDPLUS_RESP_CODE_APND)) continue;
+
+    struct mailimap_uidplus_resp_code_apnd* apnd = (struct mailimap_uidplus_resp_code_apnd*)ext_data->ext_data;
+    p_UidValidity = apnd->uid_uidvalidity;
+    if (apnd->uid_set == NULL) break;
+
+    for (clistiter* sit = clist_begin(apnd->uid_set->set_list); sit != NULL; sit = clist_next(sit))
+    {
+      struct mailimap_set_item* item = (struct mailimap_set_item*)clist_content(sit);
+      for (uint32_t uid = item->set_first; (uid != 0) && (uid <= item->set_last); ++uid)
+      {
+        p_Uids.push_back(uid);
+      }
+    }
+    break;
+  }
+}
+
+bool Imap::AppendPipelined(const std::string& p_Folder, std::vector<AppendMessage>& p_Msgs,
+                           bool p_MultiAppend, uint32_t& p_UidValidity)
+{
+  LOG_DEBUG_FUNC(STR(p_Folder, p_Msgs.size(), p_MultiAppend));
+
+  const std::string encFolder = EncodeFolderName(p_Folder);
+  const int firstTag = m_Imap->imap_tag + 1;
+  const int cmdCount = p_MultiAppend ? 1 : (int)p_Msgs.size();
+
+  // send all commands up front, one tagged APPEND per message or a single MULTIAPPEND
+  int rv = MAILIMAP_NO_ERROR;
+  for (size_t i = 0; (i < p_Msgs.size()) && (rv == MAILIMAP_NO_ERROR); ++i)
+  {
+    if (!p_MultiAppend || (i == 0))
+    {
+      rv = mailimap_send_current_tag(m_Imap);
+      if (rv != MAILIMAP_NO_ERROR) break;
+
+      rv = mailimap_token_send(m_Imap->imap_stream, "APPEND ");
+      if (rv != MAILIMAP_NO_ERROR) break;
+
+      rv = mailimap_mailbox_send(m_Imap->imap_stream, encFolder.c_str());
+      if (rv != MAILIMAP_NO_ERROR) break;
+    }
+
+    rv = AppendMessageSend(m_Imap->imap_stream, p_Msgs.at(i));
+    if (rv != MAILIMAP_NO_ERROR) break;
+
+    if (!p_MultiAppend || (i == (p_Msgs.size() - 1)))
+    {
+      rv = mailimap_crlf_send(m_Imap->imap_stream);
+    }
+  }
+
+  if ((rv == MAILIMAP_NO_ERROR) && (mailstream_flush(m_Imap->imap_stream) == -1))
+  {
+    rv = MAILIMAP_ERROR_STREAM;
+  }
+
+  if (rv != MAILIMAP_NO_ERROR)
+  {
+    LOG_IF_IMAP_ERR(rv);
+    return false;
+  }
+
+  // collect the tagged responses in order
+  std::vector<uint32_t> uids;
+  rv = ReadPipelinedResponses(firstTag, cmdCount, [&](size_t p_Index, bool p_Ok)
+  {
+    if (!p_Ok)
+    {
+      LOG_WARNING("append %d rejected", (int)p_Index);
+      return;
+    }
+
+    uids.clear();
+    GetAppendUids(m_Imap, p_UidValidity, uids);
+    if (p_MultiAppend)
+    {
+      for (size_t j = 0; j < p_Msgs.size(); ++j)
+      {
+        p_Msgs[j].m_Appended = true;
+        p_Msgs[j].m_Uid = (uids.size() == p_Msgs.size()) ? uids.at(j) : 0;
+      }
+    }
+    else
+    {
+      p_Msgs[p_Index].m_Appended = true;
+      p_Msgs[p_Index].m_Uid = (uids.size() == 1) ? uids.at(0) : 0;
+    }
+  });
+
+  return (rv == MAILIMAP_NO_ERROR);
+}
+
+int Imap::ReadPipelinedResponses(const int p_FirstTag, const int p_Count,
+                                 const std::function<void(size_t, bool)>& p_ResponseHandler)
+{
+  // libetpan matches a tagged response against the session tag, so step it for each response
+  int rv = MAILIMAP_NO_ERROR;
+  for (int i = 0; i < p_Count; ++i)
+  {
+    m_Imap->imap_tag = p_FirstTag + i;
+    if (mailimap_read_line(m_Imap) == NULL)
+    {
+      rv = MAILIMAP_ERROR_STREAM;
+      break;
+    }
+
+    struct mailimap_response* response = NULL;
+    rv = mailimap_parse_response(m_Imap, &response);
+    if ((rv == MAILIMAP_ERROR_PROTOCOL) && IsTaggedBad())
+    {
+      // libetpan reports a tagged bad as protocol error, but the response was fully read
+      LOG_DEBUG("response %d bad", i);
+      rv = MAILIMAP_NO_ERROR;
+      p_ResponseHandler(i, false);
+      continue;
+    }
+
+    if (LOG_IF_IMAP_ERR(rv) != MAILIMAP_NO_ERROR) break;
+
+    const int state = response->rsp_resp_done->rsp_data.rsp_tagged->rsp_cond_state->rsp_type;
+    mailimap_response_free(response);
+
+    p_ResponseHandler(i, (state == MAILIMAP_RESP_COND_STATE_OK));
+  }
+
+  if (rv != MAILIMAP_NO_ERROR)
+  {
+    // remaining responses are left unread on the stream, so the session cannot be reused
+    LOG_WARNING("pipelined responses aborted, reconnect needed");
+    m_ReconnectNeeded = true;
+  }
+
+  m_Imap->imap_tag = p_FirstTag + p_Count - 1;
+
+  return rv;
+}
+
+bool Imap::IsTaggedBad()
+{
+  // last line of the parsed response is the tagged status line
+  const std::string buffer(m_Imap->imap_stream_buffer->str, m_Imap->imap_stream_buffer->len);
+  const size_t end = buffer.find_last_not_of("\r\n");
+  if (end == std::string::npos) return false;
+
+  const size_t lineStart = buffer.find_last_of('\n', end);
+  const std::string line = buffer.substr((lineStart == std::string::npos) ? 0 : (lineStart + 1));
+  const std::string tag = (mailimap_is_163_workaround_enabled(m_Imap) ? "C" : "") + std::to_string(m_Imap->imap_tag);
+  return (Util::ToLower(line).compare(0, tag.size() + 5, Util::ToLower(tag) + " bad ") == 0);
+}
+
+bool Imap::AppendSequential(const std::string& p_Folder, std::vector<AppendMessage>& p_Msgs,
+                            uint32_t& p_UidValidity)
+{
+  LOG_DEBUG_FUNC(STR(p_Folder, p_Msgs.size()));
+
+  const std::string encFolder = EncodeFolderName(p_Folder);
+  int rv = MAILIMAP_NO_ERROR;
+  for (auto& msg : p_Msgs)
+  {
+    struct mailimap_flag_list* flaglist = mailimap_flag_list_new_empty();
+    if (msg.m_Seen)
+    {
+      mailimap_flag_list_add(flaglist, mailimap_flag_new_seen());
+    }
+
+    struct mailimap_date_time* datetime = NULL;
+    if (msg.m_Time != 0)
+    {
+      struct tm gmt;
+      gmtime_r(&msg.m_Time, &gmt);
+      datetime = mailimap_date_time_new(gmt.tm_mday, (gmt.tm_mon + 1), (gmt.tm_year + 1900),
+                                        gmt.tm_hour, gmt.tm_min, gmt.tm_sec, 0 /* dt_zone */);
+    }
+
+    uint32_t uidValidity = 0;
+    uint32_t uid = 0;
+    rv = LOG_IF_IMAP_ERR(mailimap_uidplus_append(m_Imap, encFolder.c_str(), flaglist, datetime,
+                                                 msg.m_Msg.c_str(), msg.m_Msg.size(), &uidValidity, &uid));
+    if (datetime != NULL)
+    {
+      mailimap_date_time_free(datetime);
+    }
+
+    mailimap_flag_list_free(flaglist);
+
+    if (rv == MAILIMAP_NO_ERROR)
+    {
+      msg.m_Appended = true;
+      msg.m_Uid = uid;
+      p_UidValidity = uidValidity;
+    }
+    else if (rv != MAILIMAP_ERROR_APPEND)
+    {
+      // connection level error, remaining messages cannot be appended
+      break;
+    }
+  }
+
+  return ((rv == MAILIMAP_NO_ERROR) || (rv == MAILIMAP_ERROR_APPEND));
+}
+
+void Imap::CacheAppendedMessages(const std::string& p_Folder, const std::vector<AppendMessage>& p_Msgs)
+{
+  std::map<uint32_t, Header> headers;
+  std::map<uint32_t, Body> bodys;
+  std::map<uint32_t, uint32_t> flags;
+  for (const auto& msg : p_Msgs)
+  {
+    if (!msg.m_Appended || (msg.m_Uid == 0)) continue;
+
+    size_t hdrEnd = msg.m_Msg.find("\r\n\r\n");
+    if (hdrEnd != std::string::npos)
+    {
+      hdrEnd += 4;
+    }
+    else
+    {
+      hdrEnd = msg.m_Msg.find("\n\n");
+      hdrEnd = (hdrEnd != std::string::npos) ? (hdrEnd + 2) : msg.m_Msg.size();
+    }
+
+    Header header;
+    const std::string hdrData = msg.m_Msg.substr(0, hdrEnd);
+    header.SetHeaderData(s_CompactHeaders ? Header::GetCompactHeaderData(hdrData) : hdrData, "", msg.m_Time);
+    headers[msg.m_Uid] = header;
+
+    Body body;
+    body.SetData(msg.m_Msg);
+    bodys[msg.m_Uid] = body;
+
+    uint32_t flag = 0;
+    Flag::SetSeen(flag, msg.m_Seen);
+    flags[msg.m_Uid] = flag;
+  }
+
+  if (headers.empty()) return;
+
+  const UidSet uids = MapKey(headers);
+  m_ImapCache->SetUids(p_Folder, m_ImapCache->GetUids(p_Folder) + uids);
+  m_ImapCache->SetHeaders(p_Folder, headers);
+  m_ImapCache->SetFlags(p_Folder, flags);
+  m_ImapCache->SetBodys(p_Folder, bodys);
+  m_ImapIndex->SetBodys(p_Folder, uids);
+}
+
 std::string Imap::DecodeFolderName(const std::string& p_Folder)
 {
   static std::map<std::string, std::string> cacheMap;
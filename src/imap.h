@@ -7,16 +7,21 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <set>
 #include <string>
+#include <vector>
 
 #include "body.h"
 #include "header.h"
 #include "imapcache.h"
 #include "imapindex.h"
+#include "uidset.h"
 
 class Imap
 {
@@ -43,6 +48,35 @@ public:
     int32_t m_Unseen = -1;
   };
 
+  // changes to the selected folder from untagged responses received while idle
+  struct IdleChanges
+  {
+    bool m_Resolved = false; // false if changes could not be mapped to uids
+    UidSet m_Uids;
+    UidSet m_NewUids;
+    UidSet m_ExpungedUids;
+    std::map<uint32_t, uint32_t> m_Flags;
+  };
+
+  struct AppendMessage
+  {
+    std::string m_Msg;
+    time_t m_Time = 0;
+    bool m_Seen = true;
+
+    bool m_Appended = false;
+    uint32_t m_Uid = 0;
+  };
+
+  struct BatchAction
+  {
+    UidSet m_Uids;
+    bool m_SetSeen = false;
+    bool m_SetUnseen = false;
+    bool m_DeleteMessages = false;
+    std::string m_MoveDestination;
+  };
+
 public:
   Imap(const std::string& p_User, const std::string& p_Pass, const std::string& p_Host,
        const uint16_t p_Port, const int64_t p_Timeout,
@@ -52,48 +86,91 @@ public:
        const std::function<void(const StatusUpdate&)>& p_StatusHandler);
   virtual ~Imap();
 
+  std::unique_ptr<Imap> CreateSession() const;
+
   bool Login();
   bool Logout();
   bool AuthRefresh();
 
   bool GetFolders(const bool p_Cached, std::set<std::string>& p_Folders);
-  bool GetUids(const std::string& p_Folder, const bool p_Cached, std::set<uint32_t>& p_Uids);
-  bool GetHeaders(const std::string& p_Folder, const std::set<uint32_t>& p_Uids,
+  bool GetUids(const std::string& p_Folder, const bool p_Cached, UidSet& p_Uids);
+  bool GetHeaders(const std::string& p_Folder, const UidSet& p_Uids,
                   const bool p_Cached, const bool p_Prefetch,
                   std::map<uint32_t, Header>& p_Headers);
-  bool GetFlags(const std::string& p_Folder, const std::set<uint32_t>& p_Uids,
+  bool GetFlags(const std::string& p_Folder, const UidSet& p_Uids,
                 const bool p_Cached, std::map<uint32_t, uint32_t>& p_Flags);
-  bool GetBodys(const std::string& p_Folder, const std::set<uint32_t>& p_Uids,
-                const bool p_Cached, const bool p_Prefetch, std::map<uint32_t, Body>& p_Bodys);
+  bool GetBodys(const std::string& p_Folder, const UidSet& p_Uids,
+                const bool p_Cached, const bool p_Prefetch, std::map<uint32_t, Body>& p_Bodys,
+                uint64_t* p_FetchedBytes = NULL);
+
+  UidSet GetHeadersNotCached(const std::string& p_Folder, const UidSet& p_Uids);
+  UidSet GetBodysNotCached(const std::string& p_Folder, const UidSet& p_Uids);
 
-  bool SetFlagSeen(const std::string& p_Folder, const std::set<uint32_t>& p_Uids, bool p_Value);
-  bool SetFlagDeleted(const std::string& p_Folder, const std::set<uint32_t>& p_Uids,
+  bool SetFlagSeen(const std::string& p_Folder, const UidSet& p_Uids, bool p_Value);
+  bool SetFlagDeleted(const std::string& p_Folder, const UidSet& p_Uids,
                       bool p_Value);
-  bool MoveMessages(const std::string& p_Folder, const std::set<uint32_t>& p_Uids,
+  bool MoveMessages(const std::string& p_Folder, const UidSet& p_Uids,
                     const std::string& p_DestFolder);
-  bool DeleteMessages(const std::string& p_Folder, const std::set<uint32_t>& p_Uids);
+  bool DeleteMessages(const std::string& p_Folder, const UidSet& p_Uids);
+  bool PerformBatch(const std::string& p_Folder, const std::vector<BatchAction>& p_BatchActions,
+                    std::vector<bool>& p_Results);
   bool CheckConnection();
 
   bool GetConnected();
   int IdleStart(const std::string& p_Folder);
-  bool IdleDone();
+  bool IdleDone(IdleChanges* p_Changes = NULL);
   bool UploadMessage(const std::string& p_Folder, const std::string& p_Msg, bool p_IsDraft);
+  bool UploadMessageFile(const std::string& p_Folder, const std::string& p_Path, bool p_IsDraft);
+  bool UploadMessages(const std::string& p_Folder, std::vector<AppendMessage>& p_Msgs);
 
   void Search(const std::string& p_QueryStr, const unsigned p_Offset, const unsigned p_Max,
               std::vector<Header>& p_Headers, std::vector<std::pair<std::string, uint32_t>>& p_FolderUids,
+              std::map<std::pair<std::string, uint32_t>, std::set<std::string>>& p_DuplicateFolders,
               bool& p_HasMore);
+  bool ServerSearch(const std::string& p_QueryStr,
+                    const std::function<bool(const std::vector<Header>&,
+                                             const std::vector<std::pair<std::string, uint32_t>>&)>&
+                    p_FolderHitsHandler);
 
   void SetAborting(bool p_Aborting);
   void IndexNotifyIdle(bool p_IsIdle);
+  void IndexNotifyUserActivity();
+  void IndexWaitDone();
 
   bool SetBodysCache(const std::string& p_Folder, const std::map<uint32_t, Body>& p_Bodys);
 
   FolderInfo GetFolderInfo(const std::string& p_Folder);
+  bool GetFolderInfos(const std::set<std::string>& p_Folders, std::map<std::string, FolderInfo>& p_FolderInfos);
+  bool NotifySet(const std::set<std::string>& p_Folders);
+
+  void GetTrafficStats(uint64_t& p_PlainBytes, uint64_t& p_WireBytes);
+
+  static void SetCompressEnabled(bool p_CompressEnabled);
+  static void SetCompactHeaders(bool p_CompactHeaders);
 
 private:
+  Imap(const std::string& p_User, const std::string& p_Pass, const std::string& p_Host,
+       const uint16_t p_Port, const int64_t p_Timeout,
+       const bool p_CacheEncrypt, const bool p_CacheIndexEncrypt,
+       const std::set<std::string>& p_FoldersExclude,
+       const bool p_SniEnabled,
+       std::shared_ptr<ImapCache> p_ImapCache, std::shared_ptr<ImapIndex> p_ImapIndex);
+
   bool SelectFolder(const std::string& p_Folder, bool p_Force = false);
   bool SelectedFolderIsEmpty();
+  bool ApplyIdleChanges(IdleChanges& p_Changes);
   uint32_t GetUidValidity();
+  bool HasCapability(const std::string& p_Name);
+  void EnableCompress();
+  void LogTrafficStats();
+  bool AppendPipelined(const std::string& p_Folder, std::vector<AppendMessage>& p_Msgs,
+                       bool p_MultiAppend, uint32_t& p_UidValidity);
+  int ReadPipelinedResponses(const int p_FirstTag, const int p_Count,
+                             const std::function<void(size_t, bool)>& p_ResponseHandler);
+  bool IsTaggedBad();
+  bool AppendSequential(const std::string& p_Folder, std::vector<AppendMessage>& p_Msgs,
+                        uint32_t& p_UidValidity);
+  void CacheAppendedMessages(const std::string& p_Folder, const std::vector<AppendMessage>& p_Msgs);
   void InitImap();
   void CleanupImap();
 
@@ -117,11 +194,29 @@ private:
 
   std::string m_SelectedFolder;
   bool m_SelectedFolderIsEmpty = true;
+  std::vector<uint32_t> m_IdleSeqUids;
+  bool m_IdleSeqValid = false;
+  bool m_ReconnectNeeded = false;
 
   std::mutex m_ConnectedMutex;
   bool m_Connected = false;
   bool m_Aborting = false;
 
   std::shared_ptr<ImapCache> m_ImapCache;
-  std::unique_ptr<ImapIndex> m_ImapIndex;
+  std::shared_ptr<ImapIndex> m_ImapIndex;
+
+  // additional sessions leave index idle scheduling to the primary connection
+  bool m_IsPrimary = true;
+
+  bool m_NotifySet = false;
+  std::set<std::string> m_NotifyFolders;
+
+  // bytes above and below the deflate stream layer, updated by the counting stream layers
+  std::atomic<uint64_t> m_PlainBytes{ 0 };
+  std::atomic<uint64_t> m_WireBytes{ 0 };
+  bool m_Compressed = false;
+  std::chrono::steady_clock::time_point m_CompressStartTime;
+
+  static bool s_CompressEnabled;
+  static bool s_CompactHeaders;
 };
@@ -9,19 +9,72 @@
 
 #include "imapcache.h"
 
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <shared_mutex>
+
+#include "blobstore.h"
 #include "body.h"
 #include "cacheutil.h"
+#include "compress.h"
 #include "crypto.h"
 #include "flag.h"
 #include "header.h"
 #include "lockfile.h"
 #include "loghelp.h"
 #include "maphelp.h"
+#include "reencrypt.h"
 #include "util.h"
 #include "serialization.h"
 #include "sethelp.h"
 #include "sqlitehelp.h"
 
+static const int64_t s_LockWaitLogMs = 50;
+static std::atomic<uint64_t> s_LockWaitCount{ 0 };
+static std::atomic<uint64_t> s_LockWaitTotalUs{ 0 };
+static std::atomic<uint64_t> s_LockWaitMaxUs{ 0 };
+static std::atomic<uint64_t> s_PackRawBytes{ 0 };
+static std::atomic<uint64_t> s_PackStoredBytes{ 0 };
+
+// header rows are small, so most of their compression comes from a preset dictionary
+// of common header fields, changing it requires a headers cache version bump
+static const std::string s_HeaderDict =
+  "MIME-Version: 1.0\r\n"
+  "Content-Type: text/plain; charset=\"UTF-8\"\r\n"
+  "Content-Type: text/html; charset=\"UTF-8\"\r\n"
+  "Content-Type: multipart/alternative; boundary=\"\r\n"
+  "Content-Type: multipart/mixed; boundary=\"\r\n"
+  "Message-ID: <\r\n"
+  "Date: Mon, Tue, Wed, Thu, Fri, Sat, Sun, "
+  " Jan  Feb  Mar  Apr  May  Jun  Jul  Aug  Sep  Oct  Nov  Dec "
+  ":00 +0000 (UTC)\r\n"
+  "From: \r\n"
+  "To: \r\n"
+  "Cc: \r\n"
+  "Bcc: \r\n"
+  "Reply-To: \r\n"
+  "Subject: Re: \r\n"
+  "@gmail.com>@outlook.com>";
+
+template<typename T>
+static std::vector<char> PackRow(const T& p_Data, const std::string& p_Dict)
+{
+  const std::string& raw = Serialization::ToString(p_Data);
+  const std::string& packed = Compress::Pack(raw, p_Dict);
+  s_PackRawBytes += raw.size();
+  s_PackStoredBytes += packed.size();
+  return std::vector<char>(packed.begin(), packed.end());
+}
+
+template<typename T>
+static T UnpackRow(const std::vector<char>& p_Bytes, const std::string& p_Dict)
+{
+  std::string raw;
+  Compress::Unpack(p_Bytes.data(), p_Bytes.size(), raw, p_Dict);
+  return Serialization::FromString<T>(raw);
+}
+
 struct ImapCache::DbConnection
 {
   DbConnection(const std::string& p_DbPath)
@@ -32,21 +85,104 @@ struct ImapCache::DbConnection
 
   void CloseDb()
   {
+    std::lock_guard<std::mutex> readPoolLock(m_ReadPoolMutex);
+    m_ReadPool.clear();
     m_Database.reset();
   }
 
   void OpenDb()
   {
-    m_Database.reset(new sqlite::database(m_DbPath));
+    // used by writers holding the exclusive lock, readers use ReadDb()
+    sqlite::sqlite_config config;
+    config.flags = sqlite::OpenFlags::READWRITE | sqlite::OpenFlags::CREATE | sqlite::OpenFlags::FULLMUTEX;
+    m_Database.reset(new sqlite::database(m_DbPath, config));
     *m_Database << "PRAGMA synchronous = OFF";
     *m_Database << "PRAGMA journal_mode = MEMORY";
   }
 
+  std::shared_lock<std::shared_timed_mutex> ReadLock()
+  {
+    std::shared_lock<std::shared_timed_mutex> lock(m_Mutex, std::try_to_lock);
+    if (!lock.owns_lock())
+    {
+      const std::chrono::steady_clock::time_point waitStart = std::chrono::steady_clock::now();
+      lock.lock();
+      LogWait(waitStart);
+    }
+
+    return lock;
+  }
+
+  // returns a connection of its own to a reader holding ReadLock(), as statements on one
+  // FULLMUTEX connection are serialized, connections are pooled and reused after release
+  std::shared_ptr<sqlite::database> ReadDb()
+  {
+    std::shared_ptr<sqlite::database> db;
+    {
+      std::lock_guard<std::mutex> readPoolLock(m_ReadPoolMutex);
+      if (!m_ReadPool.empty())
+      {
+        db = m_ReadPool.back();
+        m_ReadPool.pop_back();
+      }
+    }
+
+    if (!db)
+    {
+      sqlite::sqlite_config config;
+      config.flags = sqlite::OpenFlags::READONLY | sqlite::OpenFlags::NOMUTEX;
+      db.reset(new sqlite::database(m_DbPath, config));
+    }
+
+    return std::shared_ptr<sqlite::database>(db.get(), [this, db](sqlite::database*)
+    {
+      std::lock_guard<std::mutex> readPoolLock(m_ReadPoolMutex);
+      m_ReadPool.push_back(db);
+    });
+  }
+
+  std::unique_lock<std::shared_timed_mutex> WriteLock()
+  {
+    std::unique_lock<std::shared_timed_mutex> lock(m_Mutex, std::try_to_lock);
+    if (!lock.owns_lock())
+    {
+      const std::chrono::steady_clock::time_point waitStart = std::chrono::steady_clock::now();
+      lock.lock();
+      LogWait(waitStart);
+    }
+
+    m_Dirty = true;
+    return lock;
+  }
+
+  void LogWait(const std::chrono::steady_clock::time_point& p_WaitStart)
+  {
+    const uint64_t waitUs = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - p_WaitStart).count();
+    ++s_LockWaitCount;
+    s_LockWaitTotalUs += waitUs;
+    uint64_t maxUs = s_LockWaitMaxUs;
+    while ((waitUs > maxUs) && !s_LockWaitMaxUs.compare_exchange_weak(maxUs, waitUs))
+    {
+    }
+
+    if ((int64_t)(waitUs / 1000) >= s_LockWaitLogMs)
+    {
+      LOG_DEBUG("db lock wait %d ms %s", (int)(waitUs / 1000), m_DbPath.c_str());
+    }
+  }
+
   std::shared_ptr<sqlite::database> m_Database;
   std::string m_DbPath;
-  bool m_Dirty = false;
+  std::shared_timed_mutex m_Mutex;
+  bool m_Dirty = false; // protected by exclusive m_Mutex
+  std::vector<std::shared_ptr<sqlite::database>> m_ReadPool;
+  std::mutex m_ReadPoolMutex;
 };
 
+uint64_t ImapCache::s_MaxSize = 0;
+uint32_t ImapCache::s_MaxAgeDays = 0;
+
 ImapCache::ImapCache(const bool p_CacheEncrypt, const std::string& p_Pass)
   : m_CacheEncrypt(p_CacheEncrypt)
   , m_Pass(p_Pass)
@@ -55,89 +191,69 @@ ImapCache::ImapCache(const bool p_CacheEncrypt, const std::string& p_Pass)
   InitBodysCache();
   InitUidFlagsCache();
   InitValidityCache();
+  InitBlobsCache();
 
-  m_Folders = GetFolders();
+  if ((s_MaxSize > 0) || (s_MaxAgeDays > 0))
+  {
+    LOG_DEBUG("start evict thread");
+    m_EvictRunning = true;
+    m_EvictThread = std::thread(&ImapCache::EvictProcess, this);
+  }
 }
 
 ImapCache::~ImapCache()
 {
+  if (m_EvictThread.joinable())
+  {
+    LOG_DEBUG("stop evict thread");
+    {
+      std::lock_guard<std::mutex> lock(m_EvictMutex);
+      m_EvictRunning = false;
+      m_EvictCondVar.notify_one();
+    }
+
+    m_EvictThread.join();
+  }
+
   CleanupHeadersCache();
   CleanupBodysCache();
   CleanupUidFlagsCache();
   CleanupValidityCache();
-}
-
-bool ImapCache::ChangePass(const bool p_CacheEncrypt,
-                           const std::string& p_OldPass, const std::string& p_NewPass)
-{
-  if (!p_CacheEncrypt) return true;
+  CleanupBlobsCache();
 
-  std::string headersDir = GetCacheDbDir(HeadersDb);
-  std::vector<std::string> headerFiles = Util::ListDir(headersDir);
-  for (const auto& headerFile : headerFiles)
+  if (s_LockWaitCount > 0)
   {
-    std::string path = headersDir + headerFile;
-    std::string tmpPath = path + ".tmp";
-    if (!Crypto::AESDecryptFile(path, tmpPath, p_OldPass)) return false;
-
-    if (!Crypto::AESEncryptFile(tmpPath, path, p_NewPass)) return false;
-
-    Util::DeleteFile(tmpPath);
-
-    std::cout << ".";
+    LOG_DEBUG("db lock contention %llu waits, total %llu ms, max %llu ms",
+              (unsigned long long)s_LockWaitCount, (unsigned long long)(s_LockWaitTotalUs / 1000),
+              (unsigned long long)(s_LockWaitMaxUs / 1000));
   }
 
-  std::string bodysDir = GetCacheDbDir(BodysDb);
-  std::vector<std::string> bodyFiles = Util::ListDir(bodysDir);
-  for (const auto& bodyFile : bodyFiles)
+  if (s_PackRawBytes > 0)
   {
-    std::string path = bodysDir + bodyFile;
-    std::string tmpPath = path + ".tmp";
-    if (!Crypto::AESDecryptFile(path, tmpPath, p_OldPass)) return false;
-
-    if (!Crypto::AESEncryptFile(tmpPath, path, p_NewPass)) return false;
-
-    Util::DeleteFile(tmpPath);
-
-    std::cout << ".";
+    LOG_DEBUG("cache rows stored %llu KB as %llu KB (%llu%%)",
+              (unsigned long long)(s_PackRawBytes / 1024), (unsigned long long)(s_PackStoredBytes / 1024),
+              (unsigned long long)((s_PackStoredBytes * 100) / s_PackRawBytes));
   }
+}
 
-  std::string uidFlagsDir = GetCacheDbDir(UidFlagsDb);
-  std::vector<std::string> uidFlagFiles = Util::ListDir(uidFlagsDir);
-  for (const auto& uidFlagFile : uidFlagFiles)
-  {
-    std::string path = uidFlagsDir + uidFlagFile;
-    std::string tmpPath = path + ".tmp";
-    if (!Crypto::AESDecryptFile(path, tmpPath, p_OldPass)) return false;
-
-    if (!Crypto::AESEncryptFile(tmpPath, path, p_NewPass)) return false;
-
-    Util::DeleteFile(tmpPath);
-
-    std::cout << ".";
-  }
+void ImapCache::ChangePass(const bool p_CacheEncrypt, ReEncrypt& p_ReEncrypt)
+{
+  if (!p_CacheEncrypt) return;
 
-  std::string validityDir = GetCacheDbDir(ValidityDb);
-  std::vector<std::string> validityFiles = Util::ListDir(validityDir);
-  for (const auto& validityFile : validityFiles)
+  for (const auto& dbType : { HeadersDb, BodysDb, UidFlagsDb, ValidityDb, BlobsDb })
   {
-    std::string path = validityDir + validityFile;
-    std::string tmpPath = path + ".tmp";
-    if (!Crypto::AESDecryptFile(path, tmpPath, p_OldPass)) return false;
-
-    if (!Crypto::AESEncryptFile(tmpPath, path, p_NewPass)) return false;
-
-    Util::DeleteFile(tmpPath);
-
-    std::cout << ".";
+    p_ReEncrypt.AddDir(GetCacheDbDir(dbType));
   }
 
-  std::string path = GetHeadersFoldersPath();
-  std::string data = Crypto::AESDecrypt(Util::ReadFile(path), p_OldPass);
-  Util::WriteFile(path, Crypto::AESEncrypt(data, p_NewPass));
+  BlobStore::ChangePass(GetBlobsDataDir(), p_ReEncrypt);
+  p_ReEncrypt.AddFile(GetHeadersFoldersPath());
+  p_ReEncrypt.AddFile(GetBodysGenerationsPath());
+}
 
-  std::cout << "\n";
-  return true;
+void ImapCache::SetQuota(uint64_t p_MaxSize, uint32_t p_MaxAgeDays)
+{
+  s_MaxSize = p_MaxSize;
+  s_MaxAgeDays = p_MaxAgeDays;
 }
 
 // get all folders
@@ -157,7 +273,15 @@ void ImapCache::SetFolders(const std::set<std::string>& p_Folders)
   std::set<std::string> deletedFolders;
   {
     std::lock_guard<std::mutex> cacheLock(m_CacheMutex);
+    if (!m_FoldersLoaded)
+    {
+      // loaded on first use to keep cache construction cheap at startup
+      m_Folders = Serialization::FromString<std::set<std::string>>(ReadCacheFile(GetHeadersFoldersPath()));
+      m_FoldersLoaded = true;
+    }
+
     deletedFolders = m_Folders - p_Folders;
+    m_Folders = p_Folders;
     WriteCacheFile(GetHeadersFoldersPath(), Serialization::ToString(p_Folders));
   }
 
@@ -169,19 +293,19 @@ void ImapCache::SetFolders(const std::set<std::string>& p_Folders)
 }
 
 // get all uids
-std::set<uint32_t> ImapCache::GetUids(const std::string& p_Folder)
+UidSet ImapCache::GetUids(const std::string& p_Folder)
 {
   LOG_DURATION();
-  std::lock_guard<std::mutex> cacheLock(m_CacheMutex);
   std::shared_ptr<DbConnection> dbCon = GetDb(UidFlagsDb, p_Folder, false /* p_Writable */);
-  std::shared_ptr<sqlite::database> db = dbCon->m_Database;
+  std::shared_lock<std::shared_timed_mutex> dbLock = dbCon->ReadLock();
+  std::shared_ptr<sqlite::database> db = dbCon->ReadDb();
 
-  std::set<uint32_t> uids;
+  UidSet uids;
   try
   {
     auto lambda = [&](const std::vector<uint32_t>& data)
     {
-      uids = ToSet(data);
+      uids = UidSet(data.begin(), data.end());
     };
 
     *db << "SELECT uids.uids FROM uids LIMIT 1" >> lambda;
@@ -195,23 +319,22 @@ std::set<uint32_t> ImapCache::GetUids(const std::string& p_Folder)
 }
 
 // set all uids
-void ImapCache::SetUids(const std::string& p_Folder, const std::set<uint32_t>& p_Uids)
+void ImapCache::SetUids(const std::string& p_Folder, const UidSet& p_Uids)
 {
   LOG_DURATION();
 
-  std::lock_guard<std::mutex> cacheLock(m_CacheMutex);
-
-  std::string delUidList;
+  UidSet delUids;
 
   try
   {
     std::shared_ptr<DbConnection> dbCon = GetDb(UidFlagsDb, p_Folder, true /* p_Writable */);
+    std::unique_lock<std::shared_timed_mutex> dbLock = dbCon->WriteLock();
     std::shared_ptr<sqlite::database> db = dbCon->m_Database;
 
-    std::set<uint32_t> oldUids;
+    UidSet oldUids;
     auto lambda = [&](const std::vector<uint32_t>& data)
     {
-      oldUids = ToSet(data);
+      oldUids = UidSet(data.begin(), data.end());
     };
 
     *db << "SELECT uids.uids FROM uids LIMIT 1" >> lambda;
@@ -222,12 +345,12 @@ void ImapCache::SetUids(const std::string& p_Folder, const std::set<uint32_t>& p
       *db << "DELETE FROM uids;";
       *db << "INSERT INTO uids (uids) VALUES (?);" << ToVector(p_Uids);
 
-      std::set<uint32_t> delUids = oldUids - p_Uids;
+      delUids = oldUids - p_Uids;
       if (!delUids.empty())
       {
         std::stringstream sstream;
         std::copy(delUids.begin(), delUids.end(), std::ostream_iterator<uint32_t>(sstream, ","));
-        delUidList = sstream.str();
+        std::string delUidList = sstream.str();
         delUidList.pop_back(); // assumes non-empty input set
 
         *db << "DELETE FROM flags WHERE uid IN (" + delUidList + ");";
@@ -241,36 +364,16 @@ void ImapCache::SetUids(const std::string& p_Folder, const std::set<uint32_t>& p
     HANDLE_SQLITE_EXCEPTION(ex);
   }
 
-  if (!delUidList.empty())
+  if (!delUids.empty())
   {
-    try
-    {
-      std::shared_ptr<DbConnection> dbCon = GetDb(BodysDb, p_Folder, true /* p_Writable */);
-      std::shared_ptr<sqlite::database> db = dbCon->m_Database;
-
-      *db << "DELETE FROM bodys WHERE uid IN (" + delUidList + ");";
-    }
-    catch (const sqlite::sqlite_exception& ex)
-    {
-      HANDLE_SQLITE_EXCEPTION(ex);
-    }
-
-    try
-    {
-      std::shared_ptr<DbConnection> dbCon = GetDb(HeadersDb, p_Folder, true /* p_Writable */);
-      std::shared_ptr<sqlite::database> db = dbCon->m_Database;
-
-      *db << "DELETE FROM headers WHERE uid IN (" + delUidList + ");";
-    }
-    catch (const sqlite::sqlite_exception& ex)
-    {
-      HANDLE_SQLITE_EXCEPTION(ex);
-    }
+    // uidflags db lock is released before touching other dbs, which take their own locks
+    DeleteHeaders(p_Folder, delUids);
+    DeleteBodys(p_Folder, delUids);
   }
 }
 
 // get specified headers
-std::map<uint32_t, Header> ImapCache::GetHeaders(const std::string& p_Folder, const std::set<uint32_t>& p_Uids,
+std::map<uint32_t, Header> ImapCache::GetHeaders(const std::string& p_Folder, const UidSet& p_Uids,
                                                  const bool p_Prefetch)
 {
   LOG_DURATION();
@@ -281,9 +384,9 @@ std::map<uint32_t, Header> ImapCache::GetHeaders(const std::string& p_Folder, co
 
   try
   {
-    std::lock_guard<std::mutex> cacheLock(m_CacheMutex);
     std::shared_ptr<DbConnection> dbCon = GetDb(HeadersDb, p_Folder, false /* p_Writable */);
-    std::shared_ptr<sqlite::database> db = dbCon->m_Database;
+    std::shared_lock<std::shared_timed_mutex> dbLock = dbCon->ReadLock();
+    std::shared_ptr<sqlite::database> db = dbCon->ReadDb();
 
     std::stringstream sstream;
     std::copy(p_Uids.begin(), p_Uids.end(), std::ostream_iterator<uint32_t>(sstream, ","));
@@ -295,7 +398,7 @@ std::map<uint32_t, Header> ImapCache::GetHeaders(const std::string& p_Folder, co
       auto lambda = [&](const uint32_t& uid, const std::vector<char>& data)
       {
         Header header;
-        header = Serialization::FromBytes<Header>(data);
+        header = UnpackRow<Header>(data, s_HeaderDict);
         if (header.ParseIfNeeded())
         {
           updateCacheHeaders[uid] = header;
@@ -343,8 +446,9 @@ void ImapCache::SetHeaders(const std::string& p_Folder, const std::map<uint32_t,
   LOG_DURATION();
   if (p_Headers.empty()) return;
 
-  std::lock_guard<std::mutex> cacheLock(m_CacheMutex);
+  MarkWrite();
   std::shared_ptr<DbConnection> dbCon = GetDb(HeadersDb, p_Folder, true /* p_Writable */);
+  std::unique_lock<std::shared_timed_mutex> dbLock = dbCon->WriteLock();
   std::shared_ptr<sqlite::database> db = dbCon->m_Database;
 
   try
@@ -354,7 +458,7 @@ void ImapCache::SetHeaders(const std::string& p_Folder, const std::map<uint32_t,
     {
       const uint32_t uid = header.first;
       *db << "INSERT OR REPLACE INTO headers (uid, data) VALUES (?, ?);" << uid <<
-        Serialization::ToBytes(header.second);
+        PackRow(header.second, s_HeaderDict);
     }
     *db << "commit;";
   }
@@ -365,15 +469,15 @@ void ImapCache::SetHeaders(const std::string& p_Folder, const std::map<uint32_t,
 }
 
 // get specified flags
-std::map<uint32_t, uint32_t> ImapCache::GetFlags(const std::string& p_Folder, const std::set<uint32_t>& p_Uids)
+std::map<uint32_t, uint32_t> ImapCache::GetFlags(const std::string& p_Folder, const UidSet& p_Uids)
 {
   LOG_DURATION();
   std::map<uint32_t, uint32_t> flags;
   if (p_Uids.empty()) return flags;
 
-  std::lock_guard<std::mutex> cacheLock(m_CacheMutex);
   std::shared_ptr<DbConnection> dbCon = GetDb(UidFlagsDb, p_Folder, false /* p_Writable */);
-  std::shared_ptr<sqlite::database> db = dbCon->m_Database;
+  std::shared_lock<std::shared_timed_mutex> dbLock = dbCon->ReadLock();
+  std::shared_ptr<sqlite::database> db = dbCon->ReadDb();
 
   std::stringstream sstream;
   std::copy(p_Uids.begin(), p_Uids.end(), std::ostream_iterator<uint32_t>(sstream, ","));
@@ -401,8 +505,8 @@ std::map<uint32_t, uint32_t> ImapCache::GetFlags(const std::string& p_Folder, co
 void ImapCache::SetFlags(const std::string& p_Folder, const std::map<uint32_t, uint32_t>& p_Flags)
 {
   LOG_DURATION();
-  std::lock_guard<std::mutex> cacheLock(m_CacheMutex);
   std::shared_ptr<DbConnection> dbCon = GetDb(UidFlagsDb, p_Folder, true /* p_Writable */);
+  std::unique_lock<std::shared_timed_mutex> dbLock = dbCon->WriteLock();
   std::shared_ptr<sqlite::database> db = dbCon->m_Database;
 
   try
@@ -421,7 +525,7 @@ void ImapCache::SetFlags(const std::string& p_Folder, const std::map<uint32_t, u
 }
 
 // get specified bodys
-std::map<uint32_t, Body> ImapCache::GetBodys(const std::string& p_Folder, const std::set<uint32_t>& p_Uids,
+std::map<uint32_t, Body> ImapCache::GetBodys(const std::string& p_Folder, const UidSet& p_Uids,
                                              const bool p_Prefetch)
 {
   LOG_DURATION();
@@ -432,9 +536,9 @@ std::map<uint32_t, Body> ImapCache::GetBodys(const std::string& p_Folder, const
 
   try
   {
-    std::lock_guard<std::mutex> cacheLock(m_CacheMutex);
     std::shared_ptr<DbConnection> dbCon = GetDb(BodysDb, p_Folder, false /* p_Writable */);
-    std::shared_ptr<sqlite::database> db = dbCon->m_Database;
+    std::shared_lock<std::shared_timed_mutex> dbLock = dbCon->ReadLock();
+    std::shared_ptr<sqlite::database> db = dbCon->ReadDb();
 
     std::stringstream sstream;
     std::copy(p_Uids.begin(), p_Uids.end(), std::ostream_iterator<uint32_t>(sstream, ","));
@@ -443,10 +547,20 @@ std::map<uint32_t, Body> ImapCache::GetBodys(const std::string& p_Folder, const
 
     if (!p_Prefetch)
     {
-      auto lambda = [&](const uint32_t& uid, const std::vector<char>& data)
+      auto lambda = [&](const uint32_t& uid, const std::string& hash, const std::vector<char>& data)
       {
+        std::shared_ptr<Blob> blob = data.empty() ? std::shared_ptr<Blob>() : m_BlobStore->Get(hash);
+        if (!blob)
+        {
+          // evicted or lost, treat as not cached, so it is fetched and stored again
+          LOG_DEBUG("blob missing for uid %d", uid);
+          return;
+        }
+
+        TouchBlob(hash);
         Body body;
-        body = Serialization::FromBytes<Body>(data);
+        body = UnpackRow<Body>(data, std::string());
+        body.SetBlob(blob);
         if (body.ParseIfNeeded())
         {
           updateCacheBodys[uid] = body;
@@ -454,7 +568,7 @@ std::map<uint32_t, Body> ImapCache::GetBodys(const std::string& p_Folder, const
         bodys.insert(std::make_pair(uid, body));
       };
 
-      *db << "SELECT uid, data FROM bodys WHERE uid IN (" + uidlist + ");" >> lambda;
+      *db << "SELECT uid, hash, data FROM bodys WHERE uid IN (" + uidlist + ");" >> lambda;
     }
     else
     {
@@ -485,19 +599,78 @@ void ImapCache::SetBodys(const std::string& p_Folder, const std::map<uint32_t, B
   LOG_DURATION();
   if (p_Bodys.empty()) return;
 
-  std::lock_guard<std::mutex> cacheLock(m_CacheMutex);
+  MarkWrite();
+  const std::map<uint32_t, std::string>& dedupKeys = GetDedupKeys(p_Folder, MapKey(p_Bodys));
   std::shared_ptr<DbConnection> dbCon = GetDb(BodysDb, p_Folder, true /* p_Writable */);
+  std::unique_lock<std::shared_timed_mutex> dbLock = dbCon->WriteLock();
   std::shared_ptr<sqlite::database> db = dbCon->m_Database;
 
+  // blobs db is locked across blob file writes and ref updates, so a concurrent release
+  // or eviction cannot remove a blob file between its existence check and ref increment
+  const std::string commonFolder = "common";
+  std::shared_ptr<DbConnection> blobsDbCon = GetDb(BlobsDb, commonFolder, true /* p_Writable */);
+  std::unique_lock<std::shared_timed_mutex> blobsDbLock = blobsDbCon->WriteLock();
+  std::shared_ptr<sqlite::database> blobsDb = blobsDbCon->m_Database;
+
   try
   {
+    // raw message data is stored in a content-addressed blob, the row holds parsed data
+    std::vector<std::pair<std::string, size_t>> addBlobs;
+    std::vector<std::pair<std::string, size_t>> restoreBlobs;
+    std::vector<std::string> releaseBlobs;
+    std::map<std::string, std::string> keyHashes;
+    std::vector<std::tuple<uint32_t, std::string, size_t>> bodyRows;
     *db << "begin;";
     for (const auto& body : p_Bodys)
     {
-      *db << "INSERT OR REPLACE INTO bodys (uid, data) VALUES (?, ?);" << body.first <<
-        Serialization::ToBytes(body.second);
+      const std::string& data = body.second.GetData();
+      const std::string& hash = m_BlobStore->GetHash(data);
+      auto keyIt = dedupKeys.find(body.first);
+      if (keyIt != dedupKeys.end())
+      {
+        keyHashes[keyIt->second] = hash;
+      }
+
+      std::string prevHash;
+      auto lambda = [&](const std::string& p_Hash)
+      {
+        prevHash = p_Hash;
+      };
+
+      *db << "SELECT hash FROM bodys WHERE uid = ?;" << body.first >> lambda;
+      if (hash != prevHash)
+      {
+        size_t storedSize = 0;
+        if (!m_BlobStore->Put(hash, data, storedSize)) continue;
+
+        addBlobs.push_back(std::make_pair(hash, storedSize));
+        if (!prevHash.empty())
+        {
+          releaseBlobs.push_back(prevHash);
+        }
+      }
+      else if (!m_BlobStore->Exists(hash))
+      {
+        // evicted blob fetched again, it is still referenced by the row
+        size_t storedSize = 0;
+        if (!m_BlobStore->Put(hash, data, storedSize)) continue;
+
+        restoreBlobs.push_back(std::make_pair(hash, storedSize));
+      }
+
+      const std::vector<char>& row = PackRow(body.second, std::string());
+      *db << "INSERT OR REPLACE INTO bodys (uid, hash, data) VALUES (?, ?, ?);" << body.first << hash << row;
+      bodyRows.push_back(std::make_tuple(body.first, hash, row.size()));
     }
+
+    // add refs before commit and release after, so an interruption can only leak a blob
+    AddBlobRefs(blobsDb, addBlobs);
     *db << "commit;";
+    ReleaseBlobRefs(blobsDb, releaseBlobs);
+    SetBlobSizes(blobsDb, restoreBlobs);
+    SetBlobKeys(blobsDb, keyHashes);
+    SetBodyRows(blobsDb, p_Folder, bodyRows);
+    BumpBodysGeneration(p_Folder);
   }
   catch (const sqlite::sqlite_exception& ex)
   {
@@ -505,6 +678,58 @@ void ImapCache::SetBodys(const std::string& p_Folder, const std::map<uint32_t, B
   }
 }
 
+// get bodys for uids not cached in folder, from copies of the same message cached in other folders
+std::map<uint32_t, Body> ImapCache::GetDuplicateBodys(const std::string& p_Folder, const UidSet& p_Uids)
+{
+  LOG_DURATION();
+  std::map<uint32_t, Body> bodys;
+  if (p_Uids.empty()) return bodys;
+
+  std::map<uint32_t, std::shared_ptr<Blob>> blobs;
+  try
+  {
+    const std::map<uint32_t, std::string>& dedupKeys = GetDedupKeys(p_Folder, p_Uids);
+    if (dedupKeys.empty()) return bodys;
+
+    const std::string commonFolder = "common";
+    std::shared_ptr<DbConnection> dbCon = GetDb(BlobsDb, commonFolder, false /* p_Writable */);
+    std::shared_lock<std::shared_timed_mutex> dbLock = dbCon->ReadLock();
+    std::shared_ptr<sqlite::database> db = dbCon->ReadDb();
+    for (const auto& dedupKey : dedupKeys)
+    {
+      const uint32_t uid = dedupKey.first;
+      auto lambda = [&](const std::string& p_Hash)
+      {
+        std::shared_ptr<Blob> blob = m_BlobStore->Get(p_Hash);
+        if (blob)
+        {
+          TouchBlob(p_Hash);
+          blobs[uid] = blob;
+        }
+      };
+
+      *db << "SELECT hash FROM msgkeys WHERE key = ?;" << dedupKey.second >> lambda;
+    }
+  }
+  catch (const sqlite::sqlite_exception& ex)
+  {
+    HANDLE_SQLITE_EXCEPTION(ex);
+  }
+
+  // parse outside cache lock, as parsing may involve external html conversion
+  for (const auto& blob : blobs)
+  {
+    Body body;
+    body.SetBlob(blob.second);
+    body.ParseIfNeeded();
+    bodys[blob.first] = body;
+  }
+
+  LOG_DEBUG("found %d of %d bodys locally", (int)bodys.size(), (int)p_Uids.size());
+
+  return bodys;
+}
+
 // checks cached uid validity and clears existing cache if invalid
 bool ImapCache::CheckUidValidity(const std::string& p_Folder, int p_Uid)
 {
@@ -512,23 +737,24 @@ bool ImapCache::CheckUidValidity(const std::string& p_Folder, int p_Uid)
   bool rv = true;
   try
   {
-    std::lock_guard<std::mutex> cacheLock(m_CacheMutex);
     int storedUid = -1;
 
     const std::string commonFolder = "common";
     const std::string dbFolder = Util::ToHex(p_Folder);
-    if (storedUid == -1)
-    {
-      std::shared_ptr<DbConnection> dbCon = GetDb(ValidityDb, commonFolder,
-                                                  false /* p_Writable */);
-      std::shared_ptr<sqlite::database> db = dbCon->m_Database;
 
+    // read and update under one write lock, so concurrent checks of a folder see each other
+    std::shared_ptr<DbConnection> validityDbCon = GetDb(ValidityDb, commonFolder,
+                                                        true /* p_Writable */);
+    std::unique_lock<std::shared_timed_mutex> validityDbLock = validityDbCon->WriteLock();
+    std::shared_ptr<sqlite::database> validityDb = validityDbCon->m_Database;
+
+    {
       auto lambda = [&](const uint32_t& uid)
       {
         storedUid = uid;
       };
 
-      *db << "SELECT validity.uid FROM validity WHERE folder = '" + dbFolder + "'"
+      *validityDb << "SELECT validity.uid FROM validity WHERE folder = '" + dbFolder + "'"
         >> lambda;
     }
 
@@ -538,7 +764,8 @@ bool ImapCache::CheckUidValidity(const std::string& p_Folder, int p_Uid)
     {
       std::shared_ptr<DbConnection> dbCon = GetDb(UidFlagsDb, p_Folder,
                                                   false /* p_Writable */);
-      std::shared_ptr<sqlite::database> db = dbCon->m_Database;
+      std::shared_lock<std::shared_timed_mutex> dbLock = dbCon->ReadLock();
+      std::shared_ptr<sqlite::database> db = dbCon->ReadDb();
 
       auto lambda = [&](const std::vector<int32_t>& vecdata)
       {
@@ -556,11 +783,7 @@ bool ImapCache::CheckUidValidity(const std::string& p_Folder, int p_Uid)
     {
       LOG_DEBUG("folder %s uidvalidity %d", p_Folder.c_str(), p_Uid);
 
-      std::shared_ptr<DbConnection> dbCon = GetDb(ValidityDb, commonFolder,
-                                                  true /* p_Writable */);
-      std::shared_ptr<sqlite::database> db = dbCon->m_Database;
-
-      *db << "INSERT OR REPLACE INTO validity (folder, uid) VALUES (?, ?);"
+      *validityDb << "INSERT OR REPLACE INTO validity (folder, uid) VALUES (?, ?);"
           << dbFolder << p_Uid;
 
       if (storedUid != -1)
@@ -596,12 +819,12 @@ bool ImapCache::CheckUidValidity(const std::string& p_Folder, int p_Uid)
 }
 
 // set specified uids seen flag
-void ImapCache::SetFlagSeen(const std::string& p_Folder, const std::set<uint32_t>& p_Uids, const bool p_Value)
+void ImapCache::SetFlagSeen(const std::string& p_Folder, const UidSet& p_Uids, const bool p_Value)
 {
   LOG_DEBUG_FUNC(STR(p_Folder, p_Uids, p_Value));
 
-  std::lock_guard<std::mutex> cacheLock(m_CacheMutex);
   std::shared_ptr<DbConnection> dbCon = GetDb(UidFlagsDb, p_Folder, true /* p_Writable */);
+  std::unique_lock<std::shared_timed_mutex> dbLock = dbCon->WriteLock();
   std::shared_ptr<sqlite::database> db = dbCon->m_Database;
 
   std::stringstream sstream;
@@ -623,11 +846,11 @@ void ImapCache::SetFlagSeen(const std::string& p_Folder, const std::set<uint32_t
 void ImapCache::ClearFolder(const std::string& p_Folder)
 {
   LOG_DEBUG_FUNC(STR(p_Folder));
-  std::lock_guard<std::mutex> cacheLock(m_CacheMutex);
 
   try
   {
     std::shared_ptr<DbConnection> dbCon = GetDb(HeadersDb, p_Folder, true /* p_Writable */);
+    std::unique_lock<std::shared_timed_mutex> dbLock = dbCon->WriteLock();
     std::shared_ptr<sqlite::database> db = dbCon->m_Database;
     *db << "DELETE FROM headers;";
   }
@@ -639,8 +862,18 @@ void ImapCache::ClearFolder(const std::string& p_Folder)
   try
   {
     std::shared_ptr<DbConnection> dbCon = GetDb(BodysDb, p_Folder, true /* p_Writable */);
+    std::unique_lock<std::shared_timed_mutex> dbLock = dbCon->WriteLock();
     std::shared_ptr<sqlite::database> db = dbCon->m_Database;
+    std::vector<std::string> hashes;
+    auto lambda = [&](const std::string& p_Hash)
+    {
+      hashes.push_back(p_Hash);
+    };
+
+    *db << "SELECT hash FROM bodys;" >> lambda;
     *db << "DELETE FROM bodys;";
+    ReleaseBlobRefs(p_Folder, std::string(), hashes);
+    BumpBodysGeneration(p_Folder);
   }
   catch (const sqlite::sqlite_exception& ex)
   {
@@ -650,6 +883,7 @@ void ImapCache::ClearFolder(const std::string& p_Folder)
   try
   {
     std::shared_ptr<DbConnection> dbCon = GetDb(UidFlagsDb, p_Folder, true /* p_Writable */);
+    std::unique_lock<std::shared_timed_mutex> dbLock = dbCon->WriteLock();
     std::shared_ptr<sqlite::database> db = dbCon->m_Database;
     *db << "DELETE FROM uids;";
     *db << "DELETE FROM flags;";
@@ -661,7 +895,7 @@ void ImapCache::ClearFolder(const std::string& p_Folder)
 }
 
 // delete specified messages
-void ImapCache::DeleteMessages(const std::string& p_Folder, const std::set<uint32_t>& p_Uids)
+void ImapCache::DeleteMessages(const std::string& p_Folder, const UidSet& p_Uids)
 {
   DeleteUids(p_Folder, p_Uids);
   DeleteFlags(p_Folder, p_Uids);
@@ -670,24 +904,24 @@ void ImapCache::DeleteMessages(const std::string& p_Folder, const std::set<uint3
 }
 
 // delete specified uids
-void ImapCache::DeleteUids(const std::string& p_Folder, const std::set<uint32_t>& p_Uids)
+void ImapCache::DeleteUids(const std::string& p_Folder, const UidSet& p_Uids)
 {
   LOG_DEBUG_FUNC(STR(p_Folder, p_Uids));
-  std::lock_guard<std::mutex> cacheLock(m_CacheMutex);
   std::shared_ptr<DbConnection> dbCon = GetDb(UidFlagsDb, p_Folder, true /* p_Writable */);
+  std::unique_lock<std::shared_timed_mutex> dbLock = dbCon->WriteLock();
   std::shared_ptr<sqlite::database> db = dbCon->m_Database;
 
   try
   {
-    std::set<uint32_t> uids;
+    UidSet uids;
     auto lambda = [&](const std::vector<uint32_t>& data)
     {
-      uids = ToSet(data);
+      uids = UidSet(data.begin(), data.end());
     };
 
     *db << "SELECT uids.uids FROM uids LIMIT 1" >> lambda;
 
-    for (auto& uid : p_Uids)
+    for (const auto& uid : p_Uids)
     {
       uids.erase(uid);
     }
@@ -704,11 +938,11 @@ void ImapCache::DeleteUids(const std::string& p_Folder, const std::set<uint32_t>
 }
 
 // delete specified flags
-void ImapCache::DeleteFlags(const std::string& p_Folder, const std::set<uint32_t>& p_Uids)
+void ImapCache::DeleteFlags(const std::string& p_Folder, const UidSet& p_Uids)
 {
   LOG_DEBUG_FUNC(STR(p_Folder, p_Uids));
-  std::lock_guard<std::mutex> cacheLock(m_CacheMutex);
   std::shared_ptr<DbConnection> dbCon = GetDb(UidFlagsDb, p_Folder, true /* p_Writable */);
+  std::unique_lock<std::shared_timed_mutex> dbLock = dbCon->WriteLock();
   std::shared_ptr<sqlite::database> db = dbCon->m_Database;
 
   std::stringstream sstream;
@@ -727,11 +961,11 @@ void ImapCache::DeleteFlags(const std::string& p_Folder, const std::set<uint32_t
 }
 
 // delete specified headers
-void ImapCache::DeleteHeaders(const std::string& p_Folder, const std::set<uint32_t>& p_Uids)
+void ImapCache::DeleteHeaders(const std::string& p_Folder, const UidSet& p_Uids)
 {
   LOG_DEBUG_FUNC(STR(p_Folder, p_Uids));
-  std::lock_guard<std::mutex> cacheLock(m_CacheMutex);
   std::shared_ptr<DbConnection> dbCon = GetDb(HeadersDb, p_Folder, true /* p_Writable */);
+  std::unique_lock<std::shared_timed_mutex> dbLock = dbCon->WriteLock();
   std::shared_ptr<sqlite::database> db = dbCon->m_Database;
 
   std::stringstream sstream;
@@ -750,11 +984,11 @@ void ImapCache::DeleteHeaders(const std::string& p_Folder, const std::set<uint32
 }
 
 // delete specified bodys
-void ImapCache::DeleteBodys(const std::string& p_Folder, const std::set<uint32_t>& p_Uids)
+void ImapCache::DeleteBodys(const std::string& p_Folder, const UidSet& p_Uids)
 {
   LOG_DEBUG_FUNC(STR(p_Folder, p_Uids));
-  std::lock_guard<std::mutex> cacheLock(m_CacheMutex);
   std::shared_ptr<DbConnection> dbCon = GetDb(BodysDb, p_Folder, true /* p_Writable */);
+  std::unique_lock<std::shared_timed_mutex> dbLock = dbCon->WriteLock();
   std::shared_ptr<sqlite::database> db = dbCon->m_Database;
 
   std::stringstream sstream;
@@ -764,7 +998,16 @@ void ImapCache::DeleteBodys(const std::string& p_Folder, const std::set<uint32_t
 
   try
   {
+    std::vector<std::string> hashes;
+    auto lambda = [&](const std::string& p_Hash)
+    {
+      hashes.push_back(p_Hash);
+    };
+
+    *db << "SELECT hash FROM bodys WHERE uid IN (" + uidlist + ");" >> lambda;
     *db << "DELETE FROM bodys WHERE uid IN (" + uidlist + ");";
+    ReleaseBlobRefs(p_Folder, uidlist, hashes);
+    BumpBodysGeneration(p_Folder);
   }
   catch (const sqlite::sqlite_exception& ex)
   {
@@ -772,6 +1015,34 @@ void ImapCache::DeleteBodys(const std::string& p_Folder, const std::set<uint32_t
   }
 }
 
+// headers or bodys written recently, used by background readers to yield to the writer
+bool ImapCache::IsWriteBusy()
+{
+  static const int64_t busyMs = 250;
+  const int64_t nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+  return (nowMs - m_LastWriteTime) < busyMs;
+}
+
+void ImapCache::MarkWrite()
+{
+  m_LastWriteTime = std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// get body modification generation per folder, used by index to detect changed folders
+std::map<std::string, uint64_t> ImapCache::GetBodysGenerations()
+{
+  const std::set<std::string> folders = GetFolders();
+  std::lock_guard<std::mutex> cacheLock(m_CacheMutex);
+  for (const auto& folder : folders)
+  {
+    m_BodysGenerations.insert(std::make_pair(folder, m_BodysGenerationsBase));
+  }
+
+  return m_BodysGenerations;
+}
+
 bool ImapCache::Export(const std::string& p_Path)
 {
   // @todo: determine what is correct/portable MailDir format
@@ -791,7 +1062,7 @@ bool ImapCache::Export(const std::string& p_Path)
     Util::MkDir(folderPath + "/tmp");
     Util::MkDir(folderPath + "/cur");
 
-    const std::set<uint32_t> uids = GetUids(folder);
+    const UidSet uids = GetUids(folder);
     if (uids.empty()) continue;
 
     const std::map<uint32_t, Body> bodys = GetBodys(folder, uids, false /*p_Prefetch*/);
@@ -810,7 +1081,7 @@ bool ImapCache::Export(const std::string& p_Path)
 void ImapCache::InitHeadersCache()
 {
   std::lock_guard<std::mutex> cacheLock(m_CacheMutex);
-  static const int version = 2;
+  static const int version = 7;
   CacheUtil::CommonInitCacheDir(GetCacheDir(HeadersDb), version, m_CacheEncrypt);
   Util::MkDir(GetCacheDbDir(HeadersDb));
   if (m_CacheEncrypt)
@@ -829,20 +1100,39 @@ void ImapCache::CleanupHeadersCache()
 void ImapCache::InitBodysCache()
 {
   std::lock_guard<std::mutex> cacheLock(m_CacheMutex);
-  static const int version = 2;
-  CacheUtil::CommonInitCacheDir(GetCacheDir(BodysDb), version, m_CacheEncrypt);
+  static const int version = 8;
+  if (!CacheUtil::CommonInitCacheDir(GetCacheDir(BodysDb), version, m_CacheEncrypt))
+  {
+    // blobs are only referenced from bodys, drop them along with a re-initialized bodys cache
+    Util::RmDir(GetCacheDir(BlobsDb));
+  }
+
   Util::MkDir(GetCacheDbDir(BodysDb));
   if (m_CacheEncrypt)
   {
     Util::RmDir(GetTempDbDir(BodysDb));
     Util::MkDir(GetTempDbDir(BodysDb));
   }
+
+  const std::string& generationsPath = GetBodysGenerationsPath();
+  if (Util::Exists(generationsPath))
+  {
+    m_BodysGenerations =
+      Serialization::FromString<std::map<std::string, uint64_t>>(ReadCacheFile(generationsPath));
+  }
+
+  if (m_BodysGenerations.empty())
+  {
+    // new cache or unclean exit, use a generation range not matching any stored index watermark
+    m_BodysGenerationsBase = ((uint64_t)time(NULL)) << 20;
+  }
 }
 
 void ImapCache::CleanupBodysCache()
 {
   std::lock_guard<std::mutex> cacheLock(m_CacheMutex);
   CloseDbs(BodysDb);
+  WriteCacheFile(GetBodysGenerationsPath(), Serialization::ToString(m_BodysGenerations));
 }
 
 void ImapCache::InitUidFlagsCache()
@@ -883,6 +1173,27 @@ void ImapCache::CleanupValidityCache()
   CloseDbs(ValidityDb);
 }
 
+void ImapCache::InitBlobsCache()
+{
+  std::lock_guard<std::mutex> cacheLock(m_CacheMutex);
+  static const int version = 3;
+  CacheUtil::CommonInitCacheDir(GetCacheDir(BlobsDb), version, m_CacheEncrypt);
+  Util::MkDir(GetCacheDbDir(BlobsDb));
+  if (m_CacheEncrypt)
+  {
+    Util::RmDir(GetTempDbDir(BlobsDb));
+    Util::MkDir(GetTempDbDir(BlobsDb));
+  }
+
+  m_BlobStore.reset(new BlobStore(GetBlobsDataDir(), m_CacheEncrypt, m_Pass));
+}
+
+void ImapCache::CleanupBlobsCache()
+{
+  std::lock_guard<std::mutex> cacheLock(m_CacheMutex);
+  CloseDbs(BlobsDb);
+}
+
 std::string ImapCache::GetDbTypeName(ImapCache::DbType p_DbType)
 {
   static const std::map<DbType, std::string> dbTypeNames =
@@ -891,6 +1202,7 @@ std::string ImapCache::GetDbTypeName(ImapCache::DbType p_DbType)
     { BodysDb, "messages" },
     { UidFlagsDb, "uidflags" },
     { ValidityDb, "validity" },
+    { BlobsDb, "blobs" },
   };
   return dbTypeNames.at(p_DbType);
 }
@@ -915,6 +1227,16 @@ std::string ImapCache::GetHeadersFoldersPath()
   return GetCacheDir(HeadersDb) + std::string("folders");
 }
 
+std::string ImapCache::GetBodysGenerationsPath()
+{
+  return GetCacheDir(BodysDb) + std::string("generations");
+}
+
+std::string ImapCache::GetBlobsDataDir()
+{
+  return GetCacheDir(BlobsDb) + std::string("data/");
+}
+
 std::string ImapCache::GetDbName(const std::string& p_Folder)
 {
   return (m_CacheEncrypt ? Crypto::SHA256(p_Folder) : Util::ToHex(p_Folder)) + ".sqlite";
@@ -978,7 +1300,7 @@ void ImapCache::CreateDb(ImapCache::DbType p_DbType, const std::string& p_DbPath
     }
     else if (p_DbType == BodysDb)
     {
-      db << "CREATE TABLE IF NOT EXISTS bodys (uid INT, data BLOB, PRIMARY KEY (uid));";
+      db << "CREATE TABLE IF NOT EXISTS bodys (uid INT, hash TEXT, data BLOB, PRIMARY KEY (uid));";
     }
     else if (p_DbType == UidFlagsDb)
     {
@@ -991,6 +1313,15 @@ void ImapCache::CreateDb(ImapCache::DbType p_DbType, const std::string& p_DbPath
     {
       db << "CREATE TABLE IF NOT EXISTS validity (folder TEXT, uid INT, PRIMARY KEY (folder));";
     }
+    else if (p_DbType == BlobsDb)
+    {
+      db << "CREATE TABLE IF NOT EXISTS blobs (hash TEXT, refs INT, size INT, accessed INT, PRIMARY KEY (hash));";
+      db << "CREATE INDEX IF NOT EXISTS blobs_accessed ON blobs (accessed);";
+      db << "CREATE TABLE IF NOT EXISTS msgkeys (key TEXT, hash TEXT, PRIMARY KEY (key));";
+      db << "CREATE INDEX IF NOT EXISTS msgkeys_hash ON msgkeys (hash);";
+      db << "CREATE TABLE IF NOT EXISTS bodyrows (folder TEXT, uid INT, hash TEXT, size INT, PRIMARY KEY (folder, uid));";
+      db << "CREATE INDEX IF NOT EXISTS bodyrows_hash ON bodyrows (hash);";
+    }
   }
   catch (const sqlite::sqlite_exception& ex)
   {
@@ -998,56 +1329,445 @@ void ImapCache::CreateDb(ImapCache::DbType p_DbType, const std::string& p_DbPath
   }
 }
 
-// must be called with cachelock
+// returns connection to be locked by caller, using WriteLock() if p_Writable and ReadLock() otherwise
 std::shared_ptr<ImapCache::DbConnection> ImapCache::GetDb(ImapCache::DbType p_DbType, const std::string& p_Folder,
                                                           bool p_Writable)
 {
   std::shared_ptr<ImapCache::DbConnection> dbConnection;
-  auto& dbMap = m_DbConnections[p_DbType];
-  auto it = dbMap.find(p_Folder);
-  if (it != dbMap.end())
+  std::shared_ptr<ImapCache::DbConnection> prevDbConnection;
+  std::string prevWriteDb;
   {
-    // use existing open connection
-    dbConnection = it->second;
+    std::lock_guard<std::mutex> cacheLock(m_CacheMutex);
+    auto& dbMap = m_DbConnections[p_DbType];
+    auto it = dbMap.find(p_Folder);
+    if (it != dbMap.end())
+    {
+      // use existing open connection
+      dbConnection = it->second;
+    }
+    else
+    {
+      // open new connection
+      const std::string& dbPath = GetDbPath(p_DbType, p_Folder);
+      if (!Util::Exists(dbPath))
+      {
+        CreateDb(p_DbType, dbPath);
+      }
+
+      dbConnection = std::shared_ptr<DbConnection>(new DbConnection(dbPath));
+      dbMap[p_Folder] = dbConnection;
+    }
+
+    if (m_CacheEncrypt)
+    {
+      // for encrypted db - only keep one writable db to minimize shutdown time
+      auto& currentWriteDb = m_CurrentWriteDb[p_DbType];
+      if (p_Writable && (currentWriteDb != p_Folder))
+      {
+        if (!currentWriteDb.empty())
+        {
+          prevDbConnection = dbMap.at(currentWriteDb);
+          prevWriteDb = currentWriteDb;
+        }
+
+        currentWriteDb = p_Folder;
+      }
+    }
   }
-  else
+
+  if (prevDbConnection)
   {
-    // open new connection
-    const std::string& dbPath = GetDbPath(p_DbType, p_Folder);
-    if (!Util::Exists(dbPath))
+    // write back outside cache lock, as it waits for ongoing access to the previous db to complete
+    std::unique_lock<std::shared_timed_mutex> prevDbLock(prevDbConnection->m_Mutex);
+    if (prevDbConnection->m_Dirty)
     {
-      CreateDb(p_DbType, dbPath);
+      prevDbConnection->CloseDb();
+      WriteDb(p_DbType, prevWriteDb);
+      prevDbConnection->OpenDb();
+      prevDbConnection->m_Dirty = false;
     }
+  }
+
+  return dbConnection;
+}
+
+void ImapCache::BumpBodysGeneration(const std::string& p_Folder)
+{
+  std::lock_guard<std::mutex> cacheLock(m_CacheMutex);
+  if (!m_BodysGenerationsDirty)
+  {
+    // stored generations are only valid after clean exit
+    Util::DeleteFile(GetBodysGenerationsPath());
+    m_BodysGenerationsDirty = true;
+  }
+
+  auto it = m_BodysGenerations.insert(std::make_pair(p_Folder, m_BodysGenerationsBase)).first;
+  ++it->second;
+}
+
+// called with blobs db write lock held, which is taken after any bodys db lock
+void ImapCache::AddBlobRefs(const std::shared_ptr<sqlite::database>& p_BlobsDb,
+                            const std::vector<std::pair<std::string, size_t>>& p_BlobSizes)
+{
+  if (p_BlobSizes.empty()) return;
+
+  std::shared_ptr<sqlite::database> db = p_BlobsDb;
 
-    dbConnection = std::shared_ptr<DbConnection>(new DbConnection(dbPath));
-    dbMap[p_Folder] = dbConnection;
+  const int64_t now = (int64_t)time(NULL);
+  size_t addedSize = 0;
+  *db << "begin;";
+  for (const auto& blobSize : p_BlobSizes)
+  {
+    *db << "INSERT OR IGNORE INTO blobs (hash, refs, size, accessed) VALUES (?, 0, 0, ?);" << blobSize.first << now;
+    *db << "UPDATE blobs SET refs = refs + 1, size = ?, accessed = ? WHERE hash = ?;" <<
+      (int64_t)blobSize.second << now << blobSize.first;
+    addedSize += blobSize.second;
   }
+  *db << "commit;";
 
-  if (m_CacheEncrypt)
+  NotifyBlobsAdded(addedSize);
+}
+
+// called with blobs db write lock held, which is taken after any bodys db lock
+void ImapCache::SetBlobSizes(const std::shared_ptr<sqlite::database>& p_BlobsDb,
+                             const std::vector<std::pair<std::string, size_t>>& p_BlobSizes)
+{
+  if (p_BlobSizes.empty()) return;
+
+  std::shared_ptr<sqlite::database> db = p_BlobsDb;
+
+  const int64_t now = (int64_t)time(NULL);
+  size_t addedSize = 0;
+  *db << "begin;";
+  for (const auto& blobSize : p_BlobSizes)
+  {
+    *db << "UPDATE blobs SET size = ?, accessed = ? WHERE hash = ?;" <<
+      (int64_t)blobSize.second << now << blobSize.first;
+    addedSize += blobSize.second;
+  }
+  *db << "commit;";
+
+  NotifyBlobsAdded(addedSize);
+}
+
+// access times are buffered and written by the evict thread, to keep reads lock-free
+void ImapCache::TouchBlob(const std::string& p_Hash)
+{
+  if ((s_MaxSize == 0) && (s_MaxAgeDays == 0)) return;
+
+  std::lock_guard<std::mutex> lock(m_EvictMutex);
+  m_BlobAccessTimes[p_Hash] = (int64_t)time(NULL);
+}
+
+void ImapCache::NotifyBlobsAdded(size_t p_Size)
+{
+  if (s_MaxSize == 0) return;
+
+  // re-check quota after each percent of it has been added
+  std::lock_guard<std::mutex> lock(m_EvictMutex);
+  m_EvictAddedSize += p_Size;
+  if (m_EvictAddedSize >= std::max<uint64_t>(s_MaxSize / 100, 1))
+  {
+    m_EvictCondVar.notify_one();
+  }
+}
+
+void ImapCache::EvictProcess()
+{
+  LOG_DEBUG("start evict process");
+
+  std::unique_lock<std::mutex> lock(m_EvictMutex);
+  while (m_EvictRunning)
+  {
+    m_EvictAddedSize = 0;
+    lock.unlock();
+    EvictBlobs();
+    lock.lock();
+
+    // age based eviction only needs an occasional check
+    static const std::chrono::minutes checkInterval(10);
+    m_EvictCondVar.wait_for(lock, checkInterval, [&]()
+    {
+      return !m_EvictRunning || ((s_MaxSize > 0) && (m_EvictAddedSize >= std::max<uint64_t>(s_MaxSize / 100, 1)));
+    });
+  }
+  lock.unlock();
+
+  // persist access times buffered since the last pass, so next startup evicts by them
+  FlushBlobAccessTimes();
+
+  LOG_DEBUG("exit evict process");
+}
+
+void ImapCache::FlushBlobAccessTimes()
+{
+  std::map<std::string, int64_t> accessTimes;
+  {
+    std::lock_guard<std::mutex> lock(m_EvictMutex);
+    accessTimes.swap(m_BlobAccessTimes);
+  }
+
+  if (accessTimes.empty()) return;
+
+  try
+  {
+    const std::string commonFolder = "common";
+    std::shared_ptr<DbConnection> dbCon = GetDb(BlobsDb, commonFolder, true /* p_Writable */);
+    std::unique_lock<std::shared_timed_mutex> dbLock = dbCon->WriteLock();
+    std::shared_ptr<sqlite::database> db = dbCon->m_Database;
+
+    *db << "begin;";
+    for (const auto& accessTime : accessTimes)
+    {
+      *db << "UPDATE blobs SET accessed = ? WHERE hash = ?;" << accessTime.second << accessTime.first;
+    }
+    *db << "commit;";
+  }
+  catch (const sqlite::sqlite_exception& ex)
+  {
+    HANDLE_SQLITE_EXCEPTION(ex);
+  }
+}
+
+// evict least recently accessed body blobs beyond max age or size, referencing rows are
+// kept so evicted bodys are not prefetched again, but fetched on demand when accessed.
+// quota covers blob files and the parsed data of rows, which is cleared on eviction.
+void ImapCache::EvictBlobs()
+{
+  // evict by up-to-date access times
+  FlushBlobAccessTimes();
+
+  std::vector<std::string> evictHashes;
+  std::map<std::string, std::vector<std::pair<uint32_t, std::string>>> evictRows;
+  int64_t evictSize = 0;
+  try
+  {
+    const std::string commonFolder = "common";
+    std::shared_ptr<DbConnection> dbCon = GetDb(BlobsDb, commonFolder, true /* p_Writable */);
+    std::unique_lock<std::shared_timed_mutex> dbLock = dbCon->WriteLock();
+    std::shared_ptr<sqlite::database> db = dbCon->m_Database;
+
+    *db << "begin;";
+    int64_t totalSize = 0;
+    *db << "SELECT (SELECT COALESCE(SUM(size), 0) FROM blobs) + (SELECT COALESCE(SUM(size), 0) FROM bodyrows);" >>
+      totalSize;
+
+    // evict down to below the max size, to not trigger again right away
+    const int64_t maxSize = (int64_t)s_MaxSize;
+    int64_t excessSize = ((maxSize > 0) && (totalSize > maxSize)) ? (totalSize - ((maxSize * 9) / 10)) : 0;
+    const int64_t minAccessed = (s_MaxAgeDays > 0) ? ((int64_t)time(NULL) - ((int64_t)s_MaxAgeDays * 24 * 3600)) : 0;
+    if ((excessSize > 0) || (minAccessed > 0))
+    {
+      auto lambda = [&](const std::string& p_Hash, const int64_t& p_Size, const int64_t& p_Accessed)
+      {
+        if ((p_Accessed >= minAccessed) && (excessSize <= 0)) return;
+
+        evictHashes.push_back(p_Hash);
+        evictSize += p_Size;
+        excessSize -= p_Size;
+      };
+
+      *db << "SELECT hash, size + (SELECT COALESCE(SUM(size), 0) FROM bodyrows WHERE bodyrows.hash = blobs.hash), "
+        "accessed FROM blobs WHERE size > 0 ORDER BY accessed;" >> lambda;
+    }
+
+    for (const auto& hash : evictHashes)
+    {
+      auto lambda = [&](const std::string& p_Folder, const uint32_t& p_Uid)
+      {
+        evictRows[p_Folder].push_back(std::make_pair(p_Uid, hash));
+      };
+
+      *db << "SELECT folder, uid FROM bodyrows WHERE hash = ?;" << hash >> lambda;
+      *db << "DELETE FROM bodyrows WHERE hash = ?;" << hash;
+      *db << "UPDATE blobs SET size = 0 WHERE hash = ?;" << hash;
+    }
+    *db << "commit;";
+
+    // remove files after commit, readers holding a mapping are unaffected
+    for (const auto& hash : evictHashes)
+    {
+      m_BlobStore->Remove(hash);
+    }
+
+    LOG_DEBUG("cache blobs %lld bytes, evicted %zu blobs %lld bytes",
+              (long long)totalSize, evictHashes.size(), (long long)evictSize);
+  }
+  catch (const sqlite::sqlite_exception& ex)
   {
-    // for encrypted db - only keep one writable db to minimize shutdown time
-    auto& currentWriteDb = m_CurrentWriteDb[p_DbType];
-    if (p_Writable && (currentWriteDb != p_Folder))
+    HANDLE_SQLITE_EXCEPTION(ex);
+  }
+
+  // bodys dbs are locked before blobs db, so clear rows after releasing it
+  ClearBodyRows(evictRows);
+}
+
+// may be called with bodys db lock held, blobs db is locked last. rows of deleted
+// bodys are dropped for the folder, all of them when uid list is empty.
+void ImapCache::ReleaseBlobRefs(const std::string& p_Folder, const std::string& p_UidList,
+                                const std::vector<std::string>& p_Hashes)
+{
+  if (p_Hashes.empty()) return;
+
+  const std::string commonFolder = "common";
+  std::shared_ptr<DbConnection> dbCon = GetDb(BlobsDb, commonFolder, true /* p_Writable */);
+  std::unique_lock<std::shared_timed_mutex> dbLock = dbCon->WriteLock();
+  std::shared_ptr<sqlite::database> db = dbCon->m_Database;
+  if (p_UidList.empty())
+  {
+    *db << "DELETE FROM bodyrows WHERE folder = ?;" << p_Folder;
+  }
+  else
+  {
+    *db << "DELETE FROM bodyrows WHERE folder = ? AND uid IN (" + p_UidList + ");" << p_Folder;
+  }
+
+  ReleaseBlobRefs(db, p_Hashes);
+}
+
+// called with blobs db write lock held, which is taken after any bodys db lock
+void ImapCache::ReleaseBlobRefs(const std::shared_ptr<sqlite::database>& p_BlobsDb,
+                                const std::vector<std::string>& p_Hashes)
+{
+  if (p_Hashes.empty()) return;
+
+  std::shared_ptr<sqlite::database> db = p_BlobsDb;
+
+  std::set<std::string> unusedHashes;
+  *db << "begin;";
+  for (const auto& hash : p_Hashes)
+  {
+    *db << "UPDATE blobs SET refs = refs - 1 WHERE hash = ?;" << hash;
+  }
+
+  for (const auto& hash : std::set<std::string>(p_Hashes.begin(), p_Hashes.end()))
+  {
+    auto lambda = [&](const int64_t& p_Refs)
     {
-      if (!currentWriteDb.empty())
+      if (p_Refs <= 0)
       {
-        std::shared_ptr<ImapCache::DbConnection> prevDbConnection = dbMap.at(currentWriteDb);
-        if (prevDbConnection->m_Dirty)
-        {
-          prevDbConnection->CloseDb();
-          WriteDb(p_DbType, currentWriteDb);
-          prevDbConnection->OpenDb();
-          prevDbConnection->m_Dirty = false;
-        }
+        unusedHashes.insert(hash);
       }
+    };
+
+    *db << "SELECT refs FROM blobs WHERE hash = ?;" << hash >> lambda;
+  }
+
+  for (const auto& hash : unusedHashes)
+  {
+    *db << "DELETE FROM blobs WHERE hash = ?;" << hash;
+    *db << "DELETE FROM msgkeys WHERE hash = ?;" << hash;
+  }
+  *db << "commit;";
+
+  for (const auto& hash : unusedHashes)
+  {
+    m_BlobStore->Remove(hash);
+  }
+}
+
+// called with blobs db write lock held, which is taken after any bodys db lock
+void ImapCache::SetBlobKeys(const std::shared_ptr<sqlite::database>& p_BlobsDb,
+                            const std::map<std::string, std::string>& p_KeyHashes)
+{
+  if (p_KeyHashes.empty()) return;
+
+  std::shared_ptr<sqlite::database> db = p_BlobsDb;
+
+  *db << "begin;";
+  for (const auto& keyHash : p_KeyHashes)
+  {
+    *db << "INSERT OR REPLACE INTO msgkeys (key, hash) VALUES (?, ?);" << keyHash.first << keyHash.second;
+  }
+  *db << "commit;";
+}
+
+// called with blobs db write lock held, which is taken after any bodys db lock
+void ImapCache::SetBodyRows(const std::shared_ptr<sqlite::database>& p_BlobsDb, const std::string& p_Folder,
+                            const std::vector<std::tuple<uint32_t, std::string, size_t>>& p_BodyRows)
+{
+  if (p_BodyRows.empty()) return;
 
-      currentWriteDb = p_Folder;
+  std::shared_ptr<sqlite::database> db = p_BlobsDb;
+
+  // row sizes count towards the cache quota along with the blob they are derived from
+  size_t addedSize = 0;
+  *db << "begin;";
+  for (const auto& bodyRow : p_BodyRows)
+  {
+    *db << "INSERT OR REPLACE INTO bodyrows (folder, uid, hash, size) VALUES (?, ?, ?, ?);" << p_Folder <<
+      std::get<0>(bodyRow) << std::get<1>(bodyRow) << (int64_t)std::get<2>(bodyRow);
+    addedSize += std::get<2>(bodyRow);
+  }
+  *db << "commit;";
+
+  NotifyBlobsAdded(addedSize);
+}
+
+// clear parsed data of bodys rows whose blob was evicted, rows are kept as evicted markers
+void ImapCache::ClearBodyRows(const std::map<std::string, std::vector<std::pair<uint32_t, std::string>>>& p_FolderRows)
+{
+  for (const auto& folderRows : p_FolderRows)
+  {
+    try
+    {
+      std::shared_ptr<DbConnection> dbCon = GetDb(BodysDb, folderRows.first, true /* p_Writable */);
+      std::unique_lock<std::shared_timed_mutex> dbLock = dbCon->WriteLock();
+      std::shared_ptr<sqlite::database> db = dbCon->m_Database;
+      *db << "begin;";
+      for (const auto& uidHash : folderRows.second)
+      {
+        // row may have been replaced or its blob restored since eviction
+        if (m_BlobStore->Exists(uidHash.second)) continue;
+
+        *db << "UPDATE bodys SET data = ? WHERE uid = ? AND hash = ?;" << std::vector<char>() <<
+          uidHash.first << uidHash.second;
+      }
+      *db << "commit;";
+    }
+    catch (const sqlite::sqlite_exception& ex)
+    {
+      HANDLE_SQLITE_EXCEPTION(ex);
     }
   }
+}
 
-  dbConnection->m_Dirty |= p_Writable;
+// must not be called with bodys db lock held
+std::map<uint32_t, std::string> ImapCache::GetDedupKeys(const std::string& p_Folder, const UidSet& p_Uids)
+{
+  std::map<uint32_t, std::string> dedupKeys;
+  if (p_Uids.empty()) return dedupKeys;
 
-  return dbConnection;
+  std::shared_ptr<DbConnection> dbCon = GetDb(HeadersDb, p_Folder, false /* p_Writable */);
+  std::shared_lock<std::shared_timed_mutex> dbLock = dbCon->ReadLock();
+  std::shared_ptr<sqlite::database> db = dbCon->ReadDb();
+
+  std::stringstream sstream;
+  std::copy(p_Uids.begin(), p_Uids.end(), std::ostream_iterator<uint32_t>(sstream, ","));
+  std::string uidlist = sstream.str();
+  uidlist.pop_back(); // assumes non-empty input set
+
+  try
+  {
+    auto lambda = [&](const uint32_t& uid, const std::vector<char>& data)
+    {
+      Header header = UnpackRow<Header>(data, s_HeaderDict);
+      header.ParseIfNeeded();
+      const std::string& dedupKey = header.GetDedupKey();
+      if (!dedupKey.empty())
+      {
+        dedupKeys[uid] = dedupKey;
+      }
+    };
+
+    *db << "SELECT uid, data FROM headers WHERE uid IN (" + uidlist + ");" >> lambda;
+  }
+  catch (const sqlite::sqlite_exception& ex)
+  {
+    HANDLE_SQLITE_EXCEPTION(ex);
+  }
+
+  return dedupKeys;
 }
 
 // must be called with cachelock
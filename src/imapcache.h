@@ -7,16 +7,26 @@
 
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <set>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
 
 #include <sqlite_modern_cpp.h>
 
+#include "uidset.h"
+
+class BlobStore;
 class Body;
 class Header;
+class ReEncrypt;
 
 namespace sqlite
 {
@@ -32,6 +42,7 @@ private:
     BodysDb,
     UidFlagsDb,
     ValidityDb,
+    BlobsDb,
   };
 
   struct DbConnection;
@@ -40,32 +51,36 @@ public:
   ImapCache(const bool p_CacheEncrypt, const std::string& p_Pass);
   virtual ~ImapCache();
 
-  static bool ChangePass(const bool p_CacheEncrypt,
-                         const std::string& p_OldPass, const std::string& p_NewPass);
+  static void ChangePass(const bool p_CacheEncrypt, ReEncrypt& p_ReEncrypt);
+  static void SetQuota(uint64_t p_MaxSize, uint32_t p_MaxAgeDays);
 
   std::set<std::string> GetFolders();
   void SetFolders(const std::set<std::string>& p_Folders);
 
-  std::set<uint32_t> GetUids(const std::string& p_Folder);
-  void SetUids(const std::string& p_Folder, const std::set<uint32_t>& p_Uids);
+  UidSet GetUids(const std::string& p_Folder);
+  void SetUids(const std::string& p_Folder, const UidSet& p_Uids);
 
-  std::map<uint32_t, Header> GetHeaders(const std::string& p_Folder, const std::set<uint32_t>& p_Uids,
+  std::map<uint32_t, Header> GetHeaders(const std::string& p_Folder, const UidSet& p_Uids,
                                         const bool p_Prefetch);
   void SetHeaders(const std::string& p_Folder, const std::map<uint32_t, Header>& p_Headers);
 
-  std::map<uint32_t, uint32_t> GetFlags(const std::string& p_Folder, const std::set<uint32_t>& p_Uids);
+  std::map<uint32_t, uint32_t> GetFlags(const std::string& p_Folder, const UidSet& p_Uids);
   void SetFlags(const std::string& p_Folder, const std::map<uint32_t, uint32_t>& p_Flags);
 
-  std::map<uint32_t, Body> GetBodys(const std::string& p_Folder, const std::set<uint32_t>& p_Uids,
+  std::map<uint32_t, Body> GetBodys(const std::string& p_Folder, const UidSet& p_Uids,
                                     const bool p_Prefetch);
   void SetBodys(const std::string& p_Folder, const std::map<uint32_t, Body>& p_Bodys);
+  std::map<uint32_t, Body> GetDuplicateBodys(const std::string& p_Folder, const UidSet& p_Uids);
 
   bool CheckUidValidity(const std::string& p_Folder, int p_Uid);
-  void SetFlagSeen(const std::string& p_Folder, const std::set<uint32_t>& p_Uids, const bool p_Value);
+  void SetFlagSeen(const std::string& p_Folder, const UidSet& p_Uids, const bool p_Value);
 
   void ClearFolder(const std::string& p_Folder);
 
-  void DeleteMessages(const std::string& p_Folder, const std::set<uint32_t>& p_Uids);
+  void DeleteMessages(const std::string& p_Folder, const UidSet& p_Uids);
+
+  std::map<std::string, uint64_t> GetBodysGenerations();
+  bool IsWriteBusy();
 
   bool Export(const std::string& p_Path);
 
@@ -82,11 +97,16 @@ private:
   void InitValidityCache();
   void CleanupValidityCache();
 
+  void InitBlobsCache();
+  void CleanupBlobsCache();
+
   static std::string GetDbTypeName(ImapCache::DbType p_DbType);
   static std::string GetCacheDir(ImapCache::DbType p_DbType);
   static std::string GetCacheDbDir(ImapCache::DbType p_DbType);
   static std::string GetTempDbDir(ImapCache::DbType p_DbType);
   static std::string GetHeadersFoldersPath();
+  static std::string GetBodysGenerationsPath();
+  static std::string GetBlobsDataDir();
 
   std::string GetDbName(const std::string& p_Folder);
   std::string GetDbPath(ImapCache::DbType p_DbType, const std::string& p_Folder);
@@ -97,17 +117,54 @@ private:
   std::string ReadCacheFile(const std::string& p_Path);
   void WriteCacheFile(const std::string& p_Path, const std::string& p_Str);
 
-  void DeleteUids(const std::string& p_Folder, const std::set<uint32_t>& p_Uids);
-  void DeleteFlags(const std::string& p_Folder, const std::set<uint32_t>& p_Uids);
-  void DeleteHeaders(const std::string& p_Folder, const std::set<uint32_t>& p_Uids);
-  void DeleteBodys(const std::string& p_Folder, const std::set<uint32_t>& p_Uids);
+  void DeleteUids(const std::string& p_Folder, const UidSet& p_Uids);
+  void DeleteFlags(const std::string& p_Folder, const UidSet& p_Uids);
+  void DeleteHeaders(const std::string& p_Folder, const UidSet& p_Uids);
+  void DeleteBodys(const std::string& p_Folder, const UidSet& p_Uids);
+  void BumpBodysGeneration(const std::string& p_Folder);
+  void AddBlobRefs(const std::shared_ptr<sqlite::database>& p_BlobsDb,
+                   const std::vector<std::pair<std::string, size_t>>& p_BlobSizes);
+  void SetBlobKeys(const std::shared_ptr<sqlite::database>& p_BlobsDb,
+                   const std::map<std::string, std::string>& p_KeyHashes);
+  std::map<uint32_t, std::string> GetDedupKeys(const std::string& p_Folder, const UidSet& p_Uids);
+  void ReleaseBlobRefs(const std::string& p_Folder, const std::string& p_UidList,
+                       const std::vector<std::string>& p_Hashes);
+  void ReleaseBlobRefs(const std::shared_ptr<sqlite::database>& p_BlobsDb, const std::vector<std::string>& p_Hashes);
+  void SetBlobSizes(const std::shared_ptr<sqlite::database>& p_BlobsDb,
+                    const std::vector<std::pair<std::string, size_t>>& p_BlobSizes);
+  void SetBodyRows(const std::shared_ptr<sqlite::database>& p_BlobsDb, const std::string& p_Folder,
+                   const std::vector<std::tuple<uint32_t, std::string, size_t>>& p_BodyRows);
+  void ClearBodyRows(const std::map<std::string, std::vector<std::pair<uint32_t, std::string>>>& p_FolderRows);
+  void TouchBlob(const std::string& p_Hash);
+  void NotifyBlobsAdded(size_t p_Size);
+  void EvictProcess();
+  void EvictBlobs();
+  void FlushBlobAccessTimes();
+  void MarkWrite();
 
 private:
   bool m_CacheEncrypt;
   std::string m_Pass;
   std::set<std::string> m_Folders;
+  bool m_FoldersLoaded = false;
+  std::map<std::string, uint64_t> m_BodysGenerations;
+  uint64_t m_BodysGenerationsBase = 0;
+  bool m_BodysGenerationsDirty = false;
 
+  // guards folders, generations and the connection map, each connection has its own rw-lock
   std::mutex m_CacheMutex;
   std::map<DbType, std::map<std::string, std::shared_ptr<DbConnection>>> m_DbConnections;
   std::map<DbType, std::string> m_CurrentWriteDb;
+  std::unique_ptr<BlobStore> m_BlobStore;
+  std::atomic<int64_t> m_LastWriteTime{ 0 };
+
+  // quota is enforced by evicting body blobs only, headers and index are retained
+  static uint64_t s_MaxSize;
+  static uint32_t s_MaxAgeDays;
+  std::thread m_EvictThread;
+  std::mutex m_EvictMutex;
+  std::condition_variable m_EvictCondVar;
+  bool m_EvictRunning = false;
+  uint64_t m_EvictAddedSize = 0;
+  std::map<std::string, int64_t> m_BlobAccessTimes;
 };
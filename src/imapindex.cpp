@@ -9,17 +9,64 @@
 
 #include <unistd.h>
 
+#include <sys/resource.h>
+
+#if defined(__APPLE__)
+#include <pthread.h>
+#include <sys/qos.h>
+#elif defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
 #include "addressbook.h"
 #include "body.h"
 #include "cacheutil.h"
 #include "crypto.h"
+#include "flag.h"
 #include "header.h"
 #include "imapcache.h"
 #include "lockfile.h"
 #include "log.h"
 #include "loghelp.h"
 #include "maphelp.h"
+#include "reencrypt.h"
+#include "serialization.h"
 #include "sethelp.h"
+#include "startupprofile.h"
+
+static const uint32_t s_SummaryVersion = 1;
+static const int64_t s_UserActivityPauseMs = 2000;
+static const int64_t s_CacheWriteMaxWaitMs = 5000;
+static const size_t s_ThrottleBatchSize = 10;
+
+uint32_t ImapIndex::s_CpuShare = 50;
+int ImapIndex::s_Nice = 10;
+
+static int64_t GetSteadyTimeMs()
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void SetThreadBackgroundPriority(int p_Nice)
+{
+  if (p_Nice <= 0) return;
+
+#if defined(__APPLE__)
+  pthread_set_qos_class_self_np(QOS_CLASS_UTILITY, 0);
+#elif defined(__linux__)
+  // nice value and io priority apply to the calling thread only on linux
+  const id_t tid = (id_t)syscall(SYS_gettid);
+  LOG_IF_NONZERO(setpriority(PRIO_PROCESS, tid, std::min(p_Nice, 19)));
+#ifdef SYS_ioprio_set
+  const int ioprioWhoProcess = 1;
+  const int ioprioClassBestEffort = 2;
+  const int ioprioLowest = 7;
+  LOG_IF_NONZERO((int)syscall(SYS_ioprio_set, ioprioWhoProcess, (int)tid,
+                              (ioprioClassBestEffort << 13) | ioprioLowest));
+#endif
+#endif
+}
 
 ImapIndex::ImapIndex(const bool p_CacheIndexEncrypt,
                      const std::string& p_Pass,
@@ -55,21 +102,20 @@ ImapIndex::~ImapIndex()
   }
 }
 
-bool ImapIndex::ChangePass(const bool p_CacheEncrypt,
-                           const std::string& p_OldPass, const std::string& p_NewPass)
+void ImapIndex::ChangePass(const bool p_CacheEncrypt, ReEncrypt& p_ReEncrypt)
 {
-  if (!p_CacheEncrypt) return true;
-
-  InitCacheTempDir();
-  if (!CacheUtil::DecryptCacheDir(p_OldPass, GetCacheIndexDbDir(), GetCacheIndexDbTempDir())) return false;
+  if (!p_CacheEncrypt) return;
 
-  Util::RmDir(GetCacheIndexDbDir());
-  Util::MkDir(GetCacheIndexDbDir());
-  if (!CacheUtil::EncryptCacheDir(p_NewPass, GetCacheIndexDbTempDir(), GetCacheIndexDbDir())) return false;
-
-  CleanupCacheTempDir();
+  // segments and manifests are individually encrypted files, re-encrypt them as-is
+  p_ReEncrypt.AddDir(GetCacheIndexSegmentDir());
+  p_ReEncrypt.AddDir(GetCacheIndexDbDir());
+  p_ReEncrypt.AddFile(GetWatermarksPath());
+}
 
-  return true;
+void ImapIndex::SetSchedParams(uint32_t p_CpuShare, int p_Nice)
+{
+  s_CpuShare = std::max<uint32_t>(1, std::min<uint32_t>(p_CpuShare, 100));
+  s_Nice = p_Nice;
 }
 
 void ImapIndex::NotifyIdle(bool p_IsIdle)
@@ -82,6 +128,18 @@ void ImapIndex::NotifyIdle(bool p_IsIdle)
   }
 }
 
+void ImapIndex::NotifyUserActivity()
+{
+  m_LastUserActivity = GetSteadyTimeMs();
+}
+
+void ImapIndex::WaitDone()
+{
+  // block until initial sync and all queued notifications have been indexed and committed
+  std::unique_lock<std::mutex> lock(m_ProcessMutex);
+  m_DoneCondVar.wait(lock, [&]() { return !m_Running || (m_IsDone && m_Queue.empty()); });
+}
+
 void ImapIndex::SetFolders(const std::set<std::string>& p_Folders)
 {
   LOG_DEBUG_FUNC(STR(p_Folders));
@@ -94,12 +152,12 @@ void ImapIndex::SetFolders(const std::set<std::string>& p_Folders)
   m_ProcessCondVar.notify_one();
 }
 
-void ImapIndex::SetUids(const std::string& p_Folder, const std::set<uint32_t>& p_Uids)
+void ImapIndex::SetUids(const std::string& p_Folder, const UidSet& p_Uids)
 {
   LOG_DEBUG_FUNC(STR(p_Folder, p_Uids));
 
   std::unique_lock<std::mutex> lock(m_ProcessMutex);
-  if (!m_SyncDone) return; // to avoid double work at first idle (sync)
+  if (!m_SyncDone) return; // to avoid double work at first sync
 
   Notify notify;
   notify.m_Folder = p_Folder;
@@ -109,12 +167,12 @@ void ImapIndex::SetUids(const std::string& p_Folder, const std::set<uint32_t>& p
   m_ProcessCondVar.notify_one();
 }
 
-void ImapIndex::DeleteMessages(const std::string& p_Folder, const std::set<uint32_t>& p_Uids)
+void ImapIndex::DeleteMessages(const std::string& p_Folder, const UidSet& p_Uids)
 {
   LOG_DEBUG_FUNC(STR(p_Folder, p_Uids));
 
   std::unique_lock<std::mutex> lock(m_ProcessMutex);
-  if (!m_SyncDone) return; // to avoid double work at first idle (sync)
+  if (!m_SyncDone) return; // to avoid double work at first sync
 
   Notify notify;
   notify.m_Folder = p_Folder;
@@ -124,12 +182,12 @@ void ImapIndex::DeleteMessages(const std::string& p_Folder, const std::set<uint3
   m_ProcessCondVar.notify_one();
 }
 
-void ImapIndex::SetBodys(const std::string& p_Folder, const std::set<uint32_t>& p_Uids)
+void ImapIndex::SetBodys(const std::string& p_Folder, const UidSet& p_Uids)
 {
   LOG_DEBUG_FUNC(STR(p_Folder, p_Uids));
 
   std::unique_lock<std::mutex> lock(m_ProcessMutex);
-  if (!m_SyncDone) return; // to avoid double work at first idle (sync)
+  if (!m_SyncDone) return; // to avoid double work at first sync
 
   Notify notify;
   notify.m_Folder = p_Folder;
@@ -141,72 +199,194 @@ void ImapIndex::SetBodys(const std::string& p_Folder, const std::set<uint32_t>&
 
 void ImapIndex::Search(const std::string& p_QueryStr, const unsigned p_Offset, const unsigned p_Max,
                        std::vector<Header>& p_Headers, std::vector<std::pair<std::string, uint32_t>>& p_FolderUids,
+                       std::map<std::pair<std::string, uint32_t>, std::set<std::string>>& p_DuplicateFolders,
                        bool& p_HasMore)
 {
   LOG_DEBUG_FUNC(STR(p_QueryStr, p_Offset, p_Max, p_HasMore));
 
   if (m_SearchEngine)
   {
-    std::vector<std::string> docIds = m_SearchEngine->Search(p_QueryStr, p_Offset, p_Max, p_HasMore);
-    for (const auto& docId : docIds)
+    std::vector<std::string> summaries;
+    std::vector<std::string> collapseKeys;
+    std::vector<bool> hasCollapsed;
+    std::vector<std::string> docIds = m_SearchEngine->Search(p_QueryStr, p_Offset, p_Max, p_HasMore, summaries,
+                                                             collapseKeys, hasCollapsed);
+
+    // serve hits from stored summaries, and fall back to one bulk cache lookup per folder for others
+    std::vector<Header> headers(docIds.size());
+    std::vector<bool> found(docIds.size(), false);
+    std::map<std::string, UidSet> fallbackFolderUids;
+    for (size_t i = 0; i < docIds.size(); ++i)
     {
-      const std::string& folder = GetFolderFromDocId(docId);
-      const uint32_t uid = GetUidFromDocId(docId);
+      SearchSummary summary;
+      if (ParseSummary(summaries.at(i), summary))
+      {
+        headers[i].SetSummaryData(summary.m_TimeStamp, summary.m_ShortFrom, summary.m_ShortTo,
+                                  summary.m_Subject, summary.m_HasAttachments);
+        found[i] = true;
+      }
+      else
+      {
+        fallbackFolderUids[GetFolderFromDocId(docIds.at(i))].insert(GetUidFromDocId(docIds.at(i)));
+      }
+    }
+
+    std::map<std::string, std::map<uint32_t, Header>> fallbackHeaders;
+    for (const auto& folderUids : fallbackFolderUids)
+    {
+      fallbackHeaders[folderUids.first] = m_ImapCache->GetHeaders(folderUids.first, folderUids.second, false);
+    }
+
+    LOG_DEBUG("search hits %d summary fallback folders %d", (int)docIds.size(), (int)fallbackFolderUids.size());
+
+    for (size_t i = 0; i < docIds.size(); ++i)
+    {
+      const std::string& folder = GetFolderFromDocId(docIds.at(i));
+      const uint32_t uid = GetUidFromDocId(docIds.at(i));
+
+      if (!found.at(i))
+      {
+        const std::map<uint32_t, Header>& uidHeaders = fallbackHeaders[folder];
+        auto it = uidHeaders.find(uid);
+        if (it == uidHeaders.end()) continue;
+
+        headers[i] = it->second;
+      }
 
-      std::map<uint32_t, Header> uidHeaders = m_ImapCache->GetHeaders(folder, std::set<uint32_t>({ uid }), false);
-      if (!uidHeaders.empty())
+      p_Headers.push_back(headers.at(i));
+      p_FolderUids.push_back(std::make_pair(folder, uid));
+
+      // copies of the message in other folders are collapsed into this hit, only
+      // list them for hits known to have copies
+      const std::string& collapseKey = collapseKeys.at(i);
+      if (!collapseKey.empty() && hasCollapsed.at(i))
       {
-        p_Headers.push_back(uidHeaders.begin()->second);
-        p_FolderUids.push_back(std::make_pair(folder, uid));
+        const std::vector<std::string>& collapsedDocIds = m_SearchEngine->ListCollapsed(collapseKey);
+        for (const auto& collapsedDocId : collapsedDocIds)
+        {
+          if (collapsedDocId == docIds.at(i)) continue;
+
+          p_DuplicateFolders[std::make_pair(folder, uid)].insert(GetFolderFromDocId(collapsedDocId));
+        }
       }
     }
   }
 }
 
+UidSet ImapIndex::GetUnindexedUids(const std::string& p_Folder, const UidSet& p_Uids)
+{
+  LOG_DEBUG_FUNC(STR(p_Folder, p_Uids.size()));
+
+  if (!m_SearchEngine) return p_Uids;
+
+  // list the folder's doc ids in one term walk, rather than looking up each uid
+  const std::string prefix = p_Folder + "_";
+  std::vector<uint32_t> indexedUids;
+  for (const auto& docId : m_SearchEngine->ListDocIds(prefix))
+  {
+    // skip doc ids of other folders sharing the prefix
+    const std::string uidStr = docId.substr(prefix.size());
+    if (uidStr.empty() || (uidStr.find_first_not_of("0123456789") != std::string::npos)) continue;
+
+    indexedUids.push_back(GetUidFromDocId(docId));
+  }
+
+  std::sort(indexedUids.begin(), indexedUids.end());
+  return p_Uids - UidSet(indexedUids.begin(), indexedUids.end());
+}
+
 void ImapIndex::Process()
 {
   LOG_DEBUG("start process");
 
+  SetThreadBackgroundPriority(s_Nice);
+
   AddressBook::Init(Util::GetAddressBookEncrypt(), m_Pass);
 
   InitCacheIndexDir();
   if (m_CacheIndexEncrypt)
   {
     InitCacheTempDir();
-    CacheUtil::DecryptCacheDir(m_Pass, GetCacheIndexDbDir(), GetCacheIndexDbTempDir());
+    const bool isLegacyDir = Util::Exists(GetCacheIndexDbDir());
+    if (isLegacyDir)
+    {
+      // migrate index encrypted as whole files to segments on first commit
+      CacheUtil::DecryptCacheDir(m_Pass, GetCacheIndexDbDir(), GetCacheIndexDbTempDir());
+      m_Dirty = true;
+    }
+    else if (!CacheUtil::DecryptSegmentDir(m_Pass, GetCacheIndexSegmentDir(), GetCacheIndexDbTempDir(),
+                                           m_SegmentManifests))
+    {
+      LOG_WARNING("failed to decrypt search index, rebuilding");
+      InitCacheTempDir();
+      Util::RmDir(GetCacheIndexSegmentDir());
+      Util::MkDir(GetCacheIndexSegmentDir());
+      Util::DeleteFile(GetWatermarksPath());
+      m_SegmentManifests.clear();
+    }
+
     m_SearchEngine.reset(new SearchEngine(GetCacheIndexDbTempDir()));
+    if (isLegacyDir)
+    {
+      HandleCommit(true, true);
+      if (!m_Dirty)
+      {
+        Util::RmDir(GetCacheIndexDbDir());
+      }
+    }
   }
   else
   {
     m_SearchEngine.reset(new SearchEngine(GetCacheIndexDbDir()));
   }
 
+  LoadWatermarks();
+  StartupProfile::Mark("index open");
+
   LOG_DEBUG("entering loop");
   while (m_Running)
   {
     std::unique_lock<std::mutex> lock(m_ProcessMutex);
 
-    while (m_Running && !(m_IsIdle && (!m_Queue.empty() || !m_SyncDone)))
+    while (m_Running && m_Queue.empty() && m_SyncDone)
     {
       ClearStatus(Status::FlagIndexing);
+      m_IsDone = true;
+      m_DoneCondVar.notify_all();
       m_ProcessCondVar.wait(lock);
+
+      // time spent waiting idle is not work to throttle for
+      m_WorkStart = std::chrono::steady_clock::time_point();
+    }
+
+    m_IsDone = false;
+
+    if (!m_Running)
+    {
+      lock.unlock();
+      break;
     }
 
+    lock.unlock();
+    Throttle();
+    lock.lock();
+
     if (!m_Running)
     {
       lock.unlock();
       break;
     }
 
-    if (m_IsIdle && !m_SyncDone)
+    if (!m_SyncDone)
     {
       m_SyncDone = true;
       lock.unlock();
       HandleSyncEnqueue();
+      StartupProfile::Mark("index sync enqueued");
       continue;
     }
 
-    if (m_IsIdle && !m_Queue.empty())
+    if (!m_Queue.empty())
     {
       Notify notify = m_Queue.front();
       m_Queue.pop();
@@ -227,21 +407,37 @@ void ImapIndex::Process()
 
       HandleNotify(notify);
       HandleCommit(isQueueEmpty);
+
+      if (isQueueEmpty && m_SyncDone)
+      {
+        StartupProfile::Mark("index sync done");
+      }
     }
   }
 
   LOG_DEBUG("exiting loop");
 
-  HandleCommit(true);
+  {
+    std::unique_lock<std::mutex> lock(m_ProcessMutex);
+    m_DoneCondVar.notify_all();
+  }
 
-  m_SearchEngine.reset();
+  HandleCommit(true, true);
   if (m_CacheIndexEncrypt && m_Dirty)
   {
-    Util::RmDir(GetCacheIndexDbDir());
-    Util::MkDir(GetCacheIndexDbDir());
-    CacheUtil::EncryptCacheDir(m_Pass, GetCacheIndexDbTempDir(), GetCacheIndexDbDir());
+    // index snapshot on disk predates the watermarks, reconcile all folders on next start
+    Util::DeleteFile(GetWatermarksPath());
+  }
+  else
+  {
+    SaveWatermarks();
+  }
+
+  m_SearchEngine.reset();
+  if (m_CacheIndexEncrypt)
+  {
+    // encrypted segments are already in sync as of the last commit
     CleanupCacheTempDir();
-    m_Dirty = false;
   }
 
   AddressBook::Cleanup();
@@ -249,6 +445,49 @@ void ImapIndex::Process()
   LOG_DEBUG("exit process");
 }
 
+void ImapIndex::Throttle()
+{
+  // limit cpu share by sleeping in proportion to time worked since last call
+  std::chrono::milliseconds sleepTime(0);
+  if ((s_CpuShare < 100) && (m_WorkStart != std::chrono::steady_clock::time_point()))
+  {
+    const std::chrono::milliseconds workTime = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - m_WorkStart);
+    sleepTime = (workTime * (100 - s_CpuShare)) / s_CpuShare;
+  }
+
+  std::unique_lock<std::mutex> lock(m_ProcessMutex);
+  if (sleepTime.count() > 0)
+  {
+    m_ProcessCondVar.wait_for(lock, sleepTime, [&]() { return !m_Running; });
+  }
+
+  // pause while user is active, and yield to cache writes while imap is not idle
+  const int64_t waitStartMs = GetSteadyTimeMs();
+  while (m_Running)
+  {
+    const int64_t nowMs = GetSteadyTimeMs();
+    const int64_t userPauseMs = (m_LastUserActivity + s_UserActivityPauseMs) - nowMs;
+    int64_t waitMs = 0;
+    if (userPauseMs > 0)
+    {
+      waitMs = userPauseMs;
+    }
+    else if (!m_IsIdle && ((nowMs - waitStartMs) < s_CacheWriteMaxWaitMs) && m_ImapCache->IsWriteBusy())
+    {
+      waitMs = 100;
+    }
+    else
+    {
+      break;
+    }
+
+    m_ProcessCondVar.wait_for(lock, std::chrono::milliseconds(waitMs), [&]() { return !m_Running; });
+  }
+
+  m_WorkStart = std::chrono::steady_clock::now();
+}
+
 void ImapIndex::HandleNotify(const Notify& p_Notify)
 {
   if (!p_Notify.m_SetFolders.empty())
@@ -301,15 +540,31 @@ void ImapIndex::HandleNotify(const Notify& p_Notify)
   }
   else if (!p_Notify.m_SetBodys.empty())
   {
-    for (const auto& uid : p_Notify.m_SetBodys)
+    size_t count = 0;
+    for (auto it = p_Notify.m_SetBodys.begin(); it != p_Notify.m_SetBodys.end(); ++it)
     {
+      if ((++count % s_ThrottleBatchSize) == 0)
+      {
+        Throttle();
+        if (!m_Running)
+        {
+          // requeue remaining uids, so the folder is not considered in sync on exit
+          Notify notifyRemaining;
+          notifyRemaining.m_Folder = p_Notify.m_Folder;
+          notifyRemaining.m_SetBodys = UidSet(it, p_Notify.m_SetBodys.end());
+          std::unique_lock<std::mutex> lock(m_ProcessMutex);
+          m_Queue.push(notifyRemaining);
+          break;
+        }
+      }
+
       // add specified uid to index
-      AddMessage(p_Notify.m_Folder, uid);
+      AddMessage(p_Notify.m_Folder, *it);
     }
   }
 }
 
-void ImapIndex::HandleCommit(bool p_ForceCommit)
+void ImapIndex::HandleCommit(bool p_ForceCommit, bool p_ForceSync)
 {
   // commit
   static std::chrono::time_point<std::chrono::system_clock> lastCommit =
@@ -321,13 +576,49 @@ void ImapIndex::HandleCommit(bool p_ForceCommit)
     LOG_DEBUG("commit");
     m_SearchEngine->Commit();
     lastCommit = std::chrono::system_clock::now();
+
+    // changed files have to be re-read to find their changed segments, so segment sync is
+    // done less often than commits, each sync stores a complete snapshot and commits done
+    // after it are lost on crash, which is recovered from watermarks
+    static std::chrono::time_point<std::chrono::system_clock> lastSync = std::chrono::system_clock::now();
+    std::chrono::duration<double> secsSinceLastSync = std::chrono::system_clock::now() - lastSync;
+    if (m_CacheIndexEncrypt && m_Dirty && (p_ForceSync || (secsSinceLastSync.count() >= 60.0f)))
+    {
+      // persist only segments changed since last sync, as a new snapshot
+      if (CacheUtil::SyncSegmentDir(m_Pass, GetCacheIndexDbTempDir(), GetCacheIndexSegmentDir(),
+                                    m_SegmentManifests))
+      {
+        m_Dirty = false;
+        lastSync = std::chrono::system_clock::now();
+      }
+    }
   }
 }
 
 void ImapIndex::HandleSyncEnqueue()
 {
   LOG_DEBUG("sync enqueue start");
-  std::map<std::string, std::set<uint32_t>> docFolderUids;
+
+  // only reconcile folders whose cached bodys changed since the index was last in sync
+  const std::map<std::string, uint64_t> generations = m_ImapCache->GetBodysGenerations();
+  std::set<std::string> syncFolders;
+  for (const auto& generation : generations)
+  {
+    auto it = m_Watermarks.find(generation.first);
+    if ((it == m_Watermarks.end()) || (it->second != generation.second))
+    {
+      syncFolders.insert(generation.first);
+    }
+  }
+
+  LOG_DEBUG("sync folders %d of %d", (int)syncFolders.size(), (int)generations.size());
+  if (syncFolders.empty())
+  {
+    LOG_DEBUG("sync enqueue end");
+    return;
+  }
+
+  std::map<std::string, UidSet> docFolderUids;
   const std::vector<std::string>& docIds = m_SearchEngine->List();
   for (const auto& docId : docIds)
   {
@@ -336,20 +627,19 @@ void ImapIndex::HandleSyncEnqueue()
     docFolderUids[folder].insert(uid);
   }
 
-  const std::set<std::string>& folders = m_ImapCache->GetFolders();
-  for (const auto& folder : folders)
+  for (const auto& folder : syncFolders)
   {
-    const std::set<uint32_t>& uids = m_ImapCache->GetUids(folder);
-    const std::set<uint32_t>& bodyUids = MapKey(m_ImapCache->GetBodys(folder, uids, true /* p_Prefetch */));
-    const std::set<uint32_t>& docUids = docFolderUids[folder];
-    std::set<uint32_t> uidsToAdd = bodyUids - docUids; // present in cache, but not in index
-    std::set<uint32_t> uidsToDel = docUids - bodyUids; // present in index, but not in cache
+    const UidSet& uids = m_ImapCache->GetUids(folder);
+    const UidSet& bodyUids = MapKey(m_ImapCache->GetBodys(folder, uids, true /* p_Prefetch */));
+    const UidSet& docUids = docFolderUids[folder];
+    UidSet uidsToAdd = bodyUids - docUids; // present in cache, but not in index
+    UidSet uidsToDel = docUids - bodyUids; // present in index, but not in cache
 
     std::unique_lock<std::mutex> lock(m_ProcessMutex);
     if (!uidsToAdd.empty())
     {
       const int maxAdd = 10;
-      std::set<uint32_t> subsetUids;
+      UidSet subsetUids;
       for (auto it = uidsToAdd.begin(); it != uidsToAdd.end(); ++it)
       {
         subsetUids.insert(*it);
@@ -379,6 +669,51 @@ void ImapIndex::HandleSyncEnqueue()
   LOG_DEBUG("sync enqueue end");
 }
 
+void ImapIndex::LoadWatermarks()
+{
+  const std::string& path = GetWatermarksPath();
+  if (!Util::Exists(path)) return;
+
+  const std::string& data = Util::ReadFile(path);
+  m_Watermarks = Serialization::FromString<std::map<std::string, uint64_t>>(
+    m_CacheIndexEncrypt ? Crypto::AESDecrypt(data, m_Pass) : data);
+  LOG_DEBUG("loaded %d watermarks", (int)m_Watermarks.size());
+}
+
+void ImapIndex::SaveWatermarks()
+{
+  std::map<std::string, uint64_t> watermarks;
+  {
+    std::unique_lock<std::mutex> lock(m_ProcessMutex);
+    if (!m_SyncDone)
+    {
+      // index not reconciled this session, keep stored watermarks as-is
+      return;
+    }
+
+    watermarks = m_ImapCache->GetBodysGenerations();
+
+    // folders with unprocessed notifications are not in sync
+    std::queue<Notify> queue = m_Queue;
+    while (!queue.empty())
+    {
+      const Notify& notify = queue.front();
+      if (!notify.m_SetFolders.empty())
+      {
+        watermarks.clear();
+        break;
+      }
+
+      watermarks.erase(notify.m_Folder);
+      queue.pop();
+    }
+  }
+
+  const std::string& data = Serialization::ToString(watermarks);
+  Util::WriteFile(GetWatermarksPath(), m_CacheIndexEncrypt ? Crypto::AESEncrypt(data, m_Pass) : data);
+  LOG_DEBUG("saved %d watermarks", (int)watermarks.size());
+}
+
 void ImapIndex::AddMessage(const std::string& p_Folder, uint32_t p_Uid)
 {
   LOG_TRACE_FUNC(STR(p_Folder, p_Uid));
@@ -386,8 +721,8 @@ void ImapIndex::AddMessage(const std::string& p_Folder, uint32_t p_Uid)
   const std::string& docId = GetDocId(p_Folder, p_Uid);
   if (!m_SearchEngine->Exists(docId))
   {
-    const std::map<uint32_t, Body>& uidBodys = m_ImapCache->GetBodys(p_Folder, std::set<uint32_t>({ p_Uid }), false);
-    const std::map<uint32_t, Header>& uidHeaders = m_ImapCache->GetHeaders(p_Folder, std::set<uint32_t>(
+    const std::map<uint32_t, Body>& uidBodys = m_ImapCache->GetBodys(p_Folder, UidSet({ p_Uid }), false);
+    const std::map<uint32_t, Header>& uidHeaders = m_ImapCache->GetHeaders(p_Folder, UidSet(
                                                                              { p_Uid }), false);
 
     if (!uidBodys.empty() && !uidHeaders.empty())
@@ -401,8 +736,13 @@ void ImapIndex::AddMessage(const std::string& p_Folder, uint32_t p_Uid)
       const std::string& from = header.GetFrom();
       const std::string& to = header.GetTo() + " " + header.GetCc() + " " + header.GetBcc();
 
+      const std::map<uint32_t, uint32_t>& uidFlags = m_ImapCache->GetFlags(p_Folder, UidSet({ p_Uid }));
+      const bool seen = !uidFlags.empty() && Flag::GetSeen(uidFlags.begin()->second);
+      const std::string& summary = GetSummary(p_Folder, p_Uid, header, seen);
+      const std::string& collapseKey = header.GetDedupKey();
+
       LOG_DEBUG("add %s", docId.c_str());
-      m_SearchEngine->Index(docId, timeStamp, bodyText, subject, from, to, p_Folder);
+      m_SearchEngine->Index(docId, timeStamp, bodyText, subject, from, to, p_Folder, summary, collapseKey);
       m_Dirty = true;
 
       // @todo: decouple addressbook population from cache index
@@ -411,6 +751,30 @@ void ImapIndex::AddMessage(const std::string& p_Folder, uint32_t p_Uid)
   }
 }
 
+std::string ImapIndex::GetSummary(const std::string& p_Folder, uint32_t p_Uid, const Header& p_Header, bool p_Seen)
+{
+  SearchSummary summary;
+  summary.m_Version = s_SummaryVersion;
+  summary.m_TimeStamp = p_Header.GetTimeStamp();
+  summary.m_ShortFrom = p_Header.GetShortFrom();
+  summary.m_ShortTo = p_Header.GetShortTo();
+  summary.m_Subject = p_Header.GetSubject();
+  summary.m_HasAttachments = p_Header.GetHasAttachments();
+  summary.m_Seen = p_Seen;
+  summary.m_Folder = p_Folder;
+  summary.m_Uid = p_Uid;
+  return Serialization::ToString(summary);
+}
+
+bool ImapIndex::ParseSummary(const std::string& p_Data, SearchSummary& p_Summary)
+{
+  // documents indexed before summaries were introduced have no summary
+  if (p_Data.empty()) return false;
+
+  p_Summary = Serialization::FromString<SearchSummary>(p_Data);
+  return (p_Summary.m_Version == s_SummaryVersion);
+}
+
 std::string ImapIndex::GetDocId(const std::string& p_Folder, const uint32_t p_Uid)
 {
   return p_Folder + "_" + std::to_string(p_Uid);
@@ -453,17 +817,27 @@ std::string ImapIndex::GetCacheIndexDbDir()
   return CacheUtil::GetCacheDir() + std::string("searchindex/db/");
 }
 
+std::string ImapIndex::GetCacheIndexSegmentDir()
+{
+  return CacheUtil::GetCacheDir() + std::string("searchindex/segments/");
+}
+
 std::string ImapIndex::GetCacheIndexDbTempDir()
 {
   return Util::GetTempDir() + std::string("searchindexdb/");
 }
 
+std::string ImapIndex::GetWatermarksPath()
+{
+  return CacheUtil::GetCacheDir() + std::string("searchindex/watermarks");
+}
+
 void ImapIndex::InitCacheIndexDir()
 {
-  static const int version = 8; // note: keep synchronized with AddressBook (for now)
+  static const int version = 10; // note: keep synchronized with AddressBook (for now)
   const std::string cacheDir = GetCacheIndexDir();
   CacheUtil::CommonInitCacheDir(cacheDir, version, m_CacheIndexEncrypt);
-  Util::MkDir(GetCacheIndexDbDir());
+  Util::MkDir(m_CacheIndexEncrypt ? GetCacheIndexSegmentDir() : GetCacheIndexDbDir());
 }
 
 void ImapIndex::InitCacheTempDir()
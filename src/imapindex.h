@@ -7,20 +7,27 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <functional>
+#include <map>
 #include <queue>
 #include <set>
 #include <string>
 #include <thread>
 
+#include "cacheutil.h"
 #include "header.h"
 #include "imapcache.h"
 #include "log.h"
 #include "searchengine.h"
 #include "status.h"
+#include "uidset.h"
 #include "util.h"
 
+class ReEncrypt;
+
 class ImapIndex
 {
 public:
@@ -30,36 +37,73 @@ public:
                      const std::function<void(const StatusUpdate&)>& p_StatusHandler);
   virtual ~ImapIndex();
 
-  static bool ChangePass(const bool p_CacheEncrypt,
-                         const std::string& p_OldPass, const std::string& p_NewPass);
+  static void ChangePass(const bool p_CacheEncrypt, ReEncrypt& p_ReEncrypt);
+
+  static void SetSchedParams(uint32_t p_CpuShare, int p_Nice);
 
   void NotifyIdle(bool p_IsIdle);
+  void NotifyUserActivity();
+  void WaitDone();
 
   void SetFolders(const std::set<std::string>& p_Folders);
-  void SetUids(const std::string& p_Folder, const std::set<uint32_t>& p_Uids);
-  void DeleteMessages(const std::string& p_Folder, const std::set<uint32_t>& p_Uids);
-  void SetBodys(const std::string& p_Folder, const std::set<uint32_t>& p_Uids);
+  void SetUids(const std::string& p_Folder, const UidSet& p_Uids);
+  void DeleteMessages(const std::string& p_Folder, const UidSet& p_Uids);
+  void SetBodys(const std::string& p_Folder, const UidSet& p_Uids);
 
   void Search(const std::string& p_QueryStr, const unsigned p_Offset, const unsigned p_Max,
               std::vector<Header>& p_Headers, std::vector<std::pair<std::string, uint32_t>>& p_FolderUids,
+              std::map<std::pair<std::string, uint32_t>, std::set<std::string>>& p_DuplicateFolders,
               bool& p_HasMore);
+  UidSet GetUnindexedUids(const std::string& p_Folder, const UidSet& p_Uids);
 
 private:
+  struct SearchSummary
+  {
+    uint32_t m_Version = 0;
+    int64_t m_TimeStamp = 0;
+    std::string m_ShortFrom;
+    std::string m_ShortTo;
+    std::string m_Subject;
+    bool m_HasAttachments = false;
+    bool m_Seen = false;
+    std::string m_Folder;
+    uint32_t m_Uid = 0;
+
+    template<class Archive>
+    void serialize(Archive& p_Archive)
+    {
+      p_Archive(m_Version,
+                m_TimeStamp,
+                m_ShortFrom,
+                m_ShortTo,
+                m_Subject,
+                m_HasAttachments,
+                m_Seen,
+                m_Folder,
+                m_Uid);
+    }
+  };
+
   struct Notify
   {
     std::set<std::string> m_SetFolders;
     std::string m_Folder;
-    std::set<uint32_t> m_SetUids;
-    std::set<uint32_t> m_DeleteUids;
-    std::set<uint32_t> m_SetBodys;
+    UidSet m_SetUids;
+    UidSet m_DeleteUids;
+    UidSet m_SetBodys;
   };
 
 private:
   void Process();
+  void Throttle();
   void HandleNotify(const Notify& p_Notify);
-  void HandleCommit(bool p_ForceCommit);
+  void HandleCommit(bool p_ForceCommit, bool p_ForceSync = false);
   void HandleSyncEnqueue();
+  void LoadWatermarks();
+  void SaveWatermarks();
   void AddMessage(const std::string& p_Folder, uint32_t p_Uid);
+  static std::string GetSummary(const std::string& p_Folder, uint32_t p_Uid, const Header& p_Header, bool p_Seen);
+  static bool ParseSummary(const std::string& p_Data, SearchSummary& p_Summary);
 
   std::string GetDocId(const std::string& p_Folder, const uint32_t p_Uid);
   std::string GetFolderFromDocId(const std::string& p_DocId);
@@ -67,7 +111,9 @@ private:
 
   static std::string GetCacheIndexDir();
   static std::string GetCacheIndexDbDir();
+  static std::string GetCacheIndexSegmentDir();
   static std::string GetCacheIndexDbTempDir();
+  static std::string GetWatermarksPath();
   void InitCacheIndexDir();
   static void InitCacheTempDir();
   static void CleanupCacheTempDir();
@@ -86,8 +132,17 @@ private:
   std::thread m_Thread;
   std::mutex m_ProcessMutex;
   std::condition_variable m_ProcessCondVar;
+  std::condition_variable m_DoneCondVar;
+  bool m_IsDone = false;
   std::queue<Notify> m_Queue;
   size_t m_QueueSize = 0;
   bool m_Dirty = false;
   bool m_SyncDone = false;
+  std::map<std::string, uint64_t> m_Watermarks;
+  std::map<std::string, CacheUtil::SegmentManifest> m_SegmentManifests;
+  std::atomic<int64_t> m_LastUserActivity{ 0 };
+  std::chrono::steady_clock::time_point m_WorkStart;
+
+  static uint32_t s_CpuShare;
+  static int s_Nice;
 };
@@ -7,10 +7,16 @@
 
 #include "imapmanager.h"
 
+#include <algorithm>
+#include <iterator>
 #include <vector>
 
 #include "auth.h"
+#include "flag.h"
 #include "loghelp.h"
+#include "maphelp.h"
+#include "sethelp.h"
+#include "startupprofile.h"
 #include "util.h"
 
 ImapManager::ImapManager(const std::string& p_User, const std::string& p_Pass,
@@ -29,7 +35,9 @@ ImapManager::ImapManager(const std::string& p_User, const std::string& p_Pass,
                          const std::function<void(const SearchQuery&,
                                                   const SearchResult&)>& p_SearchHandler,
                          const bool p_IdleInbox,
-                         const std::string& p_Inbox)
+                         const std::string& p_Inbox,
+                         const std::vector<std::string>& p_IdleFolders,
+                         const uint32_t p_IdlePoolSize)
   : m_Imap(p_User, p_Pass, p_Host, p_Port, p_Timeout,
            p_CacheEncrypt, p_CacheIndexEncrypt, p_FoldersExclude, p_SniEnabled, p_StatusHandler)
   , m_Connect(p_Connect)
@@ -39,15 +47,22 @@ ImapManager::ImapManager(const std::string& p_User, const std::string& p_Pass,
   , m_SearchHandler(p_SearchHandler)
   , m_IdleInbox(p_IdleInbox)
   , m_Inbox(p_Inbox)
+  , m_IdleFolders(p_IdleFolders)
+  , m_IdlePoolSize(p_IdlePoolSize)
   , m_Connecting(false)
   , m_Running(false)
   , m_CacheRunning(false)
   , m_Aborting(false)
+  , m_SearchGeneration(0)
+  , m_IdlePoolRunning(false)
 {
   LOG_IF_NONZERO(pipe(m_Pipe));
   LOG_IF_NONZERO(pipe(m_CachePipe));
+  LOG_IF_NONZERO(pipe(m_IdlePoolPipe));
+  LOG_IF_NONZERO(pipe(m_IdlePoolStopPipe));
   m_Connecting = m_Connect;
   m_IdleTimeout = std::max(1U, p_IdleTimeout);
+  m_PrefetchScheduler.Load(p_CacheEncrypt, p_Pass);
 }
 
 ImapManager::~ImapManager()
@@ -60,6 +75,8 @@ ImapManager::~ImapManager()
     {
       m_Requests.clear();
       m_PrefetchRequests.clear();
+      m_PrefetchBodyIds.clear();
+      m_PrefetchScheduler.Clear();
       m_Actions.clear();
       m_QueueMutex.unlock();
       LOG_DEBUG("queues cleared");
@@ -99,6 +116,8 @@ ImapManager::~ImapManager()
     }
   }
 
+  StopIdlePool();
+
   {
     std::unique_lock<std::mutex> lock(m_ExitedCacheCondMutex);
 
@@ -128,10 +147,19 @@ ImapManager::~ImapManager()
     m_SearchThread.join();
   }
 
+  {
+    std::lock_guard<std::mutex> lock(m_QueueMutex);
+    m_PrefetchScheduler.Save();
+  }
+
   close(m_Pipe[0]);
   close(m_Pipe[1]);
   close(m_CachePipe[0]);
   close(m_CachePipe[1]);
+  close(m_IdlePoolPipe[0]);
+  close(m_IdlePoolPipe[1]);
+  close(m_IdlePoolStopPipe[0]);
+  close(m_IdlePoolStopPipe[1]);
 }
 
 void ImapManager::Start()
@@ -172,7 +200,7 @@ void ImapManager::PrefetchRequest(const ImapManager::Request& p_Request)
   if (m_Connecting || m_OnceConnected)
   {
     std::lock_guard<std::mutex> lock(m_QueueMutex);
-    m_PrefetchRequests[p_Request.m_PrefetchLevel].push_front(p_Request);
+    AddPrefetchRequest(p_Request);
     PipeWriteOne(m_Pipe);
     ProgressCountRequestAdd(p_Request, true /* p_IsPrefetch */);
   }
@@ -199,14 +227,44 @@ void ImapManager::AsyncAction(const ImapManager::Action& p_Action)
 void ImapManager::AsyncSearch(const SearchQuery& p_SearchQuery)
 {
   std::unique_lock<std::mutex> lock(m_SearchMutex);
-  m_SearchQueue.push_front(p_SearchQuery);
+  SearchQuery searchQuery = p_SearchQuery;
+  if (searchQuery.m_Offset == 0)
+  {
+    // a new query supersedes all queued and in-progress queries
+    searchQuery.m_Generation = ++m_SearchGeneration;
+    m_SearchQueue.clear();
+  }
+  else
+  {
+    searchQuery.m_Generation = m_SearchGeneration;
+  }
+
+  m_SearchQueue.push_back(searchQuery);
   m_SearchCond.notify_one();
 }
 
 void ImapManager::SyncSearch(const SearchQuery& p_SearchQuery, SearchResult& p_SearchResult)
 {
   m_Imap.Search(p_SearchQuery.m_QueryStr, p_SearchQuery.m_Offset, p_SearchQuery.m_Max,
-                p_SearchResult.m_Headers, p_SearchResult.m_FolderUids, p_SearchResult.m_HasMore);
+                p_SearchResult.m_Headers, p_SearchResult.m_FolderUids, p_SearchResult.m_DuplicateFolders,
+                p_SearchResult.m_HasMore);
+}
+
+void ImapManager::NotifyUserActivity()
+{
+  m_Imap.IndexNotifyUserActivity();
+}
+
+void ImapManager::NotifyMessageOpened(const std::string& p_Sender)
+{
+  std::lock_guard<std::mutex> lock(m_QueueMutex);
+  m_PrefetchScheduler.NotifyMessageOpened(p_Sender);
+}
+
+void ImapManager::NotifyMessageListCursor(const std::string& p_Folder, int32_t p_ListIndex)
+{
+  std::lock_guard<std::mutex> lock(m_QueueMutex);
+  m_PrefetchScheduler.NotifyCursor(p_Folder, p_ListIndex);
 }
 
 void ImapManager::SetCurrentFolder(const std::string& p_Folder)
@@ -214,6 +272,9 @@ void ImapManager::SetCurrentFolder(const std::string& p_Folder)
   m_Mutex.lock();
   m_CurrentFolder = p_Folder;
   m_Mutex.unlock();
+
+  std::lock_guard<std::mutex> lock(m_QueueMutex);
+  m_PrefetchScheduler.NotifyFolderVisit(p_Folder);
 }
 
 bool ImapManager::ProcessIdle()
@@ -225,7 +286,7 @@ bool ImapManager::ProcessIdle()
 
   bool rv = true;
   static bool firstIdle = true;
-  std::set<uint32_t> uids;
+  UidSet uids;
   Imap::FolderInfo lastFolderInfo = m_Imap.GetFolderInfo(m_CurrentFolder);
   if (!lastFolderInfo.IsValid())
   {
@@ -294,6 +355,39 @@ bool ImapManager::ProcessIdle()
     return rv;
   }
 
+  // other watched folders are covered by notify if supported, otherwise by an idle
+  // connection pool, and the remainder by periodic status polling
+  std::set<std::string> watchFolders;
+  std::vector<std::string> watchFoldersOrdered;
+  for (const auto& folder : m_IdleFolders)
+  {
+    if ((folder != idleFolder) && watchFolders.insert(folder).second)
+    {
+      watchFoldersOrdered.push_back(folder);
+    }
+  }
+
+  bool isNotify = false;
+  std::set<std::string> pollFolders;
+  if (!watchFolders.empty())
+  {
+    isNotify = m_Imap.NotifySet(watchFolders);
+    if (!isNotify)
+    {
+      StartIdlePool(watchFoldersOrdered);
+      std::lock_guard<std::mutex> lock(m_IdlePoolMutex);
+      pollFolders = watchFolders - m_IdlePoolFolders;
+    }
+
+    if (!CheckIdleFolders(watchFolders))
+    {
+      return false;
+    }
+  }
+
+  static const int pollIntervalSec = 120;
+  std::chrono::steady_clock::time_point lastPollTime = std::chrono::steady_clock::now();
+
   LOG_DEBUG("entering idle");
   SetStatus(Status::FlagIdle);
   while (m_Running)
@@ -310,10 +404,23 @@ bool ImapManager::ProcessIdle()
     FD_SET(m_Pipe[0], &fds);
     FD_SET(idlefd, &fds);
     int maxfd = std::max(m_Pipe[0], idlefd);
-    struct timeval idletv = {GetIdleDurationSec(), 0};
+    if (m_IdlePoolRunning)
+    {
+      FD_SET(m_IdlePoolPipe[0], &fds);
+      maxfd = std::max(maxfd, m_IdlePoolPipe[0]);
+    }
+
+    int idleDuration = GetIdleDurationSec();
+    if (!pollFolders.empty())
+    {
+      idleDuration = std::min(idleDuration, pollIntervalSec);
+    }
+
+    struct timeval idletv = {idleDuration, 0};
     int selrv = select(maxfd + 1, &fds, NULL, NULL, &idletv);
 
-    bool idleRv = m_Imap.IdleDone();
+    Imap::IdleChanges idleChanges;
+    bool idleRv = m_Imap.IdleDone(&idleChanges);
     if (!idleRv)
     {
       LOG_DEBUG("idle fail");
@@ -340,73 +447,129 @@ bool ImapManager::ProcessIdle()
     else if (FD_ISSET(idlefd, &fds))
     {
       LOG_DEBUG("idle notification");
-
-      int len = 0;
-      ioctl(idlefd, FIONREAD, &len);
-      if (len > 0)
-      {
-        std::vector<char> buf(len);
-        LOG_IF_NOT_EQUAL(read(idlefd, &buf[0], len), len);
-      }
     }
 
-    const Imap::FolderInfo newFolderInfo = m_Imap.GetFolderInfo(idleFolder);
-    if (!newFolderInfo.IsValid())
+    if (idleChanges.m_Resolved)
     {
-      LOG_WARNING("idle folder info failed");
-      rv = false;
-      break;
-    }
-
-    if (!lastFolderInfo.IsUnseenEqual(newFolderInfo) || !lastFolderInfo.IsUidsEqual(newFolderInfo))
-    {
-      // Check flags if unseen or uids don't match (after uid fetch)
-
-      SetStatus(Status::FlagFetching, 0);
-
-      rv = true;
-      if (!lastFolderInfo.IsUidsEqual(newFolderInfo))
+      // untagged responses received while idle were applied to cache, only new uids were fetched
+      if (!idleChanges.m_NewUids.empty() || !idleChanges.m_ExpungedUids.empty())
       {
-        LOG_DEBUG("idle fetch uids");
+        LOG_DEBUG_VAR("idle new uids =", idleChanges.m_NewUids);
+        LOG_DEBUG_VAR("idle expunged uids =", idleChanges.m_ExpungedUids);
+        uids = idleChanges.m_Uids;
 
-        // Check mail if uids don't match
         Request uidsRequest;
         uidsRequest.m_Folder = idleFolder;
         uidsRequest.m_GetUids = true;
         Response uidsResponse;
-        rv = PerformRequest(uidsRequest, false /* p_Cached */, false /* p_Prefetch */, uidsResponse);
-        if (rv)
-        {
-          SendRequestResponse(uidsRequest, uidsResponse);
-          uids = uidsResponse.m_Uids;
-        }
+        uidsResponse.m_Folder = idleFolder;
+        uidsResponse.m_Uids = uids;
+        SendRequestResponse(uidsRequest, uidsResponse);
+
+        // folder info no longer matches, resync fully if a later change can not be resolved
+        lastFolderInfo = Imap::FolderInfo();
       }
 
-      if (rv) // Dont continue if previous fetch failed
+      if (!idleChanges.m_Flags.empty())
       {
-        LOG_DEBUG("idle fetch flags");
-
-        // Check flags
         Request flagsRequest;
         flagsRequest.m_Folder = idleFolder;
-        flagsRequest.m_GetFlags = uids;
+        flagsRequest.m_GetFlags = MapKey(idleChanges.m_Flags);
         Response flagsResponse;
-        rv = PerformRequest(flagsRequest, false /* p_Cached */, false /* p_Prefetch */, flagsResponse);
-        if (rv)
-        {
-          SendRequestResponse(flagsRequest, flagsResponse);
-        }
+        flagsResponse.m_Folder = idleFolder;
+        flagsResponse.m_Flags = idleChanges.m_Flags;
+        SendRequestResponse(flagsRequest, flagsResponse);
       }
+    }
 
-      ClearStatus(Status::FlagFetching);
-
-      if (!rv)
+    // reconcile with folder status on idle timeout too, to catch changes not announced while idle
+    if (!idleChanges.m_Resolved || (selrv == 0))
+    {
+      const Imap::FolderInfo newFolderInfo = m_Imap.GetFolderInfo(idleFolder);
+      if (!newFolderInfo.IsValid())
       {
+        LOG_WARNING("idle folder info failed");
+        rv = false;
         break;
       }
+
+      if (!lastFolderInfo.IsUnseenEqual(newFolderInfo) || !lastFolderInfo.IsUidsEqual(newFolderInfo))
+      {
+        // Check flags if unseen or uids don't match (after uid fetch)
+
+        SetStatus(Status::FlagFetching, 0);
+
+        rv = true;
+        if (!lastFolderInfo.IsUidsEqual(newFolderInfo))
+        {
+          LOG_DEBUG("idle fetch uids");
+
+          // Check mail if uids don't match
+          Request uidsRequest;
+          uidsRequest.m_Folder = idleFolder;
+          uidsRequest.m_GetUids = true;
+          Response uidsResponse;
+          rv = PerformRequest(uidsRequest, false /* p_Cached */, false /* p_Prefetch */, uidsResponse);
+          if (rv)
+          {
+            SendRequestResponse(uidsRequest, uidsResponse);
+            uids = uidsResponse.m_Uids;
+          }
+        }
+
+        if (rv) // Dont continue if previous fetch failed
+        {
+          LOG_DEBUG("idle fetch flags");
+
+          // Check flags
+          Request flagsRequest;
+          flagsRequest.m_Folder = idleFolder;
+          flagsRequest.m_GetFlags = uids;
+          Response flagsResponse;
+          rv = PerformRequest(flagsRequest, false /* p_Cached */, false /* p_Prefetch */, flagsResponse);
+          if (rv)
+          {
+            SendRequestResponse(flagsRequest, flagsResponse);
+          }
+        }
+
+        ClearStatus(Status::FlagFetching);
+
+        if (!rv)
+        {
+          break;
+        }
+      }
+
+      lastFolderInfo = newFolderInfo;
+    }
+
+    std::set<std::string> checkFolders;
+    if (isNotify && (selrv > 0) && FD_ISSET(idlefd, &fds))
+    {
+      checkFolders = watchFolders;
+    }
+
+    if (m_IdlePoolRunning && (selrv > 0) && FD_ISSET(m_IdlePoolPipe[0], &fds))
+    {
+      PipeReadAll(m_IdlePoolPipe);
+      std::lock_guard<std::mutex> lock(m_IdlePoolMutex);
+      checkFolders.insert(m_IdlePoolChangedFolders.begin(), m_IdlePoolChangedFolders.end());
+      m_IdlePoolChangedFolders.clear();
+    }
+
+    const std::chrono::steady_clock::time_point nowTime = std::chrono::steady_clock::now();
+    if (!pollFolders.empty() && ((nowTime - lastPollTime) >= std::chrono::seconds(pollIntervalSec)))
+    {
+      checkFolders.insert(pollFolders.begin(), pollFolders.end());
+      lastPollTime = nowTime;
     }
 
-    lastFolderInfo = newFolderInfo;
+    if (!CheckIdleFolders(checkFolders))
+    {
+      rv = false;
+      break;
+    }
   }
 
   ClearStatus(Status::FlagIdle);
@@ -431,6 +594,164 @@ int ImapManager::GetIdleDurationSec()
   return idleDuration;
 }
 
+bool ImapManager::CheckIdleFolders(const std::set<std::string>& p_Folders)
+{
+  if (p_Folders.empty()) return true;
+
+  std::map<std::string, Imap::FolderInfo> folderInfos;
+  if (!m_Imap.GetFolderInfos(p_Folders, folderInfos))
+  {
+    LOG_WARNING("idle folders info failed");
+    return false;
+  }
+
+  for (const auto& folderInfo : folderInfos)
+  {
+    if (!folderInfo.second.IsValid()) continue;
+
+    auto it = m_IdleFolderInfos.find(folderInfo.first);
+    if ((it != m_IdleFolderInfos.end()) && it->second.IsUidsEqual(folderInfo.second) &&
+        it->second.IsUnseenEqual(folderInfo.second)) continue;
+
+    LOG_DEBUG("idle folder changed %s", folderInfo.first.c_str());
+    if (!FetchFolderUidsAndFlags(folderInfo.first))
+    {
+      return false;
+    }
+
+    m_IdleFolderInfos[folderInfo.first] = folderInfo.second;
+  }
+
+  return true;
+}
+
+bool ImapManager::FetchFolderUidsAndFlags(const std::string& p_Folder)
+{
+  SetStatus(Status::FlagFetching, 0);
+
+  Request uidsRequest;
+  uidsRequest.m_Folder = p_Folder;
+  uidsRequest.m_GetUids = true;
+  Response uidsResponse;
+  bool rv = PerformRequest(uidsRequest, false /* p_Cached */, false /* p_Prefetch */, uidsResponse);
+  if (rv)
+  {
+    SendRequestResponse(uidsRequest, uidsResponse);
+
+    Request flagsRequest;
+    flagsRequest.m_Folder = p_Folder;
+    flagsRequest.m_GetFlags = uidsResponse.m_Uids;
+    Response flagsResponse;
+    rv = PerformRequest(flagsRequest, false /* p_Cached */, false /* p_Prefetch */, flagsResponse);
+    if (rv)
+    {
+      SendRequestResponse(flagsRequest, flagsResponse);
+    }
+  }
+
+  ClearStatus(Status::FlagFetching);
+
+  return rv;
+}
+
+void ImapManager::StartIdlePool(const std::vector<std::string>& p_Folders)
+{
+  if (m_IdlePoolRunning || (m_IdlePoolSize == 0)) return;
+
+  m_IdlePoolRunning = true;
+  std::lock_guard<std::mutex> lock(m_IdlePoolMutex);
+  for (const auto& folder : p_Folders)
+  {
+    if (m_IdlePoolFolders.size() >= m_IdlePoolSize) break;
+
+    m_IdlePoolFolders.insert(folder);
+    m_IdlePoolThreads.emplace_back(&ImapManager::IdlePoolProcess, this, folder);
+  }
+
+  LOG_DEBUG("idle pool started with %zu connections", m_IdlePoolThreads.size());
+}
+
+void ImapManager::StopIdlePool()
+{
+  if (!m_IdlePoolRunning) return;
+
+  // pool threads never read the stop pipe, so a single write wakes all of them
+  m_IdlePoolRunning = false;
+  PipeWriteOne(m_IdlePoolStopPipe);
+  for (auto& thread : m_IdlePoolThreads)
+  {
+    thread.join();
+  }
+
+  m_IdlePoolThreads.clear();
+  LOG_DEBUG("idle pool stopped");
+}
+
+void ImapManager::IdlePoolProcess(const std::string p_Folder)
+{
+  THREAD_REGISTER();
+  LOG_DEBUG_FUNC(STR(p_Folder));
+
+  static const int retrySec = 60;
+  std::unique_ptr<Imap> session = m_Imap.CreateSession();
+  bool connected = false;
+  while (m_IdlePoolRunning)
+  {
+    int idlefd = -1;
+    if (!connected)
+    {
+      connected = session->Login();
+    }
+
+    if (connected)
+    {
+      idlefd = session->IdleStart(p_Folder);
+      if (idlefd == -1)
+      {
+        session->Logout();
+        connected = false;
+      }
+    }
+
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(m_IdlePoolStopPipe[0], &fds);
+    int maxfd = m_IdlePoolStopPipe[0];
+    if (idlefd != -1)
+    {
+      FD_SET(idlefd, &fds);
+      maxfd = std::max(maxfd, idlefd);
+    }
+
+    struct timeval idletv = {(idlefd != -1) ? GetIdleDurationSec() : retrySec, 0};
+    int selrv = select(maxfd + 1, &fds, NULL, NULL, &idletv);
+    if (idlefd == -1) continue;
+
+    // pending untagged responses are parsed and discarded by idle done
+    const bool isNotified = (selrv > 0) && FD_ISSET(idlefd, &fds);
+    if (!session->IdleDone())
+    {
+      LOG_DEBUG("idle pool fail %s", p_Folder.c_str());
+      session->Logout();
+      connected = false;
+      continue;
+    }
+
+    if (isNotified && m_IdlePoolRunning)
+    {
+      LOG_DEBUG("idle pool notification %s", p_Folder.c_str());
+      std::lock_guard<std::mutex> lock(m_IdlePoolMutex);
+      m_IdlePoolChangedFolders.insert(p_Folder);
+      PipeWriteOne(m_IdlePoolPipe);
+    }
+  }
+
+  if (connected)
+  {
+    session->Logout();
+  }
+}
+
 void ImapManager::ProcessIdleOffline()
 {
   LOG_TRACE_FUNC("");
@@ -463,6 +784,7 @@ void ImapManager::Process()
     {
       SetStatus(Status::FlagConnected);
       m_OnceConnected = true;
+      StartupProfile::Mark("imap login");
     }
     else
     {
@@ -491,7 +813,8 @@ void ImapManager::Process()
 
     int selrv = 1;
     m_QueueMutex.lock();
-    bool isQueueEmpty = m_Requests.empty() && m_PrefetchRequests.empty() && m_Actions.empty();
+    bool isQueueEmpty = m_Requests.empty() && !m_PrefetchScheduler.HasReady() && m_Actions.empty() &&
+      m_ServerSearches.empty();
     m_QueueMutex.unlock();
 
     if (isQueueEmpty || !m_OnceConnected)
@@ -524,49 +847,79 @@ void ImapManager::Process()
 
       while (m_Running && !authRefreshNeeded &&
              m_OnceConnected &&
-             (!m_Requests.empty() || !m_PrefetchRequests.empty() || !m_Actions.empty()))
+             (!m_Requests.empty() || m_PrefetchScheduler.HasReady() || !m_Actions.empty() ||
+              !m_ServerSearches.empty()))
       {
         bool isConnected = true;
         float progress = 0;
 
         while (!m_Actions.empty() && m_Running && isConnected && !authRefreshNeeded)
         {
-          Action action = m_Actions.front();
-          m_Actions.pop_front();
+          std::vector<Action> actions = PopActions();
           m_QueueMutex.unlock();
 
-          bool result = PerformAction(action);
+          const std::vector<bool> results = PerformActions(actions);
 
-          bool retry = false;
-          if (!result)
+          std::vector<Action> retryActions;
+          for (size_t i = 0; i < actions.size(); ++i)
           {
-            if (!CheckConnectivity())
+            Action& action = actions.at(i);
+            const bool result = results.at(i);
+
+            bool retry = false;
+            if (!result)
             {
-              LOG_WARNING("action failed due to connection lost");
-              SetStatus(Status::FlagConnecting);
-              isConnected = false;
+              if (isConnected && !CheckConnectivity())
+              {
+                LOG_WARNING("action failed due to connection lost");
+                SetStatus(Status::FlagConnecting);
+                isConnected = false;
+              }
+              else if (isConnected && (action.m_TryCount < 2))
+              {
+                ++action.m_TryCount;
+                LOG_WARNING("action retry %d", action.m_TryCount);
+                retry = true;
+              }
             }
-            else if (action.m_TryCount < 2)
+
+            if (retry)
             {
-              ++action.m_TryCount;
-              LOG_WARNING("action retry %d", action.m_TryCount);
-              retry = true;
+              retryActions.push_back(action);
+            }
+            else
+            {
+              SendActionResult(action, result);
             }
           }
 
-          if (!retry)
+          authRefreshNeeded = AuthRefreshNeeded();
+
+          m_QueueMutex.lock();
+
+          for (auto it = retryActions.rbegin(); it != retryActions.rend(); ++it)
           {
-            SendActionResult(action, result);
+            m_Actions.push_front(*it);
           }
+        }
 
-          authRefreshNeeded = AuthRefreshNeeded();
+        while (!m_ServerSearches.empty() && m_Running && isConnected && !authRefreshNeeded)
+        {
+          SearchQuery searchQuery = m_ServerSearches.front();
+          m_ServerSearches.pop_front();
 
-          m_QueueMutex.lock();
+          m_QueueMutex.unlock();
 
-          if (retry)
+          if (!PerformServerSearch(searchQuery) && !CheckConnectivity())
           {
-            m_Actions.push_front(action);
+            LOG_WARNING("server search failed due to connection lost");
+            SetStatus(Status::FlagConnecting);
+            isConnected = false;
           }
+
+          authRefreshNeeded = AuthRefreshNeeded();
+
+          m_QueueMutex.lock();
         }
 
         progress = 0;
@@ -626,14 +979,35 @@ void ImapManager::Process()
         m_QueueMutex.lock();
 
         progress = 0;
-        while (m_Actions.empty() && m_Requests.empty() && !m_PrefetchRequests.empty() &&
+        while (m_Actions.empty() && m_Requests.empty() && m_PrefetchScheduler.HasReady() &&
                m_Running && isConnected && !authRefreshNeeded)
         {
-          Request request = m_PrefetchRequests.begin()->second.front();
-          m_PrefetchRequests.begin()->second.pop_front();
-          if (m_PrefetchRequests.begin()->second.empty())
+          uint64_t id = 0;
+          int64_t waitMs = 0;
+          if (!m_PrefetchScheduler.Next(id, waitMs))
+          {
+            if (waitMs <= 0) break;
+
+            // body prefetch is paced, wait unless preempted by a new request
+            m_QueueMutex.unlock();
+            fd_set waitfds;
+            FD_ZERO(&waitfds);
+            FD_SET(m_Pipe[0], &waitfds);
+            struct timeval waittv = {(time_t)(waitMs / 1000), (suseconds_t)((waitMs % 1000) * 1000)};
+            if (select(m_Pipe[0] + 1, &waitfds, NULL, NULL, &waittv) > 0)
+            {
+              PipeReadAll(m_Pipe);
+            }
+
+            m_QueueMutex.lock();
+            continue;
+          }
+
+          Request request = m_PrefetchRequests.at(id);
+          m_PrefetchRequests.erase(id);
+          if (request.m_GetBodys.size() == 1)
           {
-            m_PrefetchRequests.erase(m_PrefetchRequests.begin());
+            m_PrefetchBodyIds.erase(std::make_pair(request.m_Folder, *request.m_GetBodys.begin()));
           }
 
           m_QueueMutex.unlock();
@@ -641,8 +1015,10 @@ void ImapManager::Process()
           SetStatus(Status::FlagPrefetching, progress);
 
           Response response;
+          const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
           bool result = PerformRequest(request, false /* p_Cached */, true /* p_Prefetch */,
                                        response);
+          const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
 
           bool retry = false;
           if (!result)
@@ -673,10 +1049,17 @@ void ImapManager::Process()
 
           if (retry)
           {
-            m_PrefetchRequests[request.m_PrefetchLevel].push_front(request);
+            AddPrefetchRequest(request);
           }
           else
           {
+            m_PrefetchScheduler.Done(!request.m_GetBodys.empty(), response.m_FetchedBytes,
+                                     elapsed.count());
+            if (result)
+            {
+              UpdatePrefetchHints(request);
+            }
+
             ProgressCountRequestDone(request, true /* p_IsPrefetch */);
             progress = GetProgressPercentage(request, true /* p_IsPrefetch */);
           }
@@ -704,7 +1087,8 @@ void ImapManager::Process()
         ProgressCountReset(true /* p_IsPrefetch */);
       }
 
-      isQueueEmpty = m_Requests.empty() && m_PrefetchRequests.empty() && m_Actions.empty();
+      isQueueEmpty = m_Requests.empty() && !m_PrefetchScheduler.HasReady() && m_Actions.empty() &&
+        m_ServerSearches.empty();
 
       m_QueueMutex.unlock();
     }
@@ -866,6 +1250,12 @@ void ImapManager::SearchProcess()
       m_SearchQueue.pop_front();
     }
 
+    if (IsSearchSuperseded(searchQuery))
+    {
+      LOG_DEBUG("drop superseded search \"%s\"", searchQuery.m_QueryStr.c_str());
+      continue;
+    }
+
     PerformSearch(searchQuery);
   }
 
@@ -908,7 +1298,7 @@ bool ImapManager::PerformRequest(const Request& p_Request, bool p_Cached, bool p
   if (!p_Request.m_GetBodys.empty())
   {
     const bool rv = m_Imap.GetBodys(p_Request.m_Folder, p_Request.m_GetBodys, p_Cached,
-                                    p_Prefetch, p_Response.m_Bodys);
+                                    p_Prefetch, p_Response.m_Bodys, &p_Response.m_FetchedBytes);
     if (p_Request.m_ProcessHtml)
     {
       for (auto& body : p_Response.m_Bodys)
@@ -952,7 +1342,8 @@ bool ImapManager::PerformAction(const ImapManager::Action& p_Action)
   if (p_Action.m_UploadMessage)
   {
     SetStatus(Status::FlagSaving);
-    rv &= m_Imap.UploadMessage(p_Action.m_Folder, p_Action.m_Msg, false);
+    rv &= !p_Action.m_MsgPath.empty() ? m_Imap.UploadMessageFile(p_Action.m_Folder, p_Action.m_MsgPath, false)
+                                      : m_Imap.UploadMessage(p_Action.m_Folder, p_Action.m_Msg, false);
     ClearStatus(Status::FlagSaving);
   }
 
@@ -971,16 +1362,145 @@ bool ImapManager::PerformAction(const ImapManager::Action& p_Action)
   return rv;
 }
 
+bool ImapManager::IsBatchAction(const Action& p_Action)
+{
+  // only flag, move and delete actions on first try are coalesced, retries are performed one by one
+  return (p_Action.m_TryCount == 0) && !p_Action.m_UploadDraft && !p_Action.m_UploadMessage &&
+         !p_Action.m_UpdateCache && !p_Action.m_Uids.empty() &&
+         (p_Action.m_SetSeen || p_Action.m_SetUnseen || p_Action.m_DeleteMessages ||
+          !p_Action.m_MoveDestination.empty());
+}
+
+std::vector<ImapManager::Action> ImapManager::PopActions()
+{
+  // must be called with m_QueueMutex held
+  std::vector<Action> actions;
+  if (!IsBatchAction(m_Actions.front()))
+  {
+    actions.push_back(m_Actions.front());
+    m_Actions.pop_front();
+    return actions;
+  }
+
+  // take batch actions up to the first non-batch one, to not reorder across it, oldest first
+  auto batchEnd = std::find_if_not(m_Actions.begin(), m_Actions.end(), IsBatchAction);
+  actions.assign(std::make_reverse_iterator(batchEnd), m_Actions.rend());
+  m_Actions.erase(m_Actions.begin(), batchEnd);
+  return actions;
+}
+
+std::vector<bool> ImapManager::PerformActions(const std::vector<Action>& p_Actions)
+{
+  if ((p_Actions.size() == 1) && !IsBatchAction(p_Actions.front()))
+  {
+    return std::vector<bool>({ PerformAction(p_Actions.front()) });
+  }
+
+  LOG_DURATION();
+
+  // coalesce consecutive actions of the same kind per folder
+  std::map<std::string, std::vector<Imap::BatchAction>> folderBatchActions;
+  std::vector<std::pair<std::string, size_t>> actionBatchIndex;
+  uint32_t statusFlags = 0;
+  for (const auto& action : p_Actions)
+  {
+    std::vector<Imap::BatchAction>& batchActions = folderBatchActions[action.m_Folder];
+    if (batchActions.empty() ||
+        (batchActions.back().m_SetSeen != action.m_SetSeen) ||
+        (batchActions.back().m_SetUnseen != action.m_SetUnseen) ||
+        (batchActions.back().m_DeleteMessages != action.m_DeleteMessages) ||
+        (batchActions.back().m_MoveDestination != action.m_MoveDestination))
+    {
+      Imap::BatchAction batchAction;
+      batchAction.m_SetSeen = action.m_SetSeen;
+      batchAction.m_SetUnseen = action.m_SetUnseen;
+      batchAction.m_DeleteMessages = action.m_DeleteMessages;
+      batchAction.m_MoveDestination = action.m_MoveDestination;
+      batchActions.push_back(batchAction);
+    }
+
+    batchActions.back().m_Uids.insert(action.m_Uids.begin(), action.m_Uids.end());
+    actionBatchIndex.push_back(std::make_pair(action.m_Folder, batchActions.size() - 1));
+
+    statusFlags |= (!action.m_MoveDestination.empty() ? Status::FlagMoving : 0) |
+      ((action.m_SetSeen || action.m_SetUnseen) ? Status::FlagUpdatingFlags : 0) |
+      (action.m_DeleteMessages ? Status::FlagDeleting : 0);
+  }
+
+  LOG_DEBUG("coalesced %d actions into %d folders", (int)p_Actions.size(), (int)folderBatchActions.size());
+
+  SetStatus(statusFlags);
+  std::map<std::string, std::vector<bool>> folderResults;
+  for (const auto& folderBatchAction : folderBatchActions)
+  {
+    m_Imap.PerformBatch(folderBatchAction.first, folderBatchAction.second, folderResults[folderBatchAction.first]);
+  }
+  ClearStatus(statusFlags);
+
+  std::vector<bool> results;
+  for (const auto& folderIndex : actionBatchIndex)
+  {
+    results.push_back(folderResults[folderIndex.first].at(folderIndex.second));
+  }
+
+  return results;
+}
+
 void ImapManager::PerformSearch(const SearchQuery& p_SearchQuery)
 {
   SearchResult searchResult;
   m_Imap.Search(p_SearchQuery.m_QueryStr, p_SearchQuery.m_Offset, p_SearchQuery.m_Max,
-                searchResult.m_Headers, searchResult.m_FolderUids, searchResult.m_HasMore);
+                searchResult.m_Headers, searchResult.m_FolderUids, searchResult.m_DuplicateFolders,
+                searchResult.m_HasMore);
+
+  if (IsSearchSuperseded(p_SearchQuery))
+  {
+    LOG_DEBUG("discard superseded search result \"%s\"", p_SearchQuery.m_QueryStr.c_str());
+    return;
+  }
 
   if (m_SearchHandler)
   {
     m_SearchHandler(p_SearchQuery, searchResult);
   }
+
+  // messages not yet indexed locally are searched on server, results are merged by ui
+  if ((p_SearchQuery.m_Offset == 0) && m_OnceConnected)
+  {
+    std::lock_guard<std::mutex> lock(m_QueueMutex);
+    m_ServerSearches.clear();
+    m_ServerSearches.push_back(p_SearchQuery);
+    PipeWriteOne(m_Pipe);
+  }
+}
+
+bool ImapManager::PerformServerSearch(const SearchQuery& p_SearchQuery)
+{
+  if (IsSearchSuperseded(p_SearchQuery)) return true;
+
+  return m_Imap.ServerSearch(p_SearchQuery.m_QueryStr,
+                             [&](const std::vector<Header>& p_Headers,
+                                 const std::vector<std::pair<std::string, uint32_t>>& p_FolderUids)
+  {
+    if (IsSearchSuperseded(p_SearchQuery)) return false;
+
+    SearchResult searchResult;
+    searchResult.m_HasMore = false;
+    searchResult.m_IsServerResult = true;
+    searchResult.m_Headers = p_Headers;
+    searchResult.m_FolderUids = p_FolderUids;
+    if (m_SearchHandler)
+    {
+      m_SearchHandler(p_SearchQuery, searchResult);
+    }
+
+    return true;
+  });
+}
+
+bool ImapManager::IsSearchSuperseded(const SearchQuery& p_SearchQuery)
+{
+  return (p_SearchQuery.m_Generation != 0) && (p_SearchQuery.m_Generation != m_SearchGeneration);
 }
 
 void ImapManager::SendRequestResponse(const Request& p_Request, const Response& p_Response)
@@ -1093,6 +1613,65 @@ float ImapManager::GetProgressPercentage(const Request& p_Request, bool p_IsPref
   return progress;
 }
 
+void ImapManager::AddPrefetchRequest(const Request& p_Request)
+{
+  const uint64_t id = ++m_PrefetchSeq;
+  const bool isBody = !p_Request.m_GetBodys.empty();
+  m_PrefetchRequests[id] = p_Request;
+  m_PrefetchScheduler.Add(id, p_Request.m_PrefetchLevel, isBody, p_Request.m_Folder, p_Request.m_PrefetchHints);
+  if (p_Request.m_GetBodys.size() == 1)
+  {
+    m_PrefetchBodyIds[std::make_pair(p_Request.m_Folder, *p_Request.m_GetBodys.begin())] = id;
+  }
+}
+
+void ImapManager::UpdatePrefetchHints(const Request& p_Request)
+{
+  // full sync queues bodies before their headers and flags are known, refine ranking once they are
+  const UidSet& uids = p_Request.m_GetHeaders.empty() ? p_Request.m_GetFlags : p_Request.m_GetHeaders;
+  if (uids.empty()) return;
+
+  std::map<uint32_t, uint64_t> ids;
+  for (const auto& uid : uids)
+  {
+    auto it = m_PrefetchBodyIds.find(std::make_pair(p_Request.m_Folder, uid));
+    if (it != m_PrefetchBodyIds.end())
+    {
+      ids[uid] = it->second;
+    }
+  }
+
+  if (ids.empty()) return;
+
+  // called with queue mutex held, release it during cache reads to not stall ui requests
+  m_QueueMutex.unlock();
+  const UidSet idUids = MapKey(ids);
+  std::map<uint32_t, Header> headers;
+  std::map<uint32_t, uint32_t> flags;
+  m_Imap.GetHeaders(p_Request.m_Folder, idUids, true /* p_Cached */, false /* p_Prefetch */, headers);
+  m_Imap.GetFlags(p_Request.m_Folder, idUids, true /* p_Cached */, flags);
+  m_QueueMutex.lock();
+
+  for (const auto& id : ids)
+  {
+    PrefetchHints hints;
+    auto headerIt = headers.find(id.first);
+    if (headerIt != headers.end())
+    {
+      hints.m_Time = headerIt->second.GetTimeStamp();
+      hints.m_Sender = headerIt->second.GetFrom();
+    }
+
+    auto flagIt = flags.find(id.first);
+    if (flagIt != flags.end())
+    {
+      hints.m_Unseen = !Flag::GetSeen(flagIt->second);
+    }
+
+    m_PrefetchScheduler.Update(id.second, hints);
+  }
+}
+
 void ImapManager::PipeWriteOne(int p_Fds[2])
 {
   const int readFd = p_Fds[0];
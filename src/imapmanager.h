@@ -15,6 +15,7 @@
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include <unistd.h>
 #include <sys/ioctl.h>
@@ -23,7 +24,9 @@
 #include "header.h"
 #include "imap.h"
 #include "log.h"
+#include "prefetchscheduler.h"
 #include "status.h"
+#include "uidset.h"
 
 class ImapManager
 {
@@ -46,10 +49,11 @@ public:
     bool m_GetFolders = false;
     bool m_GetUids = false;
     bool m_ProcessHtml = false;
-    std::set<uint32_t> m_GetHeaders;
-    std::set<uint32_t> m_GetFlags;
-    std::set<uint32_t> m_GetBodys;
+    UidSet m_GetHeaders;
+    UidSet m_GetFlags;
+    UidSet m_GetBodys;
     uint32_t m_TryCount = 0;
+    PrefetchHints m_PrefetchHints;
   };
 
   struct Response
@@ -58,16 +62,17 @@ public:
     std::string m_Folder;
     bool m_Cached = false;
     std::set<std::string> m_Folders;
-    std::set<uint32_t> m_Uids;
+    UidSet m_Uids;
     std::map<uint32_t, Header> m_Headers;
     std::map<uint32_t, uint32_t> m_Flags;
     std::map<uint32_t, Body> m_Bodys;
+    uint64_t m_FetchedBytes = 0;
   };
 
   struct Action
   {
     std::string m_Folder;
-    std::set<uint32_t> m_Uids;
+    UidSet m_Uids;
     bool m_SetSeen = false;
     bool m_SetUnseen = false;
     bool m_UploadDraft = false;
@@ -76,6 +81,7 @@ public:
     bool m_UpdateCache = false;
     std::string m_MoveDestination;
     std::string m_Msg;
+    std::string m_MsgPath;
     std::map<uint32_t, Body> m_SetBodysCache;
     uint32_t m_TryCount = 0;
   };
@@ -90,6 +96,7 @@ public:
     std::string m_QueryStr;
     unsigned m_Offset = 0;
     unsigned m_Max = 0;
+    uint64_t m_Generation = 0;
 
     SearchQuery()
     {
@@ -107,7 +114,9 @@ public:
   {
     std::vector<Header> m_Headers;
     std::vector<std::pair<std::string, uint32_t>> m_FolderUids;
+    std::map<std::pair<std::string, uint32_t>, std::set<std::string>> m_DuplicateFolders;
     bool m_HasMore;
+    bool m_IsServerResult = false;
   };
 
 public:
@@ -124,7 +133,9 @@ public:
               const std::function<void(const ImapManager::SearchQuery&,
                                        const ImapManager::SearchResult&)>& p_SearchHandler,
               const bool p_IdleInbox,
-              const std::string& p_Inbox);
+              const std::string& p_Inbox,
+              const std::vector<std::string>& p_IdleFolders,
+              const uint32_t p_IdlePoolSize);
   virtual ~ImapManager();
 
   void Start();
@@ -136,6 +147,9 @@ public:
   void SyncSearch(const SearchQuery& p_SearchQuery, SearchResult& p_SearchResult);
 
   void SetCurrentFolder(const std::string& p_Folder);
+  void NotifyUserActivity();
+  void NotifyMessageOpened(const std::string& p_Sender);
+  void NotifyMessageListCursor(const std::string& p_Folder, int32_t p_ListIndex);
 
 private:
   struct ProgressCount
@@ -149,6 +163,11 @@ private:
 private:
   bool ProcessIdle();
   int GetIdleDurationSec();
+  bool CheckIdleFolders(const std::set<std::string>& p_Folders);
+  bool FetchFolderUidsAndFlags(const std::string& p_Folder);
+  void StartIdlePool(const std::vector<std::string>& p_Folders);
+  void StopIdlePool();
+  void IdlePoolProcess(const std::string p_Folder);
   void ProcessIdleOffline();
   void Process();
   bool AuthRefreshNeeded();
@@ -159,7 +178,12 @@ private:
   void SearchProcess();
   bool PerformRequest(const Request& p_Request, bool p_Cached, bool p_Prefetch, Response& p_Response);
   bool PerformAction(const Action& p_Action);
+  static bool IsBatchAction(const Action& p_Action);
+  std::vector<Action> PopActions();
+  std::vector<bool> PerformActions(const std::vector<Action>& p_Actions);
   void PerformSearch(const SearchQuery& p_SearchQuery);
+  bool IsSearchSuperseded(const SearchQuery& p_SearchQuery);
+  bool PerformServerSearch(const SearchQuery& p_SearchQuery);
   void SendRequestResponse(const Request& p_Request, const Response& p_Response);
   void SendActionResult(const Action& p_Action, bool p_Result);
   void SetStatus(uint32_t p_Flags, float p_Progress = -1);
@@ -168,6 +192,8 @@ private:
   void ProgressCountRequestDone(const Request& p_Request, bool p_IsPrefetch);
   void ProgressCountReset(bool p_IsPrefetch);
   float GetProgressPercentage(const Request& p_Request, bool p_IsPrefetch);
+  void AddPrefetchRequest(const Request& p_Request);
+  void UpdatePrefetchHints(const Request& p_Request);
   void PipeWriteOne(int p_Fds[2]);
   void PipeReadAll(int p_Fds[2]);
 
@@ -181,6 +207,9 @@ private:
   bool m_IdleInbox = true;
   std::string m_Inbox = "";
   uint32_t m_IdleTimeout = 29;
+  std::vector<std::string> m_IdleFolders;
+  uint32_t m_IdlePoolSize = 0;
+  std::map<std::string, Imap::FolderInfo> m_IdleFolderInfos;
   std::atomic<bool> m_Connecting;
   std::atomic<bool> m_Running;
   std::atomic<bool> m_CacheRunning;
@@ -191,8 +220,12 @@ private:
 
   std::deque<Request> m_Requests;
   std::deque<Request> m_CacheRequests;
-  std::map<uint32_t, std::deque<Request>> m_PrefetchRequests;
+  std::map<uint64_t, Request> m_PrefetchRequests;
+  std::map<std::pair<std::string, uint32_t>, uint64_t> m_PrefetchBodyIds;
+  PrefetchScheduler m_PrefetchScheduler;
+  uint64_t m_PrefetchSeq = 0;
   std::deque<Action> m_Actions;
+  std::deque<SearchQuery> m_ServerSearches;
   ProgressCount m_FetchProgressCount;
   ProgressCount m_PrefetchProgressCount;
   std::mutex m_QueueMutex;
@@ -213,8 +246,17 @@ private:
   std::thread m_SearchThread;
   bool m_SearchRunning = false;
   std::deque<SearchQuery> m_SearchQueue;
+  std::atomic<uint64_t> m_SearchGeneration;
   std::condition_variable m_SearchCond;
   std::mutex m_SearchMutex;
 
   bool m_OnceConnected = false;
+
+  std::atomic<bool> m_IdlePoolRunning;
+  std::vector<std::thread> m_IdlePoolThreads;
+  std::set<std::string> m_IdlePoolFolders;
+  std::set<std::string> m_IdlePoolChangedFolders;
+  std::mutex m_IdlePoolMutex;
+  int m_IdlePoolPipe[2] = { -1, -1 };
+  int m_IdlePoolStopPipe[2] = { -1, -1 };
 };
@@ -12,7 +12,10 @@
 
 #include "addressbook.h"
 #include "auth.h"
+#include "batchsync.h"
+#include "bulkimport.h"
 #include "cacheutil.h"
+#include "compress.h"
 #include "config.h"
 #include "crypto.h"
 #include "imapmanager.h"
@@ -20,9 +23,12 @@
 #include "log.h"
 #include "loghelp.h"
 #include "offlinequeue.h"
+#include "prefetchscheduler.h"
+#include "reencrypt.h"
 #include "sasl.h"
 #include "sethelp.h"
 #include "smtpmanager.h"
+#include "startupprofile.h"
 #include "ui.h"
 #include "util.h"
 #include "version.h"
@@ -67,6 +73,9 @@ int main(int argc, char* argv[])
   bool setupAllowCacheEncrypt = false;
   std::string setup;
   std::string exportDir;
+  std::string importPath;
+  std::string importFolder;
+  bool sync = false;
 
   // Argument handling
   std::vector<std::string> args(argv + 1, argv + argc);
@@ -89,11 +98,21 @@ int main(int argc, char* argv[])
     {
       Log::SetVerboseLevel(Log::TRACE_LEVEL);
     }
+    else if (((*it == "-f") || (*it == "--folder")) && (std::distance(it + 1, args.end()) > 0))
+    {
+      ++it;
+      importFolder = *it;
+    }
     else if ((*it == "-h") || (*it == "--help"))
     {
       ShowHelp();
       return 0;
     }
+    else if (((*it == "-i") || (*it == "--import")) && (std::distance(it + 1, args.end()) > 0))
+    {
+      ++it;
+      importPath = *it;
+    }
     else if ((*it == "-k") || (*it == "--keydump"))
     {
       KeyDump();
@@ -112,6 +131,10 @@ int main(int argc, char* argv[])
       ++it;
       setup = *it;
     }
+    else if ((*it == "-t") || (*it == "--startup-profile"))
+    {
+      StartupProfile::Enable();
+    }
     else if ((*it == "-v") || (*it == "--version"))
     {
       ShowVersion();
@@ -122,6 +145,10 @@ int main(int argc, char* argv[])
       ++it;
       exportDir = *it;
     }
+    else if ((*it == "-y") || (*it == "--sync"))
+    {
+      sync = true;
+    }
     else
     {
       ShowHelp();
@@ -203,6 +230,20 @@ int main(int argc, char* argv[])
     { "downloads_dir", "" },
     { "idle_timeout", "29" },
     { "sni_enabled", "1" },
+    { "smtp_idle_timeout", "300" },
+    { "index_cpu_share", "50" },
+    { "index_nice", "10" },
+    { "sync_parallelism", "4" },
+    { "cache_max_size_mb", "0" },
+    { "cache_max_age_days", "0" },
+    { "imap_compress", "1" },
+    { "idle_folders", "" },
+    { "idle_pool_size", "2" },
+    { "compact_headers", "1" },
+    { "prefetch_max_kbps", "0" },
+    { "prefetch_budget_mb", "0" },
+    { "prefetch_min_kbps", "0" },
+    { "network_metered", "0" },
   };
   const std::string mainConfigPath(Util::GetApplicationDir() + std::string("main.conf"));
   std::shared_ptr<Config> mainConfig = std::make_shared<Config>(mainConfigPath, defaultMainConfig);
@@ -278,7 +319,19 @@ int main(int argc, char* argv[])
   Util::SetEditorCmd(mainConfig->Get("editor_cmd"));
   Util::SetSpellCmd(mainConfig->Get("spell_cmd"));
   std::set<std::string> foldersExclude = ToSet(Util::SplitQuoted(mainConfig->Get("folders_exclude"), true));
+  const std::vector<std::string> idleFolders = Util::SplitQuoted(mainConfig->Get("idle_folders"), true);
+  const uint32_t idlePoolSize = (uint32_t)Util::ToInteger(mainConfig->Get("idle_pool_size"));
   Util::SetUseServerTimestamps(mainConfig->Get("server_timestamps") == "1");
+  ImapIndex::SetSchedParams((uint32_t)Util::ToInteger(mainConfig->Get("index_cpu_share")),
+                            (int)Util::ToInteger(mainConfig->Get("index_nice")));
+  ImapCache::SetQuota((uint64_t)Util::ToInteger(mainConfig->Get("cache_max_size_mb")) * 1024 * 1024,
+                     (uint32_t)Util::ToInteger(mainConfig->Get("cache_max_age_days")));
+  Imap::SetCompressEnabled(mainConfig->Get("imap_compress") == "1");
+  Imap::SetCompactHeaders(mainConfig->Get("compact_headers") == "1");
+  PrefetchScheduler::SetLimits((uint32_t)Util::ToInteger(mainConfig->Get("prefetch_max_kbps")),
+                               (uint64_t)Util::ToInteger(mainConfig->Get("prefetch_budget_mb")) * 1024 * 1024,
+                               (uint32_t)Util::ToInteger(mainConfig->Get("prefetch_min_kbps")),
+                               mainConfig->Get("network_metered") == "1");
   const std::string auth = mainConfig->Get("auth");
   const bool prefetchAllHeaders = (mainConfig->Get("prefetch_all_headers") == "1");
   Util::SetSendIp(mainConfig->Get("send_ip") == "1");
@@ -327,6 +380,8 @@ int main(int argc, char* argv[])
   uint32_t prefetchLevel = 0;
   uint64_t networkTimeout = 0;
   uint32_t idleTimeout = 29;
+  int64_t smtpIdleTimeout = 300;
+  uint32_t syncParallelism = 4;
   try
   {
     imapPort = std::stoi(mainConfig->Get("imap_port"));
@@ -334,6 +389,8 @@ int main(int argc, char* argv[])
     prefetchLevel = std::stoi(mainConfig->Get("prefetch_level"));
     networkTimeout = std::stoll(mainConfig->Get("network_timeout"));
     idleTimeout = std::stoi(mainConfig->Get("idle_timeout"));
+    smtpIdleTimeout = std::stoll(mainConfig->Get("smtp_idle_timeout"));
+    syncParallelism = std::stoi(mainConfig->Get("sync_parallelism"));
   }
   catch (...)
   {
@@ -384,13 +441,74 @@ int main(int argc, char* argv[])
     return exportRv ? 0 : 1;
   }
 
+  // Perform import if requested
+  if (!importPath.empty())
+  {
+    Util::SetAddressBookEncrypt(addressBookEncrypt);
+    Auth::Init(auth, authEncrypt, pass, isSetup);
+
+    bool importRv = false;
+    {
+      Imap imap(user, pass, imapHost, imapPort, networkTimeout, cacheEncrypt, cacheIndexEncrypt,
+                foldersExclude, sniEnabled, nullptr);
+      if (imap.Login())
+      {
+        // no user interaction in import mode, allow indexing to run alongside
+        imap.IndexNotifyIdle(true);
+        BulkImport bulkImport(imap, Util::ExpandPath(importPath), importFolder.empty() ? inbox : importFolder);
+        importRv = bulkImport.Run();
+        imap.Logout();
+      }
+      else
+      {
+        std::cerr << "error: login failed\n";
+      }
+    }
+
+    Auth::Cleanup();
+    std::cout << "Import " << (importRv ? "success" : "failure") << "\n";
+    return importRv ? 0 : 1;
+  }
+
+  // Perform sync if requested
+  if (sync)
+  {
+    Util::SetAddressBookEncrypt(addressBookEncrypt);
+    Auth::Init(auth, authEncrypt, pass, isSetup);
+
+    bool syncRv = false;
+    {
+      Imap imap(user, pass, imapHost, imapPort, networkTimeout, cacheEncrypt, cacheIndexEncrypt,
+                foldersExclude, sniEnabled, nullptr);
+      if (imap.Login())
+      {
+        // no user interaction in sync mode, allow indexing to run alongside
+        imap.IndexNotifyIdle(true);
+        BatchSync batchSync(imap, syncParallelism);
+        syncRv = batchSync.Run();
+        imap.Logout();
+      }
+      else
+      {
+        std::cerr << "error: login failed\n";
+      }
+    }
+
+    Auth::Cleanup();
+    std::cout << "Sync " << (syncRv ? "success" : "failure") << "\n";
+    return syncRv ? 0 : 1;
+  }
+
   Util::InitStdErrRedirect(logPath);
 
   Util::SetAddressBookEncrypt(addressBookEncrypt);
 
   Auth::Init(auth, authEncrypt, pass, isSetup);
 
+  StartupProfile::Mark("auth init");
+
   Ui ui(inbox, address, name, prefetchLevel, prefetchAllHeaders);
+  StartupProfile::Mark("ui init");
 
   std::shared_ptr<ImapManager> imapManager =
     std::make_shared<ImapManager>(user, pass, imapHost, imapPort, online,
@@ -406,11 +524,12 @@ int main(int argc, char* argv[])
                                   std::bind(&Ui::StatusHandler, std::ref(ui), std::placeholders::_1),
                                   std::bind(&Ui::SearchHandler, std::ref(ui), std::placeholders::_1,
                                             std::placeholders::_2),
-                                  idleInbox, inbox);
+                                  idleInbox, inbox, idleFolders, idlePoolSize);
+  StartupProfile::Mark("cache init");
 
   std::shared_ptr<SmtpManager> smtpManager =
     std::make_shared<SmtpManager>(smtpUser, smtpPass, smtpHost, smtpPort, name, address, online,
-                                  networkTimeout,
+                                  networkTimeout, smtpIdleTimeout,
                                   std::bind(&Ui::SmtpResultHandler, std::ref(ui), std::placeholders::_1),
                                   std::bind(&Ui::StatusHandler, std::ref(ui), std::placeholders::_1));
 
@@ -425,6 +544,7 @@ int main(int argc, char* argv[])
 
   imapManager->Start();
   smtpManager->Start();
+  StartupProfile::Mark("managers started");
 
   ui.Run();
 
@@ -448,6 +568,8 @@ int main(int argc, char* argv[])
 
   Util::CleanupStdErrRedirect();
 
+  StartupProfile::Report();
+
   LOG_INFO("exit");
 
   Log::Cleanup();
@@ -466,12 +588,16 @@ static void ShowHelp()
     "   -d, --confdir <DIR>        use a different directory than ~/.config/falanet\n"
     "   -e, --verbose              enable verbose logging\n"
     "   -ee, --extra-verbose       enable extra verbose logging\n"
+    "   -f, --folder <FOLDER>      destination folder for import (default inbox)\n"
     "   -h, --help                 display this help and exit\n"
+    "   -i, --import <PATH>        import Maildir dir or mbox file to server and cache\n"
     "   -k, --keydump              key code dump mode\n"
     "   -o, --offline              run in offline mode\n"
     "   -p, --pass                 change password\n"
+    "   -t, --startup-profile      log startup milestone timings and print on exit\n"
     "   -v, --version              output version information and exit\n"
     "   -x, --export <DIR>         export cache to specified dir in Maildir format\n"
+    "   -y, --sync                 sync all folders to cache and search index, then exit\n"
     "\n"
     "Examples:\n"
     "   falanet                      running falanet without setup wizard will generate\n"
@@ -857,6 +983,9 @@ void LogSystemInfo()
   const std::string sqliteVersion = Util::GetSQLiteVersion();
   LOG_DEBUG("sqlite:    %s", sqliteVersion.c_str());
 
+  const std::string zlibVersion = Compress::GetVersion();
+  LOG_DEBUG("zlib:      %s", zlibVersion.c_str());
+
   const std::string selfPath = Util::GetSelfPath();
   if (!selfPath.empty())
   {
@@ -909,6 +1038,9 @@ bool ChangePasswords(std::shared_ptr<Config> p_MainConfig, std::shared_ptr<Confi
 
     p_SecretConfig->Save();
 
+    // journal is kept until the new pass is saved, to allow resuming if interrupted before
+    ReEncrypt::ClearJournal();
+
     std::cout << "Changing password complete.\n";
     return true;
   }
@@ -922,22 +1054,25 @@ bool ChangePasswords(std::shared_ptr<Config> p_MainConfig, std::shared_ptr<Confi
 bool ChangeCachePasswords(std::shared_ptr<Config> p_MainConfig,
                           const std::string& p_OldPass, const std::string& p_NewPass)
 {
+  ReEncrypt reEncrypt(p_OldPass, p_NewPass);
+
   const bool cacheEncrypt = (p_MainConfig->Get("cache_encrypt") == "1");
-  if (!ImapCache::ChangePass(cacheEncrypt, p_OldPass, p_NewPass)) return false;
+  ImapCache::ChangePass(cacheEncrypt, reEncrypt);
+  PrefetchScheduler::ChangePass(cacheEncrypt, reEncrypt);
 
   const bool cacheIndexEncrypt = (p_MainConfig->Get("cache_index_encrypt") == "1");
-  if (!ImapIndex::ChangePass(cacheIndexEncrypt, p_OldPass, p_NewPass)) return false;
+  ImapIndex::ChangePass(cacheIndexEncrypt, reEncrypt);
 
   const bool addressBookEncrypt = (p_MainConfig->Get("addressbook_encrypt") == "1");
-  if (!AddressBook::ChangePass(addressBookEncrypt, p_OldPass, p_NewPass)) return false;
+  AddressBook::ChangePass(addressBookEncrypt, reEncrypt);
 
   const bool queueEncrypt = (p_MainConfig->Get("queue_encrypt") == "1");
-  if (!OfflineQueue::ChangePass(queueEncrypt, p_OldPass, p_NewPass)) return false;
+  OfflineQueue::ChangePass(queueEncrypt, reEncrypt);
 
   const bool authEncrypt = (p_MainConfig->Get("auth_encrypt") == "1");
-  if (!Auth::ChangePass(authEncrypt, p_OldPass, p_NewPass)) return false;
+  Auth::ChangePass(authEncrypt, reEncrypt);
 
-  return true;
+  return reEncrypt.Run();
 }
 
 static void KeyDump()
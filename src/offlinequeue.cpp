@@ -12,6 +12,7 @@
 #include "cacheutil.h"
 #include "crypto.h"
 #include "loghelp.h"
+#include "reencrypt.h"
 #include "util.h"
 
 std::mutex OfflineQueue::m_Mutex;
@@ -39,15 +40,13 @@ void OfflineQueue::Cleanup()
 {
 }
 
-bool OfflineQueue::ChangePass(const bool p_CacheEncrypt,
-                              const std::string& p_OldPass, const std::string& p_NewPass)
+void OfflineQueue::ChangePass(const bool p_CacheEncrypt, ReEncrypt& p_ReEncrypt)
 {
-  if (!p_CacheEncrypt) return true;
+  if (!p_CacheEncrypt) return;
 
-  // @todo: implement password change for offline queue
-  (void)p_OldPass;
-  (void)p_NewPass;
-  return true;
+  p_ReEncrypt.AddDir(GetDraftQueueDir());
+  p_ReEncrypt.AddDir(GetOutboxQueueDir());
+  p_ReEncrypt.AddDir(GetComposeQueueDir());
 }
 
 void OfflineQueue::PushDraftMessage(const std::string& p_Str)
@@ -11,14 +11,15 @@
 #include <string>
 #include <vector>
 
+class ReEncrypt;
+
 class OfflineQueue
 {
 public:
   static void Init(const bool p_Encrypt, const std::string& p_Pass);
   static void Cleanup();
 
-  static bool ChangePass(const bool p_CacheEncrypt,
-                         const std::string& p_OldPass, const std::string& p_NewPass);
+  static void ChangePass(const bool p_CacheEncrypt, ReEncrypt& p_ReEncrypt);
 
   static void PushDraftMessage(const std::string& p_Str);
   static void PushOutboxMessage(const std::string& p_Str);
@@ -0,0 +1,288 @@
+// prefetchscheduler.cpp
+//
+// Copyright (c) 2024 Kristofer Berggren
+// All rights reserved.
+//
+// falanet is distributed under the MIT license, see LICENSE for details.
+
+#include "prefetchscheduler.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "cacheutil.h"
+#include "crypto.h"
+#include "loghelp.h"
+#include "reencrypt.h"
+#include "serialization.h"
+#include "util.h"
+
+uint32_t PrefetchScheduler::s_MaxKbps = 0;
+uint64_t PrefetchScheduler::s_DailyBudget = 0;
+uint32_t PrefetchScheduler::s_MinKbps = 0;
+bool PrefetchScheduler::s_Metered = false;
+
+// link speed is only sampled from transfers large enough not to be dominated by latency
+static const uint64_t s_MinSampleBytes = 64 * 1024;
+static const std::chrono::minutes s_SlowLinkPause(5);
+static const time_t s_BudgetPeriodSec = 24 * 60 * 60;
+
+void PrefetchScheduler::Load(const bool p_Encrypt, const std::string& p_Pass)
+{
+  m_Encrypt = p_Encrypt;
+  m_Pass = p_Pass;
+
+  const std::string& path = GetStatePath();
+  if (!Util::Exists(path)) return;
+
+  const std::string& data = Util::ReadFile(path);
+  const State state = Serialization::FromString<State>(m_Encrypt ? Crypto::AESDecrypt(data, m_Pass) : data);
+  m_BudgetStartTime = (time_t)state.m_BudgetStartTime;
+  m_BudgetBytes = state.m_BudgetBytes;
+  m_FolderVisits = state.m_FolderVisits;
+  m_SenderOpens = state.m_SenderOpens;
+  m_MaxFolderVisits = 0;
+  for (const auto& folderVisits : m_FolderVisits)
+  {
+    m_MaxFolderVisits = std::max(m_MaxFolderVisits, folderVisits.second);
+  }
+
+  LOG_DEBUG("loaded prefetch state, budget %llu bytes used", (unsigned long long)m_BudgetBytes);
+}
+
+void PrefetchScheduler::Save() const
+{
+  State state;
+  state.m_BudgetStartTime = (int64_t)m_BudgetStartTime;
+  state.m_BudgetBytes = m_BudgetBytes;
+  state.m_FolderVisits = m_FolderVisits;
+  state.m_SenderOpens = m_SenderOpens;
+  const std::string& data = Serialization::ToString(state);
+  Util::WriteFile(GetStatePath(), m_Encrypt ? Crypto::AESEncrypt(data, m_Pass) : data);
+}
+
+void PrefetchScheduler::Add(uint64_t p_Id, uint32_t p_Level, bool p_IsBody, const std::string& p_Folder,
+                            const PrefetchHints& p_Hints)
+{
+  Entry entry;
+  entry.m_Key = Key(p_Level, 0, -(++m_Seq));
+  entry.m_IsBody = p_IsBody;
+  entry.m_Folder = p_Folder;
+  entry.m_Hints = p_Hints;
+  Insert(p_Id, entry);
+}
+
+void PrefetchScheduler::Update(uint64_t p_Id, const PrefetchHints& p_Hints)
+{
+  auto it = m_Entries.find(p_Id);
+  if (it == m_Entries.end()) return;
+
+  Entry entry = it->second;
+  (entry.m_IsBody ? m_BodyQueue : m_Queue).erase(entry.m_Key);
+  m_Entries.erase(it);
+
+  // keep the list position of the original request, as it is only known by the ui
+  const int32_t listIndex = entry.m_Hints.m_ListIndex;
+  entry.m_Hints = p_Hints;
+  entry.m_Hints.m_ListIndex = (p_Hints.m_ListIndex >= 0) ? p_Hints.m_ListIndex : listIndex;
+  Insert(p_Id, entry);
+}
+
+bool PrefetchScheduler::Next(uint64_t& p_Id, int64_t& p_WaitMs)
+{
+  p_WaitMs = 0;
+  auto it = m_Queue.begin();
+  auto bodyIt = m_BodyQueue.begin();
+  bool useBody = (bodyIt != m_BodyQueue.end()) &&
+    ((it == m_Queue.end()) || (std::get<0>(bodyIt->first) < std::get<0>(it->first)));
+  if (useBody)
+  {
+    if (!IsBodyAllowed())
+    {
+      useBody = false;
+    }
+    else
+    {
+      const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+      if (m_NextBodyTime > now)
+      {
+        if (it == m_Queue.end())
+        {
+          p_WaitMs = std::chrono::duration_cast<std::chrono::milliseconds>(m_NextBodyTime - now).count();
+          return false;
+        }
+
+        useBody = false;
+      }
+    }
+  }
+
+  if (!useBody && (it == m_Queue.end())) return false;
+
+  std::map<Key, uint64_t>& queue = useBody ? m_BodyQueue : m_Queue;
+  auto nextIt = useBody ? bodyIt : it;
+  p_Id = nextIt->second;
+  queue.erase(nextIt);
+  m_Entries.erase(p_Id);
+  return true;
+}
+
+bool PrefetchScheduler::HasReady() const
+{
+  return !m_Queue.empty() || (!m_BodyQueue.empty() && IsBodyAllowed());
+}
+
+void PrefetchScheduler::Done(bool p_IsBody, uint64_t p_Bytes, double p_Secs)
+{
+  if (!p_IsBody) return;
+
+  const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  const time_t nowTime = time(NULL);
+  if ((nowTime < m_BudgetStartTime) || ((nowTime - m_BudgetStartTime) >= s_BudgetPeriodSec))
+  {
+    m_BudgetStartTime = nowTime;
+    m_BudgetBytes = 0;
+  }
+
+  m_BudgetBytes += p_Bytes;
+  if ((s_DailyBudget > 0) && (m_BudgetBytes >= s_DailyBudget))
+  {
+    LOG_DEBUG("prefetch budget %llu bytes used", (unsigned long long)m_BudgetBytes);
+  }
+
+  if (s_MaxKbps > 0)
+  {
+    const int64_t delayMs = (int64_t)((p_Bytes * 1000) / ((uint64_t)s_MaxKbps * 1024));
+    m_NextBodyTime = std::max(now, m_NextBodyTime) + std::chrono::milliseconds(delayMs);
+  }
+
+  if ((s_MinKbps > 0) && (p_Bytes >= s_MinSampleBytes) && (p_Secs > 0))
+  {
+    const double kbps = ((double)p_Bytes / 1024.0) / p_Secs;
+    m_LinkKbps = (m_LinkKbps == 0) ? kbps : ((0.7 * m_LinkKbps) + (0.3 * kbps));
+    if (m_LinkKbps < s_MinKbps)
+    {
+      LOG_DEBUG("prefetch paused on slow link %.1f KB/sec", m_LinkKbps);
+      m_PausedUntil = now + s_SlowLinkPause;
+      m_LinkKbps = 0;
+    }
+  }
+}
+
+void PrefetchScheduler::Clear()
+{
+  m_Queue.clear();
+  m_BodyQueue.clear();
+  m_Entries.clear();
+}
+
+void PrefetchScheduler::NotifyFolderVisit(const std::string& p_Folder)
+{
+  m_MaxFolderVisits = std::max(m_MaxFolderVisits, ++m_FolderVisits[p_Folder]);
+}
+
+void PrefetchScheduler::NotifyMessageOpened(const std::string& p_Sender)
+{
+  if (p_Sender.empty()) return;
+
+  ++m_SenderOpens[p_Sender];
+}
+
+void PrefetchScheduler::NotifyCursor(const std::string& p_Folder, int32_t p_ListIndex)
+{
+  if ((p_Folder == m_CursorFolder) && (p_ListIndex == m_CursorListIndex)) return;
+
+  m_CursorFolder = p_Folder;
+  m_CursorListIndex = p_ListIndex;
+
+  // re-rank queued bodies by distance to the new cursor position
+  for (auto& idEntry : m_Entries)
+  {
+    Entry& entry = idEntry.second;
+    if (!entry.m_IsBody || (entry.m_Hints.m_ListIndex < 0)) continue;
+
+    m_BodyQueue.erase(entry.m_Key);
+    std::get<1>(entry.m_Key) = -GetScore(entry.m_Folder, entry.m_Hints);
+    m_BodyQueue[entry.m_Key] = idEntry.first;
+  }
+}
+
+void PrefetchScheduler::SetLimits(uint32_t p_MaxKbps, uint64_t p_DailyBudget, uint32_t p_MinKbps, bool p_Metered)
+{
+  s_MaxKbps = p_MaxKbps;
+  s_DailyBudget = p_DailyBudget;
+  s_MinKbps = p_MinKbps;
+  s_Metered = p_Metered;
+}
+
+void PrefetchScheduler::ChangePass(const bool p_CacheEncrypt, ReEncrypt& p_ReEncrypt)
+{
+  if (!p_CacheEncrypt) return;
+
+  p_ReEncrypt.AddFile(GetStatePath());
+}
+
+double PrefetchScheduler::GetScore(const std::string& p_Folder, const PrefetchHints& p_Hints) const
+{
+  double score = 0;
+  if (p_Hints.m_Unseen)
+  {
+    score += 4.0;
+  }
+
+  if (p_Hints.m_Time != 0)
+  {
+    const double ageDays = std::max(0.0, (double)(time(NULL) - p_Hints.m_Time) / (24 * 60 * 60));
+    score += 3.0 / (1.0 + (ageDays / 7.0));
+  }
+
+  if ((p_Hints.m_ListIndex >= 0) && (m_CursorListIndex >= 0) && (p_Folder == m_CursorFolder))
+  {
+    score += 3.0 / (1.0 + std::abs(p_Hints.m_ListIndex - m_CursorListIndex));
+  }
+
+  auto folderIt = m_FolderVisits.find(p_Folder);
+  if ((folderIt != m_FolderVisits.end()) && (m_MaxFolderVisits > 0))
+  {
+    score += (2.0 * folderIt->second) / m_MaxFolderVisits;
+  }
+
+  auto senderIt = m_SenderOpens.find(p_Hints.m_Sender);
+  if (senderIt != m_SenderOpens.end())
+  {
+    score += 2.0 * std::min(1.0, senderIt->second / 5.0);
+  }
+
+  return score;
+}
+
+bool PrefetchScheduler::IsBodyAllowed() const
+{
+  if (s_Metered) return false;
+
+  const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  if (now < m_PausedUntil) return false;
+
+  const time_t nowTime = time(NULL);
+  if ((s_DailyBudget > 0) && (m_BudgetBytes >= s_DailyBudget) && (nowTime >= m_BudgetStartTime) &&
+      ((nowTime - m_BudgetStartTime) < s_BudgetPeriodSec)) return false;
+
+  return true;
+}
+
+void PrefetchScheduler::Insert(uint64_t p_Id, const Entry& p_Entry)
+{
+  Entry entry = p_Entry;
+  if (entry.m_IsBody)
+  {
+    std::get<1>(entry.m_Key) = -GetScore(entry.m_Folder, entry.m_Hints);
+  }
+
+  (entry.m_IsBody ? m_BodyQueue : m_Queue)[entry.m_Key] = p_Id;
+  m_Entries[p_Id] = entry;
+}
+
+std::string PrefetchScheduler::GetStatePath()
+{
+  return CacheUtil::GetCacheDir() + std::string("prefetch");
+}
@@ -0,0 +1,112 @@
+// prefetchscheduler.h
+//
+// Copyright (c) 2024 Kristofer Berggren
+// All rights reserved.
+//
+// falanet is distributed under the MIT license, see LICENSE for details.
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <string>
+#include <tuple>
+
+// hints on how likely a message is to be opened by the user
+struct PrefetchHints
+{
+  bool m_Unseen = false;
+  time_t m_Time = 0;
+  int32_t m_ListIndex = -1; // position in message list, -1 if not in view
+  std::string m_Sender;
+};
+
+class ReEncrypt;
+
+// orders queued prefetch requests by level, with bodies ranked by likelihood of
+// being opened, and paces body prefetch by bandwidth and daily byte budget, pausing
+// it on metered or slow links. budget use and folder and sender statistics are kept
+// in the cache across runs. callers serialize access.
+class PrefetchScheduler
+{
+public:
+  void Load(const bool p_Encrypt, const std::string& p_Pass);
+  void Save() const;
+
+  void Add(uint64_t p_Id, uint32_t p_Level, bool p_IsBody, const std::string& p_Folder,
+           const PrefetchHints& p_Hints);
+  void Update(uint64_t p_Id, const PrefetchHints& p_Hints);
+  bool Next(uint64_t& p_Id, int64_t& p_WaitMs);
+  bool HasReady() const;
+  void Done(bool p_IsBody, uint64_t p_Bytes, double p_Secs);
+  void Clear();
+
+  void NotifyFolderVisit(const std::string& p_Folder);
+  void NotifyMessageOpened(const std::string& p_Sender);
+  void NotifyCursor(const std::string& p_Folder, int32_t p_ListIndex);
+
+  static void SetLimits(uint32_t p_MaxKbps, uint64_t p_DailyBudget, uint32_t p_MinKbps, bool p_Metered);
+  static void ChangePass(const bool p_CacheEncrypt, ReEncrypt& p_ReEncrypt);
+
+private:
+  // level, negated score and negated sequence, so best and most recently added come first
+  typedef std::tuple<uint32_t, double, int64_t> Key;
+
+  struct Entry
+  {
+    Key m_Key;
+    bool m_IsBody = false;
+    std::string m_Folder;
+    PrefetchHints m_Hints;
+  };
+
+  struct State
+  {
+    int64_t m_BudgetStartTime = 0;
+    uint64_t m_BudgetBytes = 0;
+    std::map<std::string, uint32_t> m_FolderVisits;
+    std::map<std::string, uint32_t> m_SenderOpens;
+
+    template<class Archive>
+    void serialize(Archive& p_Archive)
+    {
+      p_Archive(m_BudgetStartTime,
+                m_BudgetBytes,
+                m_FolderVisits,
+                m_SenderOpens);
+    }
+  };
+
+  double GetScore(const std::string& p_Folder, const PrefetchHints& p_Hints) const;
+  bool IsBodyAllowed() const;
+  void Insert(uint64_t p_Id, const Entry& p_Entry);
+  static std::string GetStatePath();
+
+private:
+  std::map<Key, uint64_t> m_Queue;
+  std::map<Key, uint64_t> m_BodyQueue;
+  std::map<uint64_t, Entry> m_Entries;
+  int64_t m_Seq = 0;
+
+  std::map<std::string, uint32_t> m_FolderVisits;
+  uint32_t m_MaxFolderVisits = 0;
+  std::map<std::string, uint32_t> m_SenderOpens;
+  std::string m_CursorFolder;
+  int32_t m_CursorListIndex = -1;
+
+  std::chrono::steady_clock::time_point m_NextBodyTime;
+  time_t m_BudgetStartTime = 0; // wall clock, as budget period spans runs
+  uint64_t m_BudgetBytes = 0;
+  std::chrono::steady_clock::time_point m_PausedUntil;
+  double m_LinkKbps = 0;
+
+  bool m_Encrypt = false;
+  std::string m_Pass;
+
+  static uint32_t s_MaxKbps;
+  static uint64_t s_DailyBudget;
+  static uint32_t s_MinKbps;
+  static bool s_Metered;
+};
@@ -0,0 +1,379 @@
+// reencrypt.cpp
+//
+// Copyright (c) 2024 Kristofer Berggren
+// All rights reserved.
+//
+// falanet is distributed under the MIT license, see LICENSE for details.
+
+#include "reencrypt.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "crypto.h"
+#include "loghelp.h"
+#include "util.h"
+
+static const std::string s_JournalMagic = "reencrypt";
+static const std::string s_PassCheckMagic = "passcheck";
+static const std::string s_SqliteHeader = std::string("SQLite format 3", 16);
+
+ReEncrypt::ReEncrypt(const std::string& p_OldPass, const std::string& p_NewPass)
+  : m_OldPass(p_OldPass)
+  , m_NewPass(p_NewPass)
+  , m_NextFile(0)
+  , m_DoneBytes(0)
+  , m_TotalBytes(0)
+  , m_Failed(false)
+{
+}
+
+void ReEncrypt::AddFile(const std::string& p_Path)
+{
+  struct stat sb;
+  if (stat(p_Path.c_str(), &sb) != 0) return;
+
+  m_Files.push_back(std::make_pair(p_Path, (uint64_t)sb.st_size));
+  m_TotalBytes += sb.st_size;
+}
+
+void ReEncrypt::AddDir(const std::string& p_Dir)
+{
+  if (!Util::Exists(p_Dir)) return;
+
+  const std::vector<std::string>& files = Util::ListDir(p_Dir);
+  for (const auto& file : files)
+  {
+    // version files are plaintext, and tmp files are left-overs from interrupted writes
+    if ((file == "version") || (Util::GetFileExt(file) == ".tmp")) continue;
+
+    const std::string path = p_Dir + file;
+    if (Util::IsDir(path)) continue;
+
+    AddFile(path);
+  }
+}
+
+bool ReEncrypt::Run()
+{
+  if (!LoadJournal())
+  {
+    std::cout << "Found interrupted password change using a different new password.\n";
+    return false;
+  }
+
+  // process largest files first for better balance between workers
+  std::sort(m_Files.begin(), m_Files.end(),
+            [](const std::pair<std::string, uint64_t>& p_Lhs, const std::pair<std::string, uint64_t>& p_Rhs)
+  {
+    return p_Lhs.second > p_Rhs.second;
+  });
+
+  if (!m_JournaledFiles.empty())
+  {
+    auto it = std::remove_if(m_Files.begin(), m_Files.end(),
+                             [&](const std::pair<std::string, uint64_t>& p_File)
+    {
+      if (m_JournaledFiles.count(p_File.first) == 0) return false;
+
+      m_DoneBytes += p_File.second;
+      return true;
+    });
+    m_Files.erase(it, m_Files.end());
+  }
+
+  ResolveBegunFiles();
+
+  if (!m_Files.empty() && !CheckOldPass())
+  {
+    std::cout << "Old password does not match cache.\n";
+    if (!m_Resumed)
+    {
+      ClearJournal();
+    }
+
+    return false;
+  }
+
+  const unsigned threadCount =
+    std::max(1u, std::min<unsigned>(std::thread::hardware_concurrency(), m_Files.size()));
+
+  LOG_DEBUG("re-encrypt %zu files using %u threads", m_Files.size(), threadCount);
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < threadCount; ++i)
+  {
+    threads.push_back(std::thread(&ReEncrypt::Worker, this));
+  }
+
+  Worker();
+
+  for (auto& thread : threads)
+  {
+    thread.join();
+  }
+
+  ReportProgress(true);
+
+  if (m_Failed)
+  {
+    if (!m_Resumed && (m_JournalCount == 0))
+    {
+      // no file replaced yet, so there is nothing to resume
+      ClearJournal();
+    }
+    else
+    {
+      std::cout << "Re-run with the same passwords to resume.\n";
+    }
+
+    return false;
+  }
+
+  WritePassCheck(m_NewPass);
+  return true;
+}
+
+void ReEncrypt::ClearJournal()
+{
+  Util::DeleteFile(GetJournalPath());
+}
+
+void ReEncrypt::Worker()
+{
+  while (!m_Failed)
+  {
+    const size_t index = m_NextFile++;
+    if (index >= m_Files.size()) break;
+
+    const std::string& path = m_Files.at(index).first;
+    if (!ReEncryptFile(path))
+    {
+      LOG_WARNING("failed to re-encrypt %s", path.c_str());
+      m_Failed = true;
+      break;
+    }
+
+    AppendJournal("done " + path);
+    m_DoneBytes += m_Files.at(index).second;
+    ReportProgress(false);
+  }
+}
+
+bool ReEncrypt::ReEncryptFile(const std::string& p_Path)
+{
+  const std::string tmpPath = p_Path + ".tmp";
+  if (!Crypto::AESReEncryptFile(p_Path, tmpPath, m_OldPass, m_NewPass))
+  {
+    Util::DeleteFile(tmpPath);
+    return false;
+  }
+
+  // flush data before rename, so a crash cannot leave an empty file in place
+  int fd = open(tmpPath.c_str(), O_RDONLY);
+  if (fd != -1)
+  {
+    fsync(fd);
+    close(fd);
+  }
+
+  // journal the new content before rename, so resume can tell whether this file was replaced
+  const std::string mac = Crypto::HMACSHA256File(tmpPath, m_NewPass);
+  if (mac.empty())
+  {
+    Util::DeleteFile(tmpPath);
+    return false;
+  }
+
+  AppendJournal("begin " + mac + " " + p_Path);
+
+  if (rename(tmpPath.c_str(), p_Path.c_str()) != 0)
+  {
+    Util::DeleteFile(tmpPath);
+    return false;
+  }
+
+  return true;
+}
+
+bool ReEncrypt::CheckOldPass()
+{
+  if (VerifyPassCheck(m_OldPass)) return true;
+
+  // no pass check from earlier runs, identify the old pass by an encrypted sqlite db header
+  for (const auto& file : m_Files)
+  {
+    if (Crypto::AESDecryptFileHead(file.first, m_OldPass) == s_SqliteHeader)
+    {
+      // kept until all files are done, so an interrupted run can still verify the old pass
+      WritePassCheck(m_OldPass);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void ReEncrypt::ResolveBegunFiles()
+{
+  // a begun file was replaced only if its content matches the journaled mac, otherwise it has the old pass
+  auto it = std::remove_if(m_Files.begin(), m_Files.end(), [&](const std::pair<std::string, uint64_t>& p_File)
+  {
+    auto begunIt = m_BegunFiles.find(p_File.first);
+    if (begunIt == m_BegunFiles.end()) return false;
+
+    if (Crypto::HMACSHA256File(p_File.first, m_NewPass) != begunIt->second) return false;
+
+    LOG_DEBUG("already re-encrypted %s", p_File.first.c_str());
+    AppendJournal("done " + p_File.first);
+    m_DoneBytes += p_File.second;
+    return true;
+  });
+  m_Files.erase(it, m_Files.end());
+}
+
+bool ReEncrypt::LoadJournal()
+{
+  const std::string path = GetJournalPath();
+  if (!Util::Exists(path))
+  {
+    // journal must be on disk before any file is replaced, to tell which pass a file has on resume
+    WriteJournal(Util::ToHex(Crypto::AESEncrypt(s_JournalMagic, m_NewPass)));
+    const std::string dir = Util::GetApplicationDir();
+    int fd = open(dir.c_str(), O_RDONLY);
+    if (fd != -1)
+    {
+      fsync(fd);
+      close(fd);
+    }
+
+    return true;
+  }
+
+  std::istringstream stream(Util::ReadFile(path));
+  std::string line;
+  std::getline(stream, line);
+  if (Crypto::AESDecrypt(Util::FromHex(line), m_NewPass) != s_JournalMagic) return false;
+
+  m_Resumed = true;
+
+  static const std::string beginPrefix = "begin ";
+  static const std::string donePrefix = "done ";
+  while (std::getline(stream, line))
+  {
+    if (line.empty()) continue;
+
+    if (line.compare(0, beginPrefix.size(), beginPrefix) == 0)
+    {
+      const size_t macEnd = line.find(' ', beginPrefix.size());
+      if (macEnd == std::string::npos) continue;
+
+      const std::string mac = line.substr(beginPrefix.size(), macEnd - beginPrefix.size());
+      m_BegunFiles[line.substr(macEnd + 1)] = mac;
+    }
+    else if (line.compare(0, donePrefix.size(), donePrefix) == 0)
+    {
+      m_JournaledFiles.insert(line.substr(donePrefix.size()));
+    }
+    else
+    {
+      // journals from earlier versions list done files only
+      m_JournaledFiles.insert(line);
+    }
+  }
+
+  LOG_DEBUG("resume re-encrypt with %zu files done %zu begun", m_JournaledFiles.size(), m_BegunFiles.size());
+  return true;
+}
+
+void ReEncrypt::AppendJournal(const std::string& p_Path)
+{
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  WriteJournal(p_Path);
+  ++m_JournalCount;
+}
+
+// synced before returning, so a begin line is always on disk before its file is replaced
+void ReEncrypt::WriteJournal(const std::string& p_Line)
+{
+  const std::string line = p_Line + "\n";
+  int fd = open(GetJournalPath().c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
+  if (fd == -1)
+  {
+    LOG_WARNING("failed to open journal");
+    return;
+  }
+
+  if (write(fd, line.data(), line.size()) != (ssize_t)line.size())
+  {
+    LOG_WARNING("failed to write journal");
+  }
+
+  fsync(fd);
+  close(fd);
+}
+
+void ReEncrypt::ReportProgress(bool p_Done)
+{
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  const uint64_t totalBytes = m_TotalBytes;
+  const int percent = (totalBytes > 0) ? (int)((m_DoneBytes * 100) / totalBytes) : 100;
+  if ((percent != m_LastPercent) || p_Done)
+  {
+    m_LastPercent = percent;
+    std::cout << "\rRe-encrypting cache: " << percent << "% of " << Util::GetPrefixedSize(totalBytes)
+              << (p_Done ? "\n" : "") << std::flush;
+  }
+}
+
+std::string ReEncrypt::GetJournalPath()
+{
+  return Util::GetApplicationDir() + std::string("reencrypt.journal");
+}
+
+std::string ReEncrypt::GetPassCheckPath()
+{
+  return Util::GetApplicationDir() + std::string("passcheck");
+}
+
+bool ReEncrypt::VerifyPassCheck(const std::string& p_Pass)
+{
+  const std::string path = GetPassCheckPath();
+  if (!Util::Exists(path)) return false;
+
+  std::istringstream stream(Util::ReadFile(path));
+  std::string salt;
+  std::string mac;
+  stream >> salt >> mac;
+  return !mac.empty() && (Crypto::HMACSHA256(Util::FromHex(salt) + s_PassCheckMagic, p_Pass) == mac);
+}
+
+void ReEncrypt::WritePassCheck(const std::string& p_Pass)
+{
+  const std::string salt = Crypto::SHA256(std::to_string(time(NULL)) + Util::GetApplicationDir()).substr(0, 16);
+  const std::string str = salt + " " + Crypto::HMACSHA256(Util::FromHex(salt) + s_PassCheckMagic, p_Pass) + "\n";
+  const std::string path = GetPassCheckPath();
+  const std::string tmpPath = path + ".tmp";
+  int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1)
+  {
+    LOG_WARNING("failed to open pass check");
+    return;
+  }
+
+  const bool rv = (write(fd, str.data(), str.size()) == (ssize_t)str.size()) && (fsync(fd) == 0);
+  close(fd);
+  if (!rv || (rename(tmpPath.c_str(), path.c_str()) != 0))
+  {
+    LOG_WARNING("failed to write pass check");
+    Util::DeleteFile(tmpPath);
+  }
+}
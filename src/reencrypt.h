@@ -0,0 +1,64 @@
+// reencrypt.h
+//
+// Copyright (c) 2024 Kristofer Berggren
+// All rights reserved.
+//
+// falanet is distributed under the MIT license, see LICENSE for details.
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+// re-encrypts queued files from old to new pass using a pool of worker threads,
+// each file is streamed to a temporary file which atomically replaces it, and
+// replacements are journaled so an interrupted run can be resumed. the old pass
+// is verified against a pass check file or a known file header before any file
+// is touched, since cbc padding alone does not reliably reject a wrong pass.
+class ReEncrypt
+{
+public:
+  ReEncrypt(const std::string& p_OldPass, const std::string& p_NewPass);
+
+  void AddFile(const std::string& p_Path);
+  void AddDir(const std::string& p_Dir);
+  bool Run();
+
+  static void ClearJournal();
+
+private:
+  void Worker();
+  bool ReEncryptFile(const std::string& p_Path);
+  bool CheckOldPass();
+  void ResolveBegunFiles();
+  bool LoadJournal();
+  void AppendJournal(const std::string& p_Path);
+  void WriteJournal(const std::string& p_Line);
+  void ReportProgress(bool p_Done);
+  static std::string GetJournalPath();
+  static std::string GetPassCheckPath();
+  static bool VerifyPassCheck(const std::string& p_Pass);
+  static void WritePassCheck(const std::string& p_Pass);
+
+private:
+  std::string m_OldPass;
+  std::string m_NewPass;
+  std::vector<std::pair<std::string, uint64_t>> m_Files; // path, size
+  std::set<std::string> m_JournaledFiles;
+  std::map<std::string, std::string> m_BegunFiles; // path, mac of new content
+
+  std::atomic<size_t> m_NextFile;
+  std::atomic<uint64_t> m_DoneBytes;
+  std::atomic<uint64_t> m_TotalBytes;
+  std::atomic<bool> m_Failed;
+  bool m_Resumed = false;
+  size_t m_JournalCount = 0;
+  std::mutex m_Mutex;
+  int m_LastPercent = -1;
+};
@@ -22,7 +22,8 @@ SearchEngine::~SearchEngine()
 
 void SearchEngine::Index(const std::string& p_DocId, const int64_t p_Time, const std::string& p_Body,
                          const std::string& p_Subject, const std::string& p_From, const std::string& p_To,
-                         const std::string& p_Folder)
+                         const std::string& p_Folder, const std::string& p_Summary,
+                         const std::string& p_CollapseKey)
 {
   Xapian::TermGenerator termGenerator;
   termGenerator.set_stemmer(Xapian::Stem("none")); // @todo: add natural language detection
@@ -41,18 +42,26 @@ void SearchEngine::Index(const std::string& p_DocId, const int64_t p_Time, const
   termGenerator.index_text(p_Folder, 1, "D");
   termGenerator.increase_termpos();
 
+  const std::string docIdTerm = GetDocIdTerm(p_DocId);
   doc.set_data(p_DocId);
-  doc.add_boolean_term(p_DocId);
+  doc.add_boolean_term(docIdTerm);
   doc.add_value(m_DateSlot, Xapian::sortable_serialise((double)p_Time));
+  doc.add_value(m_SummarySlot, p_Summary);
+  if (!p_CollapseKey.empty())
+  {
+    // copies of the same message in different folders share collapse key
+    doc.add_boolean_term("K" + p_CollapseKey);
+    doc.add_value(m_CollapseSlot, p_CollapseKey);
+  }
 
   std::lock_guard<std::mutex> writableDatabaseLock(m_WritableDatabaseMutex);
-  m_WritableDatabase->replace_document(p_DocId, doc);
+  m_WritableDatabase->replace_document(docIdTerm, doc);
 }
 
 void SearchEngine::Remove(const std::string& p_DocId)
 {
   std::lock_guard<std::mutex> writableDatabaseLock(m_WritableDatabaseMutex);
-  m_WritableDatabase->delete_document(p_DocId);
+  m_WritableDatabase->delete_document(GetDocIdTerm(p_DocId));
 }
 
 void SearchEngine::Commit()
@@ -62,45 +71,80 @@ void SearchEngine::Commit()
 }
 
 std::vector<std::string> SearchEngine::Search(const std::string& p_QueryStr, const unsigned p_Offset,
-                                              const unsigned p_Max, bool& p_HasMore)
+                                              const unsigned p_Max, bool& p_HasMore,
+                                              std::vector<std::string>& p_Summaries,
+                                              std::vector<std::string>& p_CollapseKeys,
+                                              std::vector<bool>& p_HasCollapsed)
 {
   std::vector<std::string> docIds;
 
   try
   {
-    Xapian::QueryParser queryParser;
-    queryParser.set_stemmer(Xapian::Stem("none")); // @todo: add natural language detection
-    queryParser.set_default_op(Xapian::Query::op::OP_AND);
+    std::lock_guard<std::mutex> DatabaseLock(m_DatabaseMutex);
+    ReopenDatabase();
+    if (!m_Enquire || (p_QueryStr != m_EnquireQueryStr))
+    {
+      Xapian::QueryParser queryParser;
+      queryParser.set_stemmer(Xapian::Stem("none")); // @todo: add natural language detection
+      queryParser.set_default_op(Xapian::Query::op::OP_AND);
 
-    // search all prefixes if none specified
-    queryParser.add_prefix("", "B");
-    queryParser.add_prefix("", "S");
-    queryParser.add_prefix("", "F");
-    queryParser.add_prefix("", "T");
-    queryParser.add_prefix("", "D");
+      // search all prefixes if none specified
+      queryParser.add_prefix("", "B");
+      queryParser.add_prefix("", "S");
+      queryParser.add_prefix("", "F");
+      queryParser.add_prefix("", "T");
+      queryParser.add_prefix("", "D");
 
-    // supported search prefixes to specify specific fields
-    queryParser.add_prefix("body", "B");
-    queryParser.add_prefix("subject", "S");
-    queryParser.add_prefix("from", "F");
-    queryParser.add_prefix("to", "T");
-    queryParser.add_prefix("folder", "D");
+      // supported search prefixes to specify specific fields
+      queryParser.add_prefix("body", "B");
+      queryParser.add_prefix("subject", "S");
+      queryParser.add_prefix("from", "F");
+      queryParser.add_prefix("to", "T");
+      queryParser.add_prefix("folder", "D");
 
-    // flags
-    unsigned flags = Xapian::QueryParser::FLAG_DEFAULT | Xapian::QueryParser::FLAG_WILDCARD;
+      // flags
+      unsigned flags = Xapian::QueryParser::FLAG_DEFAULT | Xapian::QueryParser::FLAG_WILDCARD;
 
-    Xapian::Query query = queryParser.parse_query(p_QueryStr, flags);
+      Xapian::Query query = queryParser.parse_query(p_QueryStr, flags);
 
-    std::lock_guard<std::mutex> DatabaseLock(m_DatabaseMutex);
-    m_Database->reopen();
-    Xapian::Enquire enquire(*m_Database);
-    enquire.set_query(query);
-    enquire.set_sort_by_value(m_DateSlot, true /* reverse */);
+      m_Enquire.reset(new Xapian::Enquire(*m_Database));
+      m_Enquire->set_query(query);
+      m_Enquire->set_sort_by_value(m_DateSlot, true /* reverse */);
+      m_Enquire->set_collapse_key(m_CollapseSlot); // documents without collapse key are not collapsed
+      m_EnquireQueryStr = p_QueryStr;
+      m_MSetValid = false;
+    }
+
+    // reuse previous match set for consecutive pages of same query on unchanged database
+    const unsigned endOffset = p_Offset + p_Max + 1;
+    const bool useMSet = m_MSetValid && (p_Offset >= m_MSetOffset) &&
+      (m_MSetExact || (p_Offset == m_MSetOffset)) &&
+      (m_MSetComplete || (endOffset <= (m_MSetOffset + m_MSet.size())));
+    if (!useMSet)
+    {
+      // bound matching time for first page to keep search-as-you-type responsive,
+      // no total count is estimated beyond what is needed to fill the page
+      const double timeLimit = (p_Offset == 0) ? m_FirstPageTimeLimitSec : 0.0;
+      m_Enquire->set_time_limit(timeLimit);
+      const unsigned fetchCount = (p_Max + 1) * 2;
+      m_MSet = m_Enquire->get_mset(p_Offset, fetchCount, 0 /* checkatleast */);
+      m_MSetOffset = p_Offset;
+
+      // a time-limited match may stop early and come back short or unordered, so it is only
+      // trusted beyond the requested page when exact bounds prove the match ran to completion
+      m_MSetExact = (timeLimit <= 0.0) ||
+        (m_MSet.get_matches_lower_bound() == m_MSet.get_matches_upper_bound());
+      m_MSetComplete = m_MSetExact && (m_MSet.size() < fetchCount);
+      m_MSetValid = true;
+    }
+    else
+    {
+      LOG_DEBUG("reuse mset offset %d size %d", m_MSetOffset, (int)m_MSet.size());
+    }
 
     p_HasMore = false;
     size_t cnt = 0;
-    Xapian::MSet mset = enquire.get_mset(p_Offset, p_Max + 1);
-    for (Xapian::MSetIterator it = mset.begin(); it != mset.end(); ++it, ++cnt)
+    for (Xapian::doccount i = p_Offset - m_MSetOffset; i < m_MSet.size(); ++i, ++cnt)
     {
       if (cnt >= p_Max)
       {
@@ -108,8 +152,27 @@ std::vector<std::string> SearchEngine::Search(const std::string& p_QueryStr, con
         break;
       }
 
-      Xapian::Document doc = m_Database->get_document(*it);
+      Xapian::Document doc = m_MSet[i].get_document();
       docIds.push_back(doc.get_data());
+      p_Summaries.push_back(doc.get_value(m_SummarySlot));
+      const std::string& collapseKey = doc.get_value(m_CollapseSlot);
+      bool hasCollapsed = (m_MSet[i].get_collapse_count() > 0);
+      if (!hasCollapsed && !collapseKey.empty())
+      {
+        // collapse count is a lower bound as matching stops early, zero means
+        // unknown, so check for other documents with same key
+        hasCollapsed = (m_Database->get_termfreq("K" + collapseKey) > 1);
+      }
+
+      p_CollapseKeys.push_back(collapseKey);
+      p_HasCollapsed.push_back(hasCollapsed);
+    }
+
+    // matching cut short may have more beyond this mset, next page re-queries without time limit
+    if (!p_HasMore && !m_MSetComplete &&
+        ((m_MSetOffset + m_MSet.size()) < m_MSet.get_matches_upper_bound()))
+    {
+      p_HasMore = true;
     }
   }
   catch (const Xapian::QueryParserError& queryParserError)
@@ -124,7 +187,7 @@ std::vector<std::string> SearchEngine::Search(const std::string& p_QueryStr, con
 std::vector<std::string> SearchEngine::List()
 {
   std::lock_guard<std::mutex> DatabaseLock(m_DatabaseMutex);
-  m_Database->reopen();
+  ReopenDatabase();
   std::vector<std::string> docIds;
   for (Xapian::PostingIterator it = m_Database->postlist_begin("");
        it != m_Database->postlist_end(""); ++it)
@@ -136,11 +199,61 @@ std::vector<std::string> SearchEngine::List()
   return docIds;
 }
 
+std::vector<std::string> SearchEngine::ListCollapsed(const std::string& p_CollapseKey)
+{
+  std::lock_guard<std::mutex> DatabaseLock(m_DatabaseMutex);
+  ReopenDatabase();
+  std::vector<std::string> docIds;
+  const std::string term = "K" + p_CollapseKey;
+  for (Xapian::PostingIterator it = m_Database->postlist_begin(term);
+       it != m_Database->postlist_end(term); ++it)
+  {
+    Xapian::Document doc = m_Database->get_document(*it);
+    docIds.push_back(doc.get_data());
+  }
+
+  return docIds;
+}
+
 bool SearchEngine::Exists(const std::string& p_DocId)
 {
   std::lock_guard<std::mutex> DatabaseLock(m_DatabaseMutex);
-  m_Database->reopen();
-  return (m_Database->postlist_begin(p_DocId) != m_Database->postlist_end(p_DocId));
+  ReopenDatabase();
+  const std::string docIdTerm = GetDocIdTerm(p_DocId);
+  return (m_Database->postlist_begin(docIdTerm) != m_Database->postlist_end(docIdTerm));
+}
+
+// doc ids are stored as boolean terms, so listing them by prefix needs no document fetches
+std::vector<std::string> SearchEngine::ListDocIds(const std::string& p_Prefix)
+{
+  std::lock_guard<std::mutex> DatabaseLock(m_DatabaseMutex);
+  ReopenDatabase();
+  std::vector<std::string> docIds;
+  const std::string termPrefix = GetDocIdTerm(p_Prefix);
+  for (Xapian::TermIterator it = m_Database->allterms_begin(termPrefix);
+       it != m_Database->allterms_end(termPrefix); ++it)
+  {
+    docIds.push_back((*it).substr(termPrefix.size() - p_Prefix.size()));
+  }
+
+  return docIds;
+}
+
+// non-alphabetic prefix, so doc id terms cannot collide with term generator terms
+std::string SearchEngine::GetDocIdTerm(const std::string& p_DocId)
+{
+  return "#" + p_DocId;
+}
+
+// must be called with database lock
+void SearchEngine::ReopenDatabase()
+{
+  if (m_Database->reopen())
+  {
+    // cached query state refers to previous revision
+    m_Enquire.reset();
+    m_MSetValid = false;
+  }
 }
 
 std::string SearchEngine::GetXapianVersion()
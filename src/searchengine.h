@@ -22,17 +22,26 @@ public:
 
   void Index(const std::string& p_DocId, const int64_t p_Time, const std::string& p_Body,
              const std::string& p_Subject, const std::string& p_From, const std::string& p_To,
-             const std::string& p_Folder);
+             const std::string& p_Folder, const std::string& p_Summary, const std::string& p_CollapseKey);
   void Remove(const std::string& p_DocId);
   void Commit();
 
   std::vector<std::string> Search(const std::string& p_QueryStr, const unsigned p_Offset,
-                                  const unsigned p_Max, bool& p_HasMore);
+                                  const unsigned p_Max, bool& p_HasMore,
+                                  std::vector<std::string>& p_Summaries,
+                                  std::vector<std::string>& p_CollapseKeys,
+                                  std::vector<bool>& p_HasCollapsed);
   std::vector<std::string> List();
+  std::vector<std::string> ListCollapsed(const std::string& p_CollapseKey);
   bool Exists(const std::string& p_DocId);
+  std::vector<std::string> ListDocIds(const std::string& p_Prefix);
 
   static std::string GetXapianVersion();
 
+private:
+  void ReopenDatabase();
+  static std::string GetDocIdTerm(const std::string& p_DocId);
+
 private:
   std::string m_DbPath;
   std::unique_ptr<Xapian::Database> m_Database;
@@ -40,4 +49,15 @@ private:
   std::mutex m_DatabaseMutex;
   std::mutex m_WritableDatabaseMutex;
   const Xapian::valueno m_DateSlot = 1;
+  const Xapian::valueno m_SummarySlot = 2;
+  const Xapian::valueno m_CollapseSlot = 3;
+  const double m_FirstPageTimeLimitSec = 0.25;
+
+  std::unique_ptr<Xapian::Enquire> m_Enquire;
+  std::string m_EnquireQueryStr;
+  Xapian::MSet m_MSet;
+  unsigned m_MSetOffset = 0;
+  bool m_MSetComplete = false;
+  bool m_MSetExact = false;
+  bool m_MSetValid = false;
 };
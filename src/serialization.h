@@ -13,6 +13,7 @@
 #include <cereal/types/map.hpp>
 #include <cereal/types/set.hpp>
 #include <cereal/types/string.hpp>
+#include <cereal/types/vector.hpp>
 
 class Serialization
 {
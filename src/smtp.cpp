@@ -7,7 +7,10 @@
 
 #include "smtp.h"
 
+#include <chrono>
 #include <cstring>
+#include <fstream>
+#include <sstream>
 
 #include <netdb.h>
 #include <unistd.h>
@@ -18,12 +21,14 @@
 #include <libetpan/mailimf.h>
 #include <libetpan/mailmime.h>
 #include <libetpan/mailsmtp.h>
+#include <libetpan/mailstream.h>
 #include <uuid/uuid.h>
 
 #include "auth.h"
 #include "log.h"
 #include "loghelp.h"
 #include "sasl.h"
+#include "util.h"
 
 Smtp::Smtp(const std::string& p_User, const std::string& p_Pass, const std::string& p_Host,
            const uint16_t p_Port, const std::string& p_Address, const int64_t p_Timeout)
@@ -47,6 +52,9 @@ Smtp::Smtp(const std::string& p_User, const std::string& p_Pass, const std::stri
 Smtp::~Smtp()
 {
   LOG_DEBUG_FUNC(STR());
+
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  Disconnect();
 }
 
 SmtpStatus Smtp::Send(const std::string& p_Subject, const std::string& p_Message,
@@ -57,21 +65,38 @@ SmtpStatus Smtp::Send(const std::string& p_Subject, const std::string& p_Message
                       const Contact& p_From,
                       const std::vector<std::string>& p_AttachmentPaths,
                       const bool p_Flowed,
-                      std::string& p_ResultMessage)
+                      std::string& p_ResultMessage,
+                      std::string& p_ResultPath)
 {
   LOG_DEBUG_FUNC(STR());
   LOG_TRACE_FUNC(STR(p_Subject, p_Message, p_To, p_Cc, p_Bcc, p_RefMsgId, p_From, p_AttachmentPaths, p_Flowed));
 
   std::vector<Contact> hdrbcc;
   const std::string& header = GetHeader(p_Subject, p_To, p_Cc, hdrbcc, p_RefMsgId, p_From);
-  const std::string& body = GetBody(p_Message, p_HtmlMessage, p_AttachmentPaths, p_Flowed);
-  const std::string& data = header + body;
-  p_ResultMessage = data;
   std::vector<Contact> recipients;
   recipients.insert(recipients.end(), p_To.begin(), p_To.end());
   recipients.insert(recipients.end(), p_Cc.begin(), p_Cc.end());
   recipients.insert(recipients.end(), p_Bcc.begin(), p_Bcc.end());
 
+  if (!p_AttachmentPaths.empty())
+  {
+    // spool messages with attachments to file, to keep memory usage independent of attachment size
+    p_ResultPath = Util::GetTempFilename(".eml");
+    if (!WriteMessageFile(p_ResultPath, header, p_Message, p_HtmlMessage, p_AttachmentPaths, p_Flowed))
+    {
+      Util::DeleteFile(p_ResultPath);
+      p_ResultPath.clear();
+      return SmtpStatusMessageFailed;
+    }
+
+    std::ifstream file(p_ResultPath, std::ios::binary);
+    return SendMessage(file, recipients);
+  }
+
+  const std::string& body = GetBody(p_Message, p_HtmlMessage, p_AttachmentPaths, p_Flowed);
+  const std::string& data = header + body;
+  p_ResultMessage = data;
+
   return SendMessage(data, recipients);
 }
 
@@ -93,16 +118,93 @@ SmtpStatus Smtp::Send(const std::string& p_Data, const std::vector<Contact>& p_T
 
 SmtpStatus Smtp::SendMessage(const std::string& p_Data, const std::vector<Contact>& p_Recipients)
 {
-  LOG_DEBUG_FUNC(STR());
   LOG_TRACE_FUNC(STR(p_Data, p_Recipients));
 
+  std::istringstream data(p_Data);
+  return SendMessage(data, p_Recipients);
+}
+
+SmtpStatus Smtp::SendMessage(std::istream& p_Data, const std::vector<Contact>& p_Recipients)
+{
+  LOG_DEBUG_FUNC(STR());
+
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+  const bool isReused = (m_Smtp != NULL);
+
+  SmtpStatus status = Connect();
+  if (status != SmtpStatusOk) return status;
+
+  bool isStreamError = false;
+  uint64_t dataSize = 0;
+  status = SendTransaction(p_Data, p_Recipients, isStreamError, dataSize);
+  if ((status != SmtpStatusOk) && isStreamError && isReused)
+  {
+    // server may have closed an idle session, retry once on a new one
+    LOG_DEBUG("reconnect stale session");
+    Disconnect();
+    status = Connect();
+    if (status != SmtpStatusOk) return status;
+
+    p_Data.clear();
+    p_Data.seekg(0);
+    dataSize = 0;
+    status = SendTransaction(p_Data, p_Recipients, isStreamError, dataSize);
+  }
+
+  if (status != SmtpStatusOk)
+  {
+    Disconnect();
+    return status;
+  }
+
+  const int64_t durationMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now() - startTime).count();
+  LOG_DEBUG("send success %llu bytes %d ms reused %d", (unsigned long long)dataSize, (int)durationMs,
+            (int)isReused);
+
+  return SmtpStatusOk;
+}
+
+bool Smtp::IsConnected()
+{
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  return (m_Smtp != NULL);
+}
+
+bool Smtp::Keepalive()
+{
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  if (m_Smtp == NULL) return false;
+
+  int rv = LOG_IF_SMTP_ERR(mailsmtp_noop(m_Smtp));
+  if ((rv != MAILSMTP_NO_ERROR) || (m_Smtp->response_code != 250))
+  {
+    Disconnect();
+    return false;
+  }
+
+  return true;
+}
+
+void Smtp::Close()
+{
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  Disconnect();
+}
+
+SmtpStatus Smtp::Connect()
+{
+  if (m_Smtp != NULL) return SmtpStatusOk;
+
   const bool isSSL = (m_Port == 465);
   const bool isStartTLS = (m_Port == 587);
   const bool isUseIP = Util::GetSendIp();
 
-  mailsmtp* smtp = LOG_IF_NULL(mailsmtp_new(0, NULL));
-  if (smtp == NULL) return SmtpStatusFailed;
+  m_Smtp = LOG_IF_NULL(mailsmtp_new(0, NULL));
+  if (m_Smtp == NULL) return SmtpStatusFailed;
 
+  mailsmtp* smtp = m_Smtp;
   if (Log::GetTraceEnabled())
   {
     mailsmtp_set_logger(smtp, Logger, NULL);
@@ -111,151 +213,397 @@ SmtpStatus Smtp::SendMessage(const std::string& p_Data, const std::vector<Contac
   mailsmtp_set_timeout(smtp, m_Timeout);
 
   int rv = MAILSMTP_NO_ERROR;
+  SmtpStatus status = SmtpStatusOk;
 
-  if (isStartTLS)
+  if (isSSL)
+  {
+    rv = LOG_IF_SMTP_ERR(mailsmtp_ssl_connect(smtp, m_Host.c_str(), m_Port));
+  }
+  else
   {
     rv = LOG_IF_SMTP_ERR(mailsmtp_socket_connect(smtp, m_Host.c_str(), m_Port));
-    if (rv != MAILSMTP_NO_ERROR) return SmtpStatusConnFailed;
+  }
 
-    if (isUseIP)
+  if (rv != MAILSMTP_NO_ERROR)
+  {
+    status = SmtpStatusConnFailed;
+  }
+
+  if (status == SmtpStatusOk)
+  {
+    rv = isUseIP ? LOG_IF_SMTP_ERR(mailsmtp_init_with_ip(smtp, 1)) : LOG_IF_SMTP_ERR(mailsmtp_init(smtp));
+    if (rv != MAILSMTP_NO_ERROR)
     {
-      rv = LOG_IF_SMTP_ERR(mailsmtp_init_with_ip(smtp, 1));
+      status = SmtpStatusInitFailed;
     }
-    else
+  }
+
+  if ((status == SmtpStatusOk) && isStartTLS)
+  {
+    rv = LOG_IF_SMTP_ERR(mailsmtp_socket_starttls(smtp));
+    if (rv == MAILSMTP_NO_ERROR)
     {
-      rv = LOG_IF_SMTP_ERR(mailsmtp_init(smtp));
+      rv = isUseIP ? LOG_IF_SMTP_ERR(mailsmtp_init_with_ip(smtp, 1)) : LOG_IF_SMTP_ERR(mailsmtp_init(smtp));
     }
 
-    if (rv != MAILSMTP_NO_ERROR) return SmtpStatusInitFailed;
-
-    rv = LOG_IF_SMTP_ERR(mailsmtp_socket_starttls(smtp));
-    if (rv != MAILSMTP_NO_ERROR) return SmtpStatusInitFailed;
+    if (rv != MAILSMTP_NO_ERROR)
+    {
+      status = SmtpStatusInitFailed;
+    }
+  }
 
-    if (isUseIP)
+  if (status == SmtpStatusOk)
+  {
+    // libetpan does not track chunking, so check the ehlo response for it
+    const std::string ehloResponse = (smtp->response != NULL) ? smtp->response : "";
+    m_HasChunking = (smtp->esmtp & MAILSMTP_ESMTP) &&
+      (("\n" + Util::ToLower(ehloResponse)).find("\nchunking") != std::string::npos);
+    m_HasPipelining = (smtp->esmtp & MAILSMTP_ESMTP_PIPELINING);
+    LOG_DEBUG("smtp->auth = 0x%x pipelining %d chunking %d", smtp->auth, m_HasPipelining, m_HasChunking);
+
+    if (Auth::IsOAuthEnabled())
     {
-      rv = LOG_IF_SMTP_ERR(mailsmtp_init_with_ip(smtp, 1));
+      std::string token = Auth::GetAccessToken();
+      rv = LOG_IF_SMTP_ERR(mailsmtp_oauth2_authenticate(smtp, m_User.c_str(), token.c_str()));
     }
     else
     {
-      rv = LOG_IF_SMTP_ERR(mailsmtp_init(smtp));
+      rv = LOG_IF_SMTP_ERR(mailsmtp_auth(smtp, m_User.c_str(), m_Pass.c_str()));
     }
 
-    if (rv != MAILSMTP_NO_ERROR) return SmtpStatusInitFailed;
+    if (rv != MAILSMTP_NO_ERROR)
+    {
+      if (!Sasl::IsMechanismsSupported(smtp->auth))
+      {
+        LOG_ERROR("requested sasl auth mechanism not available, please ensure "
+                  "libsasl2-modules or equivalent package is installed");
+        status = SmtpStatusSaslFailed;
+      }
+      else if (rv == MAILSMTP_ERROR_NOT_IMPLEMENTED)
+      {
+        LOG_ERROR("requested sasl auth is available but not used by libetpan, "
+                  "please ensure libetpan is built with sasl support");
+        status = SmtpStatusImplFailed;
+      }
+      else
+      {
+        status = SmtpStatusAuthFailed;
+      }
+    }
   }
-  else if (isSSL)
+
+  if (status != SmtpStatusOk)
   {
-    rv = LOG_IF_SMTP_ERR(mailsmtp_ssl_connect(smtp, m_Host.c_str(), m_Port));
-    if (rv != MAILSMTP_NO_ERROR) return SmtpStatusConnFailed;
+    mailsmtp_free(m_Smtp);
+    m_Smtp = NULL;
+  }
+
+  return status;
+}
 
-    if (isUseIP)
+void Smtp::Disconnect()
+{
+  if (m_Smtp == NULL) return;
+
+  LOG_IF_SMTP_ERR(mailsmtp_quit(m_Smtp));
+  mailsmtp_free(m_Smtp);
+  m_Smtp = NULL;
+}
+
+SmtpStatus Smtp::SendTransaction(std::istream& p_Data, const std::vector<Contact>& p_Recipients,
+                                 bool& p_IsStreamError, uint64_t& p_DataSize)
+{
+  mailsmtp* smtp = m_Smtp;
+  p_IsStreamError = false;
+
+  const std::string envid = GenerateMessageId();
+  const bool isEsmtp = (smtp->esmtp & MAILSMTP_ESMTP);
+  const bool isDsn = (smtp->esmtp & MAILSMTP_ESMTP_DSN);
+  const bool useChunking = m_HasChunking;
+  char prevChar = 0;
+
+  if (!m_HasPipelining)
+  {
+    int rv = MAILSMTP_NO_ERROR;
+    if (isEsmtp)
     {
-      rv = LOG_IF_SMTP_ERR(mailsmtp_init_with_ip(smtp, 1));
+      rv = LOG_IF_SMTP_ERR(mailesmtp_mail(smtp, m_Address.c_str(), 1, envid.c_str()));
     }
     else
     {
-      rv = LOG_IF_SMTP_ERR(mailsmtp_init(smtp));
+      rv = LOG_IF_SMTP_ERR(mailsmtp_mail(smtp, m_Address.c_str()));
     }
 
-    if (rv != MAILSMTP_NO_ERROR) return SmtpStatusInitFailed;
-  }
-  else
-  {
-    rv = LOG_IF_SMTP_ERR(mailsmtp_socket_connect(smtp, m_Host.c_str(), m_Port));
-    if (rv != MAILSMTP_NO_ERROR) return SmtpStatusConnFailed;
+    p_IsStreamError = (rv == MAILSMTP_ERROR_STREAM);
+    if (rv != MAILSMTP_NO_ERROR) return SmtpStatusMessageFailed;
 
-    if (isUseIP)
+    for (auto& recipient : p_Recipients)
     {
-      rv = LOG_IF_SMTP_ERR(mailsmtp_init_with_ip(smtp, 1));
+      if (isEsmtp)
+      {
+        rv = LOG_IF_SMTP_ERR(mailesmtp_rcpt(smtp, recipient.GetAddress().c_str(),
+                                            MAILSMTP_DSN_NOTIFY_FAILURE | MAILSMTP_DSN_NOTIFY_DELAY,
+                                            NULL));
+      }
+      else
+      {
+        rv = LOG_IF_SMTP_ERR(mailsmtp_rcpt(smtp, recipient.GetAddress().c_str()));
+      }
+
+      if (rv != MAILSMTP_NO_ERROR) return SmtpStatusMessageFailed;
     }
-    else
+
+    if (useChunking)
     {
-      rv = LOG_IF_SMTP_ERR(mailsmtp_init(smtp));
+      return SendChunks(p_Data, prevChar, p_DataSize) ? SmtpStatusOk : SmtpStatusMessageFailed;
     }
 
-    if (rv != MAILSMTP_NO_ERROR) return SmtpStatusInitFailed;
+    rv = LOG_IF_SMTP_ERR(mailsmtp_data(smtp));
+    if (rv != MAILSMTP_NO_ERROR) return SmtpStatusMessageFailed;
+
+    return SendData(p_Data, p_DataSize) ? SmtpStatusOk : SmtpStatusMessageFailed;
   }
 
-  LOG_DEBUG("smtp->auth = 0x%x", smtp->auth);
+  // pipelining, send envelope and data command in one write, then read replies in order. with
+  // chunking, bdat is only sent after all recipients are accepted, as a chunk sent after a
+  // rejected recipient could not be withdrawn, and a last chunk would already be delivered.
+  std::string commands = "MAIL FROM:<" + m_Address + ">";
+  if (isDsn)
+  {
+    commands += " RET=FULL ENVID=" + envid;
+  }
 
-  if (Auth::IsOAuthEnabled())
+  commands += "\r\n";
+  for (auto& recipient : p_Recipients)
   {
-    std::string token = Auth::GetAccessToken();
-    rv = LOG_IF_SMTP_ERR(mailsmtp_oauth2_authenticate(smtp, m_User.c_str(), token.c_str()));
+    commands += "RCPT TO:<" + recipient.GetAddress() + ">" + (isDsn ? " NOTIFY=FAILURE,DELAY" : "") + "\r\n";
   }
-  else
+
+  if (!useChunking)
   {
-    rv = LOG_IF_SMTP_ERR(mailsmtp_auth(smtp, m_User.c_str(), m_Pass.c_str()));
+    commands += "DATA\r\n";
   }
 
-  if (rv != MAILSMTP_NO_ERROR)
+  if (!WriteCommand(commands))
   {
-    if (!Sasl::IsMechanismsSupported(smtp->auth))
-    {
-      LOG_ERROR("requested sasl auth mechanism not available, please ensure "
-                "libsasl2-modules or equivalent package is installed");
-      return SmtpStatusSaslFailed;
-    }
-    else if (rv == MAILSMTP_ERROR_NOT_IMPLEMENTED)
+    p_IsStreamError = true;
+    return SmtpStatusMessageFailed;
+  }
+
+  bool isOk = true;
+  const int mailCode = ReadResponse();
+  p_IsStreamError = (mailCode == 0);
+  if (mailCode != 250)
+  {
+    LOG_WARNING("smtp mail from failed %d", mailCode);
+    isOk = false;
+  }
+
+  for (size_t i = 0; i < p_Recipients.size(); ++i)
+  {
+    const int rcptCode = ReadResponse();
+    if ((rcptCode != 250) && (rcptCode != 251))
     {
-      LOG_ERROR("requested sasl auth is available but not used by libetpan, "
-                "please ensure libetpan is built with sasl support");
-      return SmtpStatusImplFailed;
+      LOG_WARNING("smtp rcpt to failed %d", rcptCode);
+      isOk = false;
     }
-
-    return SmtpStatusAuthFailed;
   }
 
-  const std::string envid = GenerateMessageId();
+  if (useChunking)
+  {
+    if (!isOk) return SmtpStatusMessageFailed;
 
-  if (smtp->esmtp & MAILSMTP_ESMTP)
+    return SendChunks(p_Data, prevChar, p_DataSize) ? SmtpStatusOk : SmtpStatusMessageFailed;
+  }
+
+  const int dataCode = ReadResponse();
+  if (dataCode != 354)
   {
-    rv = LOG_IF_SMTP_ERR(mailesmtp_mail(smtp, m_Address.c_str(), 1, envid.c_str()));
+    LOG_WARNING("smtp data failed %d", dataCode);
+    return SmtpStatusMessageFailed;
   }
-  else
+
+  if (!isOk)
   {
-    rv = LOG_IF_SMTP_ERR(mailsmtp_mail(smtp, m_Address.c_str()));
+    // some recipients rejected, abort transaction by closing the connection
+    // as any data sent now would be delivered to the accepted recipients
+    mailstream_close(smtp->stream);
+    smtp->stream = NULL;
+    return SmtpStatusMessageFailed;
   }
 
-  if (rv != MAILSMTP_NO_ERROR) return SmtpStatusMessageFailed;
+  return SendData(p_Data, p_DataSize) ? SmtpStatusOk : SmtpStatusMessageFailed;
+}
 
-  clist* recipients = clist_new();
-  for (auto& recipient : p_Recipients)
+bool Smtp::SendData(std::istream& p_Data, uint64_t& p_DataSize)
+{
+  // sends message data after a DATA command, with dot-stuffing and terminating line
+  bool isLineStart = true;
+  char prevChar = 0;
+  std::string chunk;
+  bool hasMore = true;
+  while (hasMore)
   {
-    char* r = strdup(recipient.GetAddress().c_str());
-    if (smtp->esmtp & MAILSMTP_ESMTP)
+    hasMore = ReadChunk(p_Data, chunk, prevChar);
+    p_DataSize += chunk.size();
+
+    std::string out;
+    out.reserve(chunk.size() + (chunk.size() / 64));
+    for (const char ch : chunk)
     {
-      rv = LOG_IF_SMTP_ERR(mailesmtp_rcpt(smtp, r,
-                                          MAILSMTP_DSN_NOTIFY_FAILURE | MAILSMTP_DSN_NOTIFY_DELAY,
-                                          NULL));
+      if (isLineStart && (ch == '.'))
+      {
+        out += '.';
+      }
+
+      out += ch;
+      isLineStart = (ch == '\n');
     }
-    else
+
+    if (!hasMore)
     {
-      rv = LOG_IF_SMTP_ERR(mailsmtp_rcpt(smtp, r));
+      out += isLineStart ? ".\r\n" : "\r\n.\r\n";
     }
 
-    if (rv != MAILSMTP_NO_ERROR) return SmtpStatusMessageFailed;
+    if (mailstream_write(m_Smtp->stream, out.c_str(), out.size()) == -1) return false;
+  }
 
-    clist_append(recipients, (void*)r);
+  if (mailstream_flush(m_Smtp->stream) == -1) return false;
 
-    free(r);
+  const int code = ReadResponse();
+  if (code != 250)
+  {
+    LOG_WARNING("smtp data message failed %d", code);
+    return false;
   }
 
-  rv = LOG_IF_SMTP_ERR(mailsmtp_data(smtp));
+  return true;
+}
 
-  if (rv != MAILSMTP_NO_ERROR) return SmtpStatusMessageFailed;
+bool Smtp::SendChunks(std::istream& p_Data, char& p_PrevChar, uint64_t& p_DataSize)
+{
+  // sends remaining message data as bdat chunks, bdat data is sent as-is without dot-stuffing
+  std::string chunk;
+  bool hasMore = true;
+  while (hasMore)
+  {
+    hasMore = ReadChunk(p_Data, chunk, p_PrevChar);
+    p_DataSize += chunk.size();
+    if (!WriteCommand(GetChunkCommand(chunk, !hasMore) + chunk)) return false;
 
+    const int code = ReadResponse();
+    if (code != 250)
+    {
+      LOG_WARNING("smtp bdat failed %d", code);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool Smtp::WriteCommand(const std::string& p_Command)
+{
+  if (mailstream_write(m_Smtp->stream, p_Command.c_str(), p_Command.size()) == -1) return false;
+
+  return (mailstream_flush(m_Smtp->stream) != -1);
+}
+
+int Smtp::ReadResponse()
+{
+  // returns final reply code of a (possibly multi-line) reply, or 0 on stream error
+  int code = 0;
+  while (true)
   {
-    rv = LOG_IF_SMTP_ERR(mailsmtp_data_message(smtp, p_Data.c_str(), p_Data.size()));
+    char* line = mailstream_read_line_remove_eol(m_Smtp->stream, m_Smtp->line_buffer);
+    if (line == NULL) return 0;
 
-    if (rv != MAILSMTP_NO_ERROR) return SmtpStatusMessageFailed;
+    LOG_TRACE("smtp response: %s", line);
+    code = (int)strtol(line, NULL, 10);
+    if ((strlen(line) < 4) || (line[3] != '-')) break;
   }
 
-  clist_free(recipients);
-  mailsmtp_free(smtp);
+  return code;
+}
 
-  LOG_DEBUG("send success");
+bool Smtp::ReadChunk(std::istream& p_Data, std::string& p_Chunk, char& p_PrevChar)
+{
+  // reads next chunk of message data with bare lf converted to crlf, returns false on last chunk
+  static const size_t chunkSize = 1024 * 1024;
+  std::vector<char> buf(chunkSize);
+  p_Data.read(buf.data(), buf.size());
+  const size_t len = (size_t)p_Data.gcount();
+
+  p_Chunk.clear();
+  p_Chunk.reserve(len + (len / 32));
+  for (size_t i = 0; i < len; ++i)
+  {
+    const char ch = buf[i];
+    if ((ch == '\n') && (p_PrevChar != '\r'))
+    {
+      p_Chunk += '\r';
+    }
 
-  return SmtpStatusOk;
+    p_Chunk += ch;
+    p_PrevChar = ch;
+  }
+
+  return p_Data.good() && (p_Data.peek() != std::char_traits<char>::eof());
+}
+
+std::string Smtp::GetChunkCommand(const std::string& p_Chunk, bool p_IsLast)
+{
+  return "BDAT " + std::to_string(p_Chunk.size()) + (p_IsLast ? " LAST" : "") + "\r\n";
+}
+
+static int WriteCrLf(void* p_Data, const char* p_Str, size_t p_Len)
+{
+  // mailmime write callback, writes to file with bare lf converted to crlf
+  std::pair<FILE*, char>* state = static_cast<std::pair<FILE*, char>*>(p_Data);
+  for (size_t i = 0; i < p_Len; ++i)
+  {
+    const char ch = p_Str[i];
+    if ((ch == '\n') && (state->second != '\r'))
+    {
+      if (fputc('\r', state->first) == EOF) return 0;
+    }
+
+    if (fputc(ch, state->first) == EOF) return 0;
+
+    state->second = ch;
+  }
+
+  return 1;
+}
+
+bool Smtp::WriteMessageFile(const std::string& p_Path, const std::string& p_Header,
+                            const std::string& p_Message, const std::string& p_HtmlMessage,
+                            const std::vector<std::string>& p_AttachmentPaths, bool p_Flowed)
+{
+  FILE* file = fopen(p_Path.c_str(), "wb");
+  if (file == NULL)
+  {
+    LOG_WARNING("failed to open %s", p_Path.c_str());
+    return false;
+  }
+
+  std::pair<FILE*, char> state(file, 0);
+  bool rv = WriteCrLf(&state, p_Header.c_str(), p_Header.size());
+
+  // attachments are read and encoded by libetpan directly from disk
+  struct mailmime* msgMime = GetBodyMime(p_Message, p_HtmlMessage, p_AttachmentPaths, p_Flowed);
+  int col = 0;
+  rv = rv && (mailmime_write_driver(WriteCrLf, &state, &col, msgMime->mm_data.mm_message.mm_msg_mime) ==
+              MAILIMF_NO_ERROR);
+  mailmime_free(msgMime);
+
+  rv = (fclose(file) == 0) && rv;
+  if (!rv)
+  {
+    LOG_WARNING("failed to write %s", p_Path.c_str());
+  }
+
+  return rv;
 }
 
 std::string Smtp::GetHeader(const std::string& p_Subject, const std::vector<Contact>& p_To,
@@ -364,6 +712,22 @@ std::string Smtp::GetHeader(const std::string& p_Subject, const std::vector<Cont
 
 std::string Smtp::GetBody(const std::string& p_Message, const std::string& p_HtmlMessage,
                           const std::vector<std::string>& p_AttachmentPaths, bool p_Flowed)
+{
+  struct mailmime* msgMime = GetBodyMime(p_Message, p_HtmlMessage, p_AttachmentPaths, p_Flowed);
+
+  int col = 0;
+  MMAPString* mmstr = mmap_string_new(NULL);
+  mailmime_write_mem(mmstr, &col, msgMime->mm_data.mm_message.mm_msg_mime);
+  std::string out = std::string(mmstr->str, mmstr->len);
+
+  mmap_string_free(mmstr);
+  mailmime_free(msgMime);
+
+  return out;
+}
+
+mailmime* Smtp::GetBodyMime(const std::string& p_Message, const std::string& p_HtmlMessage,
+                            const std::vector<std::string>& p_AttachmentPaths, bool p_Flowed)
 {
   // html and text message part layout:
   // mainMultipart (content for message, subType="mixed")
@@ -426,15 +790,7 @@ std::string Smtp::GetBody(const std::string& p_Message, const std::string& p_Htm
   struct mailmime* msg_mime = mailmime_new_message_data(NULL);
   mailmime_smart_add_part(msg_mime, mainMultipart);
 
-  int col = 0;
-  MMAPString* mmstr = mmap_string_new(NULL);
-  mailmime_write_mem(mmstr, &col, mainMultipart);
-  std::string out = std::string(mmstr->str, mmstr->len);
-
-  mmap_string_free(mmstr);
-  mailmime_free(msg_mime);
-
-  return out;
+  return msg_mime;
 }
 
 std::string Smtp::GetErrorMessage(SmtpStatus p_SmtpStatus)
@@ -7,6 +7,7 @@
 
 #pragma once
 
+#include <istream>
 #include <mutex>
 #include <string>
 #include <vector>
@@ -43,7 +44,8 @@ public:
                   const Contact& p_From,
                   const std::vector<std::string>& p_AttachmentPaths,
                   const bool p_Flowed,
-                  std::string& p_ResultMessage);
+                  std::string& p_ResultMessage,
+                  std::string& p_ResultPath);
   SmtpStatus Send(const std::string& p_Data, const std::vector<Contact>& p_To,
                   const std::vector<Contact>& p_Cc, const std::vector<Contact>& p_Bcc);
   std::string GetHeader(const std::string& p_Subject, const std::vector<Contact>& p_To,
@@ -53,8 +55,28 @@ public:
                       const std::vector<std::string>& p_AttachmentPaths, bool p_Flowed);
   static std::string GetErrorMessage(SmtpStatus p_SmtpStatus);
 
+  bool IsConnected();
+  bool Keepalive();
+  void Close();
+
 private:
   SmtpStatus SendMessage(const std::string& p_Data, const std::vector<Contact>& p_Recipients);
+  SmtpStatus SendMessage(std::istream& p_Data, const std::vector<Contact>& p_Recipients);
+  SmtpStatus Connect();
+  void Disconnect();
+  SmtpStatus SendTransaction(std::istream& p_Data, const std::vector<Contact>& p_Recipients,
+                             bool& p_IsStreamError, uint64_t& p_DataSize);
+  bool SendData(std::istream& p_Data, uint64_t& p_DataSize);
+  bool SendChunks(std::istream& p_Data, char& p_PrevChar, uint64_t& p_DataSize);
+  bool WriteCommand(const std::string& p_Command);
+  int ReadResponse();
+  static bool ReadChunk(std::istream& p_Data, std::string& p_Chunk, char& p_PrevChar);
+  static std::string GetChunkCommand(const std::string& p_Chunk, bool p_IsLast);
+  bool WriteMessageFile(const std::string& p_Path, const std::string& p_Header,
+                        const std::string& p_Message, const std::string& p_HtmlMessage,
+                        const std::vector<std::string>& p_AttachmentPaths, bool p_Flowed);
+  struct mailmime* GetBodyMime(const std::string& p_Message, const std::string& p_HtmlMessage,
+                               const std::vector<std::string>& p_AttachmentPaths, bool p_Flowed);
   struct mailmime* GetMimeTextPart(const char* p_MimeType, const std::string& p_Message, bool p_Flowed);
   struct mailmime* GetMimeFilePart(const std::string& p_Path,
                                    const std::string& p_MimeType);
@@ -78,4 +100,7 @@ private:
   uint16_t m_Port = 0;
   std::string m_Address;
   int64_t m_Timeout = 0;
+  mailsmtp* m_Smtp = NULL;
+  bool m_HasPipelining = false;
+  bool m_HasChunking = false;
 };
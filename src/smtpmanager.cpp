@@ -13,10 +13,12 @@
 #include "loghelp.h"
 #include "smtp.h"
 
+static const int64_t s_KeepaliveInterval = 60;
+
 SmtpManager::SmtpManager(const std::string& p_User, const std::string& p_Pass,
                          const std::string& p_Host, const uint16_t p_Port,
                          const std::string& p_Name, const std::string& p_Address,
-                         const bool p_Connect, const int64_t p_Timeout,
+                         const bool p_Connect, const int64_t p_Timeout, const int64_t p_IdleTimeout,
                          const std::function<void(const SmtpManager::Result&)>& p_ResultHandler,
                          const std::function<void(const StatusUpdate&)>& p_StatusHandler)
   : m_User(p_User)
@@ -27,11 +29,16 @@ SmtpManager::SmtpManager(const std::string& p_User, const std::string& p_Pass,
   , m_Address(p_Address)
   , m_Connect(p_Connect)
   , m_Timeout(p_Timeout)
+  , m_IdleTimeout(p_IdleTimeout)
   , m_ResultHandler(p_ResultHandler)
   , m_StatusHandler(p_StatusHandler)
   , m_Running(false)
+  , m_LastActivity(0)
 {
   LOG_IF_NONZERO(pipe(m_Pipe));
+
+  // session shared by async and sync sends, kept open between messages
+  m_Smtp.reset(new Smtp(m_User, m_Pass, m_Host, m_Port, m_Address, m_Timeout));
 }
 
 SmtpManager::~SmtpManager()
@@ -108,7 +115,8 @@ void SmtpManager::Process()
     FD_ZERO(&fds);
     FD_SET(m_Pipe[0], &fds);
     int maxfd = m_Pipe[0];
-    struct timeval tv = {60, 0};
+    const int64_t timeoutSec = PerformIdle();
+    struct timeval tv = { (time_t)timeoutSec, 0 };
     int rv = select(maxfd + 1, &fds, NULL, NULL, &tv);
 
     if (rv == 0) continue;
@@ -151,6 +159,8 @@ void SmtpManager::Process()
 
   LOG_DEBUG("exiting loop");
 
+  m_Smtp->Close();
+
   std::unique_lock<std::mutex> lock(m_ExitedCondMutex);
   m_ExitedCond.notify_one();
 }
@@ -177,17 +187,18 @@ SmtpManager::Result SmtpManager::PerformAction(const SmtpManager::Action& p_Acti
   const std::vector<std::string> att = Util::SplitPaths(p_Action.m_Att);
   const bool flow = p_Action.m_FormatFlowed;
 
-  Smtp smtp(m_User, m_Pass, m_Host, m_Port, m_Address, m_Timeout);
-
   if (p_Action.m_IsSendMessage)
   {
     SetStatus(Status::FlagSending);
-    result.m_SmtpStatus = smtp.Send(p_Action.m_Subject, p_Action.m_Body, p_Action.m_HtmlBody,
-                                    to, cc, bcc, ref, from, att, flow, result.m_Message);
+    result.m_SmtpStatus = m_Smtp->Send(p_Action.m_Subject, p_Action.m_Body, p_Action.m_HtmlBody,
+                                    to, cc, bcc, ref, from, att, flow, result.m_Message,
+                                    result.m_MessagePath);
     ClearStatus(Status::FlagSending);
   }
   else if (p_Action.m_IsCreateMessage)
   {
+    // message creation does not need the session, use separate instance to avoid waiting for a send
+    Smtp smtp(m_User, m_Pass, m_Host, m_Port, m_Address, m_Timeout);
     const std::string& header = smtp.GetHeader(p_Action.m_Subject, to, cc, bcc, ref, from);
     const std::string& body = smtp.GetBody(p_Action.m_Body, p_Action.m_HtmlBody, att, false);
     result.m_Message = header + body;
@@ -197,7 +208,7 @@ SmtpManager::Result SmtpManager::PerformAction(const SmtpManager::Action& p_Acti
   {
     SetStatus(Status::FlagSending);
     result.m_Message = p_Action.m_CreatedMsg;
-    result.m_SmtpStatus = smtp.Send(p_Action.m_CreatedMsg, to, cc, bcc);
+    result.m_SmtpStatus = m_Smtp->Send(p_Action.m_CreatedMsg, to, cc, bcc);
     ClearStatus(Status::FlagSending);
   }
   else
@@ -205,9 +216,42 @@ SmtpManager::Result SmtpManager::PerformAction(const SmtpManager::Action& p_Acti
     LOG_WARNING("unknown action");
   }
 
+  if (p_Action.m_IsSendMessage || p_Action.m_IsSendCreatedMessage)
+  {
+    m_LastActivity = (int64_t)time(NULL);
+    if (m_IdleTimeout == 0)
+    {
+      m_Smtp->Close();
+    }
+  }
+
   return result;
 }
 
+int64_t SmtpManager::PerformIdle()
+{
+  // keep session alive with noop while idle, close it after idle timeout, returns seconds until next check
+  if (!m_Smtp->IsConnected()) return s_KeepaliveInterval;
+
+  const int64_t now = (int64_t)time(NULL);
+  const int64_t idleSec = now - m_LastActivity;
+  if (idleSec >= m_IdleTimeout)
+  {
+    LOG_DEBUG("smtp idle timeout, disconnect");
+    m_Smtp->Close();
+    return s_KeepaliveInterval;
+  }
+
+  if ((now - std::max(m_LastKeepalive, (int64_t)m_LastActivity)) >= s_KeepaliveInterval)
+  {
+    m_Smtp->Keepalive();
+    m_LastKeepalive = now;
+  }
+
+  const int64_t untilIdleTimeout = m_IdleTimeout - idleSec;
+  return std::max<int64_t>(1, std::min(untilIdleTimeout, s_KeepaliveInterval));
+}
+
 void SmtpManager::SetStatus(uint32_t p_Flags)
 {
   StatusUpdate statusUpdate;
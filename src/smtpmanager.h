@@ -11,6 +11,7 @@
 #include <condition_variable>
 #include <deque>
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
@@ -50,13 +51,14 @@ public:
   {
     SmtpStatus m_SmtpStatus = SmtpStatusFailed;
     std::string m_Message;
+    std::string m_MessagePath; // set instead of m_Message for messages spooled to file
     Action m_Action;
   };
 
 public:
   SmtpManager(const std::string& p_User, const std::string& p_Pass, const std::string& p_Host,
               const uint16_t p_Port, const std::string& p_Name, const std::string& p_Address,
-              const bool p_Connect, const int64_t p_Timeout,
+              const bool p_Connect, const int64_t p_Timeout, const int64_t p_IdleTimeout,
               const std::function<void(const SmtpManager::Result&)>& p_ResultHandler,
               const std::function<void(const StatusUpdate&)>& p_StatusHandler);
   virtual ~SmtpManager();
@@ -69,6 +71,7 @@ public:
 private:
   void Process();
   Result PerformAction(const Action& p_Action);
+  int64_t PerformIdle();
   void SetStatus(uint32_t p_Flags);
   void ClearStatus(uint32_t p_Flags);
 
@@ -81,6 +84,7 @@ private:
   std::string m_Address;
   bool m_Connect = false;
   int64_t m_Timeout = 0;
+  int64_t m_IdleTimeout = 0;
   std::function<void(const SmtpManager::Result&)> m_ResultHandler;
   std::function<void(const StatusUpdate&)> m_StatusHandler;
   std::atomic<bool> m_Running;
@@ -93,4 +97,8 @@ private:
   std::mutex m_QueueMutex;
 
   int m_Pipe[2] = { -1, -1 };
+
+  std::unique_ptr<Smtp> m_Smtp;
+  std::atomic<int64_t> m_LastActivity;
+  int64_t m_LastKeepalive = 0;
 };
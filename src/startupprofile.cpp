@@ -0,0 +1,61 @@
+// startupprofile.cpp
+//
+// Copyright (c) 2024 Kristofer Berggren
+// All rights reserved.
+//
+// falanet is distributed under the MIT license, see LICENSE for details.
+
+#include "startupprofile.h"
+
+#include <algorithm>
+#include <iostream>
+
+#include "loghelp.h"
+
+bool StartupProfile::m_Enabled = false;
+std::chrono::steady_clock::time_point StartupProfile::m_StartTime = std::chrono::steady_clock::now();
+std::vector<std::pair<std::string, int64_t>> StartupProfile::m_Milestones;
+std::mutex StartupProfile::m_Mutex;
+
+void StartupProfile::Enable()
+{
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  m_Enabled = true;
+}
+
+bool StartupProfile::IsEnabled()
+{
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  return m_Enabled;
+}
+
+void StartupProfile::Mark(const std::string& p_Milestone)
+{
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  if (!m_Enabled) return;
+
+  // only first occurrence of each milestone is of interest
+  auto it = std::find_if(m_Milestones.begin(), m_Milestones.end(),
+                         [&](const std::pair<std::string, int64_t>& p_Entry)
+  {
+    return p_Entry.first == p_Milestone;
+  });
+  if (it != m_Milestones.end()) return;
+
+  const int64_t elapsedMs =
+    std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_StartTime).count();
+  m_Milestones.push_back(std::make_pair(p_Milestone, elapsedMs));
+  LOG_INFO("startup %s %d ms", p_Milestone.c_str(), (int)elapsedMs);
+}
+
+void StartupProfile::Report()
+{
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  if (!m_Enabled) return;
+
+  std::cout << "Startup profile:\n";
+  for (const auto& milestone : m_Milestones)
+  {
+    std::cout << "  " << milestone.first << ": " << milestone.second << " ms\n";
+  }
+}
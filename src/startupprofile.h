@@ -0,0 +1,29 @@
+// startupprofile.h
+//
+// Copyright (c) 2024 Kristofer Berggren
+// All rights reserved.
+//
+// falanet is distributed under the MIT license, see LICENSE for details.
+
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+class StartupProfile
+{
+public:
+  static void Enable();
+  static bool IsEnabled();
+  static void Mark(const std::string& p_Milestone);
+  static void Report();
+
+private:
+  static bool m_Enabled;
+  static std::chrono::steady_clock::time_point m_StartTime;
+  static std::vector<std::pair<std::string, int64_t>> m_Milestones;
+  static std::mutex m_Mutex;
+};
@@ -10,6 +10,7 @@
 #include <algorithm>
 #include <climits>
 #include <cstdint>
+#include <limits>
 #include <sstream>
 
 #include "addressbook.h"
@@ -19,6 +20,7 @@
 #include "offlinequeue.h"
 #include "sethelp.h"
 #include "sleepdetect.h"
+#include "startupprofile.h"
 #include "status.h"
 #include "version.h"
 
@@ -66,6 +68,7 @@ void Ui::Init()
     { "show_embedded_images", "1" },
     { "show_rich_header", "0" },
     { "markdown_html_compose", "0" },
+    { "max_frame_rate", "20" },
     { "key_prev_msg", "p" },
     { "key_next_msg", "n" },
     { "key_reply_all", "r" },
@@ -358,6 +361,7 @@ void Ui::Init()
   Util::SetLocalizedSubjectPrefixes(m_Config.Get("localized_subject_prefixes"));
   m_Signature = m_Config.Get("signature") == "1";
   m_TopBarShowVersion = m_Config.Get("top_bar_show_version") == "1";
+  m_MaxFrameRate = Util::ToInteger(m_Config.Get("max_frame_rate"));
 
   try
   {
@@ -451,6 +455,9 @@ void Ui::CleanupWindows()
 
 void Ui::DrawAll()
 {
+  StartupProfile::Mark("first draw");
+  m_CursorWin = NULL;
+
   switch (m_State)
   {
     case StateViewMessageList:
@@ -519,9 +526,15 @@ void Ui::DrawAll()
     default:
       werase(m_MainWin);
       mvwprintw(m_MainWin, 0, 0, "Unimplemented state %d", m_State);
-      wrefresh(m_MainWin);
+      wnoutrefresh(m_MainWin);
       break;
   }
+
+  // windows are staged using wnoutrefresh above and output in a single update,
+  // in which curses only emits the lines that differ from the current screen
+  doupdate();
+  m_LastFrameTime = std::chrono::steady_clock::now();
+  m_PendingUiRequest &= ~(UiRequestDrawAll | UiRequestDrawTop);
 }
 
 void Ui::DrawTop()
@@ -540,7 +553,7 @@ void Ui::DrawTop()
 
   mvwprintw(m_TopWin, 0, 0, "%s", topCombined.c_str());
   wattroff(m_TopWin, m_AttrsTopBar);
-  wrefresh(m_TopWin);
+  wnoutrefresh(m_TopWin);
 }
 
 void Ui::DrawDialog()
@@ -595,8 +608,9 @@ void Ui::DrawSearchDialog()
 
   leaveok(m_DialogWin, false);
   wmove(m_DialogWin, 0, 11 + filterPos);
-  wrefresh(m_DialogWin);
+  wnoutrefresh(m_DialogWin);
   leaveok(m_DialogWin, true);
+  m_CursorWin = m_DialogWin;
 }
 
 void Ui::DrawDefaultDialog()
@@ -618,7 +632,7 @@ void Ui::DrawDefaultDialog()
     }
   }
 
-  wrefresh(m_DialogWin);
+  wnoutrefresh(m_DialogWin);
 }
 
 void Ui::SetDialogMessage(const std::string& p_DialogMessage, bool p_Warn /*= false */)
@@ -853,7 +867,7 @@ void Ui::DrawHelp()
         break;
     }
 
-    wrefresh(m_HelpWin);
+    wnoutrefresh(m_HelpWin);
   }
 }
 
@@ -972,7 +986,7 @@ void Ui::DrawFolderList()
     }
   }
 
-  wrefresh(m_MainWin);
+  wnoutrefresh(m_MainWin);
 }
 
 void Ui::DrawAddressList()
@@ -1025,7 +1039,7 @@ void Ui::DrawAddressList()
     }
   }
 
-  wrefresh(m_MainWin);
+  wnoutrefresh(m_MainWin);
 }
 
 void Ui::DrawFileList()
@@ -1115,7 +1129,7 @@ void Ui::DrawFileList()
     }
   }
 
-  wrefresh(m_MainWin);
+  wnoutrefresh(m_MainWin);
 }
 
 void Ui::DrawMessageList()
@@ -1130,11 +1144,11 @@ void Ui::DrawMessageList()
     m_ImapManager->AsyncRequest(request);
   }
 
-  std::set<uint32_t> fetchHeaderUids;
-  std::set<uint32_t> fetchFlagUids;
-  std::set<uint32_t> fetchBodyPriUids;
-  std::set<uint32_t> fetchBodySecUids;
-  std::set<uint32_t> prefetchBodyUids;
+  UidSet fetchHeaderUids;
+  UidSet fetchFlagUids;
+  UidSet fetchBodyPriUids;
+  UidSet fetchBodySecUids;
+  std::map<uint32_t, PrefetchHints> prefetchBodyUids;
 
   {
     std::lock_guard<std::mutex> lock(m_Mutex);
@@ -1142,16 +1156,16 @@ void Ui::DrawMessageList()
     std::map<uint32_t, uint32_t>& flags = m_Flags[m_CurrentFolder];
     const std::map<std::string, uint32_t>& displayUids = GetDisplayUids(m_CurrentFolder);
 
-    std::set<uint32_t>& requestedHeaders = m_RequestedHeaders[m_CurrentFolder];
-    std::set<uint32_t>& requestedFlags = m_RequestedFlags[m_CurrentFolder];
+    UidSet& requestedHeaders = m_RequestedHeaders[m_CurrentFolder];
+    UidSet& requestedFlags = m_RequestedFlags[m_CurrentFolder];
     const std::map<uint32_t, Body>& bodys = m_Bodys[m_CurrentFolder];
-    std::set<uint32_t>& prefetchedBodys = m_PrefetchedBodys[m_CurrentFolder];
-    std::set<uint32_t>& requestedBodys = m_RequestedBodys[m_CurrentFolder];
+    UidSet& prefetchedBodys = m_PrefetchedBodys[m_CurrentFolder];
+    UidSet& requestedBodys = m_RequestedBodys[m_CurrentFolder];
     const std::string& currentDate = Header::GetCurrentDate();
 
     auto selectedUidsIt = m_SelectedUids.find(m_CurrentFolder);
-    std::set<uint32_t> noSelection;
-    const std::set<uint32_t>& folderSelectedUids =
+    UidSet noSelection;
+    const UidSet& folderSelectedUids =
       (selectedUidsIt != m_SelectedUids.end()) ? selectedUidsIt->second : noSelection;
 
     if (!m_PrefetchAllHeaders)
@@ -1181,6 +1195,11 @@ void Ui::DrawMessageList()
       }
     }
 
+    if (!headers.empty())
+    {
+      StartupProfile::Mark("first message list draw");
+    }
+
     bool hasAttrsSelected = (m_AttrsSelectedItem != A_NORMAL);
 
     werase(m_MainWin);
@@ -1296,19 +1315,26 @@ void Ui::DrawMessageList()
           if (m_PrefetchLevel >= PrefetchLevelCurrentView)
           {
             prefetchedBodys.insert(uid);
-            prefetchBodyUids.insert(uid);
+            PrefetchHints& hints = prefetchBodyUids[uid];
+            hints.m_Unseen = isUnread;
+            hints.m_ListIndex = i;
+            if (hit != headers.end())
+            {
+              hints.m_Time = hit->second.GetTimeStamp();
+              hints.m_Sender = hit->second.GetFrom();
+            }
           }
         }
       }
     }
   }
 
-  for (auto& uid : fetchBodyPriUids)
+  for (const auto& uid : fetchBodyPriUids)
   {
     ImapManager::Request request;
     request.m_Folder = m_CurrentFolder;
 
-    std::set<uint32_t> fetchUids;
+    UidSet fetchUids;
     fetchUids.insert(uid);
     request.m_GetBodys = fetchUids;
     request.m_ProcessHtml = !m_Plaintext;
@@ -1317,12 +1343,12 @@ void Ui::DrawMessageList()
     m_ImapManager->AsyncRequest(request);
   }
 
-  for (auto& uid : fetchBodySecUids)
+  for (const auto& uid : fetchBodySecUids)
   {
     ImapManager::Request request;
     request.m_Folder = m_CurrentFolder;
 
-    std::set<uint32_t> fetchUids;
+    UidSet fetchUids;
     fetchUids.insert(uid);
     request.m_GetBodys = fetchUids;
     request.m_ProcessHtml = !m_Plaintext;
@@ -1331,14 +1357,21 @@ void Ui::DrawMessageList()
     m_ImapManager->AsyncRequest(request);
   }
 
-  for (auto& uid : prefetchBodyUids)
+  if (m_PrefetchLevel >= PrefetchLevelCurrentView)
+  {
+    // queued bodies are ranked by distance to the cursor
+    m_ImapManager->NotifyMessageListCursor(m_CurrentFolder, m_MessageListCurrentIndex[m_CurrentFolder]);
+  }
+
+  for (const auto& uidHints : prefetchBodyUids)
   {
     ImapManager::Request request;
     request.m_PrefetchLevel = PrefetchLevelCurrentView;
     request.m_Folder = m_CurrentFolder;
+    request.m_PrefetchHints = uidHints.second;
 
-    std::set<uint32_t> fetchUids;
-    fetchUids.insert(uid);
+    UidSet fetchUids;
+    fetchUids.insert(uidHints.first);
     request.m_GetBodys = fetchUids;
 
     LOG_DEBUG_VAR("prefetch req bodys =", fetchUids);
@@ -1350,7 +1383,7 @@ void Ui::DrawMessageList()
   {
     LOG_DEBUG("fetching %d headers on demand", fetchHeaderUids.size());
 
-    std::set<uint32_t> subsetFetchHeaderUids;
+    UidSet subsetFetchHeaderUids;
     for (auto it = fetchHeaderUids.begin(); it != fetchHeaderUids.end(); ++it)
     {
       subsetFetchHeaderUids.insert(*it);
@@ -1374,7 +1407,7 @@ void Ui::DrawMessageList()
   {
     LOG_DEBUG("fetching %d flags on demand", fetchFlagUids.size());
 
-    std::set<uint32_t> subsetFetchFlagUids;
+    UidSet subsetFetchFlagUids;
     for (auto it = fetchFlagUids.begin(); it != fetchFlagUids.end(); ++it)
     {
       subsetFetchFlagUids.insert(*it);
@@ -1393,15 +1426,15 @@ void Ui::DrawMessageList()
     }
   }
 
-  wrefresh(m_MainWin);
+  wnoutrefresh(m_MainWin);
 }
 
 void Ui::DrawMessageListSearch()
 {
-  std::map<std::string, std::set<uint32_t>> fetchFlagUids;
-  std::map<std::string, std::set<uint32_t>> fetchHeaderUids;
-  std::map<std::string, std::set<uint32_t>> fetchBodyPriUids;
-  std::map<std::string, std::set<uint32_t>> fetchBodySecUids;
+  std::map<std::string, UidSet> fetchFlagUids;
+  std::map<std::string, UidSet> fetchHeaderUids;
+  std::map<std::string, UidSet> fetchBodyPriUids;
+  std::map<std::string, UidSet> fetchBodySecUids;
 
   {
     std::lock_guard<std::mutex> searchLock(m_SearchMutex);
@@ -1424,7 +1457,7 @@ void Ui::DrawMessageListSearch()
         std::lock_guard<std::mutex> lock(m_Mutex);
 
         std::map<uint32_t, uint32_t>& flags = m_Flags[folder];
-        std::set<uint32_t>& requestedFlags = m_RequestedFlags[folder];
+        UidSet& requestedFlags = m_RequestedFlags[folder];
         if ((flags.find(uid) == flags.end()) &&
             (requestedFlags.find(uid) == requestedFlags.end()))
         {
@@ -1460,8 +1493,8 @@ void Ui::DrawMessageListSearch()
       }
 
       auto selectedUidsIt = m_SelectedUids.find(folder);
-      std::set<uint32_t> noSelection;
-      const std::set<uint32_t>& folderSelectedUids =
+      UidSet noSelection;
+      const UidSet& folderSelectedUids =
         (selectedUidsIt != m_SelectedUids.end()) ? selectedUidsIt->second : noSelection;
       bool isSelected = (folderSelectedUids.find(uid) != folderSelectedUids.end());
       std::string selectFlag = (isSelected && !hasAttrsSelected) ? "X" : " ";
@@ -1470,7 +1503,23 @@ void Ui::DrawMessageListSearch()
       shortFrom = Util::ToString(Util::TrimPadWString(Util::ToWString(shortFrom), 20));
       std::string headerLeft = selectFlag + unreadFlag + " " + attachFlag + "  " + shortDate + "  " + shortFrom + "  ";
 
-      std::string folderTag = m_SearchShowFolder ? ("  [" + Util::BaseName(folder) + "]") : "";
+      std::string folderTag;
+      if (m_SearchShowFolder)
+      {
+        // list folders of collapsed copies of the message after its own folder
+        std::string folderNames = Util::BaseName(folder);
+        auto duplicateIt = m_MessageListSearchResultDuplicateFolders.find(std::make_pair(folder, (uint32_t)uid));
+        if (duplicateIt != m_MessageListSearchResultDuplicateFolders.end())
+        {
+          for (const auto& duplicateFolder : duplicateIt->second)
+          {
+            folderNames += ", " + Util::BaseName(duplicateFolder);
+          }
+        }
+
+        folderTag = "  [" + folderNames + "]";
+      }
+
       int subjectWidth = m_ScreenWidth - Util::WStringWidth(Util::ToWString(headerLeft + folderTag)) - 1;
       subject = Util::ToString(Util::TrimPadWString(Util::ToWString(subject), subjectWidth));
       std::string header = headerLeft + subject + folderTag + " ";
@@ -1501,7 +1550,7 @@ void Ui::DrawMessageListSearch()
       }
 
       const std::map<uint32_t, Body>& bodys = m_Bodys[folder];
-      std::set<uint32_t>& requestedBodys = m_RequestedBodys[folder];
+      UidSet& requestedBodys = m_RequestedBodys[folder];
       if (i == m_MessageListCurrentIndex[m_CurrentFolder])
       {
         std::lock_guard<std::mutex> lock(m_Mutex);
@@ -1517,7 +1566,7 @@ void Ui::DrawMessageListSearch()
         }
 
         const std::map<uint32_t, Header>& gheaders = m_Headers[folder];
-        std::set<uint32_t>& requestedHeaders = m_RequestedHeaders[folder];
+        UidSet& requestedHeaders = m_RequestedHeaders[folder];
         if ((gheaders.find(uid) == gheaders.end()) &&
             (requestedHeaders.find(uid) == requestedHeaders.end()))
         {
@@ -1587,7 +1636,7 @@ void Ui::DrawMessageListSearch()
     m_ImapManager->AsyncRequest(request);
   }
 
-  wrefresh(m_MainWin);
+  wnoutrefresh(m_MainWin);
 }
 
 void Ui::DrawMessage()
@@ -1597,16 +1646,17 @@ void Ui::DrawMessage()
   const std::string& folder = m_CurrentFolderUid.first;
   const int uid = m_CurrentFolderUid.second;
 
-  std::set<uint32_t> fetchHeaderUids;
-  std::set<uint32_t> fetchBodyPriUids;
-  std::set<uint32_t> fetchBodySecUids;
+  UidSet fetchHeaderUids;
+  UidSet fetchBodyPriUids;
+  UidSet fetchBodySecUids;
   bool markSeen = false;
   bool unseen = false;
+  std::string sender;
   {
     std::lock_guard<std::mutex> lock(m_Mutex);
 
     std::map<uint32_t, Header>& headers = m_Headers[folder];
-    std::set<uint32_t>& requestedHeaders = m_RequestedHeaders[folder];
+    UidSet& requestedHeaders = m_RequestedHeaders[folder];
 
     if ((uid != -1) &&
         (headers.find(uid) == headers.end()) &&
@@ -1617,7 +1667,7 @@ void Ui::DrawMessage()
     }
 
     std::map<uint32_t, Body>& bodys = m_Bodys[folder];
-    std::set<uint32_t>& requestedBodys = m_RequestedBodys[folder];
+    UidSet& requestedBodys = m_RequestedBodys[folder];
 
     if ((uid != -1) &&
         (bodys.find(uid) == bodys.end()) &&
@@ -1641,9 +1691,11 @@ void Ui::DrawMessage()
     if (headerIt != headers.end())
     {
       Header& header = headerIt->second;
+      sender = header.GetFrom();
       if (m_ShowFullHeader)
       {
-        ss << header.GetRawHeaderText(m_FullHeaderIncludeLocal);
+        ss << header.GetFullHeaderText(m_FullHeaderIncludeLocal,
+                                       (bodyIt != bodys.end()) ? bodyIt->second.GetHeaderData() : std::string());
       }
       else
       {
@@ -1806,22 +1858,16 @@ void Ui::DrawMessage()
 
   if (unseen && markSeen && !m_MessageViewToggledSeen)
   {
+    m_ImapManager->NotifyMessageOpened(sender);
     MarkSeen();
   }
 
-  wrefresh(m_MainWin);
+  wnoutrefresh(m_MainWin);
 }
 
 void Ui::DrawComposeMessage()
 {
-  const bool processFlowed = false; // only process when viewing message
-  const bool outputFlowed = false; // only generate when sending after compose
-  const bool quoteWrap = false; // only wrap quoted lines when viewing message
-  const int expandTabSize = 0; // disabled
-  m_ComposeMessageLines = Util::WordWrap(m_ComposeMessageStr, m_MaxComposeLineLength,
-                                         processFlowed, outputFlowed, quoteWrap, expandTabSize,
-                                         m_ComposeMessagePos, m_ComposeMessageWrapLine,
-                                         m_ComposeMessageWrapPos);
+  UpdateComposeMessageWrap();
 
   std::vector<std::wstring> headerLines;
   if (m_ShowRichHeader)
@@ -1883,10 +1929,9 @@ void Ui::DrawComposeMessage()
 
   composeLines.push_back(L"");
 
-  for (auto line = m_ComposeMessageLines.begin(); line != m_ComposeMessageLines.end(); ++line)
-  {
-    composeLines.push_back(*line);
-  }
+  // message lines are accessed from wrap cache, only for the visible range
+  const int headerLineCount = (int)composeLines.size();
+  const int lineCount = headerLineCount + (int)m_ComposeMessageWrapCache.GetLineCount();
 
   if (cursY < m_ComposeMessageOffsetY)
   {
@@ -1899,14 +1944,13 @@ void Ui::DrawComposeMessage()
   }
 
   int messageY = 0;
-  int idx = 0;
-  for (auto line = composeLines.begin(); line != composeLines.end(); ++line, ++idx)
+  for (int idx = m_ComposeMessageOffsetY; idx < lineCount; ++idx)
   {
-    if (idx < m_ComposeMessageOffsetY) continue;
-
     if (messageY > m_MainWinHeight) break;
 
-    const std::string& dispStr = Util::ToString(*line);
+    const std::wstring& line = (idx < headerLineCount) ? composeLines.at(idx)
+                                                       : m_ComposeMessageWrapCache.GetLine(idx - headerLineCount);
+    const std::string& dispStr = Util::ToString(line);
     const bool isQuote = (dispStr.rfind(">", 0) == 0);
 
     if (isQuote)
@@ -1928,8 +1972,9 @@ void Ui::DrawComposeMessage()
 
   leaveok(m_MainWin, false);
   wmove(m_MainWin, cursY, cursX);
-  wrefresh(m_MainWin);
+  wnoutrefresh(m_MainWin);
   leaveok(m_MainWin, true);
+  m_CursorWin = m_MainWin;
 }
 
 void Ui::DrawPartList()
@@ -1988,7 +2033,7 @@ void Ui::DrawPartList()
     }
   }
 
-  wrefresh(m_MainWin);
+  wnoutrefresh(m_MainWin);
 }
 
 void Ui::AsyncUiRequest(char p_UiRequest)
@@ -2002,6 +2047,21 @@ void Ui::PerformUiRequest(char p_UiRequest)
   {
     DrawAll();
   }
+  else if (p_UiRequest & UiRequestDrawTop)
+  {
+    DrawTop();
+    if (m_CursorWin != NULL)
+    {
+      // top window does not position cursor, restore it in the window being edited
+      leaveok(m_CursorWin, false);
+      wnoutrefresh(m_CursorWin);
+      leaveok(m_CursorWin, true);
+    }
+
+    doupdate();
+    m_LastFrameTime = std::chrono::steady_clock::now();
+    m_PendingUiRequest &= ~UiRequestDrawTop;
+  }
 
   if (p_UiRequest & UiRequestDrawError)
   {
@@ -2022,6 +2082,23 @@ void Ui::PerformUiRequest(char p_UiRequest)
   }
 }
 
+int64_t Ui::PerformPendingDraw()
+{
+  if (m_PendingUiRequest == UiRequestNone) return -1;
+
+  const int64_t frameIntervalMs = (m_MaxFrameRate > 0) ? (1000 / m_MaxFrameRate) : 0;
+  const int64_t elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now() - m_LastFrameTime).count();
+  if (elapsedMs < frameIntervalMs)
+  {
+    return frameIntervalMs - elapsedMs;
+  }
+
+  PerformUiRequest(m_PendingUiRequest);
+  m_PendingUiRequest = UiRequestNone;
+  return -1;
+}
+
 void Ui::Run()
 {
   DrawAll();
@@ -2032,16 +2109,27 @@ void Ui::Run()
 
   while (s_Running)
   {
+    // async draw requests are coalesced and drawn at most at max frame rate
+    const int64_t pendingDrawMs = PerformPendingDraw();
+
     fd_set fds;
     FD_ZERO(&fds);
     FD_SET(STDIN_FILENO, &fds);
     FD_SET(m_Pipe[0], &fds);
     int maxfd = std::max(STDIN_FILENO, m_Pipe[0]);
     struct timeval tv = {1, 0}; // uiIdleTime logic below is dependent on timeout value
+    if (pendingDrawMs >= 0)
+    {
+      tv.tv_sec = 0;
+      tv.tv_usec = pendingDrawMs * 1000;
+    }
+
     int rv = select(maxfd + 1, &fds, NULL, NULL, &tv);
 
     if (rv == 0)
     {
+      if (pendingDrawMs >= 0) continue;
+
       if (++uiIdleTime >= 600) // ui idle refresh every 10 minutes
       {
         PerformUiRequest(UiRequestDrawAll);
@@ -2057,6 +2145,7 @@ void Ui::Run()
     {
       wint_t key = 0;
       get_wch(&key);
+      m_ImapManager->NotifyUserActivity();
 
       if (key == KEY_RESIZE)
       {
@@ -2125,7 +2214,12 @@ void Ui::Run()
           uiRequest |= buf[i];
         }
 
-        PerformUiRequest(uiRequest);
+        m_PendingUiRequest |= (uiRequest & (UiRequestDrawAll | UiRequestDrawTop));
+        uiRequest &= ~(UiRequestDrawAll | UiRequestDrawTop);
+        if (uiRequest != UiRequestNone)
+        {
+          PerformUiRequest(uiRequest);
+        }
       }
     }
 
@@ -2670,7 +2764,7 @@ void Ui::ViewMessageListKeyHandler(int p_Key)
         ImapManager::Request request;
         request.m_Folder = m_CurrentFolder;
         request.m_GetUids = true;
-        request.m_GetHeaders = std::set<uint32_t>({ uid });
+        request.m_GetHeaders = UidSet({ uid });
         LOG_DEBUG_VAR("async req uids =", m_CurrentFolder);
         m_HasRequestedUids[m_CurrentFolder] = true;
         m_ImapManager->AsyncRequest(request);
@@ -2686,7 +2780,7 @@ void Ui::ViewMessageListKeyHandler(int p_Key)
           {
             std::lock_guard<std::mutex> lock(m_Mutex);
             std::map<uint32_t, Header>& headers = m_Headers[m_CurrentFolder];
-            std::set<uint32_t>& uids = m_Uids[m_CurrentFolder];
+            UidSet& uids = m_Uids[m_CurrentFolder];
 
             if ((headers.find(uid) != headers.end()) && (uids.size() == headers.size()))
             {
@@ -3075,6 +3169,8 @@ void Ui::ComposeMessageKeyHandler(int p_Key)
   }
   else // compose body
   {
+    const int oldSize = (int)m_ComposeMessageStr.size();
+    const int oldPos = m_ComposeMessagePos;
     if (p_Key == KEY_UP)
     {
       ComposeMessagePrevLine();
@@ -3085,32 +3181,18 @@ void Ui::ComposeMessageKeyHandler(int p_Key)
     }
     else if (p_Key == m_KeyPrevPageCompose)
     {
-      const bool processFlowed = false; // only process when viewing message
-      const bool outputFlowed = false; // only generate when sending after compose
-      const bool quoteWrap = false; // only wrap quoted lines when viewing message
-      const int expandTabSize = 0; // disabled
       for (int i = 0; i < (m_MainWinHeight / 2); ++i)
       {
         ComposeMessagePrevLine();
-        m_ComposeMessageLines = Util::WordWrap(m_ComposeMessageStr, m_MaxComposeLineLength,
-                                               processFlowed, outputFlowed, quoteWrap, expandTabSize,
-                                               m_ComposeMessagePos, m_ComposeMessageWrapLine,
-                                               m_ComposeMessageWrapPos);
+        UpdateComposeMessageWrap();
       }
     }
     else if (p_Key == m_KeyNextPageCompose)
     {
-      const bool processFlowed = false; // only process when viewing message
-      const bool outputFlowed = false; // only generate when sending after compose
-      const bool quoteWrap = false; // only wrap quoted lines when viewing message
-      const int expandTabSize = 0; // disabled
       for (int i = 0; i < (m_MainWinHeight / 2); ++i)
       {
         ComposeMessageNextLine();
-        m_ComposeMessageLines = Util::WordWrap(m_ComposeMessageStr, m_MaxComposeLineLength,
-                                               processFlowed, outputFlowed, quoteWrap, expandTabSize,
-                                               m_ComposeMessagePos, m_ComposeMessageWrapLine,
-                                               m_ComposeMessageWrapPos);
+        UpdateComposeMessageWrap();
       }
     }
     else if ((p_Key == KEY_LEFT) && (m_ComposeMessagePos == 0))
@@ -3128,6 +3210,7 @@ void Ui::ComposeMessageKeyHandler(int p_Key)
         m_ComposeMessageStr.insert(m_ComposeMessagePos++, 1, ' ');
       }
 
+      m_ComposeMessageWrapCache.Edit(oldPos, 0, tabSpaces);
       asyncRedraw = true;
     }
     else if (HandleComposeKey(p_Key))
@@ -3136,7 +3219,12 @@ void Ui::ComposeMessageKeyHandler(int p_Key)
     }
     else if (HandleLineKey(p_Key, m_ComposeMessageStr, m_ComposeMessagePos))
     {
-      // none
+      // line keys only erase text adjacent to the cursor
+      const int sizeDiff = oldSize - (int)m_ComposeMessageStr.size();
+      if (sizeDiff > 0)
+      {
+        m_ComposeMessageWrapCache.Edit(std::min(oldPos, m_ComposeMessagePos), sizeDiff, 0);
+      }
     }
     else if (HandleDocKey(p_Key, m_ComposeMessageStr, m_ComposeMessagePos))
     {
@@ -3159,6 +3247,7 @@ void Ui::ComposeMessageKeyHandler(int p_Key)
       }
       else
       {
+        m_ComposeMessageWrapCache.Edit(m_ComposeMessagePos, 0, 1);
         m_ComposeMessageStr.insert(m_ComposeMessagePos++, 1, p_Key);
       }
 
@@ -3232,8 +3321,7 @@ void Ui::ViewPartListKeyHandler(int p_Key)
       {
         Body& body = bodyIt->second;
         const std::map<ssize_t, PartInfo>& parts = body.GetPartInfos();
-        const std::map<ssize_t, std::string>& partDatas = body.GetPartDatas();
-        partData = partDatas.at(m_PartListCurrentIndex);
+        partData = body.GetPartData(m_PartListCurrentIndex);
 
         if (m_ShowEmbeddedImages && isUnamedTextHtml)
         {
@@ -3243,7 +3331,7 @@ void Ui::ViewPartListKeyHandler(int p_Key)
             {
               const std::string& tempPartFilePath = Util::GetAttachmentsTempDir() + part.second.m_ContentId;
               LOG_DEBUG("writing \"%s\"", tempPartFilePath.c_str());
-              Util::WriteFile(tempPartFilePath, partDatas.at(part.first));
+              Util::WriteFile(tempPartFilePath, body.GetPartData(part.first));
             }
           }
         }
@@ -3269,6 +3357,7 @@ void Ui::ViewPartListKeyHandler(int p_Key)
 
     SetDialogMessage("Waiting for external viewer to exit");
     DrawDialog();
+    doupdate();
     int rv = ExtPartsViewer(tempFilePath);
     if (rv != 0)
     {
@@ -3299,8 +3388,7 @@ void Ui::ViewPartListKeyHandler(int p_Key)
           if (bodyIt != bodys.end())
           {
             Body& body = bodyIt->second;
-            const std::map<ssize_t, std::string>& partDatas = body.GetPartDatas();
-            partData = partDatas.at(m_PartListCurrentIndex);
+            partData = body.GetPartData(m_PartListCurrentIndex);
           }
         }
 
@@ -3342,6 +3430,9 @@ void Ui::ViewPartListKeyHandler(int p_Key)
 
 void Ui::SetState(Ui::State p_State)
 {
+  // compose message may be replaced when entering states
+  m_ComposeMessageWrapCache.Invalidate();
+
   if ((p_State == StateAddressList) || (p_State == StateFromAddressList) || (p_State == StateFileList))
   {
     // going to address or file list
@@ -3474,7 +3565,6 @@ void Ui::SetState(Ui::State p_State)
 
         int idx = 0;
         std::string tmppath = Util::GetTempDirectory();
-        const std::map<ssize_t, std::string>& partDatas = body.GetPartDatas();
         for (auto& part : body.GetPartInfos())
         {
           if (!part.second.m_Filename.empty())
@@ -3483,7 +3573,7 @@ void Ui::SetState(Ui::State p_State)
             Util::MkDir(tmpfiledir);
             std::string tmpfilepath = tmpfiledir + part.second.m_Filename;
 
-            Util::WriteFile(tmpfilepath, partDatas.at(part.first));
+            Util::WriteFile(tmpfilepath, body.GetPartData(part.first));
             tmpfilepath = Util::EscapePath(tmpfilepath);
             if (GetComposeStr(HeaderAtt).empty())
             {
@@ -3653,7 +3743,6 @@ void Ui::SetState(Ui::State p_State)
 
       int idx = 0;
       std::string tmppath = Util::GetTempDirectory();
-      const std::map<ssize_t, std::string>& partDatas = body.GetPartDatas();
       for (auto& part : body.GetPartInfos())
       {
         if (!part.second.m_Filename.empty())
@@ -3662,7 +3751,7 @@ void Ui::SetState(Ui::State p_State)
           Util::MkDir(tmpfiledir);
           std::string tmpfilepath = tmpfiledir + part.second.m_Filename;
 
-          Util::WriteFile(tmpfilepath, partDatas.at(part.first));
+          Util::WriteFile(tmpfilepath, body.GetPartData(part.first));
           tmpfilepath = Util::EscapePath(tmpfilepath);
           if (GetComposeStr(HeaderAtt).empty())
           {
@@ -3748,7 +3837,7 @@ void Ui::SetState(Ui::State p_State)
       Util::RemoveNonAlphaNumSpace(filename);
       Util::ReplaceString(filename, " ", "_");
       std::string filepath = tmppath + "/" + filename + ".eml";
-      LOG_INFO("write to %s size %d", filepath.c_str(), body.GetData().size());
+      LOG_INFO("write to %s size %d", filepath.c_str(), body.GetDataSize());
       Util::WriteFile(filepath, body.GetData());
 
       SetComposeStr(HeaderAtt,
@@ -3802,8 +3891,8 @@ void Ui::ResponseHandler(const ImapManager::Request& p_Request, const ImapManage
 
   if (p_Request.m_PrefetchLevel < PrefetchLevelFullSync)
   {
-    std::set<uint32_t> fetchHeaderUids;
-    std::set<uint32_t> fetchFlagUids;
+    UidSet fetchHeaderUids;
+    UidSet fetchFlagUids;
 
     if (p_Request.m_GetFolders && !(p_Response.m_ResponseStatus & ImapManager::ResponseStatusGetFoldersFailed))
     {
@@ -3817,7 +3906,7 @@ void Ui::ResponseHandler(const ImapManager::Request& p_Request, const ImapManage
     {
       std::lock_guard<std::mutex> lock(m_Mutex);
 
-      const std::set<uint32_t> newUids = p_Response.m_Uids - m_Uids[p_Response.m_Folder];
+      const UidSet newUids = p_Response.m_Uids - m_Uids[p_Response.m_Folder];
       if (!p_Response.m_Cached && (p_Response.m_Folder == m_Inbox) && !newUids.empty())
       {
         if (m_NewMsgBell)
@@ -3827,7 +3916,7 @@ void Ui::ResponseHandler(const ImapManager::Request& p_Request, const ImapManage
         }
       }
 
-      const std::set<uint32_t>& removedUids = m_Uids[p_Response.m_Folder] - p_Response.m_Uids;
+      const UidSet& removedUids = m_Uids[p_Response.m_Folder] - p_Response.m_Uids;
       if (!removedUids.empty())
       {
         LOG_DEBUG_VAR("del uids =", removedUids);
@@ -3842,16 +3931,16 @@ void Ui::ResponseHandler(const ImapManager::Request& p_Request, const ImapManage
 
       if (!m_PrefetchAllHeaders && !newUids.empty())
       {
-        UpdateDisplayUids(p_Response.m_Folder, std::set<uint32_t>(), newUids);
+        UpdateDisplayUids(p_Response.m_Folder, UidSet(), newUids);
       }
 
       if (m_PrefetchAllHeaders)
       {
         std::map<uint32_t, Header>& headers = m_Headers[p_Response.m_Folder];
         std::map<uint32_t, uint32_t>& flags = m_Flags[p_Response.m_Folder];
-        std::set<uint32_t>& requestedHeaders = m_RequestedHeaders[p_Response.m_Folder];
-        std::set<uint32_t>& requestedFlags = m_RequestedFlags[p_Response.m_Folder];
-        for (auto& uid : newUids)
+        UidSet& requestedHeaders = m_RequestedHeaders[p_Response.m_Folder];
+        UidSet& requestedFlags = m_RequestedFlags[p_Response.m_Folder];
+        for (const auto& uid : newUids)
         {
           if ((headers.find(uid) == headers.end()) &&
               (requestedHeaders.find(uid) == requestedHeaders.end()))
@@ -3861,7 +3950,7 @@ void Ui::ResponseHandler(const ImapManager::Request& p_Request, const ImapManage
           }
         }
 
-        for (auto& uid : p_Response.m_Uids)
+        for (const auto& uid : p_Response.m_Uids)
         {
           if (((flags.find(uid) == flags.end()) &&
                (requestedFlags.find(uid) == requestedFlags.end())))
@@ -3883,7 +3972,7 @@ void Ui::ResponseHandler(const ImapManager::Request& p_Request, const ImapManage
       m_Headers[p_Response.m_Folder].insert(headers.begin(), headers.end());
       if (m_PrefetchAllHeaders)
       {
-        UpdateDisplayUids(p_Response.m_Folder, std::set<uint32_t>(), MapKey(headers));
+        UpdateDisplayUids(p_Response.m_Folder, UidSet(), MapKey(headers));
       }
       uiRequest |= UiRequestDrawAll;
       updateIndexFromUid = true;
@@ -3914,7 +4003,7 @@ void Ui::ResponseHandler(const ImapManager::Request& p_Request, const ImapManage
     if (!fetchHeaderUids.empty())
     {
       const int maxHeadersFetchRequest = 25;
-      std::set<uint32_t> subsetFetchHeaderUids;
+      UidSet subsetFetchHeaderUids;
       for (auto it = fetchHeaderUids.begin(); it != fetchHeaderUids.end(); ++it)
       {
         subsetFetchHeaderUids.insert(*it);
@@ -3936,7 +4025,7 @@ void Ui::ResponseHandler(const ImapManager::Request& p_Request, const ImapManage
     if (!fetchFlagUids.empty())
     {
       const int maxFlagsFetchRequest = 1000;
-      std::set<uint32_t> subsetFetchFlagUids;
+      UidSet subsetFetchFlagUids;
       for (auto it = fetchFlagUids.begin(); it != fetchFlagUids.end(); ++it)
       {
         subsetFetchFlagUids.insert(*it);
@@ -3987,26 +4076,26 @@ void Ui::ResponseHandler(const ImapManager::Request& p_Request, const ImapManage
     {
       const std::string& folder = p_Response.m_Folder;
 
-      std::set<uint32_t> prefetchHeaders;
-      std::set<uint32_t> prefetchFlags;
-      std::set<uint32_t> prefetchBodys;
+      UidSet prefetchHeaders;
+      UidSet prefetchFlags;
+      UidSet prefetchBodys;
 
       {
         std::lock_guard<std::mutex> lock(m_Mutex);
 
         std::map<uint32_t, Header>& headers = m_Headers[folder];
-        std::set<uint32_t>& requestedHeaders = m_RequestedHeaders[folder];
-        std::set<uint32_t>& prefetchedHeaders = m_PrefetchedHeaders[folder];
+        UidSet& requestedHeaders = m_RequestedHeaders[folder];
+        UidSet& prefetchedHeaders = m_PrefetchedHeaders[folder];
 
         std::map<uint32_t, uint32_t>& flags = m_Flags[folder];
-        std::set<uint32_t>& requestedFlags = m_RequestedFlags[folder];
-        std::set<uint32_t>& prefetchedFlags = m_PrefetchedFlags[folder];
+        UidSet& requestedFlags = m_RequestedFlags[folder];
+        UidSet& prefetchedFlags = m_PrefetchedFlags[folder];
 
         std::map<uint32_t, Body>& bodys = m_Bodys[folder];
-        std::set<uint32_t>& requestedBodys = m_RequestedBodys[folder];
-        std::set<uint32_t>& prefetchedBodys = m_PrefetchedBodys[folder];
+        UidSet& requestedBodys = m_RequestedBodys[folder];
+        UidSet& prefetchedBodys = m_PrefetchedBodys[folder];
 
-        for (auto& uid : p_Response.m_Uids)
+        for (const auto& uid : p_Response.m_Uids)
         {
           if ((headers.find(uid) == headers.end()) &&
               (requestedHeaders.find(uid) == requestedHeaders.end()) &&
@@ -4037,7 +4126,7 @@ void Ui::ResponseHandler(const ImapManager::Request& p_Request, const ImapManage
       const int maxHeadersFetchRequest = 25;
       if (!prefetchHeaders.empty())
       {
-        std::set<uint32_t> subsetPrefetchHeaders;
+        UidSet subsetPrefetchHeaders;
         for (auto it = prefetchHeaders.begin(); it != prefetchHeaders.end(); ++it)
         {
           if (!s_Running) break;
@@ -4062,7 +4151,7 @@ void Ui::ResponseHandler(const ImapManager::Request& p_Request, const ImapManage
       const int maxFlagsFetchRequest = 1000;
       if (!prefetchFlags.empty())
       {
-        std::set<uint32_t> subsetPrefetchFlags;
+        UidSet subsetPrefetchFlags;
         for (auto it = prefetchFlags.begin(); it != prefetchFlags.end(); ++it)
         {
           if (!s_Running) break;
@@ -4087,7 +4176,7 @@ void Ui::ResponseHandler(const ImapManager::Request& p_Request, const ImapManage
       const int maxBodysFetchRequest = 1;
       if (!prefetchBodys.empty())
       {
-        std::set<uint32_t> subsetPrefetchBodys;
+        UidSet subsetPrefetchBodys;
         for (auto it = prefetchBodys.begin(); it != prefetchBodys.end(); ++it)
         {
           if (!s_Running) break;
@@ -4149,6 +4238,11 @@ void Ui::ResponseHandler(const ImapManager::Request& p_Request, const ImapManage
 
 void Ui::ResultHandler(const ImapManager::Action& p_Action, const ImapManager::Result& p_Result)
 {
+  if (!p_Action.m_MsgPath.empty())
+  {
+    Util::DeleteFile(p_Action.m_MsgPath);
+  }
+
   if (!p_Result.m_Result)
   {
     if (!p_Action.m_MoveDestination.empty())
@@ -4182,6 +4276,11 @@ void Ui::ResultHandler(const ImapManager::Action& p_Action, const ImapManager::R
 
 void Ui::SmtpResultHandlerError(const SmtpManager::Result& p_Result)
 {
+  if (!p_Result.m_MessagePath.empty())
+  {
+    Util::DeleteFile(p_Result.m_MessagePath);
+  }
+
   bool saveDraft = false;
   SmtpManager::Action smtpAction = p_Result.m_Action;
   std::string draftMessage;
@@ -4234,7 +4333,7 @@ void Ui::SmtpResultHandlerError(const SmtpManager::Result& p_Result)
 
     if (smtpAction.m_ComposeDraftUid != 0)
     {
-      MoveMessages(std::set<uint32_t>({ smtpAction.m_ComposeDraftUid }), m_DraftsFolder,
+      MoveMessages(UidSet({ smtpAction.m_ComposeDraftUid }), m_DraftsFolder,
                    m_TrashFolder);
       m_HasRequestedUids[m_TrashFolder] = false;
     }
@@ -4302,7 +4401,7 @@ void Ui::SmtpResultHandler(const SmtpManager::Result& p_Result)
 
     if ((action.m_ComposeDraftUid != 0) && !m_DraftsFolder.empty() && !m_TrashFolder.empty())
     {
-      MoveMessages(std::set<uint32_t>({ action.m_ComposeDraftUid }), m_DraftsFolder,
+      MoveMessages(UidSet({ action.m_ComposeDraftUid }), m_DraftsFolder,
                    m_TrashFolder);
     }
 
@@ -4314,6 +4413,7 @@ void Ui::SmtpResultHandler(const SmtpManager::Result& p_Result)
         imapAction.m_UploadMessage = true;
         imapAction.m_Folder = m_SentFolder;
         imapAction.m_Msg = p_Result.m_Message;
+        imapAction.m_MsgPath = p_Result.m_MessagePath;
         m_ImapManager->AsyncAction(imapAction);
       }
       else
@@ -4322,6 +4422,11 @@ void Ui::SmtpResultHandler(const SmtpManager::Result& p_Result)
       }
     }
 
+    if (!p_Result.m_MessagePath.empty() && !(m_ClientStoreSent && !m_SentFolder.empty()))
+    {
+      Util::DeleteFile(p_Result.m_MessagePath);
+    }
+
     if (!m_SentFolder.empty())
     {
       std::lock_guard<std::mutex> lock(m_Mutex);
@@ -4358,7 +4463,10 @@ void Ui::StatusHandler(const StatusUpdate& p_StatusUpdate)
     m_ImapManager->PrefetchRequest(request);
   }
 
-  char uiRequest = UiRequestDrawAll;
+  // progress and activity updates only affect the top bar
+  const uint32_t connectionFlags = Status::FlagConnected | Status::FlagOffline;
+  char uiRequest = ((p_StatusUpdate.SetFlags | p_StatusUpdate.ClearFlags) & connectionFlags) ? UiRequestDrawAll
+                                                                                             : UiRequestDrawTop;
   if (p_StatusUpdate.SetFlags & Status::FlagConnected)
   {
     uiRequest |= UiRequestHandleConnected;
@@ -4372,10 +4480,29 @@ void Ui::SearchHandler(const ImapManager::SearchQuery& p_SearchQuery,
 {
   {
     std::lock_guard<std::mutex> lock(m_SearchMutex);
-    if (p_SearchQuery.m_Offset == 0)
+    if (p_SearchResult.m_IsServerResult)
+    {
+      if (p_SearchQuery.m_QueryStr != m_MessageListSearchQuery)
+      {
+        LOG_DEBUG("ignore stale server search result");
+        return;
+      }
+
+      // server results arrive per folder
+      m_MessageListSearchServerHeaders.insert(m_MessageListSearchServerHeaders.end(),
+                                              p_SearchResult.m_Headers.begin(), p_SearchResult.m_Headers.end());
+      m_MessageListSearchServerFolderUids.insert(m_MessageListSearchServerFolderUids.end(),
+                                                 p_SearchResult.m_FolderUids.begin(),
+                                                 p_SearchResult.m_FolderUids.end());
+      LOG_DEBUG("server search result count = %d", (int)p_SearchResult.m_Headers.size());
+    }
+    else if (p_SearchQuery.m_Offset == 0)
     {
+      m_MessageListSearchServerHeaders.clear();
+      m_MessageListSearchServerFolderUids.clear();
       m_MessageListSearchResultHeaders = p_SearchResult.m_Headers;
       m_MessageListSearchResultFolderUids = p_SearchResult.m_FolderUids;
+      m_MessageListSearchResultDuplicateFolders = p_SearchResult.m_DuplicateFolders;
       LOG_DEBUG("search result offset = %d", p_SearchQuery.m_Offset);
     }
     else if (p_SearchQuery.m_Offset > 0)
@@ -4385,16 +4512,65 @@ void Ui::SearchHandler(const ImapManager::SearchQuery& p_SearchQuery,
       m_MessageListSearchResultFolderUids.insert(m_MessageListSearchResultFolderUids.end(),
                                                  p_SearchResult.m_FolderUids.begin(),
                                                  p_SearchResult.m_FolderUids.end());
+      m_MessageListSearchResultDuplicateFolders.insert(p_SearchResult.m_DuplicateFolders.begin(),
+                                                       p_SearchResult.m_DuplicateFolders.end());
       LOG_DEBUG("search result offset = %d", p_SearchQuery.m_Offset);
     }
 
-    m_MessageListSearchHasMore = p_SearchResult.m_HasMore;
+    if (!p_SearchResult.m_IsServerResult)
+    {
+      m_MessageListSearchHasMore = p_SearchResult.m_HasMore;
+    }
+
+    MergeSearchServerResults();
   }
 
   AsyncUiRequest(UiRequestDrawAll);
   UpdateUidFromIndex(false /* p_UserTriggered */);
 }
 
+void Ui::MergeSearchServerResults()
+{
+  // insert server hits within the date range of loaded local results, keep the older ones
+  // pending until further local result pages have been loaded
+  const bool mergeAll = !m_MessageListSearchHasMore;
+  const int64_t oldestTime = m_MessageListSearchResultHeaders.empty()
+    ? std::numeric_limits<int64_t>::min() : m_MessageListSearchResultHeaders.back().GetTimeStamp();
+
+  std::vector<Header> pendingHeaders;
+  std::vector<std::pair<std::string, uint32_t>> pendingFolderUids;
+  std::set<std::pair<std::string, uint32_t>> resultFolderUids(m_MessageListSearchResultFolderUids.begin(),
+                                                              m_MessageListSearchResultFolderUids.end());
+  for (size_t i = 0; i < m_MessageListSearchServerHeaders.size(); ++i)
+  {
+    const Header& header = m_MessageListSearchServerHeaders.at(i);
+    const std::pair<std::string, uint32_t>& folderUid = m_MessageListSearchServerFolderUids.at(i);
+    const int64_t time = header.GetTimeStamp();
+    if (!mergeAll && (time < oldestTime))
+    {
+      pendingHeaders.push_back(header);
+      pendingFolderUids.push_back(folderUid);
+      continue;
+    }
+
+    if (!resultFolderUids.insert(folderUid).second) continue;
+
+    auto& folderUids = m_MessageListSearchResultFolderUids;
+    auto& headers = m_MessageListSearchResultHeaders;
+    auto pos = std::find_if(headers.begin(), headers.end(), [&](const Header& p_Header)
+    {
+      return p_Header.GetTimeStamp() < time;
+    });
+
+    const size_t idx = pos - headers.begin();
+    headers.insert(pos, header);
+    folderUids.insert(folderUids.begin() + idx, folderUid);
+  }
+
+  m_MessageListSearchServerHeaders = pendingHeaders;
+  m_MessageListSearchServerFolderUids = pendingFolderUids;
+}
+
 void Ui::SetImapManager(std::shared_ptr<ImapManager> p_ImapManager)
 {
   m_ImapManager = p_ImapManager;
@@ -4704,7 +4880,7 @@ void Ui::UploadDraftMessage()
 
         if (m_ComposeDraftUid != 0)
         {
-          MoveMessages(std::set<uint32_t>({ m_ComposeDraftUid }), m_DraftsFolder, m_TrashFolder);
+          MoveMessages(UidSet({ m_ComposeDraftUid }), m_DraftsFolder, m_TrashFolder);
         }
 
         m_HasRequestedUids[m_DraftsFolder] = false;
@@ -4802,11 +4978,11 @@ void Ui::MoveSelectedMessages(const std::string& p_To)
   {
     const std::string& folder = m_CurrentFolderUid.first;
     const uint32_t uid = m_CurrentFolderUid.second;
-    MoveMessages(std::set<uint32_t>({ uid }), folder, p_To);
+    MoveMessages(UidSet({ uid }), folder, p_To);
   }
 }
 
-void Ui::MoveMessages(const std::set<uint32_t>& p_Uids, const std::string& p_From,
+void Ui::MoveMessages(const UidSet& p_Uids, const std::string& p_From,
                       const std::string& p_To)
 {
   ImapManager::Action action;
@@ -4863,11 +5039,11 @@ void Ui::DeleteSelectedMessages()
   {
     const std::string& folder = m_CurrentFolderUid.first;
     const uint32_t uid = m_CurrentFolderUid.second;
-    DeleteMessages(std::set<uint32_t>({ uid }), folder);
+    DeleteMessages(UidSet({ uid }), folder);
   }
 }
 
-void Ui::DeleteMessages(const std::set<uint32_t>& p_Uids, const std::string& p_Folder)
+void Ui::DeleteMessages(const UidSet& p_Uids, const std::string& p_Folder)
 {
   ImapManager::Action action;
   action.m_Folder = p_Folder;
@@ -4916,7 +5092,7 @@ void Ui::ToggleSeen()
     }
     bool oldSeen = ((flags.find(uid) != flags.end()) && (Flag::GetSeen(flags.at(uid))));
     bool newSeen = !oldSeen;
-    std::set<uint32_t> uids;
+    UidSet uids;
     uids.insert(uid);
 
     SetSeen(folder, uids, newSeen);
@@ -4949,7 +5125,7 @@ void Ui::ToggleSeen()
   }
 }
 
-void Ui::SetSeen(const std::string& p_Folder, const std::set<uint32_t>& p_Uids, bool p_Seen)
+void Ui::SetSeen(const std::string& p_Folder, const UidSet& p_Uids, bool p_Seen)
 {
   ImapManager::Action action;
   action.m_Folder = p_Folder;
@@ -4960,7 +5136,7 @@ void Ui::SetSeen(const std::string& p_Folder, const std::set<uint32_t>& p_Uids,
 
   {
     std::lock_guard<std::mutex> lock(m_Mutex);
-    for (auto& uid : p_Uids)
+    for (const auto& uid : p_Uids)
     {
       Flag::SetSeen(m_Flags[p_Folder][uid], p_Seen);
     }
@@ -5108,10 +5284,10 @@ void Ui::ComposeMessagePrevLine()
   if (m_ComposeMessageWrapLine > 0)
   {
     int stepsBack = 0;
-    if ((int)m_ComposeMessageLines[m_ComposeMessageWrapLine - 1].size() >
+    if ((int)m_ComposeMessageWrapCache.GetLine(m_ComposeMessageWrapLine - 1).size() >
         m_ComposeMessageWrapPos)
     {
-      stepsBack = m_ComposeMessageLines[m_ComposeMessageWrapLine - 1].size() + 1;
+      stepsBack = m_ComposeMessageWrapCache.GetLine(m_ComposeMessageWrapLine - 1).size() + 1;
     }
     else
     {
@@ -5132,18 +5308,18 @@ void Ui::ComposeMessageNextLine()
 {
   if (m_ComposeMessagePos < (int)m_ComposeMessageStr.size())
   {
-    int stepsForward = (int)m_ComposeMessageLines[m_ComposeMessageWrapLine].size() -
+    int stepsForward = (int)m_ComposeMessageWrapCache.GetLine(m_ComposeMessageWrapLine).size() -
       m_ComposeMessageWrapPos + 1;
-    if ((m_ComposeMessageWrapLine + 1) < (int)m_ComposeMessageLines.size())
+    if ((m_ComposeMessageWrapLine + 1) < (int)m_ComposeMessageWrapCache.GetLineCount())
     {
-      if ((int)m_ComposeMessageLines[m_ComposeMessageWrapLine + 1].size() >
+      if ((int)m_ComposeMessageWrapCache.GetLine(m_ComposeMessageWrapLine + 1).size() >
           m_ComposeMessageWrapPos)
       {
         stepsForward += m_ComposeMessageWrapPos;
       }
       else
       {
-        stepsForward += (int)m_ComposeMessageLines[m_ComposeMessageWrapLine + 1].size();
+        stepsForward += (int)m_ComposeMessageWrapCache.GetLine(m_ComposeMessageWrapLine + 1).size();
       }
     }
 
@@ -5153,6 +5329,13 @@ void Ui::ComposeMessageNextLine()
   }
 }
 
+void Ui::UpdateComposeMessageWrap()
+{
+  m_ComposeMessageWrapCache.SetLineLength(m_MaxComposeLineLength);
+  m_ComposeMessageWrapCache.Update(m_ComposeMessageStr);
+  m_ComposeMessageWrapCache.GetWrapPos(m_ComposeMessagePos, m_ComposeMessageWrapLine, m_ComposeMessageWrapPos);
+}
+
 int Ui::ReadKeyBlocking()
 {
   while (true)
@@ -5733,6 +5916,9 @@ void Ui::SearchMessage(const std::string& p_Query /*= std::string()*/)
         m_MessageListSearchHasMore = false;
         m_MessageListSearchResultHeaders.clear();
         m_MessageListSearchResultFolderUids.clear();
+        m_MessageListSearchResultDuplicateFolders.clear();
+        m_MessageListSearchServerHeaders.clear();
+        m_MessageListSearchServerFolderUids.clear();
       }
 
       ImapManager::SearchQuery searchQuery;
@@ -5914,7 +6100,8 @@ std::wstring Ui::GetComposeBodyForSend()
   }
   else if (m_ComposeLineWrap == LineWrapHardWrap)
   {
-    return Util::Join(m_ComposeMessageLines);
+    UpdateComposeMessageWrap();
+    return Util::Join(m_ComposeMessageWrapCache.GetLines());
   }
   else
   {
@@ -6167,7 +6354,7 @@ std::map<std::string, uint32_t>& Ui::GetDisplayUids(const std::string& p_Folder)
   return displayUids;
 }
 
-std::set<uint32_t>& Ui::GetHeaderUids(const std::string& p_Folder)
+UidSet& Ui::GetHeaderUids(const std::string& p_Folder)
 {
   return m_HeaderUids[p_Folder];
 }
@@ -6308,11 +6495,11 @@ std::string Ui::GetDisplayUidsKey(const std::string& p_Folder, uint32_t p_Uid, S
 
 // must be called with m_Mutex lock held
 void Ui::UpdateDisplayUids(const std::string& p_Folder,
-                           const std::set<uint32_t>& p_RemovedUids /*= std::set<uint32_t>()*/,
-                           const std::set<uint32_t>& p_AddedUids /*= std::set<uint32_t>()*/,
+                           const UidSet& p_RemovedUids /*= UidSet()*/,
+                           const UidSet& p_AddedUids /*= UidSet()*/,
                            bool p_FilterUpdated /*= false*/)
 {
-  std::set<uint32_t>& headerUids = m_HeaderUids[p_Folder];
+  UidSet& headerUids = m_HeaderUids[p_Folder];
   SortFilter& sortFilter = m_SortFilter[p_Folder];
   std::map<std::string, uint32_t>& displayUids = m_DisplayUids[p_Folder][sortFilter];
   uint64_t& displayUidsVersion = m_DisplayUidsVersion[p_Folder][sortFilter];
@@ -6322,7 +6509,7 @@ void Ui::UpdateDisplayUids(const std::string& p_Folder,
   if (displayUidsVersion != headerUidsVersion)
   {
     displayUids.clear();
-    for (auto& uid : headerUids)
+    for (const auto& uid : headerUids)
     {
       if (uid == 0) continue;
 
@@ -6340,7 +6527,7 @@ void Ui::UpdateDisplayUids(const std::string& p_Folder,
     headerUids = headerUids - p_RemovedUids;
     ++headerUidsVersion;
 
-    for (auto& uid : p_RemovedUids)
+    for (const auto& uid : p_RemovedUids)
     {
       if (uid == 0) continue;
 
@@ -6362,7 +6549,7 @@ void Ui::UpdateDisplayUids(const std::string& p_Folder,
     headerUids = headerUids + p_AddedUids;
     ++headerUidsVersion;
 
-    for (auto& uid : p_AddedUids)
+    for (const auto& uid : p_AddedUids)
     {
       if (uid == 0) continue;
 
@@ -6388,7 +6575,7 @@ void Ui::SortFilterUpdated(bool p_FilterUpdated)
 {
   {
     std::lock_guard<std::mutex> lock(m_Mutex);
-    UpdateDisplayUids(m_CurrentFolder, std::set<uint32_t>(), std::set<uint32_t>(), p_FilterUpdated);
+    UpdateDisplayUids(m_CurrentFolder, UidSet(), UidSet(), p_FilterUpdated);
   }
 
   if (m_PersistSelectionOnSortFilterChange)
@@ -6527,7 +6714,7 @@ void Ui::ToggleSelected()
   const std::string& folder = m_CurrentFolderUid.first;
   const int uid = m_CurrentFolderUid.second;
 
-  std::set<uint32_t>& folderSelectedUids = m_SelectedUids[folder];
+  UidSet& folderSelectedUids = m_SelectedUids[folder];
   auto it = folderSelectedUids.find(uid);
   if (it == folderSelectedUids.end())
   {
@@ -6572,7 +6759,7 @@ void Ui::ToggleSelectAll()
   }
   else
   {
-    std::set<uint32_t>& folderSelectedUids = m_SelectedUids[m_CurrentFolder];
+    UidSet& folderSelectedUids = m_SelectedUids[m_CurrentFolder];
 
     std::lock_guard<std::mutex> lock(m_Mutex);
     const std::map<std::string, uint32_t>& displayUids = GetDisplayUids(m_CurrentFolder);
@@ -6944,6 +7131,7 @@ bool Ui::HandleComposeKey(int p_Key)
   {
     const std::string editorCmd = Util::GetEditorCmd();
     ExtEditor(editorCmd, m_ComposeMessageStr, m_ComposeMessagePos);
+    m_ComposeMessageWrapCache.Invalidate();
   }
   else if (p_Key == m_KeyRichHeader)
   {
@@ -7001,6 +7189,8 @@ bool Ui::HandleComposeKey(int p_Key)
         ExtEditor(spellCmd, messageComposed, m_ComposeMessagePos);
         m_ComposeMessageStr = messageComposed + messageQuoted;
       }
+
+      m_ComposeMessageWrapCache.Invalidate();
     }
     else
     {
@@ -7,6 +7,7 @@
 
 #pragma once
 
+#include <chrono>
 #include <csignal>
 #include <string>
 #include <vector>
@@ -16,6 +17,8 @@
 #include "config.h"
 #include "imapmanager.h"
 #include "smtpmanager.h"
+#include "uidset.h"
+#include "wrapcache.h"
 
 class SleepDetect;
 
@@ -46,6 +49,7 @@ public:
     UiRequestDrawAll = (1 << 0),
     UiRequestDrawError = (1 << 1),
     UiRequestHandleConnected = (1 << 2),
+    UiRequestDrawTop = (1 << 3),
   };
 
   enum PrefetchLevel
@@ -116,6 +120,7 @@ public:
   void StatusHandler(const StatusUpdate& p_StatusUpdate);
   void SearchHandler(const ImapManager::SearchQuery& p_SearchQuery,
                      const ImapManager::SearchResult& p_SearchResult);
+  void MergeSearchServerResults();
 
 public:
   static void SetRunning(bool p_Running);
@@ -145,6 +150,7 @@ private:
 
   void AsyncUiRequest(char p_UiRequest);
   void PerformUiRequest(char p_UiRequest);
+  int64_t PerformPendingDraw();
   void SetDialogMessage(const std::string& p_DialogMessage, bool p_Warn = false);
 
   void ViewFolderListKeyHandler(int p_Key);
@@ -169,19 +175,20 @@ private:
   void UploadDraftMessage();
   bool DeleteMessage();
   void MoveSelectedMessages(const std::string& p_To);
-  void MoveMessages(const std::set<uint32_t>& p_Uids, const std::string& p_From,
+  void MoveMessages(const UidSet& p_Uids, const std::string& p_From,
                     const std::string& p_To);
   void DeleteSelectedMessages();
-  void DeleteMessages(const std::set<uint32_t>& p_Uids, const std::string& p_Folder);
+  void DeleteMessages(const UidSet& p_Uids, const std::string& p_Folder);
   void ToggleSeen();
-  void SetSeen(const std::string& p_Folder, const std::set<uint32_t>& p_Uids, bool p_Seen);
+  void SetSeen(const std::string& p_Folder, const UidSet& p_Uids, bool p_Seen);
   void MarkSeen();
   void UpdateUidFromIndex(bool p_UserTriggered);
   void UpdateIndexFromUid();
   void AddUidDate(const std::string& p_Folder, const std::map<uint32_t, Header>& p_UidHeaders);
-  void RemoveUidDate(const std::string& p_Folder, const std::set<uint32_t>& p_Uids);
+  void RemoveUidDate(const std::string& p_Folder, const UidSet& p_Uids);
   void ComposeMessagePrevLine();
   void ComposeMessageNextLine();
+  void UpdateComposeMessageWrap();
   int ReadKeyBlocking();
   bool PromptYesNo(const std::string& p_Prompt);
   bool PromptString(const std::string& p_Prompt, const std::string& p_Action,
@@ -217,11 +224,11 @@ private:
   void ComposeBackupProcess();
 
   std::map<std::string, uint32_t>& GetDisplayUids(const std::string& p_Folder);
-  std::set<uint32_t>& GetHeaderUids(const std::string& p_Folder);
+  UidSet& GetHeaderUids(const std::string& p_Folder);
   std::string GetDisplayUidsKey(const std::string& p_Folder, uint32_t p_Uid, SortFilter p_SortFilter);
   void UpdateDisplayUids(const std::string& p_Folder,
-                         const std::set<uint32_t>& p_RemovedUids = std::set<uint32_t>(),
-                         const std::set<uint32_t>& p_AddedUids = std::set<uint32_t>(),
+                         const UidSet& p_RemovedUids = UidSet(),
+                         const UidSet& p_AddedUids = UidSet(),
                          bool p_FilterUpdated = false);
   void SortFilterPreUpdate();
   void SortFilterUpdated(bool p_FilterUpdated);
@@ -270,12 +277,12 @@ private:
   std::mutex m_Mutex;
   Status m_Status;
   std::set<std::string> m_Folders;
-  std::map<std::string, std::set<uint32_t>> m_Uids;
+  std::map<std::string, UidSet> m_Uids;
   std::map<std::string, std::map<uint32_t, Header>> m_Headers;
   std::map<std::string, std::map<uint32_t, uint32_t>> m_Flags;
   std::map<std::string, std::map<uint32_t, Body>> m_Bodys;
   std::map<std::string, SortFilter> m_SortFilter;
-  std::map<std::string, std::set<uint32_t>> m_HeaderUids;
+  std::map<std::string, UidSet> m_HeaderUids;
   std::map<std::string, std::map<SortFilter, std::map<std::string, uint32_t>>> m_DisplayUids;
   std::map<std::string, std::map<SortFilter, uint64_t>> m_DisplayUidsVersion;
   std::map<std::string, uint64_t> m_HeaderUidsVersion;
@@ -284,14 +291,14 @@ private:
   bool m_HasPrefetchRequestedFolders = false;
   std::map<std::string, bool> m_HasRequestedUids;
   std::map<std::string, bool> m_HasPrefetchRequestedUids;
-  std::map<std::string, std::set<uint32_t>> m_PrefetchedHeaders;
-  std::map<std::string, std::set<uint32_t>> m_RequestedHeaders;
+  std::map<std::string, UidSet> m_PrefetchedHeaders;
+  std::map<std::string, UidSet> m_RequestedHeaders;
 
-  std::map<std::string, std::set<uint32_t>> m_PrefetchedFlags;
-  std::map<std::string, std::set<uint32_t>> m_RequestedFlags;
+  std::map<std::string, UidSet> m_PrefetchedFlags;
+  std::map<std::string, UidSet> m_RequestedFlags;
 
-  std::map<std::string, std::set<uint32_t>> m_PrefetchedBodys;
-  std::map<std::string, std::set<uint32_t>> m_RequestedBodys;
+  std::map<std::string, UidSet> m_PrefetchedBodys;
+  std::map<std::string, UidSet> m_RequestedBodys;
 
   std::vector<std::string> m_Addresses;
 
@@ -302,6 +309,7 @@ private:
   WINDOW* m_MainWin = NULL;
   WINDOW* m_DialogWin = NULL;
   WINDOW* m_HelpWin = NULL;
+  WINDOW* m_CursorWin = NULL; // window showing the terminal cursor, if any
 
   int m_ScreenWidth = 0;
   int m_ScreenHeight = 0;
@@ -431,6 +439,7 @@ private:
   bool m_SearchShowFolder = false;
   bool m_Signature = false;
   bool m_TopBarShowVersion = false;
+  int m_MaxFrameRate = 20;
 
   std::string m_TerminalTitle;
 
@@ -477,7 +486,7 @@ private:
 
   std::wstring m_ComposeMessageStr;
   int m_ComposeMessagePos = 0;
-  std::vector<std::wstring> m_ComposeMessageLines;
+  WrapCache m_ComposeMessageWrapCache;
   int m_ComposeMessageWrapLine = 0;
   int m_ComposeMessageWrapPos = 0;
   int m_ComposeMessageOffsetY = 0;
@@ -503,7 +512,10 @@ private:
   int m_MaxComposeLineLength = 0;
 
   int m_Pipe[2] = { -1, -1 };
+  char m_PendingUiRequest = UiRequestNone;
+  std::chrono::steady_clock::time_point m_LastFrameTime;
 
+  // guards search result state below, which is written by local and server search threads
   std::mutex m_SearchMutex;
   bool m_MessageListSearch = false;
   std::string m_MessageListSearchQuery;
@@ -512,6 +524,9 @@ private:
   bool m_MessageListSearchHasMore = false;
   std::vector<Header> m_MessageListSearchResultHeaders;
   std::vector<std::pair<std::string, uint32_t>> m_MessageListSearchResultFolderUids;
+  std::map<std::pair<std::string, uint32_t>, std::set<std::string>> m_MessageListSearchResultDuplicateFolders;
+  std::vector<Header> m_MessageListSearchServerHeaders;
+  std::vector<std::pair<std::string, uint32_t>> m_MessageListSearchServerFolderUids;
 
   std::pair<std::string, int32_t> m_CurrentFolderUid = std::make_pair("", -1);
 
@@ -531,7 +546,7 @@ private:
   std::string m_FilterCustomStr;
   int m_TabSize = 8;
 
-  std::map<std::string, std::set<uint32_t>> m_SelectedUids;
+  std::map<std::string, UidSet> m_SelectedUids;
   bool m_AllSelected = false;
 
   std::unique_ptr<SleepDetect> m_SleepDetect;
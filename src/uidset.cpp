@@ -0,0 +1,321 @@
+// uidset.cpp
+//
+// Copyright (c) 2024 Kristofer Berggren
+// All rights reserved.
+//
+// falanet is distributed under the MIT license, see LICENSE for details.
+
+#include "uidset.h"
+
+#include <algorithm>
+
+UidSet::UidSet()
+{
+}
+
+UidSet::UidSet(std::initializer_list<uint32_t> p_Uids)
+{
+  insert(p_Uids.begin(), p_Uids.end());
+}
+
+UidSet::UidSet(const std::set<uint32_t>& p_Uids)
+{
+  insert(p_Uids.begin(), p_Uids.end());
+}
+
+UidSet::const_iterator UidSet::begin() const
+{
+  return m_Ranges.empty() ? end() : const_iterator(&m_Ranges, m_Ranges.begin(), m_Ranges.begin()->first);
+}
+
+UidSet::const_iterator UidSet::end() const
+{
+  return const_iterator(&m_Ranges, m_Ranges.end(), 0);
+}
+
+UidSet::const_reverse_iterator UidSet::rbegin() const
+{
+  return const_reverse_iterator(end());
+}
+
+UidSet::const_reverse_iterator UidSet::rend() const
+{
+  return const_reverse_iterator(begin());
+}
+
+bool UidSet::empty() const
+{
+  return m_Ranges.empty();
+}
+
+size_t UidSet::size() const
+{
+  return m_Size;
+}
+
+void UidSet::clear()
+{
+  m_Ranges.clear();
+  m_Size = 0;
+}
+
+std::pair<UidSet::const_iterator, bool> UidSet::insert(uint32_t p_Uid)
+{
+  // fast path for uids inserted in ascending order
+  if (!m_Ranges.empty())
+  {
+    Ranges::iterator last = std::prev(m_Ranges.end());
+    if ((last->second != UINT32_MAX) && (p_Uid == (last->second + 1)))
+    {
+      last->second = p_Uid;
+      ++m_Size;
+      return std::make_pair(const_iterator(&m_Ranges, last, p_Uid), true);
+    }
+  }
+
+  Ranges::iterator next = m_Ranges.upper_bound(p_Uid);
+  Ranges::iterator prev = m_Ranges.end();
+  if (next != m_Ranges.begin())
+  {
+    prev = std::prev(next);
+    if (p_Uid <= prev->second)
+    {
+      return std::make_pair(const_iterator(&m_Ranges, prev, p_Uid), false);
+    }
+  }
+
+  const bool joinPrev = (prev != m_Ranges.end()) && ((prev->second + 1) == p_Uid);
+  const bool joinNext = (next != m_Ranges.end()) && ((p_Uid + 1) == next->first);
+  Ranges::iterator it;
+  if (joinPrev && joinNext)
+  {
+    prev->second = next->second;
+    m_Ranges.erase(next);
+    it = prev;
+  }
+  else if (joinPrev)
+  {
+    prev->second = p_Uid;
+    it = prev;
+  }
+  else if (joinNext)
+  {
+    const uint32_t last = next->second;
+    m_Ranges.erase(next++);
+    it = m_Ranges.emplace_hint(next, p_Uid, last);
+  }
+  else
+  {
+    it = m_Ranges.emplace_hint(next, p_Uid, p_Uid);
+  }
+
+  ++m_Size;
+  return std::make_pair(const_iterator(&m_Ranges, it, p_Uid), true);
+}
+
+size_t UidSet::erase(uint32_t p_Uid)
+{
+  Ranges::iterator it = m_Ranges.upper_bound(p_Uid);
+  if (it == m_Ranges.begin()) return 0;
+
+  --it;
+  if (p_Uid > it->second) return 0;
+
+  const uint32_t first = it->first;
+  const uint32_t last = it->second;
+  if (first == last)
+  {
+    m_Ranges.erase(it);
+  }
+  else if (p_Uid == first)
+  {
+    m_Ranges.erase(it++);
+    m_Ranges.emplace_hint(it, first + 1, last);
+  }
+  else if (p_Uid == last)
+  {
+    it->second = last - 1;
+  }
+  else
+  {
+    it->second = p_Uid - 1;
+    m_Ranges.emplace_hint(std::next(it), p_Uid + 1, last);
+  }
+
+  --m_Size;
+  return 1;
+}
+
+UidSet::const_iterator UidSet::erase(const_iterator p_It)
+{
+  const uint32_t uid = *p_It;
+  erase(uid);
+  return upper_bound(uid);
+}
+
+size_t UidSet::count(uint32_t p_Uid) const
+{
+  return (find(p_Uid) != end()) ? 1 : 0;
+}
+
+UidSet::const_iterator UidSet::find(uint32_t p_Uid) const
+{
+  Ranges::const_iterator it = m_Ranges.upper_bound(p_Uid);
+  if (it == m_Ranges.begin()) return end();
+
+  --it;
+  return (p_Uid <= it->second) ? const_iterator(&m_Ranges, it, p_Uid) : end();
+}
+
+UidSet::const_iterator UidSet::lower_bound(uint32_t p_Uid) const
+{
+  Ranges::const_iterator next = m_Ranges.upper_bound(p_Uid);
+  if (next != m_Ranges.begin())
+  {
+    Ranges::const_iterator prev = std::prev(next);
+    if (p_Uid <= prev->second)
+    {
+      return const_iterator(&m_Ranges, prev, p_Uid);
+    }
+  }
+
+  return (next != m_Ranges.end()) ? const_iterator(&m_Ranges, next, next->first) : end();
+}
+
+UidSet::const_iterator UidSet::upper_bound(uint32_t p_Uid) const
+{
+  return (p_Uid == UINT32_MAX) ? end() : lower_bound(p_Uid + 1);
+}
+
+bool UidSet::operator==(const UidSet& p_Other) const
+{
+  return m_Ranges == p_Other.m_Ranges;
+}
+
+bool UidSet::operator!=(const UidSet& p_Other) const
+{
+  return m_Ranges != p_Other.m_Ranges;
+}
+
+const UidSet::Ranges& UidSet::GetRanges() const
+{
+  return m_Ranges;
+}
+
+void UidSet::AppendRange(uint32_t p_First, uint32_t p_Last)
+{
+  // ranges must be appended in ascending order of first uid
+  if (!m_Ranges.empty())
+  {
+    Ranges::iterator last = std::prev(m_Ranges.end());
+    if ((last->second == UINT32_MAX) || (p_First <= (last->second + 1)))
+    {
+      last->second = std::max(last->second, p_Last);
+      return;
+    }
+  }
+
+  m_Ranges.emplace_hint(m_Ranges.end(), p_First, p_Last);
+}
+
+void UidSet::UpdateSize()
+{
+  m_Size = 0;
+  for (const auto& range : m_Ranges)
+  {
+    m_Size += (size_t)(range.second - range.first) + 1;
+  }
+}
+
+UidSet operator+(const UidSet& p_Lhs, const UidSet& p_Rhs)
+{
+  UidSet rv;
+  UidSet::Ranges::const_iterator lhsIt = p_Lhs.m_Ranges.begin();
+  UidSet::Ranges::const_iterator rhsIt = p_Rhs.m_Ranges.begin();
+  while ((lhsIt != p_Lhs.m_Ranges.end()) || (rhsIt != p_Rhs.m_Ranges.end()))
+  {
+    if ((rhsIt == p_Rhs.m_Ranges.end()) ||
+        ((lhsIt != p_Lhs.m_Ranges.end()) && (lhsIt->first <= rhsIt->first)))
+    {
+      rv.AppendRange(lhsIt->first, lhsIt->second);
+      ++lhsIt;
+    }
+    else
+    {
+      rv.AppendRange(rhsIt->first, rhsIt->second);
+      ++rhsIt;
+    }
+  }
+
+  rv.UpdateSize();
+  return rv;
+}
+
+UidSet operator-(const UidSet& p_Lhs, const UidSet& p_Rhs)
+{
+  UidSet rv;
+  UidSet::Ranges::const_iterator rhsIt = p_Rhs.m_Ranges.begin();
+  for (const auto& range : p_Lhs.m_Ranges)
+  {
+    uint32_t first = range.first;
+    const uint32_t last = range.second;
+
+    // skip rhs ranges fully preceding current range
+    while ((rhsIt != p_Rhs.m_Ranges.end()) && (rhsIt->second < first))
+    {
+      ++rhsIt;
+    }
+
+    bool remaining = true;
+    for (auto it = rhsIt; (it != p_Rhs.m_Ranges.end()) && (it->first <= last); ++it)
+    {
+      if (it->first > first)
+      {
+        rv.AppendRange(first, it->first - 1);
+      }
+
+      if (it->second >= last)
+      {
+        remaining = false;
+        break;
+      }
+
+      first = it->second + 1;
+    }
+
+    if (remaining)
+    {
+      rv.AppendRange(first, last);
+    }
+  }
+
+  rv.UpdateSize();
+  return rv;
+}
+
+std::vector<uint32_t> ToVector(const UidSet& p_Uids)
+{
+  std::vector<uint32_t> vec;
+  vec.reserve(p_Uids.size());
+  vec.insert(vec.end(), p_Uids.begin(), p_Uids.end());
+  return vec;
+}
+
+std::ostream& operator<<(std::ostream& p_Stream, const UidSet& p_Uids)
+{
+  p_Stream << "{";
+  bool first = true;
+  for (const auto& range : p_Uids.GetRanges())
+  {
+    p_Stream << (first ? "" : ", ") << range.first;
+    if (range.second != range.first)
+    {
+      p_Stream << ":" << range.second;
+    }
+
+    first = false;
+  }
+
+  p_Stream << "}";
+  return p_Stream;
+}
@@ -0,0 +1,193 @@
+// uidset.h
+//
+// Copyright (c) 2024 Kristofer Berggren
+// All rights reserved.
+//
+// falanet is distributed under the MIT license, see LICENSE for details.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <iterator>
+#include <map>
+#include <ostream>
+#include <set>
+#include <utility>
+#include <vector>
+
+// ordered set of uids stored as ranges of consecutive uids, as imap uids in
+// a folder are mostly consecutive this is typically a handful of ranges
+class UidSet
+{
+public:
+  typedef std::map<uint32_t, uint32_t> Ranges; // first uid -> last uid (inclusive)
+  typedef uint32_t key_type;
+  typedef uint32_t value_type;
+  typedef size_t size_type;
+
+  class const_iterator
+  {
+  public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef uint32_t value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const uint32_t* pointer;
+    typedef uint32_t reference;
+
+    const_iterator()
+    {
+    }
+
+    const_iterator(const Ranges* p_Ranges, Ranges::const_iterator p_It, uint32_t p_Value)
+      : m_Ranges(p_Ranges)
+      , m_It(p_It)
+      , m_Value(p_Value)
+    {
+    }
+
+    uint32_t operator*() const
+    {
+      return m_Value;
+    }
+
+    const uint32_t* operator->() const
+    {
+      return &m_Value;
+    }
+
+    const_iterator& operator++()
+    {
+      if (m_Value < m_It->second)
+      {
+        ++m_Value;
+      }
+      else
+      {
+        ++m_It;
+        m_Value = (m_It != m_Ranges->end()) ? m_It->first : 0;
+      }
+
+      return *this;
+    }
+
+    const_iterator operator++(int)
+    {
+      const_iterator it = *this;
+      ++(*this);
+      return it;
+    }
+
+    const_iterator& operator--()
+    {
+      if ((m_It != m_Ranges->end()) && (m_Value > m_It->first))
+      {
+        --m_Value;
+      }
+      else
+      {
+        --m_It;
+        m_Value = m_It->second;
+      }
+
+      return *this;
+    }
+
+    const_iterator operator--(int)
+    {
+      const_iterator it = *this;
+      --(*this);
+      return it;
+    }
+
+    bool operator==(const const_iterator& p_Other) const
+    {
+      return (m_It == p_Other.m_It) && (m_Value == p_Other.m_Value);
+    }
+
+    bool operator!=(const const_iterator& p_Other) const
+    {
+      return !(*this == p_Other);
+    }
+
+  private:
+    const Ranges* m_Ranges = nullptr;
+    Ranges::const_iterator m_It;
+    uint32_t m_Value = 0;
+  };
+
+  typedef const_iterator iterator;
+  typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+  typedef const_reverse_iterator reverse_iterator;
+
+public:
+  UidSet();
+  UidSet(std::initializer_list<uint32_t> p_Uids);
+  UidSet(const std::set<uint32_t>& p_Uids);
+
+  template<typename T>
+  UidSet(T p_First, T p_Last)
+  {
+    insert(p_First, p_Last);
+  }
+
+  const_iterator begin() const;
+  const_iterator end() const;
+  const_reverse_iterator rbegin() const;
+  const_reverse_iterator rend() const;
+
+  bool empty() const;
+  size_t size() const;
+  void clear();
+
+  std::pair<const_iterator, bool> insert(uint32_t p_Uid);
+
+  template<typename T>
+  void insert(T p_First, T p_Last)
+  {
+    for (T it = p_First; it != p_Last; ++it)
+    {
+      insert(*it);
+    }
+  }
+
+  size_t erase(uint32_t p_Uid);
+  const_iterator erase(const_iterator p_It);
+
+  size_t count(uint32_t p_Uid) const;
+  const_iterator find(uint32_t p_Uid) const;
+  const_iterator lower_bound(uint32_t p_Uid) const;
+  const_iterator upper_bound(uint32_t p_Uid) const;
+
+  bool operator==(const UidSet& p_Other) const;
+  bool operator!=(const UidSet& p_Other) const;
+
+  const Ranges& GetRanges() const;
+
+  friend UidSet operator+(const UidSet& p_Lhs, const UidSet& p_Rhs);
+  friend UidSet operator-(const UidSet& p_Lhs, const UidSet& p_Rhs);
+
+private:
+  void AppendRange(uint32_t p_First, uint32_t p_Last);
+  void UpdateSize();
+
+private:
+  Ranges m_Ranges;
+  size_t m_Size = 0;
+};
+
+UidSet operator+(const UidSet& p_Lhs, const UidSet& p_Rhs);
+UidSet operator-(const UidSet& p_Lhs, const UidSet& p_Rhs);
+std::vector<uint32_t> ToVector(const UidSet& p_Uids);
+std::ostream& operator<<(std::ostream& p_Stream, const UidSet& p_Uids);
+
+template<typename U>
+std::map<uint32_t, U> operator-(std::map<uint32_t, U> p_Lhs, const UidSet& p_Rhs)
+{
+  for (const auto& range : p_Rhs.GetRanges())
+  {
+    p_Lhs.erase(p_Lhs.lower_bound(range.first), p_Lhs.upper_bound(range.second));
+  }
+  return p_Lhs;
+}
@@ -0,0 +1,276 @@
+// wrapcache.cpp
+//
+// Copyright (c) 2024 Kristofer Berggren
+// All rights reserved.
+//
+// falanet is distributed under the MIT license, see LICENSE for details.
+
+#include "wrapcache.h"
+
+#include <algorithm>
+
+#include "util.h"
+
+void WrapCache::SetLineLength(unsigned p_LineLength)
+{
+  if (p_LineLength == m_LineLength) return;
+
+  // all paragraphs are re-wrapped on next update
+  m_LineLength = p_LineLength;
+  m_Paragraphs.clear();
+  UpdateIndex(0);
+  Invalidate();
+}
+
+void WrapCache::Edit(size_t p_Pos, size_t p_RemoveCount, size_t p_InsertCount)
+{
+  if (!m_EditKnown) return;
+
+  if ((p_Pos + p_RemoveCount) > m_TextSize)
+  {
+    Invalidate();
+    return;
+  }
+
+  // extend changed range to cover the edit, shifting its end if after the edit
+  const size_t end = p_Pos + p_InsertCount;
+  if (!m_Edited)
+  {
+    m_EditStart = p_Pos;
+    m_EditEnd = end;
+    m_Edited = true;
+  }
+  else
+  {
+    size_t prevEnd = m_EditEnd;
+    if (prevEnd > p_Pos)
+    {
+      prevEnd = (prevEnd >= (p_Pos + p_RemoveCount)) ? (prevEnd - p_RemoveCount + p_InsertCount) : end;
+    }
+
+    m_EditStart = std::min(m_EditStart, p_Pos);
+    m_EditEnd = std::max(prevEnd, end);
+  }
+
+  m_TextSize = m_TextSize - p_RemoveCount + p_InsertCount;
+}
+
+void WrapCache::Invalidate()
+{
+  m_EditKnown = false;
+  m_Edited = false;
+}
+
+void WrapCache::Update(const std::wstring& p_Text)
+{
+  if (m_EditKnown && !m_Paragraphs.empty() && (p_Text.size() == m_TextSize))
+  {
+    if (!m_Edited) return;
+
+    // only re-wrap paragraphs overlapping the changed range, mapped to the previous text
+    if ((m_EditEnd + m_UpdateTextSize) >= m_TextSize)
+    {
+      const size_t prevEditEnd = m_EditEnd + m_UpdateTextSize - m_TextSize;
+      if ((prevEditEnd >= m_EditStart) && (prevEditEnd <= m_UpdateTextSize))
+      {
+        const size_t first = FindParagraph(m_EditStart);
+        const size_t last = FindParagraph(prevEditEnd);
+        const size_t start = m_ParagraphOffsets.at(first);
+        const size_t end = m_ParagraphOffsets.at(last) + m_Paragraphs.at(last).m_Text.size() + m_TextSize -
+          m_UpdateTextSize;
+        std::vector<Paragraph> paragraphs = Split(p_Text, start, end);
+        Replace(first, last - first + 1, paragraphs);
+        m_Edited = false;
+        m_UpdateTextSize = m_TextSize;
+        return;
+      }
+    }
+  }
+
+  // paragraphs unchanged at the start, each followed by a newline
+  const size_t count = m_Paragraphs.size();
+  size_t prefixCount = 0;
+  size_t prefixEnd = 0;
+  while ((prefixCount + 1) < count)
+  {
+    const std::wstring& text = m_Paragraphs.at(prefixCount).m_Text;
+    if (((prefixEnd + text.size()) >= p_Text.size()) || (p_Text[prefixEnd + text.size()] != L'\n') ||
+        (p_Text.compare(prefixEnd, text.size(), text) != 0))
+    {
+      break;
+    }
+
+    prefixEnd += text.size() + 1;
+    ++prefixCount;
+  }
+
+  // paragraphs unchanged at the end, not overlapping the ones at the start
+  size_t suffixCount = 0;
+  size_t suffixStart = p_Text.size() + 1;
+  while ((prefixCount + suffixCount) < count)
+  {
+    const std::wstring& text = m_Paragraphs.at(count - suffixCount - 1).m_Text;
+    const size_t end = suffixStart - 1;
+    if ((end < (prefixEnd + text.size())) || (p_Text.compare(end - text.size(), text.size(), text) != 0))
+    {
+      break;
+    }
+
+    const size_t start = end - text.size();
+    if ((start > prefixEnd) && (p_Text[start - 1] != L'\n'))
+    {
+      break;
+    }
+
+    suffixStart = start;
+    ++suffixCount;
+    if (start == prefixEnd) break;
+  }
+
+  // split and wrap the changed text between them into paragraphs
+  std::vector<Paragraph> paragraphs;
+  if ((suffixCount == 0) || (suffixStart > prefixEnd))
+  {
+    const size_t end = (suffixCount > 0) ? (suffixStart - 1) : p_Text.size();
+    paragraphs = Split(p_Text, prefixEnd, end);
+  }
+
+  Replace(prefixCount, count - prefixCount - suffixCount, paragraphs);
+  m_EditKnown = true;
+  m_Edited = false;
+  m_TextSize = p_Text.size();
+  m_UpdateTextSize = p_Text.size();
+}
+
+void WrapCache::GetWrapPos(int p_Pos, int& p_WrapLine, int& p_WrapPos) const
+{
+  p_WrapLine = 0;
+  p_WrapPos = 0;
+  if (m_Paragraphs.empty()) return;
+
+  const size_t index = FindParagraph((size_t)std::max(p_Pos, 0));
+  int pos = std::max(p_Pos, 0) - (int)m_ParagraphOffsets.at(index);
+  p_WrapLine = (int)m_ParagraphLines.at(index);
+
+  // same cursor mapping as Util::WordWrap, within the paragraph
+  for (const auto& line : m_Paragraphs.at(index).m_Lines)
+  {
+    if (pos <= 0) break;
+
+    const int lineLength = std::min((unsigned)line.size() + 1, m_LineLength);
+    if (lineLength <= pos)
+    {
+      pos -= lineLength;
+      ++p_WrapLine;
+    }
+    else
+    {
+      p_WrapPos = pos;
+      pos = 0;
+    }
+  }
+}
+
+size_t WrapCache::GetLineCount() const
+{
+  return m_LineCount;
+}
+
+const std::wstring& WrapCache::GetLine(size_t p_Line) const
+{
+  auto it = std::upper_bound(m_ParagraphLines.begin(), m_ParagraphLines.end(), p_Line);
+  const size_t index = std::distance(m_ParagraphLines.begin(), it) - 1;
+  return m_Paragraphs.at(index).m_Lines.at(p_Line - m_ParagraphLines.at(index));
+}
+
+std::vector<std::wstring> WrapCache::GetLines() const
+{
+  std::vector<std::wstring> lines;
+  for (size_t i = 0; i < m_LineCount; ++i)
+  {
+    lines.push_back(GetLine(i));
+  }
+
+  return lines;
+}
+
+void WrapCache::Wrap(Paragraph& p_Paragraph) const
+{
+  const bool processFlowed = false; // only process when viewing message
+  const bool outputFlowed = false; // only generate when sending after compose
+  const bool quoteWrap = false; // only wrap quoted lines when viewing message
+  const int expandTabSize = 0; // disabled
+  p_Paragraph.m_Lines = Util::WordWrap(p_Paragraph.m_Text, m_LineLength, processFlowed, outputFlowed, quoteWrap,
+                                       expandTabSize);
+  if (p_Paragraph.m_Lines.empty())
+  {
+    p_Paragraph.m_Lines.push_back(L"");
+  }
+}
+
+std::vector<WrapCache::Paragraph> WrapCache::Split(const std::wstring& p_Text, size_t p_Start,
+                                                   size_t p_End) const
+{
+  std::vector<Paragraph> paragraphs;
+  size_t start = p_Start;
+  while (true)
+  {
+    const size_t pos = std::min(p_Text.find(L'\n', start), p_End);
+    Paragraph paragraph;
+    paragraph.m_Text = p_Text.substr(start, pos - start);
+    Wrap(paragraph);
+    paragraphs.push_back(std::move(paragraph));
+    if (pos >= p_End) break;
+
+    start = pos + 1;
+  }
+
+  return paragraphs;
+}
+
+void WrapCache::Replace(size_t p_First, size_t p_Count, std::vector<Paragraph>& p_Paragraphs)
+{
+  // replace changed paragraphs in place, only shifting the vector when the count differs
+  const size_t replaceCount = std::min(p_Count, p_Paragraphs.size());
+  std::move(p_Paragraphs.begin(), p_Paragraphs.begin() + replaceCount, m_Paragraphs.begin() + p_First);
+  if (p_Count > replaceCount)
+  {
+    m_Paragraphs.erase(m_Paragraphs.begin() + p_First + replaceCount, m_Paragraphs.begin() + p_First + p_Count);
+  }
+  else if (p_Paragraphs.size() > replaceCount)
+  {
+    m_Paragraphs.insert(m_Paragraphs.begin() + p_First + replaceCount,
+                        std::make_move_iterator(p_Paragraphs.begin() + replaceCount),
+                        std::make_move_iterator(p_Paragraphs.end()));
+  }
+
+  UpdateIndex(p_First);
+}
+
+size_t WrapCache::FindParagraph(size_t p_Pos) const
+{
+  auto it = std::upper_bound(m_ParagraphOffsets.begin(), m_ParagraphOffsets.end(), p_Pos);
+  return std::distance(m_ParagraphOffsets.begin(), it) - 1;
+}
+
+void WrapCache::UpdateIndex(size_t p_First)
+{
+  // paragraphs before the first changed one keep their offsets, the one before it is
+  // revisited as it may have become the last paragraph
+  m_ParagraphOffsets.resize(m_Paragraphs.size());
+  m_ParagraphLines.resize(m_Paragraphs.size());
+  const size_t first = std::min(p_First, m_Paragraphs.size());
+  const size_t start = (first > 0) ? (first - 1) : 0;
+  size_t offset = (start > 0) ? m_ParagraphOffsets[start] : 0;
+  m_LineCount = (start > 0) ? m_ParagraphLines[start] : 0;
+  for (size_t i = start; i < m_Paragraphs.size(); ++i)
+  {
+    m_ParagraphOffsets[i] = offset;
+    m_ParagraphLines[i] = m_LineCount;
+    offset += m_Paragraphs[i].m_Text.size() + 1;
+
+    // an empty last paragraph (text ending with newline) has no line, as with Util::WordWrap
+    const bool isEmptyLast = ((i + 1) == m_Paragraphs.size()) && m_Paragraphs[i].m_Text.empty();
+    m_LineCount += isEmptyLast ? 0 : m_Paragraphs[i].m_Lines.size();
+  }
+}
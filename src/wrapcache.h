@@ -0,0 +1,57 @@
+// wrapcache.h
+//
+// Copyright (c) 2024 Kristofer Berggren
+// All rights reserved.
+//
+// falanet is distributed under the MIT license, see LICENSE for details.
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+// word wrapped lines of an edited text, cached per paragraph (source line) so that
+// an update only re-wraps the paragraphs that changed since the previous update. edits
+// reported with Edit() let the update skip comparing the unchanged paragraphs, other
+// changes of the text must be reported with Invalidate().
+class WrapCache
+{
+public:
+  void SetLineLength(unsigned p_LineLength);
+  void Edit(size_t p_Pos, size_t p_RemoveCount, size_t p_InsertCount);
+  void Invalidate();
+  void Update(const std::wstring& p_Text);
+  void GetWrapPos(int p_Pos, int& p_WrapLine, int& p_WrapPos) const;
+
+  size_t GetLineCount() const;
+  const std::wstring& GetLine(size_t p_Line) const;
+  std::vector<std::wstring> GetLines() const;
+
+private:
+  struct Paragraph
+  {
+    std::wstring m_Text;
+    std::vector<std::wstring> m_Lines;
+  };
+
+  void Wrap(Paragraph& p_Paragraph) const;
+  std::vector<Paragraph> Split(const std::wstring& p_Text, size_t p_Start, size_t p_End) const;
+  void Replace(size_t p_First, size_t p_Count, std::vector<Paragraph>& p_Paragraphs);
+  size_t FindParagraph(size_t p_Pos) const;
+  void UpdateIndex(size_t p_First);
+
+private:
+  unsigned m_LineLength = 0;
+  std::vector<Paragraph> m_Paragraphs;
+  std::vector<size_t> m_ParagraphOffsets; // text offset of each paragraph
+  std::vector<size_t> m_ParagraphLines; // index of first wrapped line of each paragraph
+  size_t m_LineCount = 0;
+
+  // edits since previous update, as changed range of the current text
+  bool m_EditKnown = false;
+  bool m_Edited = false;
+  size_t m_EditStart = 0;
+  size_t m_EditEnd = 0;
+  size_t m_TextSize = 0;
+  size_t m_UpdateTextSize = 0;
+};
@@ -0,0 +1,289 @@
+// blobstoretest.cpp
+//
+// Copyright (c) 2024 Kristofer Berggren
+// All rights reserved.
+//
+// falanet is distributed under the MIT license, see LICENSE for details.
+
+// round-trip check of blob store packing, and measurement of disk size, sync throughput
+// and read latency of packed blobs against raw message files, the previous format, over
+// a synthetic corpus or the messages of a maildir folder given as argument
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "blobstore.h"
+#include "util.h"
+
+struct Result
+{
+  uint64_t m_DiskBytes = 0;
+  double m_SyncSec = 0;
+  double m_ReadSec = 0;
+};
+
+static std::string MakeText(std::mt19937& p_Rng, size_t p_Size)
+{
+  static const std::vector<std::string> words =
+  {
+    "the", "meeting", "tomorrow", "please", "review", "attached", "draft", "thanks", "regards",
+    "project", "update", "schedule", "we", "should", "discuss", "budget", "and", "next", "steps",
+    "could", "you", "send", "me", "latest", "version", "of", "report", "before", "friday",
+  };
+
+  std::string text;
+  size_t lineLen = 0;
+  while (text.size() < p_Size)
+  {
+    const std::string& word = words.at(p_Rng() % words.size());
+    text += word;
+    lineLen += word.size() + 1;
+    if (lineLen > 72)
+    {
+      text += "\r\n";
+      lineLen = 0;
+    }
+    else
+    {
+      text += " ";
+    }
+  }
+
+  return text;
+}
+
+static std::string MakeBase64(std::mt19937& p_Rng, size_t p_Size)
+{
+  static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string data;
+  while (data.size() < p_Size)
+  {
+    for (int i = 0; i < 76; ++i)
+    {
+      data += chars[p_Rng() % 64];
+    }
+
+    data += "\r\n";
+  }
+
+  return data;
+}
+
+static std::vector<std::string> MakeCorpus()
+{
+  std::mt19937 rng(1);
+  std::vector<std::string> msgs;
+  for (int i = 0; i < 300; ++i)
+  {
+    std::string msg =
+      "Date: Mon, 3 Jun 2024 10:" + std::to_string(10 + (i % 50)) + ":00 +0000\r\n"
+      "From: Sender " + std::to_string(i % 17) + " <sender" + std::to_string(i % 17) + "@example.com>\r\n"
+      "To: Recipient <recipient@example.com>\r\n"
+      "Subject: Message " + std::to_string(i) + "\r\n"
+      "Message-ID: <" + std::to_string(i) + ".1717409400@example.com>\r\n"
+      "MIME-Version: 1.0\r\n"
+      "Content-Type: multipart/mixed; boundary=\"b\"\r\n\r\n"
+      "--b\r\nContent-Type: text/plain; charset=\"UTF-8\"\r\n\r\n" +
+      MakeText(rng, 2000 + (rng() % 20000));
+    if ((i % 3) == 0)
+    {
+      msg += "--b\r\nContent-Type: text/html; charset=\"UTF-8\"\r\n\r\n<html><body><p>" +
+        MakeText(rng, 4000 + (rng() % 30000)) + "</p></body></html>\r\n";
+    }
+
+    if ((i % 5) == 0)
+    {
+      msg += "--b\r\nContent-Type: application/pdf\r\nContent-Transfer-Encoding: base64\r\n\r\n" +
+        MakeBase64(rng, 50000 + (rng() % 150000));
+    }
+
+    msg += "--b--\r\n";
+    msgs.push_back(msg);
+  }
+
+  return msgs;
+}
+
+static std::vector<std::string> ReadMaildir(const std::string& p_Dir)
+{
+  std::vector<std::string> msgs;
+  for (const auto& subdir : { "/cur/", "/new/" })
+  {
+    const std::string dir = p_Dir + subdir;
+    if (!Util::IsDir(dir)) continue;
+
+    for (const auto& file : Util::ListDir(dir))
+    {
+      msgs.push_back(Util::ReadFile(dir + file));
+    }
+  }
+
+  return msgs;
+}
+
+static double Elapsed(const std::chrono::steady_clock::time_point& p_Start)
+{
+  const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - p_Start;
+  return elapsed.count();
+}
+
+// previous format, raw message written to its own file and mapped on read
+static bool MeasureRaw(const std::string& p_Dir, const std::vector<std::string>& p_Msgs, Result& p_Result)
+{
+  Util::MkDir(p_Dir);
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < p_Msgs.size(); ++i)
+  {
+    const std::string path = p_Dir + std::to_string(i);
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) return false;
+
+    const std::string& msg = p_Msgs.at(i);
+    const bool rv = (write(fd, msg.data(), msg.size()) == (ssize_t)msg.size()) && (fsync(fd) == 0);
+    close(fd);
+    if (!rv) return false;
+
+    p_Result.m_DiskBytes += msg.size();
+  }
+
+  p_Result.m_SyncSec = Elapsed(start);
+
+  bool ok = true;
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < p_Msgs.size(); ++i)
+  {
+    const std::string path = p_Dir + std::to_string(i);
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) return false;
+
+    struct stat sb;
+    std::string data;
+    if ((fstat(fd, &sb) == 0) && (sb.st_size > 0))
+    {
+      void* map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED)
+      {
+        data.assign((const char*)map, sb.st_size);
+        munmap(map, sb.st_size);
+      }
+    }
+
+    close(fd);
+    ok &= (data == p_Msgs.at(i));
+  }
+
+  p_Result.m_ReadSec = Elapsed(start);
+  return ok;
+}
+
+static bool MeasureBlobStore(const std::string& p_Dir, bool p_Encrypt, const std::vector<std::string>& p_Msgs,
+                             Result& p_Result)
+{
+  BlobStore blobStore(p_Dir, p_Encrypt, "pass");
+  std::vector<std::string> hashes;
+  for (const auto& msg : p_Msgs)
+  {
+    hashes.push_back(blobStore.GetHash(msg));
+  }
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < p_Msgs.size(); ++i)
+  {
+    size_t storedSize = 0;
+    if (!blobStore.Put(hashes.at(i), p_Msgs.at(i), storedSize)) return false;
+
+    p_Result.m_DiskBytes += storedSize;
+  }
+
+  p_Result.m_SyncSec = Elapsed(start);
+
+  bool ok = true;
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < p_Msgs.size(); ++i)
+  {
+    std::shared_ptr<Blob> blob = blobStore.Get(hashes.at(i));
+    ok &= blob && (blob->ToString() == p_Msgs.at(i));
+  }
+
+  p_Result.m_ReadSec = Elapsed(start);
+  return ok;
+}
+
+static void Report(const std::string& p_Name, const Result& p_Result, uint64_t p_RawBytes, size_t p_Count)
+{
+  std::cout << std::left << std::setw(18) << p_Name << std::right << std::fixed << std::setprecision(1)
+            << std::setw(10) << (p_Result.m_DiskBytes / 1024.0) << " KB"
+            << std::setw(7) << ((p_Result.m_DiskBytes * 100.0) / p_RawBytes) << " %"
+            << std::setw(10) << ((p_RawBytes / (1024.0 * 1024.0)) / p_Result.m_SyncSec) << " MB/s sync"
+            << std::setw(10) << ((p_Result.m_ReadSec * 1000000.0) / p_Count) << " us/read\n";
+}
+
+int main(int argc, char* argv[])
+{
+  const std::vector<std::string> msgs = (argc > 1) ? ReadMaildir(argv[1]) : MakeCorpus();
+  if (msgs.empty())
+  {
+    std::cerr << "fail: no messages\n";
+    return 1;
+  }
+
+  char tmpl[] = "/tmp/blobstoretest.XXXXXX";
+  if (mkdtemp(tmpl) == NULL)
+  {
+    std::cerr << "fail: mkdtemp\n";
+    return 1;
+  }
+
+  const std::string dir = std::string(tmpl) + "/";
+  uint64_t rawBytes = 0;
+  for (const auto& msg : msgs)
+  {
+    rawBytes += msg.size();
+  }
+
+  Result raw;
+  Result packed;
+  Result packedEncrypted;
+  bool ok = true;
+  if (!MeasureRaw(dir + "raw/", msgs, raw))
+  {
+    std::cerr << "fail: raw round-trip\n";
+    ok = false;
+  }
+
+  if (!MeasureBlobStore(dir + "packed/", false, msgs, packed))
+  {
+    std::cerr << "fail: packed round-trip\n";
+    ok = false;
+  }
+
+  if (!MeasureBlobStore(dir + "encrypted/", true, msgs, packedEncrypted))
+  {
+    std::cerr << "fail: encrypted round-trip\n";
+    ok = false;
+  }
+
+  if (ok)
+  {
+    std::cout << msgs.size() << " messages, " << (rawBytes / 1024) << " KB\n";
+    Report("raw", raw, rawBytes, msgs.size());
+    Report("packed", packed, rawBytes, msgs.size());
+    Report("packed encrypted", packedEncrypted, rawBytes, msgs.size());
+  }
+
+  Util::RmDir(dir);
+
+  return ok ? 0 : 1;
+}
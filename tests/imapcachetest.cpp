@@ -0,0 +1,290 @@
+// imapcachetest.cpp
+//
+// Copyright (c) 2024 Kristofer Berggren
+// All rights reserved.
+//
+// falanet is distributed under the MIT license, see LICENSE for details.
+
+// measurement of cache read contention: ui header read latency while idle, during body
+// writes to another folder and with parallel readers, and sqlite read throughput of
+// readers sharing one serialized connection against a connection per reader
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sqlite_modern_cpp.h>
+
+#include "body.h"
+#include "cacheutil.h"
+#include "header.h"
+#include "imapcache.h"
+#include "uidset.h"
+#include "util.h"
+
+static const uint32_t s_MsgCount = 2000;
+static const uint32_t s_ReadCount = 50;
+static const int s_ReaderCount = 4;
+
+struct Latency
+{
+  uint64_t m_Count = 0;
+  double m_TotalSec = 0;
+  double m_MaxSec = 0;
+};
+
+static double Elapsed(const std::chrono::steady_clock::time_point& p_Start)
+{
+  const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - p_Start;
+  return elapsed.count();
+}
+
+static std::string MakeHeader(uint32_t p_Uid)
+{
+  return "Date: Mon, 3 Jun 2024 10:00:00 +0000\r\n"
+    "From: Sender <sender@example.com>\r\n"
+    "To: Recipient <recipient@example.com>\r\n"
+    "Subject: Message " + std::to_string(p_Uid) + "\r\n"
+    "Message-ID: <" + std::to_string(p_Uid) + "@example.com>\r\n\r\n";
+}
+
+static std::map<uint32_t, Body> MakeBodys(uint32_t p_First, uint32_t p_Count)
+{
+  std::map<uint32_t, Body> bodys;
+  for (uint32_t uid = p_First; uid < (p_First + p_Count); ++uid)
+  {
+    std::string data = MakeHeader(uid);
+    while (data.size() < 20000)
+    {
+      data += "please review the attached draft before the meeting " + std::to_string(uid) + "\r\n";
+    }
+
+    bodys[uid].SetData(data);
+  }
+
+  return bodys;
+}
+
+static void Populate(ImapCache& p_ImapCache, const std::string& p_Folder)
+{
+  UidSet uids;
+  std::map<uint32_t, Header> headers;
+  for (uint32_t uid = 1; uid <= s_MsgCount; ++uid)
+  {
+    uids.insert(uid);
+    headers[uid].SetHeaderData(MakeHeader(uid), "", 1717408800);
+  }
+
+  p_ImapCache.SetUids(p_Folder, uids);
+  p_ImapCache.SetHeaders(p_Folder, headers);
+}
+
+// reads headers of random pages of the folder until stopped, as the ui does when scrolling
+static void ReadHeaders(ImapCache& p_ImapCache, const std::string& p_Folder, const std::atomic<bool>& p_Stop,
+                        Latency& p_Latency, bool& p_Ok)
+{
+  uint32_t first = 1;
+  while (!p_Stop)
+  {
+    UidSet uids;
+    for (uint32_t uid = first; uid < (first + s_ReadCount); ++uid)
+    {
+      uids.insert(uid);
+    }
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const std::map<uint32_t, Header> headers = p_ImapCache.GetHeaders(p_Folder, uids, false /* p_Prefetch */);
+    const double sec = Elapsed(start);
+    p_Ok &= (headers.size() == s_ReadCount);
+    ++p_Latency.m_Count;
+    p_Latency.m_TotalSec += sec;
+    p_Latency.m_MaxSec = std::max(p_Latency.m_MaxSec, sec);
+    first = 1 + ((first + (s_ReadCount * 7)) % (s_MsgCount - s_ReadCount));
+  }
+}
+
+static void Report(const std::string& p_Name, const Latency& p_Latency, double p_Sec)
+{
+  std::cout << std::left << std::setw(26) << p_Name << std::right << std::fixed << std::setprecision(1)
+            << std::setw(10) << ((p_Latency.m_TotalSec * 1000000.0) / std::max<uint64_t>(p_Latency.m_Count, 1))
+            << " us avg" << std::setw(10) << (p_Latency.m_MaxSec * 1000000.0) << " us max"
+            << std::setw(10) << (p_Latency.m_Count / p_Sec) << " reads/s\n";
+}
+
+static bool MeasureImapCache()
+{
+  ImapCache imapCache(false /* p_CacheEncrypt */, "");
+  Populate(imapCache, "INBOX");
+  Populate(imapCache, "Archive");
+
+  bool ok = true;
+  const double durationSec = 1.0;
+
+  // ui reads alone
+  {
+    std::atomic<bool> stop(false);
+    Latency latency;
+    bool readOk = true;
+    std::thread reader(ReadHeaders, std::ref(imapCache), "INBOX", std::cref(stop), std::ref(latency),
+                       std::ref(readOk));
+    std::this_thread::sleep_for(std::chrono::duration<double>(durationSec));
+    stop = true;
+    reader.join();
+    ok &= readOk;
+    Report("idle", latency, durationSec);
+  }
+
+  // ui reads while sync writes 500 message body transactions to another folder
+  {
+    std::atomic<bool> stop(false);
+    Latency latency;
+    bool readOk = true;
+    std::thread reader(ReadHeaders, std::ref(imapCache), "INBOX", std::cref(stop), std::ref(latency),
+                       std::ref(readOk));
+    std::thread writer([&]()
+    {
+      for (uint32_t first = 1; !stop; first = (first % s_MsgCount) + 500)
+      {
+        imapCache.SetBodys("Archive", MakeBodys(first, 500));
+      }
+    });
+    std::this_thread::sleep_for(std::chrono::duration<double>(durationSec));
+    stop = true;
+    reader.join();
+    writer.join();
+    ok &= readOk;
+    Report("writes to other folder", latency, durationSec);
+  }
+
+  // parallel ui and index reads of the same folder
+  {
+    std::atomic<bool> stop(false);
+    std::vector<Latency> latencies(s_ReaderCount);
+    std::vector<char> readOks(s_ReaderCount, 1);
+    std::vector<std::thread> readers;
+    for (int i = 0; i < s_ReaderCount; ++i)
+    {
+      readers.push_back(std::thread([&, i]()
+      {
+        bool readOk = true;
+        ReadHeaders(imapCache, "INBOX", stop, latencies[i], readOk);
+        readOks[i] = readOk;
+      }));
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(durationSec));
+    stop = true;
+    Latency total;
+    for (int i = 0; i < s_ReaderCount; ++i)
+    {
+      readers[i].join();
+      ok &= (readOks[i] != 0);
+      total.m_Count += latencies[i].m_Count;
+      total.m_TotalSec += latencies[i].m_TotalSec;
+      total.m_MaxSec = std::max(total.m_MaxSec, latencies[i].m_MaxSec);
+    }
+
+    Report(std::to_string(s_ReaderCount) + " parallel readers", total, durationSec);
+  }
+
+  return ok;
+}
+
+static double MeasureSqliteReads(const std::vector<std::shared_ptr<sqlite::database>>& p_Dbs)
+{
+  const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::vector<std::thread> readers;
+  for (size_t i = 0; i < p_Dbs.size(); ++i)
+  {
+    readers.push_back(std::thread([&, i]()
+    {
+      for (uint32_t uid = 1; uid <= s_MsgCount; ++uid)
+      {
+        std::vector<char> data;
+        *p_Dbs.at(i) << "SELECT data FROM headers WHERE uid = ?;" << uid >> data;
+      }
+    }));
+  }
+
+  for (auto& reader : readers)
+  {
+    reader.join();
+  }
+
+  return (p_Dbs.size() * s_MsgCount) / Elapsed(start);
+}
+
+static void MeasureSqlite(const std::string& p_Dir)
+{
+  const std::string dbPath = p_Dir + "sqlitetest.sqlite";
+  {
+    sqlite::database db(dbPath);
+    db << "CREATE TABLE headers (uid INT PRIMARY KEY NOT NULL, data BLOB);";
+    db << "begin;";
+    for (uint32_t uid = 1; uid <= s_MsgCount; ++uid)
+    {
+      const std::string header = MakeHeader(uid);
+      db << "INSERT INTO headers (uid, data) VALUES (?, ?);" << uid
+         << std::vector<char>(header.begin(), header.end());
+    }
+    db << "commit;";
+  }
+
+  sqlite::sqlite_config sharedConfig;
+  sharedConfig.flags = sqlite::OpenFlags::READWRITE | sqlite::OpenFlags::FULLMUTEX;
+  std::shared_ptr<sqlite::database> sharedDb(new sqlite::database(dbPath, sharedConfig));
+  const double sharedRate = MeasureSqliteReads(std::vector<std::shared_ptr<sqlite::database>>(s_ReaderCount,
+                                                                                               sharedDb));
+
+  sqlite::sqlite_config readerConfig;
+  readerConfig.flags = sqlite::OpenFlags::READONLY | sqlite::OpenFlags::NOMUTEX;
+  std::vector<std::shared_ptr<sqlite::database>> readerDbs;
+  for (int i = 0; i < s_ReaderCount; ++i)
+  {
+    readerDbs.push_back(std::shared_ptr<sqlite::database>(new sqlite::database(dbPath, readerConfig)));
+  }
+
+  const double readerRate = MeasureSqliteReads(readerDbs);
+
+  std::cout << std::left << std::setw(26) << "shared connection" << std::right << std::fixed
+            << std::setprecision(1) << std::setw(10) << sharedRate << " reads/s\n"
+            << std::left << std::setw(26) << "connection per reader" << std::right
+            << std::setw(10) << readerRate << " reads/s\n";
+}
+
+int main()
+{
+  char tmpl[] = "/tmp/imapcachetest.XXXXXX";
+  if (mkdtemp(tmpl) == NULL)
+  {
+    std::cerr << "fail: mkdtemp\n";
+    return 1;
+  }
+
+  const std::string dir = std::string(tmpl) + "/";
+  Util::SetApplicationDir(dir);
+  Util::InitTempDir();
+  CacheUtil::InitCacheDir();
+
+  const bool ok = MeasureImapCache();
+  if (!ok)
+  {
+    std::cerr << "fail: header read\n";
+  }
+
+  MeasureSqlite(dir);
+
+  Util::CleanupTempDir();
+  Util::RmDir(dir);
+
+  return ok ? 0 : 1;
+}
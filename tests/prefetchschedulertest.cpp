@@ -0,0 +1,241 @@
+// prefetchschedulertest.cpp
+//
+// Copyright (c) 2024 Kristofer Berggren
+// All rights reserved.
+//
+// falanet is distributed under the MIT license, see LICENSE for details.
+
+// checks of prefetch scheduler ordering by level and body score, re-ranking of queued
+// bodies on cursor move, pacing by bandwidth, budget and metered link, and persistence
+// of budget use and statistics across runs
+
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "cacheutil.h"
+#include "prefetchscheduler.h"
+#include "util.h"
+
+static bool Check(bool p_Cond, const std::string& p_Desc)
+{
+  if (!p_Cond)
+  {
+    std::cerr << "fail: " << p_Desc << "\n";
+  }
+
+  return p_Cond;
+}
+
+static PrefetchHints MakeHints(int32_t p_ListIndex, bool p_Unseen = false, const std::string& p_Sender = "")
+{
+  PrefetchHints hints;
+  hints.m_ListIndex = p_ListIndex;
+  hints.m_Unseen = p_Unseen;
+  hints.m_Sender = p_Sender;
+  return hints;
+}
+
+static std::vector<uint64_t> TakeAll(PrefetchScheduler& p_Scheduler)
+{
+  std::vector<uint64_t> ids;
+  uint64_t id = 0;
+  int64_t waitMs = 0;
+  while (p_Scheduler.Next(id, waitMs))
+  {
+    ids.push_back(id);
+  }
+
+  return ids;
+}
+
+static bool TestOrder()
+{
+  bool ok = true;
+  PrefetchScheduler::SetLimits(0, 0, 0, false);
+
+  // lower level first, most recently added first within a level
+  {
+    PrefetchScheduler scheduler;
+    scheduler.Add(1, 3, false, "INBOX", PrefetchHints());
+    scheduler.Add(2, 2, true, "INBOX", PrefetchHints());
+    scheduler.Add(3, 1, false, "INBOX", PrefetchHints());
+    scheduler.Add(4, 1, false, "INBOX", PrefetchHints());
+    ok &= Check(TakeAll(scheduler) == std::vector<uint64_t>({ 4, 3, 2, 1 }), "level order");
+    ok &= Check(!scheduler.HasReady(), "empty after take");
+  }
+
+  // bodies ranked by unseen, age and opened sender
+  {
+    PrefetchScheduler scheduler;
+    PrefetchHints old = MakeHints(-1);
+    old.m_Time = time(NULL) - (365 * 24 * 60 * 60);
+    PrefetchHints recent = MakeHints(-1);
+    recent.m_Time = time(NULL);
+    scheduler.Add(1, 2, true, "INBOX", old);
+    scheduler.Add(2, 2, true, "INBOX", MakeHints(-1, true /* p_Unseen */));
+    scheduler.Add(3, 2, true, "INBOX", recent);
+    ok &= Check(TakeAll(scheduler) == std::vector<uint64_t>({ 2, 3, 1 }), "body score order");
+  }
+
+  // header and flag info arriving later updates the rank
+  {
+    PrefetchScheduler scheduler;
+    scheduler.Add(1, 2, true, "INBOX", MakeHints(-1));
+    scheduler.Add(2, 2, true, "INBOX", MakeHints(-1));
+    scheduler.Update(1, MakeHints(-1, true /* p_Unseen */));
+    scheduler.Update(9, MakeHints(-1, true /* p_Unseen */));
+    ok &= Check(TakeAll(scheduler) == std::vector<uint64_t>({ 1, 2 }), "update rank");
+  }
+
+  return ok;
+}
+
+static bool TestCursor()
+{
+  bool ok = true;
+  PrefetchScheduler::SetLimits(0, 0, 0, false);
+
+  PrefetchScheduler scheduler;
+  scheduler.NotifyCursor("INBOX", 0);
+  for (uint64_t id = 0; id < 10; ++id)
+  {
+    scheduler.Add(id, 2, true, "INBOX", MakeHints((int32_t)id));
+  }
+
+  // list index is kept when hints are refined without it
+  scheduler.Update(5, MakeHints(-1));
+
+  uint64_t id = 0;
+  int64_t waitMs = 0;
+  ok &= Check(scheduler.Next(id, waitMs) && (id == 0), "nearest to cursor");
+
+  // cursor moved to end of list
+  scheduler.NotifyCursor("INBOX", 9);
+  ok &= Check(scheduler.Next(id, waitMs) && (id == 9), "nearest to moved cursor");
+  ok &= Check(scheduler.Next(id, waitMs) && (id == 8), "next nearest to moved cursor");
+
+  scheduler.NotifyCursor("INBOX", 5);
+  ok &= Check(scheduler.Next(id, waitMs) && (id == 5), "updated entry follows cursor");
+
+  // cursor in another folder, no distance bonus, most recently added first
+  scheduler.NotifyCursor("Archive", 1);
+  ok &= Check(scheduler.Next(id, waitMs) && (id == 7), "cursor in other folder");
+
+  return ok;
+}
+
+static bool TestLimits()
+{
+  bool ok = true;
+  uint64_t id = 0;
+  int64_t waitMs = 0;
+
+  // metered link only allows headers and flags
+  {
+    PrefetchScheduler::SetLimits(0, 0, 0, true /* p_Metered */);
+    PrefetchScheduler scheduler;
+    scheduler.Add(1, 2, true, "INBOX", PrefetchHints());
+    ok &= Check(!scheduler.HasReady() && !scheduler.Next(id, waitMs), "metered body");
+    scheduler.Add(2, 3, false, "INBOX", PrefetchHints());
+    ok &= Check(scheduler.Next(id, waitMs) && (id == 2), "metered header");
+  }
+
+  // bandwidth limit delays next body, headers pass
+  {
+    PrefetchScheduler::SetLimits(1 /* p_MaxKbps */, 0, 0, false);
+    PrefetchScheduler scheduler;
+    scheduler.Add(1, 2, true, "INBOX", PrefetchHints());
+    scheduler.Add(2, 2, true, "INBOX", PrefetchHints());
+    ok &= Check(scheduler.Next(id, waitMs) && (id == 2), "first body");
+    scheduler.Done(true, 10 * 1024, 0.1);
+    ok &= Check(!scheduler.Next(id, waitMs) && (waitMs > 5000) && (waitMs <= 10000), "paced body");
+    scheduler.Add(3, 3, false, "INBOX", PrefetchHints());
+    ok &= Check(scheduler.Next(id, waitMs) && (id == 3), "header while paced");
+  }
+
+  // slow link pauses bodies
+  {
+    PrefetchScheduler::SetLimits(0, 0, 100 /* p_MinKbps */, false);
+    PrefetchScheduler scheduler;
+    scheduler.Add(1, 2, true, "INBOX", PrefetchHints());
+    scheduler.Done(true, 1024 * 1024, 20.0);
+    ok &= Check(!scheduler.HasReady(), "slow link pause");
+  }
+
+  return ok;
+}
+
+static bool TestPersist()
+{
+  bool ok = true;
+  uint64_t id = 0;
+  int64_t waitMs = 0;
+
+  // budget used up in one run blocks bodies in the next, stats rank bodies
+  PrefetchScheduler::SetLimits(0, 1024 * 1024 /* p_DailyBudget */, 0, false);
+  {
+    PrefetchScheduler scheduler;
+    scheduler.Load(true /* p_Encrypt */, "pass");
+    scheduler.NotifyFolderVisit("INBOX");
+    scheduler.NotifyMessageOpened("alice@example.com");
+    scheduler.Add(1, 2, true, "INBOX", PrefetchHints());
+    ok &= Check(scheduler.Next(id, waitMs), "body before budget");
+    scheduler.Done(true, 2 * 1024 * 1024, 1.0);
+    scheduler.Add(2, 2, true, "INBOX", PrefetchHints());
+    ok &= Check(!scheduler.HasReady(), "budget used");
+    scheduler.Save();
+  }
+
+  {
+    PrefetchScheduler scheduler;
+    scheduler.Load(true /* p_Encrypt */, "pass");
+    scheduler.Add(1, 2, true, "INBOX", PrefetchHints());
+    ok &= Check(!scheduler.HasReady(), "budget used after reload");
+
+    PrefetchScheduler::SetLimits(0, 0, 0, false);
+    scheduler.Add(2, 2, true, "INBOX", MakeHints(-1, false, "alice@example.com"));
+    scheduler.Add(3, 2, true, "Archive", PrefetchHints());
+    scheduler.Add(4, 2, true, "INBOX", MakeHints(-1, false, "bob@example.com"));
+    ok &= Check(TakeAll(scheduler) == std::vector<uint64_t>({ 2, 4, 1, 3 }), "stats after reload");
+  }
+
+  // wrong pass starts from empty state
+  {
+    PrefetchScheduler::SetLimits(0, 1024 * 1024 /* p_DailyBudget */, 0, false);
+    PrefetchScheduler scheduler;
+    scheduler.Load(true /* p_Encrypt */, "wrong");
+    scheduler.Add(1, 2, true, "INBOX", PrefetchHints());
+    ok &= Check(scheduler.HasReady(), "wrong pass");
+  }
+
+  PrefetchScheduler::SetLimits(0, 0, 0, false);
+  return ok;
+}
+
+int main()
+{
+  char tmpl[] = "/tmp/prefetchschedulertest.XXXXXX";
+  if (mkdtemp(tmpl) == NULL)
+  {
+    std::cerr << "fail: mkdtemp\n";
+    return 1;
+  }
+
+  const std::string dir = std::string(tmpl) + "/";
+  Util::SetApplicationDir(dir);
+  CacheUtil::InitCacheDir();
+
+  bool ok = true;
+  ok &= TestOrder();
+  ok &= TestCursor();
+  ok &= TestLimits();
+  ok &= TestPersist();
+
+  Util::RmDir(dir);
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,319 @@
+// streamtest.cpp
+//
+// Copyright (c) 2024 Kristofer Berggren
+// All rights reserved.
+//
+// falanet is distributed under the MIT license, see LICENSE for details.
+
+// round-trip check of the counting and deflate mailstream layers over a socketpair,
+// stacked as used for imap compress: socket, wire counter, deflate, plain counter, and
+// of imap compress negotiation and traffic stats against a minimal scripted server
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "libetpan_help.h"
+#include <libetpan/mailstream.h>
+#include <libetpan/mailstream_compress.h>
+#include <libetpan/mailstream_helper.h>
+#include <libetpan/mailstream_socket.h>
+
+#include "cacheutil.h"
+#include "countingstream.h"
+#include "imap.h"
+#include "log.h"
+#include "util.h"
+
+struct Endpoint
+{
+  mailstream* m_Stream = nullptr;
+  std::atomic<uint64_t> m_WireBytes{ 0 };
+  std::atomic<uint64_t> m_PlainBytes{ 0 };
+};
+
+static bool Open(Endpoint& p_Endpoint, int p_Fd)
+{
+  p_Endpoint.m_Stream = mailstream_socket_open(p_Fd);
+  if (p_Endpoint.m_Stream == NULL) return false;
+
+  if (!CountingStream::Push(p_Endpoint.m_Stream, &p_Endpoint.m_WireBytes)) return false;
+
+  mailstream_low* compressLow = mailstream_low_compress_open(mailstream_get_low(p_Endpoint.m_Stream));
+  if (compressLow == NULL) return false;
+
+  mailstream_set_low(p_Endpoint.m_Stream, compressLow);
+  return CountingStream::Push(p_Endpoint.m_Stream, &p_Endpoint.m_PlainBytes);
+}
+
+static bool Send(Endpoint& p_Endpoint, const std::string& p_Data)
+{
+  return (mailstream_write(p_Endpoint.m_Stream, p_Data.data(), p_Data.size()) == (ssize_t)p_Data.size()) &&
+         (mailstream_flush(p_Endpoint.m_Stream) == 0);
+}
+
+static bool Receive(Endpoint& p_Endpoint, size_t p_Size, std::string& p_Data)
+{
+  p_Data.clear();
+  char buf[4096];
+  while (p_Data.size() < p_Size)
+  {
+    // mailstream_read reads from the layer below until the requested count is buffered
+    const size_t count = std::min(sizeof(buf), p_Size - p_Data.size());
+    const ssize_t len = mailstream_read(p_Endpoint.m_Stream, buf, count);
+    if (len <= 0) return false;
+
+    p_Data.append(buf, len);
+  }
+
+  return (p_Data.size() == p_Size);
+}
+
+static bool Check(bool p_Cond, const std::string& p_Desc)
+{
+  if (!p_Cond)
+  {
+    std::cerr << "fail: " << p_Desc << "\n";
+  }
+
+  return p_Cond;
+}
+
+static bool TestStreamLayers()
+{
+  int fds[2] = { -1, -1 };
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+  {
+    std::cerr << "fail: socketpair\n";
+    return false;
+  }
+
+  Endpoint client;
+  Endpoint server;
+  if (!Open(client, fds[0]) || !Open(server, fds[1]))
+  {
+    std::cerr << "fail: open streams\n";
+    return false;
+  }
+
+  // repetitive imap-like payload, kept small enough that its deflated form fits the socket buffer
+  std::string request;
+  for (int i = 0; i < 1000; ++i)
+  {
+    request += "* " + std::to_string(i + 1) + " FETCH (UID " + std::to_string(i + 100) +
+      " FLAGS (\\Seen) RFC822.SIZE 4096)\r\n";
+  }
+
+  const std::string response = "A001 OK FETCH completed\r\n";
+
+  bool ok = true;
+  std::string received;
+  ok &= Check(Send(client, request), "send request");
+  ok &= Check(Receive(server, request.size(), received), "receive request");
+  ok &= Check(received == request, "request content");
+  ok &= Check(Send(server, response), "send response");
+  ok &= Check(Receive(client, response.size(), received), "receive response");
+  ok &= Check(received == response, "response content");
+
+  const uint64_t plainSize = request.size() + response.size();
+  ok &= Check(client.m_PlainBytes == plainSize, "client plain bytes");
+  ok &= Check(server.m_PlainBytes == plainSize, "server plain bytes");
+  ok &= Check(client.m_WireBytes == server.m_WireBytes, "wire bytes match");
+  ok &= Check(client.m_WireBytes < (request.size() / 4), "request deflated");
+
+  std::cout << "plain " << client.m_PlainBytes << " bytes, wire " << client.m_WireBytes << " bytes\n";
+
+  mailstream_close(client.m_Stream);
+  mailstream_close(server.m_Stream);
+
+  return ok;
+}
+
+// answers only what the imap client sends when connecting with compress enabled
+struct ScriptedServer
+{
+  int m_ListenFd = -1;
+  uint16_t m_Port = 0;
+  bool m_HasCompress = false;
+  bool m_CompressActive = false;
+  std::vector<std::string> m_Commands;
+  std::atomic<uint64_t> m_PlainBytes{ 0 };
+};
+
+static bool Listen(ScriptedServer& p_Server)
+{
+  p_Server.m_ListenFd = socket(AF_INET, SOCK_STREAM, 0);
+  if (p_Server.m_ListenFd == -1) return false;
+
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  socklen_t addrLen = sizeof(addr);
+  if ((bind(p_Server.m_ListenFd, (struct sockaddr*)&addr, sizeof(addr)) != 0) ||
+      (listen(p_Server.m_ListenFd, 1) != 0) ||
+      (getsockname(p_Server.m_ListenFd, (struct sockaddr*)&addr, &addrLen) != 0)) return false;
+
+  p_Server.m_Port = ntohs(addr.sin_port);
+  return true;
+}
+
+static void Serve(ScriptedServer* p_Server)
+{
+  int fd = accept(p_Server->m_ListenFd, NULL, NULL);
+  if (fd == -1) return;
+
+  Endpoint endpoint;
+  endpoint.m_Stream = mailstream_socket_open(fd);
+  if (endpoint.m_Stream == NULL)
+  {
+    close(fd);
+    return;
+  }
+
+  Send(endpoint, "* OK scripted server ready\r\n");
+  MMAPString* buffer = mmap_string_new("");
+  char* line = NULL;
+  while ((line = mailstream_read_line_remove_eol(endpoint.m_Stream, buffer)) != NULL)
+  {
+    const std::string request(line);
+    const size_t tagEnd = request.find(' ');
+    if (tagEnd == std::string::npos) break;
+
+    const std::string tag = request.substr(0, tagEnd);
+    const size_t commandEnd = request.find(' ', tagEnd + 1);
+    const std::string command = request.substr(tagEnd + 1, commandEnd - tagEnd - 1);
+    p_Server->m_Commands.push_back(command);
+    if (command == "CAPABILITY")
+    {
+      Send(endpoint, std::string("* CAPABILITY IMAP4rev1") + (p_Server->m_HasCompress ? " COMPRESS=DEFLATE" : "") +
+           "\r\n" + tag + " OK CAPABILITY completed\r\n");
+    }
+    else if (command == "LOGIN")
+    {
+      Send(endpoint, tag + " OK LOGIN completed\r\n");
+    }
+    else if ((command == "COMPRESS") && p_Server->m_HasCompress)
+    {
+      // subsequent traffic in both directions is deflated
+      Send(endpoint, tag + " OK DEFLATE active\r\n");
+      mailstream_low* compressLow = mailstream_low_compress_open(mailstream_get_low(endpoint.m_Stream));
+      if (compressLow == NULL) break;
+
+      mailstream_set_low(endpoint.m_Stream, compressLow);
+      if (!CountingStream::Push(endpoint.m_Stream, &p_Server->m_PlainBytes)) break;
+
+      p_Server->m_CompressActive = true;
+    }
+    else if (command == "LOGOUT")
+    {
+      Send(endpoint, "* BYE scripted server logging out\r\n" + tag + " OK LOGOUT completed\r\n");
+      break;
+    }
+    else
+    {
+      Send(endpoint, tag + " BAD unexpected command\r\n");
+    }
+  }
+
+  mmap_string_free(buffer);
+  mailstream_close(endpoint.m_Stream);
+}
+
+static bool LogContains(const std::string& p_LogPath, const std::string& p_Str)
+{
+  return Util::ReadFile(p_LogPath).find(p_Str) != std::string::npos;
+}
+
+static bool TestEnableCompress(const std::string& p_LogPath, bool p_HasCompress)
+{
+  const std::string desc = p_HasCompress ? "compress " : "no compress ";
+  ScriptedServer server;
+  server.m_HasCompress = p_HasCompress;
+  if (!Listen(server))
+  {
+    std::cerr << "fail: listen\n";
+    return false;
+  }
+
+  std::thread serverThread(Serve, &server);
+  bool ok = true;
+  uint64_t plainBytes = 0;
+  uint64_t wireBytes = 0;
+  {
+    Imap imap("user", "pass", "127.0.0.1", server.m_Port, 5 /* p_Timeout */, false /* p_CacheEncrypt */,
+              false /* p_CacheIndexEncrypt */, std::set<std::string>(), false /* p_SniEnabled */,
+              [](const StatusUpdate&) { });
+    ok &= Check(imap.Login(), desc + "login");
+    ok &= Check(imap.Logout(), desc + "logout");
+    imap.GetTrafficStats(plainBytes, wireBytes);
+  }
+
+  serverThread.join();
+  close(server.m_ListenFd);
+
+  const std::vector<std::string> expectCommands = p_HasCompress
+    ? std::vector<std::string>({ "LOGIN", "CAPABILITY", "COMPRESS", "LOGOUT" })
+    : std::vector<std::string>({ "LOGIN", "CAPABILITY", "LOGOUT" });
+  ok &= Check(server.m_Commands == expectCommands, desc + "commands");
+  ok &= Check(server.m_CompressActive == p_HasCompress, desc + "server deflate");
+
+  // logout is the only exchange after compress is enabled, and is counted as plain on both ends
+  const bool hasStats = LogContains(p_LogPath, "wire bytes ratio");
+  if (p_HasCompress)
+  {
+    ok &= Check((plainBytes > 0) && (plainBytes == server.m_PlainBytes), desc + "plain bytes");
+    ok &= Check(wireBytes > 0, desc + "wire bytes");
+    ok &= Check(hasStats, desc + "traffic stats logged");
+    std::cout << "imap plain " << plainBytes << " bytes, wire " << wireBytes << " bytes\n";
+  }
+  else
+  {
+    ok &= Check((plainBytes == 0) && (wireBytes == 0), desc + "traffic bytes");
+    ok &= Check(!hasStats, desc + "traffic stats not logged");
+  }
+
+  return ok;
+}
+
+int main()
+{
+  char tmpl[] = "/tmp/streamtest.XXXXXX";
+  if (mkdtemp(tmpl) == NULL)
+  {
+    std::cerr << "fail: mkdtemp\n";
+    return 1;
+  }
+
+  const std::string dir = std::string(tmpl) + "/";
+  Util::SetApplicationDir(dir);
+  Util::InitTempDir();
+  CacheUtil::InitCacheDir();
+
+  bool ok = true;
+  ok &= TestStreamLayers();
+
+  Log::SetPath(dir + "log-nocompress.txt");
+  ok &= TestEnableCompress(dir + "log-nocompress.txt", false);
+  Log::Cleanup();
+
+  Log::SetPath(dir + "log-compress.txt");
+  ok &= TestEnableCompress(dir + "log-compress.txt", true);
+  Log::Cleanup();
+
+  Util::CleanupTempDir();
+  Util::RmDir(dir);
+
+  return ok ? 0 : 1;
+}
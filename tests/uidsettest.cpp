@@ -0,0 +1,235 @@
+// uidsettest.cpp
+//
+// Copyright (c) 2024 Kristofer Berggren
+// All rights reserved.
+//
+// falanet is distributed under the MIT license, see LICENSE for details.
+
+// checks of uid set range merge, split, erase and serialization, randomized against
+// std::set, and measurement of build, union, difference and iteration of a large folder
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "loghelp.h"
+#include "serialization.h"
+#include "sethelp.h"
+#include "uidset.h"
+
+static bool Check(bool p_Cond, const std::string& p_Desc)
+{
+  if (!p_Cond)
+  {
+    std::cerr << "fail: " << p_Desc << "\n";
+  }
+
+  return p_Cond;
+}
+
+static std::string ToStr(const UidSet& p_Uids)
+{
+  std::stringstream sstream;
+  sstream << p_Uids;
+  return sstream.str();
+}
+
+static bool Equal(const UidSet& p_Uids, const std::set<uint32_t>& p_Ref)
+{
+  return (p_Uids.size() == p_Ref.size()) &&
+         std::equal(p_Uids.begin(), p_Uids.end(), p_Ref.begin()) &&
+         std::equal(p_Uids.rbegin(), p_Uids.rend(), p_Ref.rbegin());
+}
+
+static bool TestRanges()
+{
+  bool ok = true;
+
+  // merge
+  UidSet uids = { 1, 3, 5 };
+  ok &= Check(ToStr(uids) == "{1, 3, 5}", "separate ranges");
+  uids.insert(2);
+  ok &= Check(ToStr(uids) == "{1:3, 5}", "join prev and next");
+  uids.insert(6);
+  ok &= Check(ToStr(uids) == "{1:3, 5:6}", "join prev");
+  uids.insert(4);
+  ok &= Check((ToStr(uids) == "{1:6}") && (uids.GetRanges().size() == 1), "join into one range");
+  uids.insert(0);
+  ok &= Check(ToStr(uids) == "{0:6}", "join next");
+  ok &= Check(!uids.insert(3).second && (uids.size() == 7), "insert existing");
+
+  // split by erase
+  ok &= Check(uids.erase(3) == 1, "erase middle");
+  ok &= Check(ToStr(uids) == "{0:2, 4:6}", "split range");
+  ok &= Check((uids.erase(0) == 1) && (uids.erase(6) == 1), "erase ends");
+  ok &= Check(ToStr(uids) == "{1:2, 4:5}", "shrink ranges");
+  ok &= Check(uids.erase(3) == 0, "erase missing");
+  ok &= Check((uids.erase(uids.find(4)) == uids.find(5)) && (ToStr(uids) == "{1:2, 5}"), "erase iterator");
+  ok &= Check(uids.size() == 3, "size after erase");
+
+  // bounds
+  ok &= Check((*uids.lower_bound(3) == 5) && (*uids.upper_bound(1) == 2), "bounds");
+  ok &= Check(uids.upper_bound(5) == uids.end(), "upper bound past end");
+
+  // limits
+  UidSet limits = { UINT32_MAX, UINT32_MAX - 1, 0 };
+  ok &= Check(ToStr(limits) == "{0, 4294967294:4294967295}", "uint32 max");
+  ok &= Check((limits.erase(UINT32_MAX) == 1) && (limits.size() == 2), "erase uint32 max");
+
+  // set algebra
+  const UidSet lhs = { 1, 2, 3, 4, 5, 10, 11, 12, 20 };
+  const UidSet rhs = { 3, 4, 11, 20, 21 };
+  ok &= Check(ToStr(lhs + rhs) == "{1:5, 10:12, 20:21}", "union");
+  ok &= Check(ToStr(lhs - rhs) == "{1:2, 5, 10, 12}", "difference");
+  ok &= Check((lhs - rhs).size() == 5, "difference size");
+  ok &= Check((rhs - lhs) == UidSet({ 21 }), "reverse difference");
+
+  // serialization as stored in cache
+  const UidSet stored = lhs + rhs;
+  const std::vector<uint32_t> vec = ToVector(stored);
+  const std::vector<uint32_t> loadedVec =
+    Serialization::FromString<std::vector<uint32_t>>(Serialization::ToString(vec));
+  ok &= Check(UidSet(loadedVec.begin(), loadedVec.end()) == stored, "serialization round-trip");
+  ok &= Check(ToVector(UidSet()).empty(), "empty serialization");
+
+  return ok;
+}
+
+static bool TestRandom()
+{
+  bool ok = true;
+  std::mt19937 rng(1);
+  for (int round = 0; round < 200; ++round)
+  {
+    const uint32_t maxUid = 10 + (rng() % 500);
+    UidSet uids;
+    std::set<uint32_t> ref;
+    UidSet other;
+    std::set<uint32_t> otherRef;
+    for (int i = 0; i < 400; ++i)
+    {
+      const uint32_t uid = rng() % maxUid;
+      if ((rng() % 3) == 0)
+      {
+        ok &= Check(uids.erase(uid) == ref.erase(uid), "random erase");
+      }
+      else
+      {
+        ok &= Check(uids.insert(uid).second == ref.insert(uid).second, "random insert");
+      }
+
+      const uint32_t otherUid = rng() % maxUid;
+      other.insert(otherUid);
+      otherRef.insert(otherUid);
+    }
+
+    ok &= Check(Equal(uids, ref), "random content");
+    ok &= Check(Equal(uids + other, ref + otherRef), "random union");
+    ok &= Check(Equal(uids - other, ref - otherRef), "random difference");
+
+    for (uint32_t uid = 0; uid <= maxUid; ++uid)
+    {
+      const bool found = (uids.count(uid) == 1);
+      const auto lowerIt = uids.lower_bound(uid);
+      const auto refLowerIt = ref.lower_bound(uid);
+      ok &= Check(found == (ref.count(uid) == 1), "random count");
+      ok &= Check((lowerIt == uids.end()) == (refLowerIt == ref.end()), "random lower bound end");
+      if ((lowerIt != uids.end()) && (refLowerIt != ref.end()))
+      {
+        ok &= Check(*lowerIt == *refLowerIt, "random lower bound");
+      }
+    }
+
+    if (!ok) break;
+  }
+
+  return ok;
+}
+
+static double Elapsed(const std::chrono::steady_clock::time_point& p_Start)
+{
+  const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - p_Start;
+  return elapsed.count();
+}
+
+template<typename T>
+static void Measure(const std::string& p_Name, const std::vector<uint32_t>& p_Uids,
+                    const std::vector<uint32_t>& p_OtherUids)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  const T uids(p_Uids.begin(), p_Uids.end());
+  const double buildSec = Elapsed(start);
+
+  const T otherUids(p_OtherUids.begin(), p_OtherUids.end());
+  start = std::chrono::steady_clock::now();
+  const T unionUids = uids + otherUids;
+  const double unionSec = Elapsed(start);
+
+  start = std::chrono::steady_clock::now();
+  const T diffUids = uids - otherUids;
+  const double diffSec = Elapsed(start);
+
+  start = std::chrono::steady_clock::now();
+  uint64_t sum = 0;
+  for (const auto& uid : uids)
+  {
+    sum += uid;
+  }
+  const double iterSec = Elapsed(start);
+
+  std::cout << std::left << std::setw(14) << p_Name << std::right << std::fixed << std::setprecision(2)
+            << std::setw(9) << (buildSec * 1000.0) << " ms build"
+            << std::setw(9) << (unionSec * 1000.0) << " ms union"
+            << std::setw(9) << (diffSec * 1000.0) << " ms diff"
+            << std::setw(9) << (iterSec * 1000.0) << " ms iterate"
+            << "  (" << unionUids.size() << ", " << diffUids.size() << ", " << (sum % 10) << ")\n";
+}
+
+static void Benchmark()
+{
+  // 300k uid folder with occasional gaps from deleted messages, against a copy with
+  // recent uids added and a few removed, as when reconciling a folder after sync
+  std::mt19937 rng(1);
+  std::vector<uint32_t> uids;
+  std::vector<uint32_t> otherUids;
+  uint32_t uid = 1;
+  while (uids.size() < 300000)
+  {
+    uid += ((rng() % 50) == 0) ? (1 + (rng() % 20)) : 1;
+    uids.push_back(uid);
+    if ((rng() % 1000) != 0)
+    {
+      otherUids.push_back(uid);
+    }
+  }
+
+  for (int i = 0; i < 100; ++i)
+  {
+    otherUids.push_back(++uid);
+  }
+
+  std::cout << uids.size() << " uids, " << UidSet(uids.begin(), uids.end()).GetRanges().size() << " ranges\n";
+  Measure<std::set<uint32_t>>("std::set", uids, otherUids);
+  Measure<UidSet>("UidSet", uids, otherUids);
+}
+
+int main()
+{
+  bool ok = true;
+  ok &= TestRanges();
+  ok &= TestRandom();
+  if (ok)
+  {
+    Benchmark();
+  }
+
+  return ok ? 0 : 1;
+}
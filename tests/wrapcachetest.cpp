@@ -0,0 +1,271 @@
+// wrapcachetest.cpp
+//
+// Copyright (c) 2024 Kristofer Berggren
+// All rights reserved.
+//
+// falanet is distributed under the MIT license, see LICENSE for details.
+
+// checks of compose wrap cache lines and cursor positions against Util::WordWrap over
+// random insert, delete and paragraph split and join edits, and measurement of update
+// time per keystroke in a large message
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "util.h"
+#include "wrapcache.h"
+
+static bool Check(bool p_Cond, const std::string& p_Desc)
+{
+  if (!p_Cond)
+  {
+    std::cerr << "fail: " << p_Desc << "\n";
+  }
+
+  return p_Cond;
+}
+
+static std::wstring MakeWord(std::mt19937& p_Rng)
+{
+  static const std::vector<std::wstring> words =
+  {
+    L"the", L"meeting", L"tomorrow", L"please", L"review", L"attached", L"draft", L"thanks",
+    L"regards", L"a", L"supercalifragilisticexpialidocious", L"I", L"we", L"", L"> quoted",
+  };
+
+  return words.at(p_Rng() % words.size());
+}
+
+static std::wstring MakeText(std::mt19937& p_Rng, size_t p_Size)
+{
+  std::wstring text;
+  while (text.size() < p_Size)
+  {
+    text += MakeWord(p_Rng);
+    const unsigned sep = p_Rng() % 10;
+    text += (sep == 0) ? L"\n" : ((sep == 1) ? L"  " : L" ");
+  }
+
+  return text;
+}
+
+static std::vector<std::wstring> WordWrap(const std::wstring& p_Text, unsigned p_LineLength)
+{
+  return Util::WordWrap(p_Text, p_LineLength, false, false, false, 0);
+}
+
+static bool CheckEqual(const WrapCache& p_WrapCache, const std::wstring& p_Text, unsigned p_LineLength,
+                       std::mt19937& p_Rng, const std::string& p_Desc)
+{
+  bool ok = true;
+  const std::vector<std::wstring> lines = WordWrap(p_Text, p_LineLength);
+  ok &= Check(p_WrapCache.GetLines() == lines, p_Desc + " lines");
+  ok &= Check(p_WrapCache.GetLineCount() == lines.size(), p_Desc + " line count");
+
+  std::vector<int> positions = { 0, (int)p_Text.size() };
+  for (int i = 0; i < 4; ++i)
+  {
+    positions.push_back(p_Rng() % (p_Text.size() + 1));
+  }
+
+  for (const int pos : positions)
+  {
+    int wrapLine = 0;
+    int wrapPos = 0;
+    Util::WordWrap(p_Text, p_LineLength, false, false, false, 0, pos, wrapLine, wrapPos);
+    int cacheWrapLine = 0;
+    int cacheWrapPos = 0;
+    p_WrapCache.GetWrapPos(pos, cacheWrapLine, cacheWrapPos);
+    ok &= Check((cacheWrapLine == wrapLine) && (cacheWrapPos == wrapPos), p_Desc + " wrap pos");
+  }
+
+  return ok;
+}
+
+// applies a random edit at a random position, as the compose key handling does
+static void RandomEdit(std::mt19937& p_Rng, std::wstring& p_Text, size_t& p_Pos, size_t& p_RemoveCount,
+                       size_t& p_InsertCount, std::string& p_Desc)
+{
+  p_Pos = p_Rng() % (p_Text.size() + 1);
+  p_RemoveCount = 0;
+  p_InsertCount = 0;
+  const unsigned type = p_Rng() % 6;
+  if ((type == 0) || p_Text.empty())
+  {
+    const std::wstring chars = L"abc  -";
+    p_Text.insert(p_Pos, 1, chars.at(p_Rng() % chars.size()));
+    p_InsertCount = 1;
+    p_Desc = "insert";
+  }
+  else if (type == 1)
+  {
+    p_Text.insert(p_Pos, 1, L'\n');
+    p_InsertCount = 1;
+    p_Desc = "split";
+  }
+  else if (type == 2)
+  {
+    p_Pos = std::min(p_Pos, p_Text.size() - 1);
+    p_Text.erase(p_Pos, 1);
+    p_RemoveCount = 1;
+    p_Desc = "delete";
+  }
+  else if (type == 3)
+  {
+    const size_t newlinePos = p_Text.find(L'\n', p_Pos);
+    p_Pos = (newlinePos != std::wstring::npos) ? newlinePos : p_Text.rfind(L'\n');
+    if (p_Pos == std::wstring::npos)
+    {
+      p_Pos = 0;
+      p_Desc = "join none";
+      return;
+    }
+
+    p_Text.erase(p_Pos, 1);
+    p_RemoveCount = 1;
+    p_Desc = "join";
+  }
+  else if (type == 4)
+  {
+    p_RemoveCount = std::min<size_t>(p_Rng() % 40, p_Text.size() - std::min(p_Pos, p_Text.size()));
+    p_Text.erase(p_Pos, p_RemoveCount);
+    p_Desc = "delete range";
+  }
+  else
+  {
+    const std::wstring paste = MakeText(p_Rng, p_Rng() % 60);
+    p_Text.insert(p_Pos, paste);
+    p_InsertCount = paste.size();
+    p_Desc = "paste";
+  }
+}
+
+static bool TestRandom()
+{
+  bool ok = true;
+  std::mt19937 rng(1);
+  for (int round = 0; round < 100; ++round)
+  {
+    unsigned lineLength = 10 + (rng() % 70);
+    std::wstring text = MakeText(rng, rng() % 2000);
+    WrapCache wrapCache;
+    wrapCache.SetLineLength(lineLength);
+    wrapCache.Update(text);
+    ok &= CheckEqual(wrapCache, text, lineLength, rng, "initial");
+
+    for (int i = 0; i < 300; ++i)
+    {
+      // one or more edits between updates, as with several keys handled before a redraw
+      const int editCount = ((rng() % 4) == 0) ? (2 + (rng() % 3)) : 1;
+      const unsigned notify = rng() % 20;
+      std::string desc;
+      for (int edit = 0; edit < editCount; ++edit)
+      {
+        size_t pos = 0;
+        size_t removeCount = 0;
+        size_t insertCount = 0;
+        RandomEdit(rng, text, pos, removeCount, insertCount, desc);
+        if (notify > 1)
+        {
+          wrapCache.Edit(pos, removeCount, insertCount);
+        }
+      }
+
+      if (notify == 0)
+      {
+        wrapCache.Invalidate();
+      }
+      else if (notify == 1)
+      {
+        lineLength = 10 + (rng() % 70);
+        wrapCache.SetLineLength(lineLength);
+      }
+
+      wrapCache.Update(text);
+      ok &= CheckEqual(wrapCache, text, lineLength, rng, desc);
+
+      // redraw without edits
+      wrapCache.Update(text);
+      ok &= Check(wrapCache.GetLines() == WordWrap(text, lineLength), desc + " unchanged");
+      if (!ok) break;
+    }
+
+    if (!ok) break;
+  }
+
+  // replaced text of same size with no edit reported, as when entering compose state
+  {
+    std::wstring text = L"first paragraph\nsecond";
+    WrapCache wrapCache;
+    wrapCache.SetLineLength(8);
+    wrapCache.Update(text);
+    wrapCache.Invalidate();
+    text = L"other paragraph\nthird!";
+    wrapCache.Update(text);
+    ok &= CheckEqual(wrapCache, text, 8, rng, "replaced");
+  }
+
+  return ok;
+}
+
+static double Elapsed(const std::chrono::steady_clock::time_point& p_Start)
+{
+  const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - p_Start;
+  return elapsed.count();
+}
+
+static void Benchmark()
+{
+  // typing at the start of a 2000 paragraph message, with and without reported edits
+  std::mt19937 rng(1);
+  const unsigned lineLength = 72;
+  const std::wstring initText = MakeText(rng, 200000);
+  const int keyCount = 1000;
+  for (const bool reportEdits : { false, true })
+  {
+    std::wstring text = initText;
+    WrapCache wrapCache;
+    wrapCache.SetLineLength(lineLength);
+    wrapCache.Update(text);
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < keyCount; ++i)
+    {
+      text.insert(i, 1, L'x');
+      if (reportEdits)
+      {
+        wrapCache.Edit(i, 0, 1);
+      }
+      else
+      {
+        wrapCache.Invalidate();
+      }
+
+      wrapCache.Update(text);
+    }
+
+    const double sec = Elapsed(start);
+    std::cout << std::left << std::setw(16) << (reportEdits ? "reported edits" : "full scan") << std::right
+              << std::fixed << std::setprecision(1) << std::setw(10) << ((sec * 1000000.0) / keyCount)
+              << " us/key  (" << text.size() << " chars, " << wrapCache.GetLineCount() << " lines)\n";
+  }
+
+  const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  const size_t lineCount = WordWrap(initText, lineLength).size();
+  std::cout << std::left << std::setw(16) << "word wrap" << std::right << std::fixed << std::setprecision(1)
+            << std::setw(10) << (Elapsed(start) * 1000000.0) << " us/key  (" << lineCount << " lines)\n";
+}
+
+int main()
+{
+  const bool ok = TestRandom();
+  if (ok)
+  {
+    Benchmark();
+  }
+
+  return ok ? 0 : 1;
+}